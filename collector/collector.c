@@ -8,12 +8,25 @@
  *   [Department of Electrical, Electronic and Information Engineering, DEI],
  *   [Andrea Bartolini, a.bartolini@unibo.it]
  */
+#include <pthread.h>
+
 #include "collector.h"
 
 #define MONITORING_BENEVENTI
 
+/*
+ * All the collectors share a single reactor, and so a single network thread,
+ * which is started by the first collector_init() and stopped by the last
+ * collector_clean().
+ */
+static struct mosquitto_reactor *reactor = NULL;
+static int reactor_users = 0;
+static pthread_mutex_t reactor_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static void connect_callback(struct mosquitto*, void*, int result);
 static void message_callback(struct mosquitto *, void*, const struct mosquitto_message*);
+static int reactor_get(void);
+static void reactor_put(void);
 
 int collector_init(struct collector_val *val, char *mqtt_broker_ip, int mqtt_port)
 {
@@ -32,10 +45,15 @@ int collector_init(struct collector_val *val, char *mqtt_broker_ip, int mqtt_por
       return 1;
    }
 
-   if (mosquitto_loop_start(val->mosq)){
+   if(reactor_get()){
       fprintf(stderr,"[Collector]: Unable to create Thread.");
       return 1;
    }
+   if(mosquitto_reactor_add(reactor, val->mosq)){
+      fprintf(stderr,"[Collector]: Unable to create Thread.");
+      reactor_put();
+      return 1;
+   }
    return 0;
 }
 
@@ -84,16 +102,49 @@ int collector_clean(struct collector_val *val)
       return 1;
    }
 
-   if(mosquitto_loop_stop(val->mosq, true)){
+   if(mosquitto_reactor_remove(reactor, val->mosq)){
       fprintf(stderr,"[Collector]: Error closing Thread.");
       return 1;
    }
 
    mosquitto_destroy(val->mosq);
+   reactor_put();
    mosquitto_lib_cleanup();
    return 0;
 }
 
+static int reactor_get(void)
+{
+   pthread_mutex_lock(&reactor_mutex);
+   if(!reactor){
+      reactor = mosquitto_reactor_new();
+      if(!reactor){
+         pthread_mutex_unlock(&reactor_mutex);
+         return 1;
+      }
+      if(mosquitto_reactor_loop_start(reactor)){
+         mosquitto_reactor_destroy(reactor);
+         reactor = NULL;
+         pthread_mutex_unlock(&reactor_mutex);
+         return 1;
+      }
+   }
+   reactor_users++;
+   pthread_mutex_unlock(&reactor_mutex);
+   return 0;
+}
+
+static void reactor_put(void)
+{
+   pthread_mutex_lock(&reactor_mutex);
+   reactor_users--;
+   if(!reactor_users){
+      mosquitto_reactor_destroy(reactor);
+      reactor = NULL;
+   }
+   pthread_mutex_unlock(&reactor_mutex);
+}
+
 static void connect_callback(struct mosquitto *mosq, void *userdata, int result)
 {
    if(!result){
@@ -43,6 +43,11 @@ WITH_THREADING:=yes
 # memory size and CPU time.
 WITH_BRIDGE:=yes
 
+# Comment out to remove support for compressing batched bridge messages
+# (the bridge_batch_compression option), which needs zlib. Batching itself
+# is part of bridge support.
+WITH_BRIDGE_COMPRESSION:=yes
+
 # Comment out to remove persistent database support from the broker. This
 # allows the broker to store retained messages and durable subscriptions to a
 # file periodically and on shutdown. This is usually desirable (and is
@@ -63,6 +68,11 @@ WITH_MEMORY_TRACKING:=yes
 # information about the broker state.
 WITH_SYS_TREE:=yes
 
+# Comment out to remove support for spreading socket reads and writes over
+# several threads in the broker (the io_threads option). Routing of messages
+# is always done by a single thread.
+WITH_IO_THREADS:=yes
+
 # Build with Python module. Comment out if Python is not installed, or required
 # Python modules are not available.
 WITH_PYTHON:=yes
@@ -181,6 +191,10 @@ endif
 
 ifeq ($(WITH_BRIDGE),yes)
 	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_BRIDGE
+	ifeq ($(WITH_BRIDGE_COMPRESSION),yes)
+		BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_BRIDGE_COMPRESSION
+		BROKER_LIBS:=$(BROKER_LIBS) -lz
+	endif
 endif
 
 ifeq ($(WITH_PERSISTENCE),yes)
@@ -201,6 +215,11 @@ ifeq ($(WITH_SYS_TREE),yes)
 	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_SYS_TREE
 endif
 
+ifeq ($(WITH_IO_THREADS),yes)
+	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_IO_THREADS
+	BROKER_LIBS:=$(BROKER_LIBS) -lpthread
+endif
+
 ifeq ($(WITH_SRV),yes)
 	LIB_CFLAGS:=$(LIB_CFLAGS) -DWITH_SRV
 	LIB_LIBS:=$(LIB_LIBS) -lcares
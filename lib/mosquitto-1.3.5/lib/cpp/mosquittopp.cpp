@@ -212,11 +212,21 @@ int mosquittopp::publish(int *mid, const char *topic, int payloadlen, const void
 	return mosquitto_publish(m_mosq, mid, topic, payloadlen, payload, qos, retain);
 }
 
+int mosquittopp::publish_batch(struct mosquitto_publish_entry *messages, int count)
+{
+	return mosquitto_publish_batch(m_mosq, messages, count);
+}
+
 void mosquittopp::reconnect_delay_set(unsigned int reconnect_delay, unsigned int reconnect_delay_max, bool reconnect_exponential_backoff)
 {
 	mosquitto_reconnect_delay_set(m_mosq, reconnect_delay, reconnect_delay_max, reconnect_exponential_backoff);
 }
 
+void mosquittopp::reconnect_jitter_set(unsigned int reconnect_jitter)
+{
+	mosquitto_reconnect_jitter_set(m_mosq, reconnect_jitter);
+}
+
 int mosquittopp::max_inflight_messages_set(unsigned int max_inflight_messages)
 {
 	return mosquitto_max_inflight_messages_set(m_mosq, max_inflight_messages);
@@ -272,6 +282,16 @@ int mosquittopp::loop_stop(bool force)
 	return mosquitto_loop_stop(m_mosq, force);
 }
 
+int mosquittopp::reactor_add(struct mosquitto_reactor *reactor)
+{
+	return mosquitto_reactor_add(reactor, m_mosq);
+}
+
+int mosquittopp::reactor_remove(struct mosquitto_reactor *reactor)
+{
+	return mosquitto_reactor_remove(reactor, m_mosq);
+}
+
 bool mosquittopp::want_write()
 {
 	return mosquitto_want_write(m_mosq);
@@ -88,9 +88,11 @@ class mosqpp_EXPORT mosquittopp {
 		int reconnect_async();
 		int disconnect();
 		int publish(int *mid, const char *topic, int payloadlen=0, const void *payload=NULL, int qos=0, bool retain=false);
+		int publish_batch(struct mosquitto_publish_entry *messages, int count);
 		int subscribe(int *mid, const char *sub, int qos=0);
 		int unsubscribe(int *mid, const char *sub);
 		void reconnect_delay_set(unsigned int reconnect_delay, unsigned int reconnect_delay_max, bool reconnect_exponential_backoff);
+		void reconnect_jitter_set(unsigned int reconnect_jitter);
 		int max_inflight_messages_set(unsigned int max_inflight_messages);
 		void message_retry_set(unsigned int message_retry);
 		void user_data_set(void *userdata);
@@ -106,6 +108,8 @@ class mosqpp_EXPORT mosquittopp {
 		int loop_forever(int timeout=-1, int max_packets=1);
 		int loop_start();
 		int loop_stop(bool force=false);
+		int reactor_add(struct mosquitto_reactor *reactor);
+		int reactor_remove(struct mosquitto_reactor *reactor);
 		bool want_write();
 		
 		virtual void on_connect(int rc) {return;};
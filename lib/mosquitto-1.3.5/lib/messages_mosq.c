@@ -35,6 +35,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "mosquitto.h"
 #include "memory_mosq.h"
 #include "messages_mosq.h"
+#include "pool_mosq.h"
 #include "send_mosq.h"
 #include "time_mosq.h"
 
@@ -46,9 +47,11 @@ void _mosquitto_message_cleanup(struct mosquitto_message_all **message)
 
 	msg = *message;
 
-	if(msg->msg.topic) _mosquitto_free(msg->msg.topic);
-	if(msg->msg.payload) _mosquitto_free(msg->msg.payload);
-	_mosquitto_free(msg);
+	/* Messages held by the library are allocated from the client's packet
+	 * pool, unlike those from mosquitto_message_copy(). */
+	_mosquitto_pool_free(msg->msg.topic);
+	_mosquitto_pool_free(msg->msg.payload);
+	_mosquitto_pool_free(msg);
 }
 
 void _mosquitto_message_cleanup_all(struct mosquitto *mosq)
@@ -49,6 +49,7 @@ typedef int ssize_t;
 #include "memory_mosq.h"
 #include "mqtt3_protocol.h"
 #include "net_mosq.h"
+#include "pool_mosq.h"
 #include "read_handle.h"
 #include "send_mosq.h"
 #include "time_mosq.h"
@@ -60,6 +61,10 @@ typedef int ssize_t;
 #define HAVE_PSELECT
 #endif
 
+/* Maximum number of bytes of consecutive QoS 0 messages from a batch that
+ * are written into one packet, the largest packet pool size class. */
+#define MOSQ_PUBLISH_RUN_MAX 16384
+
 void _mosquitto_destroy(struct mosquitto *mosq);
 static int _mosquitto_reconnect(struct mosquitto *mosq, bool blocking);
 static int _mosquitto_connect_init(struct mosquitto *mosq, const char *host, int port, int keepalive, const char *bind_address);
@@ -90,6 +95,7 @@ int mosquitto_lib_init(void)
 
 int mosquitto_lib_cleanup(void)
 {
+	_mosquitto_pool_thread_cleanup();
 	_mosquitto_net_cleanup();
 
 	return MOSQ_ERR_SUCCESS;
@@ -145,6 +151,7 @@ int mosquitto_reinitialise(struct mosquitto *mosq, const char *id, bool clean_se
 
 	_mosquitto_destroy(mosq);
 	memset(mosq, 0, sizeof(struct mosquitto));
+	_mosquitto_packet_pool_init(mosq);
 
 	if(userdata){
 		mosq->userdata = userdata;
@@ -181,6 +188,7 @@ int mosquitto_reinitialise(struct mosquitto *mosq, const char *id, bool clean_se
 	mosq->in_packet.payload = NULL;
 	_mosquitto_packet_cleanup(&mosq->in_packet);
 	mosq->out_packet = NULL;
+	mosq->out_packet_pending = NULL;
 	mosq->current_out_packet = NULL;
 	mosq->last_msg_in = mosquitto_time();
 	mosq->last_msg_out = mosquitto_time();
@@ -206,6 +214,8 @@ int mosquitto_reinitialise(struct mosquitto *mosq, const char *id, bool clean_se
 	mosq->reconnect_delay = 1;
 	mosq->reconnect_delay_max = 1;
 	mosq->reconnect_exponential_backoff = false;
+	mosq->reconnect_jitter = 0;
+	_mosquitto_reconnect_seed(mosq);
 	mosq->threaded = false;
 #ifdef WITH_TLS
 	mosq->ssl = NULL;
@@ -279,11 +289,23 @@ int mosquitto_reconnect_delay_set(struct mosquitto *mosq, unsigned int reconnect
 	
 }
 
+int mosquitto_reconnect_jitter_set(struct mosquitto *mosq, unsigned int reconnect_jitter)
+{
+	if(!mosq) return MOSQ_ERR_INVAL;
+
+	mosq->reconnect_jitter = reconnect_jitter;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
 void _mosquitto_destroy(struct mosquitto *mosq)
 {
 	struct _mosquitto_packet *packet;
 	if(!mosq) return;
 
+	if(mosq->reactor){
+		mosquitto_reactor_remove(mosq->reactor, mosq);
+	}
 #ifdef WITH_THREADING
 	if(mosq->threaded && !pthread_equal(mosq->thread_id, pthread_self())){
 		pthread_cancel(mosq->thread_id);
@@ -354,6 +376,7 @@ void _mosquitto_destroy(struct mosquitto *mosq)
 	}
 
 	/* Out packet cleanup */
+	_mosquitto_packet_pending_collect(mosq);
 	if(mosq->out_packet && !mosq->current_out_packet){
 		mosq->current_out_packet = mosq->out_packet;
 		mosq->out_packet = mosq->out_packet->next;
@@ -366,19 +389,12 @@ void _mosquitto_destroy(struct mosquitto *mosq)
 			mosq->out_packet = mosq->out_packet->next;
 		}
 
-		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 	}
 
 	_mosquitto_packet_cleanup(&mosq->in_packet);
-	if(mosq->sockpairR != INVALID_SOCKET){
-		COMPAT_CLOSE(mosq->sockpairR);
-		mosq->sockpairR = INVALID_SOCKET;
-	}
-	if(mosq->sockpairW != INVALID_SOCKET){
-		COMPAT_CLOSE(mosq->sockpairW);
-		mosq->sockpairW = INVALID_SOCKET;
-	}
+	_mosquitto_wakeup_close(mosq);
+	_mosquitto_packet_pool_cleanup(mosq);
 }
 
 void mosquitto_destroy(struct mosquitto *mosq)
@@ -413,7 +429,7 @@ static int _mosquitto_connect_init(struct mosquitto *mosq, const char *host, int
 
 	mosq->keepalive = keepalive;
 
-	if(_mosquitto_socketpair(&mosq->sockpairR, &mosq->sockpairW)){
+	if(mosq->sockpairR == INVALID_SOCKET && _mosquitto_wakeup_open(mosq)){
 		_mosquitto_log_printf(mosq, MOSQ_LOG_WARNING,
 				"Warning: Unable to open socket pair, outgoing publish commands may be delayed.");
 	}
@@ -485,10 +501,13 @@ static int _mosquitto_reconnect(struct mosquitto *mosq, bool blocking)
 	mosq->ping_t = 0;
 
 	_mosquitto_packet_cleanup(&mosq->in_packet);
+	mosq->in_buf_pos = 0;
+	mosq->in_buf_len = 0;
 		
 	pthread_mutex_lock(&mosq->current_out_packet_mutex);
 	pthread_mutex_lock(&mosq->out_packet_mutex);
 
+	_mosquitto_packet_pending_collect(mosq);
 	if(mosq->out_packet && !mosq->current_out_packet){
 		mosq->current_out_packet = mosq->out_packet;
 		mosq->out_packet = mosq->out_packet->next;
@@ -502,8 +521,7 @@ static int _mosquitto_reconnect(struct mosquitto *mosq, bool blocking)
 			mosq->out_packet = mosq->out_packet->next;
 		}
 
-		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 	}
 	pthread_mutex_unlock(&mosq->out_packet_mutex);
 	pthread_mutex_unlock(&mosq->current_out_packet_mutex);
@@ -530,18 +548,83 @@ int mosquitto_disconnect(struct mosquitto *mosq)
 	return _mosquitto_send_disconnect(mosq);
 }
 
-int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain)
+static int _mosquitto_publish_check(const char *topic, int payloadlen, int qos)
 {
-	struct mosquitto_message_all *message;
-	uint16_t local_mid;
-
-	if(!mosq || !topic || qos<0 || qos>2) return MOSQ_ERR_INVAL;
+	if(!topic || qos<0 || qos>2) return MOSQ_ERR_INVAL;
 	if(strlen(topic) == 0) return MOSQ_ERR_INVAL;
 	if(payloadlen < 0 || payloadlen > MQTT_MAX_PAYLOAD) return MOSQ_ERR_PAYLOAD_SIZE;
 
 	if(_mosquitto_topic_wildcard_len_check(topic) != MOSQ_ERR_SUCCESS){
 		return MOSQ_ERR_INVAL;
 	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Copy an outgoing QoS>0 message so that it can be kept until the broker has
+ * acknowledged it. */
+static struct mosquitto_message_all *_mosquitto_publish_message_new(struct mosquitto *mosq, uint16_t mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain)
+{
+	struct mosquitto_message_all *message;
+
+	message = _mosquitto_pool_calloc(mosq, sizeof(struct mosquitto_message_all));
+	if(!message) return NULL;
+
+	message->next = NULL;
+	message->timestamp = mosquitto_time();
+	message->msg.mid = mid;
+	message->msg.topic = _mosquitto_pool_strdup(mosq, topic);
+	if(!message->msg.topic){
+		_mosquitto_message_cleanup(&message);
+		return NULL;
+	}
+	if(payloadlen){
+		message->msg.payloadlen = payloadlen;
+		message->msg.payload = _mosquitto_pool_alloc(mosq, payloadlen*sizeof(uint8_t));
+		if(!message->msg.payload){
+			_mosquitto_message_cleanup(&message);
+			return NULL;
+		}
+		memcpy(message->msg.payload, payload, payloadlen*sizeof(uint8_t));
+	}else{
+		message->msg.payloadlen = 0;
+		message->msg.payload = NULL;
+	}
+	message->msg.qos = qos;
+	message->msg.retain = retain;
+	message->dup = false;
+
+	return message;
+}
+
+/* Add a new outgoing QoS>0 message to the queue and mark it as in flight if
+ * there is room. out_message_mutex must be held. Returns true if the message
+ * should be sent now. */
+static bool _mosquitto_publish_message_queue(struct mosquitto *mosq, struct mosquitto_message_all *message)
+{
+	_mosquitto_message_queue(mosq, message, mosq_md_out);
+	if(mosq->max_inflight_messages == 0 || mosq->inflight_messages < mosq->max_inflight_messages){
+		mosq->inflight_messages++;
+		if(message->msg.qos == 1){
+			message->state = mosq_ms_wait_for_puback;
+		}else if(message->msg.qos == 2){
+			message->state = mosq_ms_wait_for_pubrec;
+		}
+		return true;
+	}else{
+		message->state = mosq_ms_invalid;
+		return false;
+	}
+}
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain)
+{
+	struct mosquitto_message_all *message;
+	uint16_t local_mid;
+	int rc;
+
+	if(!mosq) return MOSQ_ERR_INVAL;
+	rc = _mosquitto_publish_check(topic, payloadlen, qos);
+	if(rc) return rc;
 
 	local_mid = _mosquitto_mid_generate(mosq);
 	if(mid){
@@ -551,50 +634,171 @@ int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int p
 	if(qos == 0){
 		return _mosquitto_send_publish(mosq, local_mid, topic, payloadlen, payload, qos, retain, false);
 	}else{
-		message = _mosquitto_calloc(1, sizeof(struct mosquitto_message_all));
+		message = _mosquitto_publish_message_new(mosq, local_mid, topic, payloadlen, payload, qos, retain);
 		if(!message) return MOSQ_ERR_NOMEM;
 
-		message->next = NULL;
-		message->timestamp = mosquitto_time();
-		message->msg.mid = local_mid;
-		message->msg.topic = _mosquitto_strdup(topic);
-		if(!message->msg.topic){
-			_mosquitto_message_cleanup(&message);
-			return MOSQ_ERR_NOMEM;
+		pthread_mutex_lock(&mosq->out_message_mutex);
+		if(_mosquitto_publish_message_queue(mosq, message)){
+			pthread_mutex_unlock(&mosq->out_message_mutex);
+			return _mosquitto_send_publish(mosq, message->msg.mid, message->msg.topic, message->msg.payloadlen, message->msg.payload, message->msg.qos, message->msg.retain, message->dup);
+		}else{
+			pthread_mutex_unlock(&mosq->out_message_mutex);
+			return MOSQ_ERR_SUCCESS;
 		}
-		if(payloadlen){
-			message->msg.payloadlen = payloadlen;
-			message->msg.payload = _mosquitto_malloc(payloadlen*sizeof(uint8_t));
-			if(!message->msg.payload){
-				_mosquitto_message_cleanup(&message);
+	}
+}
+
+/* Length of a QoS 0 PUBLISH of entry, fixed header included. */
+static uint32_t _mosquitto_publish_run_length(const struct mosquitto_publish_entry *entry)
+{
+	uint32_t remaining_length;
+	uint32_t length;
+
+	remaining_length = 2+strlen(entry->topic) + entry->payloadlen;
+	length = 1 + remaining_length;
+	do{
+		length++;
+		remaining_length = remaining_length / 128;
+	}while(remaining_length > 0);
+	return length;
+}
+
+/* Add a run of count consecutive QoS 0 messages from a batch, length bytes
+ * in all, to the list of packets from first to last. A run of more than one
+ * message goes in a single packet. */
+static int _mosquitto_publish_run_add(struct mosquitto *mosq, struct mosquitto_publish_entry *messages, int count, uint32_t length, struct _mosquitto_packet **first, struct _mosquitto_packet **last)
+{
+	struct _mosquitto_packet *packet = NULL;
+	int rc;
+
+	if(count == 1){
+		_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBLISH (d0, q0, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, messages[0].retain, messages[0].mid, messages[0].topic, (long)messages[0].payloadlen);
+		rc = _mosquitto_publish_packet_new(mosq, &packet, messages[0].mid, messages[0].topic, messages[0].payloadlen, messages[0].payload, 0, messages[0].retain, false);
+	}else{
+		_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending %d PUBLISH (d0, q0, m%d to m%d, ... (%ld bytes))", mosq->id, count, messages[0].mid, messages[count-1].mid, (long)length);
+		rc = _mosquitto_publish_run_packet_new(mosq, &packet, messages, count, length);
+	}
+	if(rc) return rc;
+
+	if(*last){
+		(*last)->next = packet;
+	}else{
+		*first = packet;
+	}
+	*last = packet;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_publish_batch(struct mosquitto *mosq, struct mosquitto_publish_entry *messages, int count)
+{
+	struct mosquitto_publish_entry *entry;
+	struct mosquitto_message_all *message, *stored = NULL, *stored_last = NULL;
+	struct _mosquitto_packet *packet, *first = NULL, *last = NULL;
+	bool connected;
+	int rc = MOSQ_ERR_SUCCESS;
+	int i;
+	int run_start = 0, run_count = 0;
+	uint32_t run_length = 0, length;
+	uint16_t run_next_mid = 0;
+
+	if(!mosq || count < 0 || (count > 0 && !messages)) return MOSQ_ERR_INVAL;
+
+	/* Check everything first, so that either all or none are queued. */
+	for(i=0; i<count; i++){
+		entry = &messages[i];
+		rc = _mosquitto_publish_check(entry->topic, entry->payloadlen, entry->qos);
+		if(rc) return rc;
+	}
+
+	/* Take copies of the QoS>0 messages before locking the queue. */
+	for(i=0; i<count; i++){
+		entry = &messages[i];
+		entry->mid = _mosquitto_mid_generate(mosq);
+		if(entry->qos > 0){
+			message = _mosquitto_publish_message_new(mosq, entry->mid, entry->topic, entry->payloadlen, entry->payload, entry->qos, entry->retain);
+			if(!message){
+				while(stored){
+					message = stored->next;
+					_mosquitto_message_cleanup(&stored);
+					stored = message;
+				}
 				return MOSQ_ERR_NOMEM;
 			}
-			memcpy(message->msg.payload, payload, payloadlen*sizeof(uint8_t));
-		}else{
-			message->msg.payloadlen = 0;
-			message->msg.payload = NULL;
+			if(stored_last){
+				stored_last->next = message;
+			}else{
+				stored = message;
+			}
+			stored_last = message;
 		}
-		message->msg.qos = qos;
-		message->msg.retain = retain;
-		message->dup = false;
+	}
 
-		pthread_mutex_lock(&mosq->out_message_mutex);
-		_mosquitto_message_queue(mosq, message, mosq_md_out);
-		if(mosq->max_inflight_messages == 0 || mosq->inflight_messages < mosq->max_inflight_messages){
-			mosq->inflight_messages++;
-			if(qos == 1){
-				message->state = mosq_ms_wait_for_puback;
-			}else if(qos == 2){
-				message->state = mosq_ms_wait_for_pubrec;
+	connected = (mosq->sock != INVALID_SOCKET);
+
+	pthread_mutex_lock(&mosq->out_message_mutex);
+	for(i=0; i<count; i++){
+		entry = &messages[i];
+		packet = NULL;
+		if(entry->qos == 0){
+			if(!connected) continue;
+			/* Consecutive QoS 0 messages are written back to back into
+			 * one packet, so that they share a single allocation and
+			 * completion. */
+			length = _mosquitto_publish_run_length(entry);
+			if(run_count && (entry->mid != run_next_mid || run_length + length > MOSQ_PUBLISH_RUN_MAX)){
+				if(_mosquitto_publish_run_add(mosq, &messages[run_start], run_count, run_length, &first, &last)){
+					rc = MOSQ_ERR_NOMEM;
+				}
+				run_count = 0;
 			}
-			pthread_mutex_unlock(&mosq->out_message_mutex);
-			return _mosquitto_send_publish(mosq, message->msg.mid, message->msg.topic, message->msg.payloadlen, message->msg.payload, message->msg.qos, message->msg.retain, message->dup);
+			if(!run_count){
+				run_start = i;
+				run_length = 0;
+			}
+			run_count++;
+			run_length += length;
+			run_next_mid = entry->mid + 1;
+			if(run_next_mid == 0) run_next_mid++;
+			continue;
+		}
+
+		if(run_count){
+			if(_mosquitto_publish_run_add(mosq, &messages[run_start], run_count, run_length, &first, &last)){
+				rc = MOSQ_ERR_NOMEM;
+			}
+			run_count = 0;
+		}
+		message = stored;
+		stored = stored->next;
+		if(!_mosquitto_publish_message_queue(mosq, message) || !connected){
+			continue;
+		}
+		_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBLISH (d0, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, entry->qos, entry->retain, entry->mid, entry->topic, (long)entry->payloadlen);
+		if(_mosquitto_publish_packet_new(mosq, &packet, entry->mid, entry->topic, entry->payloadlen, entry->payload, entry->qos, entry->retain, false)){
+			/* QoS>0 messages stay queued and are sent on retry. */
+			rc = MOSQ_ERR_NOMEM;
+			continue;
+		}
+		if(last){
+			last->next = packet;
 		}else{
-			message->state = mosq_ms_invalid;
-			pthread_mutex_unlock(&mosq->out_message_mutex);
-			return MOSQ_ERR_SUCCESS;
+			first = packet;
+		}
+		last = packet;
+	}
+	if(run_count){
+		if(_mosquitto_publish_run_add(mosq, &messages[run_start], run_count, run_length, &first, &last)){
+			rc = MOSQ_ERR_NOMEM;
 		}
 	}
+	pthread_mutex_unlock(&mosq->out_message_mutex);
+
+	if(!connected) return MOSQ_ERR_NO_CONN;
+	if(first){
+		i = _mosquitto_packet_queue_list(mosq, first, last);
+		if(i) return i;
+	}
+	return rc;
 }
 
 int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const char *sub, int qos)
@@ -815,7 +1019,6 @@ int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets)
 	fd_set readfds, writefds;
 	int fdcount;
 	int rc;
-	char pairbuf;
 	int maxfd = 0;
 
 	if(!mosq || max_packets < 1) return MOSQ_ERR_INVAL;
@@ -827,7 +1030,7 @@ int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets)
 		FD_SET(mosq->sock, &readfds);
 		pthread_mutex_lock(&mosq->current_out_packet_mutex);
 		pthread_mutex_lock(&mosq->out_packet_mutex);
-		if(mosq->out_packet || mosq->current_out_packet){
+		if(mosq->out_packet || mosq->current_out_packet || mosq->out_packet_pending){
 			FD_SET(mosq->sock, &writefds);
 #ifdef WITH_TLS
 		}else if(mosq->ssl && mosq->want_write){
@@ -902,12 +1105,7 @@ int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets)
 				}
 			}
 			if(mosq->sockpairR >= 0 && FD_ISSET(mosq->sockpairR, &readfds)){
-#ifndef WIN32
-				if(read(mosq->sockpairR, &pairbuf, 1) == 0){
-				}
-#else
-				recv(mosq->sockpairR, &pairbuf, 1, 0);
-#endif
+				_mosquitto_wakeup_drain(mosq);
 				/* Fake write possible, to stimulate output write even though
 				 * we didn't ask for it, because at that point the publish or
 				 * other command wasn't present. */
@@ -935,6 +1133,9 @@ int mosquitto_loop_forever(struct mosquitto *mosq, int timeout, int max_packets)
 	int rc;
 	unsigned int reconnects = 0;
 	unsigned long reconnect_delay;
+#ifndef WIN32
+	struct timespec ts;
+#endif
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 
@@ -959,22 +1160,14 @@ int mosquitto_loop_forever(struct mosquitto *mosq, int timeout, int max_packets)
 		}else{
 			pthread_mutex_unlock(&mosq->state_mutex);
 
-			if(mosq->reconnect_delay > 0 && mosq->reconnect_exponential_backoff){
-				reconnect_delay = mosq->reconnect_delay*reconnects*reconnects;
-			}else{
-				reconnect_delay = mosq->reconnect_delay;
-			}
-
-			if(reconnect_delay > mosq->reconnect_delay_max){
-				reconnect_delay = mosq->reconnect_delay_max;
-			}else{
-				reconnects++;
-			}
-				
+			reconnect_delay = _mosquitto_reconnect_delay(mosq, &reconnects);
 #ifdef WIN32
-			Sleep(reconnect_delay*1000);
+			Sleep(reconnect_delay);
 #else
-			sleep(reconnect_delay);
+			ts.tv_sec = reconnect_delay/1000;
+			ts.tv_nsec = (reconnect_delay%1000)*1000000;
+			while(nanosleep(&ts, &ts) == -1 && errno == EINTR){
+			}
 #endif
 
 			pthread_mutex_lock(&mosq->state_mutex);
@@ -1106,7 +1299,7 @@ int mosquitto_loop_write(struct mosquitto *mosq, int max_packets)
 
 bool mosquitto_want_write(struct mosquitto *mosq)
 {
-	if(mosq->out_packet || mosq->current_out_packet){
+	if(mosq->out_packet || mosq->current_out_packet || mosq->out_packet_pending){
 		return true;
 #ifdef WITH_TLS
 	}else if(mosq->ssl && mosq->want_write){
@@ -113,12 +113,27 @@ struct mosquitto_message{
 	bool retain;
 };
 
+/* For use with <mosquitto_publish_batch>. */
+struct mosquitto_publish_entry{
+	int mid;
+	const char *topic;
+	const void *payload;
+	int payloadlen;
+	int qos;
+	bool retain;
+};
+
 struct mosquitto;
+struct mosquitto_reactor;
 
 /*
  * Topic: Threads
  *	libmosquitto provides thread safe operation, with the exception of
  *	<mosquitto_lib_init> which is not thread safe.
+ *
+ *	Callbacks should be set before connecting. The publish and message
+ *	callbacks are not guarded against being changed while the network loop
+ *	is running in another thread.
  */
 /***************************************************
  * Important note
@@ -138,6 +153,7 @@ struct mosquitto;
  * mosquitto_subscribe()
  * mosquitto_unsubscribe()
  * mosquitto_publish()
+ * mosquitto_publish_batch()
  ***************************************************/
 
 /*
@@ -603,6 +619,42 @@ libmosq_EXPORT int mosquitto_disconnect(struct mosquitto *mosq);
  */
 libmosq_EXPORT int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain);
 
+/*
+ * Function: mosquitto_publish_batch
+ *
+ * Publish a number of messages at once. This is equivalent to calling
+ * <mosquitto_publish> for each message in turn, but the messages are added to
+ * the outgoing queue together and the network thread is woken up once for the
+ * whole batch rather than once per message. This makes it the better choice
+ * for clients that publish many messages at a time, such as those sending a
+ * set of readings each sampling period. Consecutive QoS 0 messages are written
+ * out together, but the publish callback is still called once for each.
+ *
+ * Either all of the messages are queued, or, if any of them are invalid,
+ * none are.
+ *
+ * Parameters:
+ * 	mosq -     a valid mosquitto instance.
+ * 	messages - array of messages to publish. The topic, payloadlen, payload,
+ * 	           qos and retain members are used as the equivalent parameters of
+ * 	           <mosquitto_publish>. On return, the mid member of each is set
+ * 	           to the message id of that message.
+ * 	count -    the number of messages in the array.
+ *
+ * Returns:
+ * 	MOSQ_ERR_SUCCESS -      on success.
+ * 	MOSQ_ERR_INVAL -        if the input parameters were invalid.
+ * 	MOSQ_ERR_NOMEM -        if an out of memory condition occurred.
+ * 	MOSQ_ERR_NO_CONN -      if the client isn't connected to a broker.
+ *	MOSQ_ERR_PROTOCOL -     if there is a protocol error communicating with the
+ *                          broker.
+ * 	MOSQ_ERR_PAYLOAD_SIZE - if a payloadlen is too large.
+ *
+ * See Also:
+ *	<mosquitto_publish>
+ */
+libmosq_EXPORT int mosquitto_publish_batch(struct mosquitto *mosq, struct mosquitto_publish_entry *messages, int count);
+
 /*
  * Function: mosquitto_subscribe
  *
@@ -805,6 +857,193 @@ libmosq_EXPORT int mosquitto_loop_start(struct mosquitto *mosq);
  */
 libmosq_EXPORT int mosquitto_loop_stop(struct mosquitto *mosq, bool force);
 
+/*
+ * Function: mosquitto_reactor_new
+ *
+ * Create a new reactor. A reactor runs the network loop for any number of
+ * clients in a single thread, as an alternative to calling <mosquitto_loop>
+ * for each of them or giving each its own thread with <mosquitto_loop_start>.
+ * Clients are attached with <mosquitto_reactor_add>.
+ *
+ * Reactors are only available on Linux.
+ *
+ * Returns:
+ * 	Pointer to a struct mosquitto_reactor on success.
+ * 	NULL on failure. Interrogate errno to determine the cause for the failure:
+ *      - ENOMEM on out of memory.
+ *      - ENOSYS if reactors are not supported on this platform.
+ *      - other values set by epoll_create1() or eventfd().
+ *
+ * See Also:
+ * 	<mosquitto_reactor_destroy>, <mosquitto_reactor_add>
+ */
+libmosq_EXPORT struct mosquitto_reactor *mosquitto_reactor_new(void);
+
+/*
+ * Function: mosquitto_reactor_destroy
+ *
+ * Use to free memory associated with a reactor. Stops the reactor thread if
+ * <mosquitto_reactor_loop_start> was used and removes any clients still
+ * attached. The clients themselves are not destroyed.
+ *
+ * Parameters:
+ * 	reactor - a struct mosquitto_reactor pointer to free.
+ *
+ * See Also:
+ * 	<mosquitto_reactor_new>
+ */
+libmosq_EXPORT void mosquitto_reactor_destroy(struct mosquitto_reactor *reactor);
+
+/*
+ * Function: mosquitto_reactor_add
+ *
+ * Attach a client to a reactor. From then on the reactor carries out the
+ * network reads and writes of the client, the work of <mosquitto_loop_misc>
+ * and reconnects after a lost connection, honouring
+ * <mosquitto_reconnect_delay_set>. The client may be connected already, or
+ * have been set up with <mosquitto_connect_async>, in which case the reactor
+ * makes the connection.
+ *
+ * The client must not also be run with <mosquitto_loop>,
+ * <mosquitto_loop_forever> or <mosquitto_loop_start>. Must not be called
+ * from a callback.
+ *
+ * Parameters:
+ * 	reactor - a valid reactor.
+ *	mosq -    a valid mosquitto instance.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -       on success.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid, or the
+ * 	                         client is threaded or already attached.
+ * 	MOSQ_ERR_NOMEM -         if an out of memory condition occurred.
+ *	MOSQ_ERR_NOT_SUPPORTED - if reactors are not supported on this platform.
+ *
+ * See Also:
+ * 	<mosquitto_reactor_remove>, <mosquitto_reactor_loop>
+ */
+libmosq_EXPORT int mosquitto_reactor_add(struct mosquitto_reactor *reactor, struct mosquitto *mosq);
+
+/*
+ * Function: mosquitto_reactor_remove
+ *
+ * Detach a client from a reactor. The connection is left as it is, and the
+ * client may be run with the other loop functions or added to a reactor
+ * again. <mosquitto_destroy> removes the client from its reactor itself.
+ * Must not be called from a callback.
+ *
+ * Parameters:
+ * 	reactor - a valid reactor.
+ *	mosq -    a mosquitto instance attached to reactor.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -       on success.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid or the
+ * 	                         client is not attached to reactor.
+ *	MOSQ_ERR_NOT_SUPPORTED - if reactors are not supported on this platform.
+ *
+ * See Also:
+ * 	<mosquitto_reactor_add>
+ */
+libmosq_EXPORT int mosquitto_reactor_remove(struct mosquitto_reactor *reactor, struct mosquitto *mosq);
+
+/*
+ * Function: mosquitto_reactor_loop
+ *
+ * The equivalent of <mosquitto_loop> for every client attached to a reactor.
+ * Waits for network activity on any of the clients for up to timeout
+ * milliseconds, then handles it. Clients that are due to reconnect are
+ * reconnected first.
+ *
+ * Parameters:
+ * 	reactor -     a valid reactor.
+ *	timeout -     Maximum number of milliseconds to wait for network activity
+ *	              before returning. Set to 0 for an instant return. Set
+ *	              negative to use the default of 1000ms.
+ *	max_packets - the maximum number of packets to process per client and
+ *	              event. Must be greater than 0.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -       on success.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid.
+ *	MOSQ_ERR_ERRNO -         if a system call returned an error. The variable
+ *	                         errno contains the error code.
+ *	MOSQ_ERR_NOT_SUPPORTED - if reactors are not supported on this platform.
+ *
+ * See Also:
+ * 	<mosquitto_reactor_loop_forever>, <mosquitto_reactor_loop_start>
+ */
+libmosq_EXPORT int mosquitto_reactor_loop(struct mosquitto_reactor *reactor, int timeout, int max_packets);
+
+/*
+ * Function: mosquitto_reactor_loop_forever
+ *
+ * Calls <mosquitto_reactor_loop> in an infinite blocking loop, until
+ * <mosquitto_reactor_loop_stop> is called, for example from a callback.
+ *
+ * Parameters:
+ * 	reactor -     a valid reactor.
+ *	timeout -     Maximum number of milliseconds to wait for network activity
+ *	              in each iteration. Set negative to use the default of
+ *	              1000ms.
+ *	max_packets - the maximum number of packets to process per client and
+ *	              event. Must be greater than 0.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -       once stopped.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid.
+ *	MOSQ_ERR_ERRNO -         if a system call returned an error. The variable
+ *	                         errno contains the error code.
+ *	MOSQ_ERR_NOT_SUPPORTED - if reactors are not supported on this platform.
+ *
+ * See Also:
+ * 	<mosquitto_reactor_loop>, <mosquitto_reactor_loop_start>
+ */
+libmosq_EXPORT int mosquitto_reactor_loop_forever(struct mosquitto_reactor *reactor, int timeout, int max_packets);
+
+/*
+ * Function: mosquitto_reactor_loop_start
+ *
+ * Start a thread running <mosquitto_reactor_loop_forever>. As with
+ * <mosquitto_loop_start>, the attached clients may then be used from any
+ * thread and clients may be added and removed while the thread runs.
+ *
+ * Parameters:
+ * 	reactor - a valid reactor.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -       on success.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid or the
+ * 	                         thread is already running.
+ *	MOSQ_ERR_NOT_SUPPORTED - if thread or reactor support is not available.
+ *
+ * See Also:
+ * 	<mosquitto_reactor_loop_stop>
+ */
+libmosq_EXPORT int mosquitto_reactor_loop_start(struct mosquitto_reactor *reactor);
+
+/*
+ * Function: mosquitto_reactor_loop_stop
+ *
+ * Stop <mosquitto_reactor_loop_forever>. If the reactor thread was started
+ * with <mosquitto_reactor_loop_start>, this blocks until it has finished,
+ * unless called from a callback in that thread. Unlike <mosquitto_loop_stop>
+ * the clients need not be disconnected first.
+ *
+ * Parameters:
+ * 	reactor - a valid reactor.
+ *	force -   set to true to force thread cancellation.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS -       on success.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid.
+ *	MOSQ_ERR_NOT_SUPPORTED - if reactors are not supported on this platform.
+ *
+ * See Also:
+ * 	<mosquitto_reactor_loop_start>
+ */
+libmosq_EXPORT int mosquitto_reactor_loop_stop(struct mosquitto_reactor *reactor, bool force);
+
 /*
  * Function: mosquitto_socket
  *
@@ -1238,6 +1477,28 @@ libmosq_EXPORT void mosquitto_log_callback_set(struct mosquitto *mosq, void (*on
  */
 libmosq_EXPORT int mosquitto_reconnect_delay_set(struct mosquitto *mosq, unsigned int reconnect_delay, unsigned int reconnect_delay_max, bool reconnect_exponential_backoff);
 
+/*
+ * Function: mosquitto_reconnect_jitter_set
+ *
+ * Add a random delay of up to reconnect_jitter seconds to each of the delays
+ * set with <mosquitto_reconnect_delay_set>, including the first attempt after
+ * the connection is lost. When many clients lose the same broker at once this
+ * spreads their reconnection attempts out instead of having them all arrive
+ * together. The default is 0, no jitter.
+ *
+ * Parameters:
+ *  mosq -             a valid mosquitto instance.
+ *  reconnect_jitter - the maximum number of seconds to add to each delay.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success.
+ * 	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ *
+ * See Also:
+ *	<mosquitto_reconnect_delay_set>
+ */
+libmosq_EXPORT int mosquitto_reconnect_jitter_set(struct mosquitto *mosq, unsigned int reconnect_jitter);
+
 /*
  * Function: mosquitto_max_inflight_messages_set
  *
@@ -68,6 +68,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "time_mosq.h"
 #ifdef WITH_BROKER
 struct mosquitto_client_msg;
+struct _mosquitto_msg_topic;
 #endif
 
 enum mosquitto_msg_direction {
@@ -113,6 +114,16 @@ enum _mosquitto_transport {
 	mosq_t_sctp = 3
 };
 
+#ifdef WITH_BROKER
+/* Serialised packet that is shared, read only, by the outgoing packets of
+ * several clients. */
+struct _mosquitto_shared_packet{
+	int ref_count;
+	uint32_t packet_length;
+	uint8_t *payload;
+};
+#endif
+
 struct _mosquitto_packet{
 	uint8_t command;
 	uint8_t have_remaining;
@@ -125,7 +136,54 @@ struct _mosquitto_packet{
 	uint32_t pos;
 	uint8_t *payload;
 	struct _mosquitto_packet *next;
+#ifdef WITH_BROKER
+	struct _mosquitto_shared_packet *shared;
+	/* For PUBLISH packets whose latency is measured, when the message was
+	 * queued for its subscribers, in microseconds. */
+	uint64_t enqueued_us;
+#else
+	/* For a run of QoS 0 PUBLISHes written back to back in one packet by
+	 * mosquitto_publish_batch(), how many there are. Their message ids
+	 * count up from mid. 0 for any other packet. */
+	uint16_t mid_count;
+#endif
+};
+
+#ifndef WITH_BROKER
+/* Number of packet buffer size classes, 64 bytes to 16 kB. See pool_mosq.c. */
+#define MOSQ_POOL_CLASSES 9
+
+struct _mosquitto_pool_item;
+
+/* Free packet buffers belonging to one client, by size class. */
+struct _mosquitto_packet_pool{
+	struct _mosquitto_pool_item *free[MOSQ_POOL_CLASSES];
+	int count[MOSQ_POOL_CLASSES];
+#  ifdef WITH_THREADING
+	pthread_mutex_t mutex;
+#  endif
 };
+#endif
+
+#ifdef WITH_BROKER
+enum mosquitto_timer_type {
+	mosq_tt_keepalive = 0,
+	mosq_tt_retry = 1,
+	mosq_tt_expire = 2,
+	mosq_tt_bridge = 3
+};
+
+/* Entry in the broker timer wheel. These are embedded in struct mosquitto so
+ * scheduling a timer never allocates. pprev points at whichever pointer refers
+ * to this entry, so removal works without knowing which slot it lives in. */
+struct _mosquitto_timer{
+	struct _mosquitto_timer *next;
+	struct _mosquitto_timer **pprev;
+	struct mosquitto *context;
+	time_t expiry;
+	enum mosquitto_timer_type type;
+};
+#endif
 
 struct mosquitto_message_all{
 	struct mosquitto_message_all *next;
@@ -140,6 +198,7 @@ struct mosquitto {
 #ifndef WIN32
 	int sock;
 #  ifndef WITH_BROKER
+	/* Used to wake the network loop. On Linux both are the same eventfd. */
 	int sockpairR, sockpairW;
 #  endif
 #else
@@ -161,6 +220,10 @@ struct mosquitto {
 	time_t ping_t;
 	uint16_t last_mid;
 	struct _mosquitto_packet in_packet;
+	/* Data received from the network but not yet parsed into in_packet. */
+	uint8_t *in_buf;
+	uint32_t in_buf_pos;
+	uint32_t in_buf_len;
 	struct _mosquitto_packet *current_out_packet;
 	struct _mosquitto_packet *out_packet;
 	struct mosquitto_message *will;
@@ -198,13 +261,38 @@ struct mosquitto {
 	struct mosquitto_client_msg *last_msg;
 	int msg_count;
 	int msg_count12;
+	/* An enum mqtt3_queue_policy, chosen when the client connects. */
+	int queue_policy;
+	struct _mosquitto_msg_topic *msg_topics;
 	struct _mosquitto_acl_user *acl_list;
+	/* Pattern ACLs with %c and %u already substituted for this client. */
+	struct _mosquitto_acl *acl_expanded;
+	struct _mosquitto_acl_cache *acl_cache;
+	/* Next acl_cache entry looked at for eviction. */
+	struct _mosquitto_acl_cache *acl_cache_hand;
+	int acl_cache_count;
 	struct _mqtt3_listener *listener;
 	time_t disconnect_t;
 	int pollfd_index;
 	int db_index;
 	struct _mosquitto_packet *out_packet_last;
 	bool is_dropping;
+	/* Set while a batch of packets is being queued; the caller writes them
+	 * out together afterwards rather than one at a time. */
+	bool out_packet_held;
+#ifdef WITH_IO_THREADS
+	/* Set for clients whose socket I/O is done by the I/O threads. Queued
+	 * packets are left for the threads to write after the current round of
+	 * reads has been handled. */
+	bool out_packet_deferred;
+	/* Set when an I/O thread has just filled in_buf, so the main thread
+	 * doesn't read the socket again while parsing it. */
+	bool in_buf_refilled;
+#endif
+	struct _mosquitto_timer keepalive_timer;
+	struct _mosquitto_timer retry_timer;
+	struct _mosquitto_timer expire_timer;
+	struct _mosquitto_timer bridge_timer;
 #else
 	void *userdata;
 	bool in_callback;
@@ -214,6 +302,9 @@ struct mosquitto {
 	struct mosquitto_message_all *in_messages_last;
 	struct mosquitto_message_all *out_messages;
 	struct mosquitto_message_all *out_messages_last;
+	/* Callbacks are set before connecting and left alone afterwards, so
+	 * on_publish and on_message, which are called for every message, are
+	 * read without taking callback_mutex. */
 	void (*on_connect)(struct mosquitto *, void *userdata, int rc);
 	void (*on_disconnect)(struct mosquitto *, void *userdata, int rc);
 	void (*on_publish)(struct mosquitto *, void *userdata, int mid);
@@ -230,8 +321,27 @@ struct mosquitto {
 	unsigned int reconnect_delay;
 	unsigned int reconnect_delay_max;
 	bool reconnect_exponential_backoff;
+	unsigned int reconnect_jitter;
+	/* State of the generator reconnect_jitter delays are drawn from, see
+	 * _mosquitto_reconnect_seed(). */
+	uint32_t reconnect_rand;
 	bool threaded;
 	struct _mosquitto_packet *out_packet_last;
+	/* Packets queued by _mosquitto_packet_queue_list() that the network loop
+	 * has yet to move to out_packet, newest first. Any thread may push on to
+	 * it without locking; only the writer, holding out_packet_mutex, takes
+	 * from it, all at once. See _mosquitto_packet_pending_collect(). */
+	struct _mosquitto_packet *volatile out_packet_pending;
+	struct _mosquitto_packet_pool packet_pool;
+	/* Set while the client is attached to a reactor. The remaining fields
+	 * belong to the reactor and are only used under its mutex. See
+	 * reactor_mosq.c. */
+	struct mosquitto_reactor *reactor;
+	int reactor_slot;
+	int reactor_sock;
+	uint32_t reactor_events;
+	unsigned int reactor_reconnects;
+	time_t reactor_reconnect_at;
 	int inflight_messages;
 	int max_inflight_messages;
 #  ifdef WITH_SRV
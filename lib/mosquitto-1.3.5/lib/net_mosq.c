@@ -35,6 +35,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef WIN32
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #else
 #include <winsock2.h>
@@ -68,6 +69,34 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <tls_mosq.h>
 #endif
 
+#if defined(__linux__) && !defined(WITH_BROKER)
+#  define HAVE_EVENTFD
+#  include <sys/eventfd.h>
+#endif
+
+#ifndef WITH_BROKER
+/* Atomic pointer operations for out_packet_pending. The exchange need only
+ * be an acquire barrier, the compare and swap must be a release barrier. */
+#  ifdef WIN32
+#    define _mosquitto_atomic_cas_ptr(ptr, oldval, newval) \
+		(InterlockedCompareExchangePointer((PVOID volatile *)(ptr), (newval), (oldval)) == (oldval))
+#    define _mosquitto_atomic_xchg_ptr(ptr, newval) \
+		InterlockedExchangePointer((PVOID volatile *)(ptr), (newval))
+#  else
+#    define _mosquitto_atomic_cas_ptr(ptr, oldval, newval) \
+		__sync_bool_compare_and_swap((ptr), (oldval), (newval))
+#    define _mosquitto_atomic_xchg_ptr(ptr, newval) \
+		__sync_lock_test_and_set((ptr), (newval))
+#  endif
+#endif
+
+/* Maximum number of queued packets gathered into a single write. */
+#define MOSQ_WRITE_BATCH_MAX 64
+#ifdef WITH_TLS
+/* Maximum number of bytes coalesced into a single SSL_write(). */
+#define MOSQ_TLS_COALESCE_MAX 16384
+#endif
+
 #ifdef WITH_BROKER
 #  include <mosquitto_broker.h>
 #  ifdef WITH_SYS_TREE
@@ -79,6 +108,8 @@ POSSIBILITY OF SUCH DAMAGE.
    extern unsigned long g_pub_msgs_sent;
 #  endif
 #else
+#  include <pool_mosq.h>
+#  include <reactor_mosq.h>
 #  include <read_handle.h>
 #endif
 
@@ -141,55 +172,240 @@ void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet)
 	packet->remaining_count = 0;
 	packet->remaining_mult = 1;
 	packet->remaining_length = 0;
+#ifdef WITH_BROKER
+	if(packet->shared){
+		/* The payload belongs to the shared packet. */
+		_mosquitto_shared_packet_release(packet->shared);
+		packet->shared = NULL;
+		packet->payload = NULL;
+	}
+#endif
+#ifdef WITH_BROKER
 	if(packet->payload) _mosquitto_free(packet->payload);
+#else
+	_mosquitto_pool_free(packet->payload);
+#endif
 	packet->payload = NULL;
 	packet->to_process = 0;
 	packet->pos = 0;
 }
 
+/* Clean up and free a packet allocated with _mosquitto_packet_new(). */
+void _mosquitto_packet_free(struct _mosquitto_packet *packet)
+{
+	if(!packet) return;
+
+	_mosquitto_packet_cleanup(packet);
+#ifdef WITH_BROKER
+	_mosquitto_free(packet);
+#else
+	_mosquitto_pool_free(packet);
+#endif
+}
+
+#ifdef WITH_BROKER
+void _mosquitto_shared_packet_release(struct _mosquitto_shared_packet *shared)
+{
+	if(!shared) return;
+
+	shared->ref_count--;
+	if(shared->ref_count == 0){
+		if(shared->payload) _mosquitto_free(shared->payload);
+		_mosquitto_free(shared);
+	}
+}
+#endif
+
 int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet)
 {
+	assert(packet);
+
+	packet->next = NULL;
+	return _mosquitto_packet_queue_list(mosq, packet, packet);
+}
+
+/* Queue the list of packets from first to last, linked through next, as
+ * _mosquitto_packet_queue() does for a single packet but with one
+ * acquisition of out_packet_mutex and one wakeup for the whole list. In the
+ * client library the list is pushed on to out_packet_pending instead, which
+ * takes no lock at all. */
+int _mosquitto_packet_queue_list(struct mosquitto *mosq, struct _mosquitto_packet *first, struct _mosquitto_packet *last)
+{
+	struct _mosquitto_packet *packet;
 #ifndef WITH_BROKER
-	char sockpair_data = 0;
+	struct _mosquitto_packet *prev, *next, *head;
 #endif
 	assert(mosq);
-	assert(packet);
+	assert(first);
+	assert(last);
 
-	packet->pos = 0;
-	packet->to_process = packet->packet_length;
+	for(packet=first; packet; packet=packet->next){
+		packet->pos = 0;
+		packet->to_process = packet->packet_length;
+	}
 
-	packet->next = NULL;
+	last->next = NULL;
+#ifndef WITH_BROKER
+	/* out_packet_pending is newest first, so reverse the list before
+	 * pushing it. */
+	prev = NULL;
+	for(packet=first; packet; packet=next){
+		next = packet->next;
+		packet->next = prev;
+		prev = packet;
+	}
+	do{
+		head = mosq->out_packet_pending;
+		first->next = head;
+	}while(!_mosquitto_atomic_cas_ptr(&mosq->out_packet_pending, head, last));
+
+	/* Only a push on to an empty list needs to wake the network loop. Until
+	 * the loop has collected that list, anything pushed after it will be
+	 * collected along with it. */
+	if(!head){
+		_mosquitto_wakeup(mosq);
+	}
+
+	if(mosq->in_callback == false && mosq->threaded == false){
+		return _mosquitto_packet_write(mosq);
+	}else{
+		return MOSQ_ERR_SUCCESS;
+	}
+#else
 	pthread_mutex_lock(&mosq->out_packet_mutex);
 	if(mosq->out_packet){
-		mosq->out_packet_last->next = packet;
+		mosq->out_packet_last->next = first;
 	}else{
-		mosq->out_packet = packet;
+		mosq->out_packet = first;
 	}
-	mosq->out_packet_last = packet;
+	mosq->out_packet_last = last;
 	pthread_mutex_unlock(&mosq->out_packet_mutex);
-#ifdef WITH_BROKER
-	return _mosquitto_packet_write(mosq);
-#else
 
-	/* Write a single byte to sockpairW (connected to sockpairR) to break out
-	 * of select() if in threaded mode. */
-	if(mosq->sockpairW != INVALID_SOCKET){
-#ifndef WIN32
-		if(write(mosq->sockpairW, &sockpair_data, 1)){
-		}
-#else
-		send(mosq->sockpairW, &sockpair_data, 1, 0);
+	if(mosq->out_packet_held){
+		/* The caller writes the whole batch once it is queued. */
+		return MOSQ_ERR_SUCCESS;
+	}
+#  ifdef WITH_IO_THREADS
+	if(mosq->out_packet_deferred){
+		/* Written by the I/O threads later in this loop iteration. */
+		return MOSQ_ERR_SUCCESS;
+	}
+#  endif
+	return _mosquitto_packet_write(mosq);
 #endif
+}
+
+#ifndef WITH_BROKER
+/* Move the packets pushed on to out_packet_pending to the end of out_packet,
+ * in the order they were queued. out_packet_mutex must be held, or the
+ * client otherwise not in use by any other thread. */
+void _mosquitto_packet_pending_collect(struct mosquitto *mosq)
+{
+	struct _mosquitto_packet *packet, *next, *list = NULL, *newest;
+
+	if(!mosq->out_packet_pending) return;
+
+	newest = _mosquitto_atomic_xchg_ptr(&mosq->out_packet_pending, NULL);
+	for(packet=newest; packet; packet=next){
+		next = packet->next;
+		packet->next = list;
+		list = packet;
 	}
+	if(!list) return;
 
-	if(mosq->in_callback == false && mosq->threaded == false){
-		return _mosquitto_packet_write(mosq);
+	if(mosq->out_packet){
+		mosq->out_packet_last->next = list;
 	}else{
+		mosq->out_packet = list;
+	}
+	mosq->out_packet_last = newest;
+}
+
+/* Create the means of waking the network loop: an eventfd where there is
+ * one, otherwise a socket pair. */
+int _mosquitto_wakeup_open(struct mosquitto *mosq)
+{
+#ifdef HAVE_EVENTFD
+	int fd;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(fd != -1){
+		mosq->sockpairR = fd;
+		mosq->sockpairW = fd;
 		return MOSQ_ERR_SUCCESS;
 	}
+#endif
+	if(_mosquitto_socketpair(&mosq->sockpairR, &mosq->sockpairW)){
+		return MOSQ_ERR_ERRNO;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void _mosquitto_wakeup_close(struct mosquitto *mosq)
+{
+	if(mosq->sockpairW != INVALID_SOCKET && mosq->sockpairW != mosq->sockpairR){
+		COMPAT_CLOSE(mosq->sockpairW);
+	}
+	mosq->sockpairW = INVALID_SOCKET;
+	if(mosq->sockpairR != INVALID_SOCKET){
+		COMPAT_CLOSE(mosq->sockpairR);
+		mosq->sockpairR = INVALID_SOCKET;
+	}
+}
+
+/* Break the network loop out of select(). */
+void _mosquitto_wakeup(struct mosquitto *mosq)
+{
+#ifdef HAVE_EVENTFD
+	uint64_t one = 1;
+#endif
+	char sockpair_data = 0;
+
+	if(mosq->reactor){
+		_mosquitto_reactor_wakeup(mosq->reactor);
+		return;
+	}
+	if(mosq->sockpairW == INVALID_SOCKET) return;
+
+#ifdef HAVE_EVENTFD
+	if(mosq->sockpairW == mosq->sockpairR){
+		if(write(mosq->sockpairW, &one, sizeof(one))){
+		}
+		return;
+	}
+#endif
+#ifndef WIN32
+	if(write(mosq->sockpairW, &sockpair_data, 1)){
+	}
+#else
+	send(mosq->sockpairW, &sockpair_data, 1, 0);
 #endif
 }
 
+/* Clear any wakeups once the network loop has been woken. */
+void _mosquitto_wakeup_drain(struct mosquitto *mosq)
+{
+	char buf[64];
+
+	if(mosq->sockpairR == INVALID_SOCKET) return;
+
+#ifdef HAVE_EVENTFD
+	if(mosq->sockpairW == mosq->sockpairR){
+		/* Reading an eventfd resets its counter. */
+		if(read(mosq->sockpairR, buf, sizeof(uint64_t))){
+		}
+		return;
+	}
+#endif
+#ifndef WIN32
+	if(read(mosq->sockpairR, buf, sizeof(buf))){
+	}
+#else
+	recv(mosq->sockpairR, buf, sizeof(buf), 0);
+#endif
+}
+#endif
+
 /* Close a socket associated with a context and set it to -1.
  * Returns 1 on failure (context is NULL)
  * Returns 0 on success.
@@ -199,6 +415,19 @@ int _mosquitto_socket_close(struct mosquitto *mosq)
 	int rc = 0;
 
 	assert(mosq);
+#if defined(WITH_BROKER) && defined(WITH_IO_THREADS)
+	if(mosq->out_packet_deferred && mosq->sock != INVALID_SOCKET){
+		/* Give anything still queued, such as a CONNACK refusing the
+		 * connection, a chance to go out before the socket is closed. */
+		_mosquitto_packet_write(mosq);
+	}
+#endif
+	if(mosq->in_buf){
+		_mosquitto_free(mosq->in_buf);
+		mosq->in_buf = NULL;
+	}
+	mosq->in_buf_pos = 0;
+	mosq->in_buf_len = 0;
 #ifdef WITH_TLS
 	if(mosq->ssl){
 		SSL_shutdown(mosq->ssl);
@@ -214,6 +443,12 @@ int _mosquitto_socket_close(struct mosquitto *mosq)
 	if(mosq->sock != INVALID_SOCKET){
 		rc = COMPAT_CLOSE(mosq->sock);
 		mosq->sock = INVALID_SOCKET;
+#ifndef WITH_BROKER
+		/* Closing took the socket out of the reactor's epoll set. A
+		 * reconnect may get the same fd number back, so make sure the
+		 * reactor registers it again. */
+		mosq->reactor_events = 0;
+#endif
 	}
 
 	return rc;
@@ -391,6 +626,8 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 			/* Use even less memory per SSL connection. */
 			SSL_CTX_set_mode(mosq->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
 #endif
+		/* A retried write may come from a different coalescing buffer. */
+		SSL_CTX_set_mode(mosq->ssl_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
 		if(mosq->tls_ciphers){
 			ret = SSL_CTX_set_cipher_list(mosq->ssl_ctx, mosq->tls_ciphers);
@@ -565,6 +802,31 @@ int _mosquitto_read_string(struct _mosquitto_packet *packet, char **str)
 	return MOSQ_ERR_SUCCESS;
 }
 
+#ifndef WITH_BROKER
+/* As _mosquitto_read_string(), but with the string taken from the packet
+ * pool of mosq. It must be freed with _mosquitto_pool_free(). */
+int _mosquitto_read_string_pool(struct mosquitto *mosq, struct _mosquitto_packet *packet, char **str)
+{
+	uint16_t len;
+	int rc;
+
+	assert(packet);
+	rc = _mosquitto_read_uint16(packet, &len);
+	if(rc) return rc;
+
+	if(packet->pos+len > packet->remaining_length) return MOSQ_ERR_PROTOCOL;
+
+	*str = _mosquitto_pool_alloc(mosq, len+1);
+	if(!*str) return MOSQ_ERR_NOMEM;
+
+	memcpy(*str, &(packet->payload[packet->pos]), len);
+	(*str)[len] = '\0';
+	packet->pos += len;
+
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
 void _mosquitto_write_string(struct _mosquitto_packet *packet, const char *str, uint16_t length)
 {
 	assert(packet);
@@ -691,16 +953,106 @@ ssize_t _mosquitto_net_write(struct mosquitto *mosq, void *buf, size_t count)
 #endif
 }
 
+/* Write as much as possible of the current packet and the packets queued
+ * behind it in one call - writev() for plain sockets, or a single
+ * SSL_write() over a coalesced copy for TLS. Nothing beyond a DISCONNECT is
+ * included. */
+static ssize_t _packet_write_batch(struct mosquitto *mosq, struct _mosquitto_packet *packet)
+{
+#ifndef WIN32
+	struct iovec iov[MOSQ_WRITE_BATCH_MAX];
+	struct _mosquitto_packet *next;
+	int count;
+#ifdef WITH_TLS
+	uint8_t buf[MOSQ_TLS_COALESCE_MAX];
+	size_t len;
+	int i;
+#endif
+
+	iov[0].iov_base = &(packet->payload[packet->pos]);
+	iov[0].iov_len = packet->to_process;
+	count = 1;
+
+	if(((packet->command)&0xF0) != DISCONNECT){
+		pthread_mutex_lock(&mosq->out_packet_mutex);
+#ifndef WITH_BROKER
+		_mosquitto_packet_pending_collect(mosq);
+#endif
+		next = mosq->out_packet;
+		while(next && count < MOSQ_WRITE_BATCH_MAX){
+			iov[count].iov_base = &(next->payload[next->pos]);
+			iov[count].iov_len = next->to_process;
+			count++;
+			if(((next->command)&0xF0) == DISCONNECT) break;
+			next = next->next;
+		}
+		pthread_mutex_unlock(&mosq->out_packet_mutex);
+	}
+	if(count == 1){
+		return _mosquitto_net_write(mosq, iov[0].iov_base, iov[0].iov_len);
+	}
+
+#ifdef WITH_TLS
+	if(mosq->ssl){
+		if(iov[0].iov_len + iov[1].iov_len > MOSQ_TLS_COALESCE_MAX){
+			return _mosquitto_net_write(mosq, iov[0].iov_base, iov[0].iov_len);
+		}
+		len = 0;
+		for(i=0; i<count && len+iov[i].iov_len <= MOSQ_TLS_COALESCE_MAX; i++){
+			memcpy(&buf[len], iov[i].iov_base, iov[i].iov_len);
+			len += iov[i].iov_len;
+		}
+		return _mosquitto_net_write(mosq, buf, len);
+	}
+#endif
+
+	errno = 0;
+	return writev(mosq->sock, iov, count);
+#else
+	return _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+#endif
+}
+
+/* Account for write_length bytes written by _packet_write_batch(), which
+ * may run on past the current packet into those queued behind it. */
+static void _packet_write_consume(struct mosquitto *mosq, struct _mosquitto_packet *packet, ssize_t write_length)
+{
+	uint32_t len;
+
+	while(packet && write_length > 0){
+		len = write_length < packet->to_process ? write_length : packet->to_process;
+		packet->to_process -= len;
+		packet->pos += len;
+		write_length -= len;
+
+		if(packet == mosq->current_out_packet){
+			pthread_mutex_lock(&mosq->out_packet_mutex);
+			packet = mosq->out_packet;
+			pthread_mutex_unlock(&mosq->out_packet_mutex);
+		}else{
+			packet = packet->next;
+		}
+	}
+}
+
 int _mosquitto_packet_write(struct mosquitto *mosq)
 {
 	ssize_t write_length;
 	struct _mosquitto_packet *packet;
+#ifndef WITH_BROKER
+	void (*on_publish)(struct mosquitto *, void *, int);
+	uint16_t mid;
+	int i;
+#endif
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 
 	pthread_mutex_lock(&mosq->current_out_packet_mutex);
 	pthread_mutex_lock(&mosq->out_packet_mutex);
+#ifndef WITH_BROKER
+	_mosquitto_packet_pending_collect(mosq);
+#endif
 	if(mosq->out_packet && !mosq->current_out_packet){
 		mosq->current_out_packet = mosq->out_packet;
 		mosq->out_packet = mosq->out_packet->next;
@@ -714,13 +1066,12 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 		packet = mosq->current_out_packet;
 
 		while(packet->to_process > 0){
-			write_length = _mosquitto_net_write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+			write_length = _packet_write_batch(mosq, packet);
 			if(write_length > 0){
 #if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
 				g_bytes_sent += write_length;
 #endif
-				packet->to_process -= write_length;
-				packet->pos += write_length;
+				_packet_write_consume(mosq, packet, write_length);
 			}else{
 #ifdef WIN32
 				errno = WSAGetLastError();
@@ -745,18 +1096,28 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 		g_msgs_sent++;
 		if(((packet->command)&0xF6) == PUBLISH){
 			g_pub_msgs_sent++;
+			if(packet->enqueued_us){
+				mqtt3_sys_latency_record(mlt_enqueue_write, mosquitto_time_us() - packet->enqueued_us);
+			}
 		}
 #  endif
 #else
 		if(((packet->command)&0xF6) == PUBLISH){
-			pthread_mutex_lock(&mosq->callback_mutex);
-			if(mosq->on_publish){
-				/* This is a QoS=0 message */
+			/* This is a QoS=0 message. on_publish is read without
+			 * callback_mutex, see struct mosquitto. */
+			on_publish = mosq->on_publish;
+			if(on_publish){
 				mosq->in_callback = true;
-				mosq->on_publish(mosq, mosq->userdata, packet->mid);
+				on_publish(mosq, mosq->userdata, packet->mid);
+				/* A run of messages from mosquitto_publish_batch(). */
+				mid = packet->mid;
+				for(i=1; i<packet->mid_count; i++){
+					mid++;
+					if(mid == 0) mid++;
+					on_publish(mosq, mosq->userdata, mid);
+				}
 				mosq->in_callback = false;
 			}
-			pthread_mutex_unlock(&mosq->callback_mutex);
 		}else if(((packet->command)&0xF0) == DISCONNECT){
 			/* FIXME what cleanup needs doing here? 
 			 * incoming/outgoing messages? */
@@ -775,8 +1136,7 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 			}
 			pthread_mutex_unlock(&mosq->out_packet_mutex);
 
-			_mosquitto_packet_cleanup(packet);
-			_mosquitto_free(packet);
+			_mosquitto_packet_free(packet);
 
 			pthread_mutex_lock(&mosq->msgtime_mutex);
 			mosq->last_msg_out = mosquitto_time();
@@ -797,6 +1157,9 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 
 		/* Free data and reset values */
 		pthread_mutex_lock(&mosq->out_packet_mutex);
+#ifndef WITH_BROKER
+		_mosquitto_packet_pending_collect(mosq);
+#endif
 		mosq->current_out_packet = mosq->out_packet;
 		if(mosq->out_packet){
 			mosq->out_packet = mosq->out_packet->next;
@@ -806,8 +1169,7 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 		}
 		pthread_mutex_unlock(&mosq->out_packet_mutex);
 
-		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 
 		pthread_mutex_lock(&mosq->msgtime_mutex);
 		mosq->last_msg_out = mosquitto_time();
@@ -817,18 +1179,141 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 	return MOSQ_ERR_SUCCESS;
 }
 
+#ifdef WITH_IO_THREADS
+/* Write as much of the queued output as the socket will take. This is the
+ * part of writing done by an I/O thread, so it touches nothing but the
+ * client's own socket and packets: written packets are left in the queue
+ * with nothing left to process, for _mosquitto_packet_write() on the main
+ * thread to free and count. Only used for plain sockets.
+ * *written is set to the number of bytes written.
+ * Returns MOSQ_ERR_SUCCESS if everything was written or the socket is full,
+ * MOSQ_ERR_CONN_LOST or MOSQ_ERR_ERRNO on error. */
+int _mosquitto_packet_flush(struct mosquitto *mosq, ssize_t *written)
+{
+	struct iovec iov[MOSQ_WRITE_BATCH_MAX];
+	struct _mosquitto_packet *first, *packet;
+	ssize_t write_length;
+	int count;
+
+	*written = 0;
+	first = mosq->current_out_packet ? mosq->current_out_packet : mosq->out_packet;
+	while(first){
+		count = 0;
+		for(packet = first; packet && count < MOSQ_WRITE_BATCH_MAX; ){
+			if(packet->to_process > 0){
+				iov[count].iov_base = &(packet->payload[packet->pos]);
+				iov[count].iov_len = packet->to_process;
+				count++;
+			}
+			if(((packet->command)&0xF0) == DISCONNECT) break;
+			packet = (packet == mosq->current_out_packet) ? mosq->out_packet : packet->next;
+		}
+		if(count == 0) return MOSQ_ERR_SUCCESS;
+
+		write_length = writev(mosq->sock, iov, count);
+		if(write_length > 0){
+			*written += write_length;
+			_packet_write_consume(mosq, first, write_length);
+			while(first && first->to_process == 0 && ((first->command)&0xF0) != DISCONNECT){
+				first = (first == mosq->current_out_packet) ? mosq->out_packet : first->next;
+			}
+		}else if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
+			return MOSQ_ERR_SUCCESS;
+		}else if(errno == COMPAT_ECONNRESET){
+			return MOSQ_ERR_CONN_LOST;
+		}else{
+			return MOSQ_ERR_ERRNO;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
+/* Copy up to count bytes of received data into buf, refilling the receive
+ * buffer from the network when it is empty. A read of at least a buffer's
+ * worth that finds the buffer empty goes straight into buf. The buffer is
+ * refilled at most once per call to _mosquitto_packet_read(), tracked by
+ * *refilled, so a busy connection can't starve the others; any further data
+ * is still waiting on the socket for the next poll.
+ * Returns as _mosquitto_net_read(). */
+static ssize_t _packet_read_buffered(struct mosquitto *mosq, uint8_t *buf, size_t count, bool *refilled)
+{
+	ssize_t len;
+
+	if(mosq->in_buf_pos == mosq->in_buf_len){
+		if(count >= MOSQ_READ_BUF_SIZE){
+			return _mosquitto_net_read(mosq, buf, count);
+		}
+#ifdef WITH_TLS
+		if(*refilled && !(mosq->ssl && SSL_pending(mosq->ssl))){
+#else
+		if(*refilled){
+#endif
+			errno = EAGAIN;
+			return -1;
+		}
+		if(!mosq->in_buf){
+			mosq->in_buf = _mosquitto_malloc(MOSQ_READ_BUF_SIZE);
+			if(!mosq->in_buf){
+				errno = ENOMEM;
+				return -1;
+			}
+		}
+		*refilled = true;
+		len = _mosquitto_net_read(mosq, mosq->in_buf, MOSQ_READ_BUF_SIZE);
+		if(len <= 0) return len;
+		mosq->in_buf_pos = 0;
+		mosq->in_buf_len = len;
+	}
+	len = mosq->in_buf_len - mosq->in_buf_pos;
+	if((size_t)len > count) len = count;
+	memcpy(buf, &(mosq->in_buf[mosq->in_buf_pos]), len);
+	mosq->in_buf_pos += len;
+
+	return len;
+}
+
+#ifdef WITH_IO_THREADS
+/* Receive whatever is waiting on the socket into the empty receive buffer,
+ * which must already be allocated. This is the part of reading done by an
+ * I/O thread; the buffer is parsed by _mosquitto_packet_read() on the main
+ * thread, which won't read the socket again before the next poll.
+ * Returns MOSQ_ERR_SUCCESS if data was read or none was waiting,
+ * MOSQ_ERR_CONN_LOST if the connection was closed, or MOSQ_ERR_ERRNO. */
+int _mosquitto_packet_fill(struct mosquitto *mosq)
+{
+	ssize_t len;
+
+	assert(mosq->in_buf);
+	assert(mosq->in_buf_pos == mosq->in_buf_len);
+
+	mosq->in_buf_refilled = true;
+	len = _mosquitto_net_read(mosq, mosq->in_buf, MOSQ_READ_BUF_SIZE);
+	if(len > 0){
+		mosq->in_buf_pos = 0;
+		mosq->in_buf_len = len;
+		return MOSQ_ERR_SUCCESS;
+	}else if(len == 0){
+		return MOSQ_ERR_CONN_LOST;
+	}else if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
+		return MOSQ_ERR_SUCCESS;
+	}else if(errno == COMPAT_ECONNRESET){
+		return MOSQ_ERR_CONN_LOST;
+	}
+	return MOSQ_ERR_ERRNO;
+}
+#endif
+
 #ifdef WITH_BROKER
-int _mosquitto_packet_read(struct mosquitto_db *db, struct mosquitto *mosq)
+static int _packet_read_one(struct mosquitto_db *db, struct mosquitto *mosq, bool *refilled)
 #else
-int _mosquitto_packet_read(struct mosquitto *mosq)
+static int _packet_read_one(struct mosquitto *mosq, bool *refilled)
 #endif
 {
 	uint8_t byte;
 	ssize_t read_length;
 	int rc = 0;
 
-	if(!mosq) return MOSQ_ERR_INVAL;
-	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 	/* This gets called if pselect() indicates that there is network data
 	 * available - ie. at least one byte.  What we do depends on what data we
 	 * already have.
@@ -844,7 +1329,7 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 	 * Finally, free the memory and reset everything to starting conditions.
 	 */
 	if(!mosq->in_packet.command){
-		read_length = _mosquitto_net_read(mosq, &byte, 1);
+		read_length = _packet_read_buffered(mosq, &byte, 1, refilled);
 		if(read_length == 1){
 			mosq->in_packet.command = byte;
 #ifdef WITH_BROKER
@@ -873,7 +1358,7 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 	}
 	if(!mosq->in_packet.have_remaining){
 		do{
-			read_length = _mosquitto_net_read(mosq, &byte, 1);
+			read_length = _packet_read_buffered(mosq, &byte, 1, refilled);
 			if(read_length == 1){
 				mosq->in_packet.remaining_count++;
 				/* Max 4 bytes length for remaining length as defined by protocol.
@@ -905,14 +1390,18 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 		}while((byte & 128) != 0);
 
 		if(mosq->in_packet.remaining_length > 0){
+#ifdef WITH_BROKER
 			mosq->in_packet.payload = _mosquitto_malloc(mosq->in_packet.remaining_length*sizeof(uint8_t));
+#else
+			mosq->in_packet.payload = _mosquitto_pool_alloc(mosq, mosq->in_packet.remaining_length*sizeof(uint8_t));
+#endif
 			if(!mosq->in_packet.payload) return MOSQ_ERR_NOMEM;
 			mosq->in_packet.to_process = mosq->in_packet.remaining_length;
 		}
 		mosq->in_packet.have_remaining = 1;
 	}
 	while(mosq->in_packet.to_process>0){
-		read_length = _mosquitto_net_read(mosq, &(mosq->in_packet.payload[mosq->in_packet.pos]), mosq->in_packet.to_process);
+		read_length = _packet_read_buffered(mosq, &(mosq->in_packet.payload[mosq->in_packet.pos]), mosq->in_packet.to_process, refilled);
 		if(read_length > 0){
 #if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
 			g_bytes_received += read_length;
@@ -969,6 +1458,35 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 	return rc;
 }
 
+#ifdef WITH_BROKER
+int _mosquitto_packet_read(struct mosquitto_db *db, struct mosquitto *mosq)
+#else
+int _mosquitto_packet_read(struct mosquitto *mosq)
+#endif
+{
+	bool refilled = false;
+	int rc;
+
+	if(!mosq) return MOSQ_ERR_INVAL;
+	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+
+#ifdef WITH_IO_THREADS
+	refilled = mosq->in_buf_refilled;
+	mosq->in_buf_refilled = false;
+#endif
+	/* Handle every complete packet that arrived in the same read. */
+	do{
+#ifdef WITH_BROKER
+		rc = _packet_read_one(db, mosq, &refilled);
+#else
+		rc = _packet_read_one(mosq, &refilled);
+#endif
+	}while(rc == MOSQ_ERR_SUCCESS && mosq->sock != INVALID_SOCKET
+			&& mosq->in_buf_pos < mosq->in_buf_len);
+
+	return rc;
+}
+
 int _mosquitto_socket_nonblock(int sock)
 {
 #ifndef WIN32
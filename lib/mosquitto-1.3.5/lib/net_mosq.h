@@ -62,6 +62,9 @@ struct mosquitto_db;
 #define INVALID_SOCKET -1
 #endif
 
+/* Size of the per-connection receive buffer. */
+#define MOSQ_READ_BUF_SIZE 4096
+
 /* Macros for accessing the MSB and LSB of a uint16_t */
 #define MOSQ_MSB(A) (uint8_t)((A & 0xFF00) >> 8)
 #define MOSQ_LSB(A) (uint8_t)(A & 0x00FF)
@@ -70,7 +73,19 @@ void _mosquitto_net_init(void);
 void _mosquitto_net_cleanup(void);
 
 void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet);
+void _mosquitto_packet_free(struct _mosquitto_packet *packet);
 int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet);
+int _mosquitto_packet_queue_list(struct mosquitto *mosq, struct _mosquitto_packet *first, struct _mosquitto_packet *last);
+#ifndef WITH_BROKER
+void _mosquitto_packet_pending_collect(struct mosquitto *mosq);
+int _mosquitto_wakeup_open(struct mosquitto *mosq);
+void _mosquitto_wakeup_close(struct mosquitto *mosq);
+void _mosquitto_wakeup(struct mosquitto *mosq);
+void _mosquitto_wakeup_drain(struct mosquitto *mosq);
+#endif
+#ifdef WITH_BROKER
+void _mosquitto_shared_packet_release(struct _mosquitto_shared_packet *shared);
+#endif
 int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port, const char *bind_address, bool blocking);
 int _mosquitto_socket_close(struct mosquitto *mosq);
 int _mosquitto_try_connect(const char *host, uint16_t port, int *sock, const char *bind_address, bool blocking);
@@ -80,6 +95,9 @@ int _mosquitto_socketpair(int *sp1, int *sp2);
 int _mosquitto_read_byte(struct _mosquitto_packet *packet, uint8_t *byte);
 int _mosquitto_read_bytes(struct _mosquitto_packet *packet, void *bytes, uint32_t count);
 int _mosquitto_read_string(struct _mosquitto_packet *packet, char **str);
+#ifndef WITH_BROKER
+int _mosquitto_read_string_pool(struct mosquitto *mosq, struct _mosquitto_packet *packet, char **str);
+#endif
 int _mosquitto_read_uint16(struct _mosquitto_packet *packet, uint16_t *word);
 
 void _mosquitto_write_byte(struct _mosquitto_packet *packet, uint8_t byte);
@@ -93,6 +111,10 @@ ssize_t _mosquitto_net_write(struct mosquitto *mosq, void *buf, size_t count);
 int _mosquitto_packet_write(struct mosquitto *mosq);
 #ifdef WITH_BROKER
 int _mosquitto_packet_read(struct mosquitto_db *db, struct mosquitto *mosq);
+#  ifdef WITH_IO_THREADS
+int _mosquitto_packet_fill(struct mosquitto *mosq);
+int _mosquitto_packet_flush(struct mosquitto *mosq, ssize_t *written);
+#  endif
 #else
 int _mosquitto_packet_read(struct mosquitto *mosq);
 #endif
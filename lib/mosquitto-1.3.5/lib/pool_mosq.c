@@ -0,0 +1,369 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Size classed packet buffer pool for the client library.
+ *
+ * Every packet a client sends or receives needs a struct _mosquitto_packet
+ * and a buffer for its bytes, and a long running publisher goes through
+ * millions of them. Instead of passing each through malloc(), requests of up
+ * to POOL_MAX_SIZE bytes are rounded up to a power of two size class and the
+ * buffers are recycled. Each client keeps free lists of its own, and each
+ * thread keeps a small cache in front of them so that the common case takes
+ * no lock. A single threaded client only ever touches its thread's cache.
+ * With mosquitto_loop_start() the network thread frees what the publishing
+ * threads allocate, so it hands buffers back through the client's free lists
+ * a batch at a time.
+ *
+ * Every buffer is a separate allocation with a small header recording its
+ * size class and the client pool it was taken for. _mosquitto_pool_free()
+ * therefore needs no other arguments, and a buffer sitting in a thread cache
+ * may be reused by any client. Larger requests are passed straight through
+ * to _mosquitto_malloc()/_mosquitto_free().
+ */
+
+#include <string.h>
+
+#include "config.h"
+
+#include "memory_mosq.h"
+#include "mosquitto_internal.h"
+#include "pool_mosq.h"
+
+#define POOL_MIN_SHIFT 6
+#define POOL_MAX_SIZE (1<<(POOL_MIN_SHIFT+MOSQ_POOL_CLASSES-1))
+#define POOL_CLASS_SIZE(class) ((size_t)1<<(POOL_MIN_SHIFT+(class)))
+#define POOL_NO_CLASS -1
+
+/* Limits on how many buffers of one class a thread caches and a client keeps
+ * free, in buffers and in bytes. */
+#define POOL_CACHE_MAX 32
+#define POOL_CACHE_MAX_BYTES 65536
+#define POOL_CLIENT_MAX 256
+#define POOL_CLIENT_MAX_BYTES 262144
+
+struct _mosquitto_pool_item{
+	union{
+		struct _mosquitto_pool_item *next; /* While free. */
+		struct _mosquitto_packet_pool *pool; /* While in use. */
+	} u;
+	int class;
+};
+
+struct _pool_cache{
+	struct _mosquitto_pool_item *free[MOSQ_POOL_CLASSES];
+	int count[MOSQ_POOL_CLASSES];
+};
+
+#ifdef WITH_THREADING
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static int cache_key_valid = 0;
+#else
+static struct _pool_cache cache_single;
+#endif
+
+static int _pool_class(size_t size)
+{
+	int class = 0;
+
+	if(size > POOL_MAX_SIZE) return POOL_NO_CLASS;
+
+	while(POOL_CLASS_SIZE(class) < size){
+		class++;
+	}
+	return class;
+}
+
+static int _pool_cache_max(int class)
+{
+	int max = POOL_CACHE_MAX_BYTES/POOL_CLASS_SIZE(class);
+
+	return max < POOL_CACHE_MAX ? max : POOL_CACHE_MAX;
+}
+
+static int _pool_client_max(int class)
+{
+	int max = POOL_CLIENT_MAX_BYTES/POOL_CLASS_SIZE(class);
+
+	return max < POOL_CLIENT_MAX ? max : POOL_CLIENT_MAX;
+}
+
+/* Move up to count items from the front of one free list to another. Returns
+ * the number moved. */
+static int _pool_move(struct _mosquitto_pool_item **from, struct _mosquitto_pool_item **to, int count)
+{
+	struct _mosquitto_pool_item *item;
+	int i;
+
+	for(i=0; i<count && *from; i++){
+		item = *from;
+		*from = item->u.next;
+		item->u.next = *to;
+		*to = item;
+	}
+	return i;
+}
+
+static void _pool_list_free(struct _mosquitto_pool_item *list)
+{
+	struct _mosquitto_pool_item *item;
+
+	while(list){
+		item = list;
+		list = list->u.next;
+		_mosquitto_free(item);
+	}
+}
+
+static void _pool_cache_destroy(void *data)
+{
+	struct _pool_cache *cache = data;
+	int i;
+
+	for(i=0; i<MOSQ_POOL_CLASSES; i++){
+		_pool_list_free(cache->free[i]);
+		cache->free[i] = NULL;
+		cache->count[i] = 0;
+	}
+#ifdef WITH_THREADING
+	_mosquitto_free(cache);
+#endif
+}
+
+#ifdef WITH_THREADING
+static void _pool_key_create(void)
+{
+	if(!pthread_key_create(&cache_key, _pool_cache_destroy)){
+		cache_key_valid = 1;
+	}
+}
+#endif
+
+/* Return the calling thread's cache, creating it if needed. Returns NULL if
+ * it cannot be created, in which case the client's free lists are used
+ * directly. */
+static struct _pool_cache *_pool_cache_get(void)
+{
+#ifdef WITH_THREADING
+	struct _pool_cache *cache;
+
+	pthread_once(&cache_once, _pool_key_create);
+	if(!cache_key_valid) return NULL;
+
+	cache = pthread_getspecific(cache_key);
+	if(!cache){
+		cache = _mosquitto_calloc(1, sizeof(struct _pool_cache));
+		if(!cache) return NULL;
+		if(pthread_setspecific(cache_key, cache)){
+			_mosquitto_free(cache);
+			return NULL;
+		}
+	}
+	return cache;
+#else
+	return &cache_single;
+#endif
+}
+
+void _mosquitto_packet_pool_init(struct mosquitto *mosq)
+{
+	memset(&mosq->packet_pool, 0, sizeof(struct _mosquitto_packet_pool));
+	pthread_mutex_init(&mosq->packet_pool.mutex, NULL);
+}
+
+/* Free the buffers held by a client. Buffers it allocated that are still in
+ * use, or sitting in a thread cache, are not affected. */
+void _mosquitto_packet_pool_cleanup(struct mosquitto *mosq)
+{
+	struct _mosquitto_packet_pool *pool = &mosq->packet_pool;
+	int i;
+
+	for(i=0; i<MOSQ_POOL_CLASSES; i++){
+		_pool_list_free(pool->free[i]);
+		pool->free[i] = NULL;
+		pool->count[i] = 0;
+	}
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+void *_mosquitto_pool_alloc(struct mosquitto *mosq, size_t size)
+{
+	struct _mosquitto_packet_pool *pool = &mosq->packet_pool;
+	struct _mosquitto_pool_item *item = NULL;
+	struct _pool_cache *cache;
+	int class;
+	int moved;
+
+	class = _pool_class(size);
+	if(class == POOL_NO_CLASS){
+		item = _mosquitto_malloc(sizeof(struct _mosquitto_pool_item) + size);
+		if(!item) return NULL;
+		item->u.pool = NULL;
+		item->class = POOL_NO_CLASS;
+		return item+1;
+	}
+
+	cache = _pool_cache_get();
+	if(cache){
+		if(!cache->free[class]){
+			/* Refill the cache with half its capacity from the client's free
+			 * list. */
+			pthread_mutex_lock(&pool->mutex);
+			moved = _pool_move(&pool->free[class], &cache->free[class], _pool_cache_max(class)/2);
+			pool->count[class] -= moved;
+			pthread_mutex_unlock(&pool->mutex);
+			cache->count[class] += moved;
+		}
+		if(cache->free[class]){
+			item = cache->free[class];
+			cache->free[class] = item->u.next;
+			cache->count[class]--;
+		}
+	}else{
+		pthread_mutex_lock(&pool->mutex);
+		if(pool->free[class]){
+			item = pool->free[class];
+			pool->free[class] = item->u.next;
+			pool->count[class]--;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	if(!item){
+		item = _mosquitto_malloc(sizeof(struct _mosquitto_pool_item) + POOL_CLASS_SIZE(class));
+		if(!item) return NULL;
+		item->class = class;
+	}
+	item->u.pool = pool;
+	return item+1;
+}
+
+void *_mosquitto_pool_calloc(struct mosquitto *mosq, size_t size)
+{
+	void *mem;
+
+	mem = _mosquitto_pool_alloc(mosq, size);
+	if(mem){
+		memset(mem, 0, size);
+	}
+	return mem;
+}
+
+char *_mosquitto_pool_strdup(struct mosquitto *mosq, const char *s)
+{
+	size_t len;
+	char *str;
+
+	len = strlen(s)+1;
+	str = _mosquitto_pool_alloc(mosq, len);
+	if(str){
+		memcpy(str, s, len);
+	}
+	return str;
+}
+
+void _mosquitto_pool_free(void *mem)
+{
+	struct _mosquitto_pool_item *item, *excess = NULL;
+	struct _mosquitto_packet_pool *pool;
+	struct _pool_cache *cache;
+	int class;
+	int space;
+
+	if(!mem) return;
+
+	item = (struct _mosquitto_pool_item *)mem - 1;
+	class = item->class;
+	if(class == POOL_NO_CLASS){
+		_mosquitto_free(item);
+		return;
+	}
+	/* The client the buffer was taken for is still alive, because its
+	 * packets are all freed before it is destroyed. */
+	pool = item->u.pool;
+
+	cache = _pool_cache_get();
+	if(cache){
+		item->u.next = cache->free[class];
+		cache->free[class] = item;
+		cache->count[class]++;
+		if(cache->count[class] <= _pool_cache_max(class)){
+			return;
+		}
+		/* Hand half the cache to the client, where its other threads can
+		 * pick it up. Anything the client has no room for is freed. */
+		pthread_mutex_lock(&pool->mutex);
+		space = _pool_client_max(class) - pool->count[class];
+		if(space > cache->count[class]/2){
+			space = cache->count[class]/2;
+		}
+		if(space > 0){
+			pool->count[class] += _pool_move(&cache->free[class], &pool->free[class], space);
+		}else{
+			space = 0;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+		cache->count[class] -= space;
+		if(cache->count[class] > _pool_cache_max(class)/2){
+			cache->count[class] -= _pool_move(&cache->free[class], &excess, cache->count[class] - _pool_cache_max(class)/2);
+			_pool_list_free(excess);
+		}
+	}else{
+		pthread_mutex_lock(&pool->mutex);
+		if(pool->count[class] < _pool_client_max(class)){
+			item->u.next = pool->free[class];
+			pool->free[class] = item;
+			pool->count[class]++;
+			item = NULL;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+		if(item){
+			_mosquitto_free(item);
+		}
+	}
+}
+
+/* Free the calling thread's cache. Other threads' caches are freed when the
+ * thread exits. */
+void _mosquitto_pool_thread_cleanup(void)
+{
+#ifdef WITH_THREADING
+	struct _pool_cache *cache;
+
+	if(!cache_key_valid) return;
+
+	cache = pthread_getspecific(cache_key);
+	if(cache){
+		pthread_setspecific(cache_key, NULL);
+		_pool_cache_destroy(cache);
+	}
+#else
+	_pool_cache_destroy(&cache_single);
+#endif
+}
@@ -0,0 +1,501 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Reactor driving many clients from a single network loop.
+ *
+ * mosquitto_loop() builds fd_sets for one client and mosquitto_loop_start()
+ * gives every client its own thread. A reactor instead keeps the sockets of
+ * all the clients attached to it in one epoll set, with a single eventfd that
+ * mosquitto_publish() and friends use to wake it in place of each client's
+ * own sockpair. Each iteration it brings the epoll set up to date with the
+ * clients' sockets, waits, reads and writes whichever sockets are ready and
+ * then does the keepalive and retry housekeeping of mosquitto_loop_misc()
+ * for every client. Clients whose connection is lost are reconnected with
+ * the same delays as mosquitto_loop_forever() would use, but without
+ * blocking the other clients while they wait.
+ *
+ * Clients are kept in an array and the epoll data of a socket is the index
+ * of its client plus one, zero being the eventfd. A removed client leaves a
+ * hole that the next mosquitto_reactor_add() fills. An event still pending
+ * for the old client is dropped because the new client's socket has not
+ * been registered yet.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "memory_mosq.h"
+#include "mosquitto.h"
+#include "mosquitto_internal.h"
+#include "net_mosq.h"
+#include "reactor_mosq.h"
+#include "time_mosq.h"
+#include "util_mosq.h"
+
+#ifdef __linux__
+#  define HAVE_EPOLL
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+#endif
+
+/* Maximum number of events taken from epoll_wait() at once. */
+#define REACTOR_MAX_EVENTS 64
+
+#ifdef HAVE_EPOLL
+struct mosquitto_reactor{
+	int epoll_fd;
+	int wakeup_fd;
+	/* Nonzero while a wakeup is sitting in wakeup_fd, so that a burst of
+	 * publishes costs a single write(). */
+	volatile int wakeup_pending;
+	struct mosquitto **clients;
+	int client_count;
+	int client_max;
+#  ifdef WITH_THREADING
+	pthread_mutex_t mutex;
+	pthread_t thread_id;
+#  endif
+	bool threaded;
+	volatile bool run;
+};
+
+static void _reactor_reconnect_schedule(struct mosquitto *mosq, time_t now);
+static void _reactor_client_prepare(struct mosquitto_reactor *reactor, struct mosquitto *mosq, time_t now);
+static void _reactor_client_detach(struct mosquitto_reactor *reactor, struct mosquitto *mosq);
+static int _reactor_loop_forever(struct mosquitto_reactor *reactor, int timeout, int max_packets);
+#  ifdef WITH_THREADING
+static void *_reactor_thread_main(void *obj);
+#  endif
+#endif
+
+struct mosquitto_reactor *mosquitto_reactor_new(void)
+{
+#ifdef HAVE_EPOLL
+	struct mosquitto_reactor *reactor;
+	struct epoll_event ev;
+	int err;
+
+	reactor = (struct mosquitto_reactor *)_mosquitto_calloc(1, sizeof(struct mosquitto_reactor));
+	if(!reactor){
+		errno = ENOMEM;
+		return NULL;
+	}
+	reactor->wakeup_fd = -1;
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(reactor->epoll_fd == -1) goto error;
+	reactor->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(reactor->wakeup_fd == -1) goto error;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wakeup_fd, &ev)) goto error;
+
+	pthread_mutex_init(&reactor->mutex, NULL);
+	reactor->run = true;
+	return reactor;
+
+error:
+	err = errno;
+	if(reactor->wakeup_fd != -1) close(reactor->wakeup_fd);
+	if(reactor->epoll_fd != -1) close(reactor->epoll_fd);
+	_mosquitto_free(reactor);
+	errno = err;
+	return NULL;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+void mosquitto_reactor_destroy(struct mosquitto_reactor *reactor)
+{
+#ifdef HAVE_EPOLL
+	int i;
+
+	if(!reactor) return;
+
+	if(reactor->threaded){
+		mosquitto_reactor_loop_stop(reactor, false);
+	}
+	for(i=0; i<reactor->client_count; i++){
+		if(reactor->clients[i]){
+			_reactor_client_detach(reactor, reactor->clients[i]);
+		}
+	}
+	close(reactor->wakeup_fd);
+	close(reactor->epoll_fd);
+	pthread_mutex_destroy(&reactor->mutex);
+	if(reactor->clients) _mosquitto_free(reactor->clients);
+	_mosquitto_free(reactor);
+#endif
+}
+
+int mosquitto_reactor_add(struct mosquitto_reactor *reactor, struct mosquitto *mosq)
+{
+#ifdef HAVE_EPOLL
+	struct mosquitto **clients;
+	int slot;
+
+	if(!reactor || !mosq) return MOSQ_ERR_INVAL;
+	if(mosq->reactor || mosq->threaded) return MOSQ_ERR_INVAL;
+
+	pthread_mutex_lock(&reactor->mutex);
+	for(slot=0; slot<reactor->client_count; slot++){
+		if(!reactor->clients[slot]) break;
+	}
+	if(slot == reactor->client_max){
+		clients = _mosquitto_realloc(reactor->clients, sizeof(struct mosquitto *)*(reactor->client_max+16));
+		if(!clients){
+			pthread_mutex_unlock(&reactor->mutex);
+			return MOSQ_ERR_NOMEM;
+		}
+		reactor->clients = clients;
+		reactor->client_max += 16;
+	}
+	if(slot == reactor->client_count){
+		reactor->client_count++;
+	}
+	reactor->clients[slot] = mosq;
+
+	mosq->reactor_slot = slot;
+	mosq->reactor_sock = INVALID_SOCKET;
+	mosq->reactor_events = 0;
+	mosq->reactor_reconnects = 0;
+	mosq->reactor_reconnect_at = 0;
+	mosq->threaded = reactor->threaded;
+	mosq->reactor = reactor;
+	pthread_mutex_unlock(&reactor->mutex);
+
+	/* Have the socket registered without waiting for the current
+	 * epoll_wait() to time out. */
+	_mosquitto_reactor_wakeup(reactor);
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+int mosquitto_reactor_remove(struct mosquitto_reactor *reactor, struct mosquitto *mosq)
+{
+#ifdef HAVE_EPOLL
+	if(!reactor || !mosq || mosq->reactor != reactor) return MOSQ_ERR_INVAL;
+
+	pthread_mutex_lock(&reactor->mutex);
+	_reactor_client_detach(reactor, mosq);
+	pthread_mutex_unlock(&reactor->mutex);
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+int mosquitto_reactor_loop(struct mosquitto_reactor *reactor, int timeout, int max_packets)
+{
+#ifdef HAVE_EPOLL
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	struct mosquitto *mosq;
+	uint64_t count;
+	uint32_t slot;
+	time_t now;
+	int event_count;
+	int i;
+	int rc;
+
+	if(!reactor || max_packets < 1) return MOSQ_ERR_INVAL;
+	if(timeout < 0) timeout = 1000;
+
+	now = mosquitto_time();
+	pthread_mutex_lock(&reactor->mutex);
+	for(i=0; i<reactor->client_count; i++){
+		mosq = reactor->clients[i];
+		if(!mosq) continue;
+		_reactor_client_prepare(reactor, mosq, now);
+		if(mosq->reactor_reconnect_at && timeout > 1000){
+			/* Don't oversleep a pending reconnect. */
+			timeout = 1000;
+		}
+	}
+	pthread_mutex_unlock(&reactor->mutex);
+
+	event_count = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, timeout);
+	if(event_count == -1){
+		if(errno == EINTR){
+			return MOSQ_ERR_SUCCESS;
+		}
+		return MOSQ_ERR_ERRNO;
+	}
+
+	pthread_mutex_lock(&reactor->mutex);
+	for(i=0; i<event_count; i++){
+		if(events[i].data.u64 == 0){
+			/* Clear the flag first, so that a wakeup arriving from here on
+			 * is written to the eventfd again. The sockets wanting writes
+			 * are picked up by _reactor_client_prepare(). */
+			__sync_lock_release(&reactor->wakeup_pending);
+			if(read(reactor->wakeup_fd, &count, sizeof(count))){
+			}
+			continue;
+		}
+		slot = (uint32_t)(events[i].data.u64 - 1);
+		if(slot >= (uint32_t)reactor->client_count) continue;
+		mosq = reactor->clients[slot];
+		if(!mosq || mosq->sock == INVALID_SOCKET || mosq->sock != mosq->reactor_sock) continue;
+
+		if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+			rc = mosquitto_loop_read(mosq, max_packets);
+			if(rc || mosq->sock == INVALID_SOCKET) continue;
+			mosq->reactor_reconnects = 0;
+		}
+		if(events[i].events & EPOLLOUT){
+			mosquitto_loop_write(mosq, max_packets);
+		}
+	}
+	for(i=0; i<reactor->client_count; i++){
+		mosq = reactor->clients[i];
+		if(mosq && mosq->sock != INVALID_SOCKET){
+			mosquitto_loop_misc(mosq);
+		}
+	}
+	pthread_mutex_unlock(&reactor->mutex);
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+int mosquitto_reactor_loop_forever(struct mosquitto_reactor *reactor, int timeout, int max_packets)
+{
+#ifdef HAVE_EPOLL
+	if(!reactor) return MOSQ_ERR_INVAL;
+
+	reactor->run = true;
+	return _reactor_loop_forever(reactor, timeout, max_packets);
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+int mosquitto_reactor_loop_start(struct mosquitto_reactor *reactor)
+{
+#if defined(HAVE_EPOLL) && defined(WITH_THREADING)
+	int i;
+
+	if(!reactor || reactor->threaded) return MOSQ_ERR_INVAL;
+
+	pthread_mutex_lock(&reactor->mutex);
+	reactor->threaded = true;
+	for(i=0; i<reactor->client_count; i++){
+		if(reactor->clients[i]) reactor->clients[i]->threaded = true;
+	}
+	pthread_mutex_unlock(&reactor->mutex);
+
+	reactor->run = true;
+	pthread_create(&reactor->thread_id, NULL, _reactor_thread_main, reactor);
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+int mosquitto_reactor_loop_stop(struct mosquitto_reactor *reactor, bool force)
+{
+#ifdef HAVE_EPOLL
+	int i;
+
+	if(!reactor) return MOSQ_ERR_INVAL;
+
+	reactor->run = false;
+	_mosquitto_reactor_wakeup(reactor);
+
+#  ifdef WITH_THREADING
+	if(!reactor->threaded || pthread_equal(reactor->thread_id, pthread_self())){
+		/* Either mosquitto_reactor_loop_forever() was called by the
+		 * application or this is a callback in the reactor thread. Either
+		 * way it returns once the current iteration is done. */
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(force){
+		pthread_cancel(reactor->thread_id);
+	}
+	pthread_join(reactor->thread_id, NULL);
+
+	pthread_mutex_lock(&reactor->mutex);
+	reactor->threaded = false;
+	for(i=0; i<reactor->client_count; i++){
+		if(reactor->clients[i]) reactor->clients[i]->threaded = false;
+	}
+	pthread_mutex_unlock(&reactor->mutex);
+#  endif
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void _mosquitto_reactor_wakeup(struct mosquitto_reactor *reactor)
+{
+#ifdef HAVE_EPOLL
+	uint64_t one = 1;
+
+	if(!__sync_lock_test_and_set(&reactor->wakeup_pending, 1)){
+		if(write(reactor->wakeup_fd, &one, sizeof(one))){
+		}
+	}
+#endif
+}
+
+#ifdef HAVE_EPOLL
+
+static void _reactor_reconnect_schedule(struct mosquitto *mosq, time_t now)
+{
+	unsigned long reconnect_delay;
+
+	/* Same delays as mosquitto_loop_forever(), rounded up to the second the
+	 * reactor checks them at. */
+	reconnect_delay = _mosquitto_reconnect_delay(mosq, &mosq->reactor_reconnects);
+	/* reactor_reconnect_at of zero means no reconnect is due. */
+	mosq->reactor_reconnect_at = now + (reconnect_delay+999)/1000;
+	if(!mosq->reactor_reconnect_at) mosq->reactor_reconnect_at = 1;
+}
+
+/* Bring the epoll registration of a client up to date with its socket,
+ * reconnecting it first if it has lost its connection. */
+static void _reactor_client_prepare(struct mosquitto_reactor *reactor, struct mosquitto *mosq, time_t now)
+{
+	struct epoll_event ev;
+	enum mosquitto_client_state state;
+	uint32_t events;
+
+	if(mosq->sock != mosq->reactor_sock){
+		if(mosq->reactor_sock != INVALID_SOCKET){
+			/* The socket has been closed, which also took it out of the
+			 * epoll set. */
+			mosq->reactor_sock = INVALID_SOCKET;
+			mosq->reactor_events = 0;
+			if(mosq->sock == INVALID_SOCKET && !mosq->reactor_reconnect_at){
+				_reactor_reconnect_schedule(mosq, now);
+			}
+		}
+	}
+
+	if(mosq->sock == INVALID_SOCKET){
+		pthread_mutex_lock(&mosq->state_mutex);
+		state = mosq->state;
+		pthread_mutex_unlock(&mosq->state_mutex);
+
+		if(state == mosq_cs_disconnecting){
+			mosq->reactor_reconnect_at = 0;
+			return;
+		}
+		if(state == mosq_cs_connect_async
+				|| (mosq->reactor_reconnect_at && mosq->reactor_reconnect_at <= now)){
+
+			mosq->reactor_reconnect_at = 0;
+			if(mosquitto_reconnect_async(mosq) != MOSQ_ERR_SUCCESS){
+				_mosquitto_socket_close(mosq);
+				_reactor_reconnect_schedule(mosq, now);
+				return;
+			}
+		}
+		if(mosq->sock == INVALID_SOCKET) return;
+	}
+
+	events = EPOLLIN;
+	if(mosquitto_want_write(mosq)){
+		events |= EPOLLOUT;
+	}
+	if(mosq->sock == mosq->reactor_sock && events == mosq->reactor_events){
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = (uint64_t)mosq->reactor_slot + 1;
+	if(mosq->sock == mosq->reactor_sock){
+		if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, mosq->sock, &ev)){
+			/* The socket was closed and the fd number reused by a
+			 * reconnect from a callback, so it is no longer registered. */
+			if(errno != ENOENT) return;
+			if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, mosq->sock, &ev)) return;
+		}
+	}else{
+		if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, mosq->sock, &ev)){
+			if(errno != EEXIST) return;
+			epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, mosq->sock, &ev);
+		}
+		mosq->reactor_sock = mosq->sock;
+	}
+	mosq->reactor_events = events;
+}
+
+/* Must be called with the reactor mutex held. */
+static void _reactor_client_detach(struct mosquitto_reactor *reactor, struct mosquitto *mosq)
+{
+	struct epoll_event ev;
+
+	if(mosq->reactor_sock != INVALID_SOCKET && mosq->sock == mosq->reactor_sock){
+		/* Older kernels insist on a non-NULL event for EPOLL_CTL_DEL. */
+		memset(&ev, 0, sizeof(ev));
+		epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, mosq->reactor_sock, &ev);
+	}
+	reactor->clients[mosq->reactor_slot] = NULL;
+	while(reactor->client_count > 0 && !reactor->clients[reactor->client_count-1]){
+		reactor->client_count--;
+	}
+	mosq->reactor_sock = INVALID_SOCKET;
+	mosq->reactor_events = 0;
+	mosq->reactor_reconnect_at = 0;
+	mosq->threaded = false;
+	mosq->reactor = NULL;
+}
+
+static int _reactor_loop_forever(struct mosquitto_reactor *reactor, int timeout, int max_packets)
+{
+	int rc;
+
+	while(reactor->run){
+		rc = mosquitto_reactor_loop(reactor, timeout, max_packets);
+		if(rc) return rc;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+#  ifdef WITH_THREADING
+static void *_reactor_thread_main(void *obj)
+{
+	struct mosquitto_reactor *reactor = obj;
+
+	_reactor_loop_forever(reactor, 1000, 1);
+	return obj;
+}
+#  endif
+#endif
@@ -37,6 +37,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "messages_mosq.h"
 #include "mqtt3_protocol.h"
 #include "net_mosq.h"
+#include "pool_mosq.h"
 #include "read_handle.h"
 #include "send_mosq.h"
 #include "time_mosq.h"
@@ -80,10 +81,11 @@ int _mosquitto_handle_publish(struct mosquitto *mosq)
 	struct mosquitto_message_all *message;
 	int rc = 0;
 	uint16_t mid;
+	void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *);
 
 	assert(mosq);
 
-	message = _mosquitto_calloc(1, sizeof(struct mosquitto_message_all));
+	message = _mosquitto_pool_calloc(mosq, sizeof(struct mosquitto_message_all));
 	if(!message) return MOSQ_ERR_NOMEM;
 
 	header = mosq->in_packet.command;
@@ -92,7 +94,7 @@ int _mosquitto_handle_publish(struct mosquitto *mosq)
 	message->msg.qos = (header & 0x06)>>1;
 	message->msg.retain = (header & 0x01);
 
-	rc = _mosquitto_read_string(&mosq->in_packet, &message->msg.topic);
+	rc = _mosquitto_read_string_pool(mosq, &mosq->in_packet, &message->msg.topic);
 	if(rc){
 		_mosquitto_message_cleanup(&message);
 		return rc;
@@ -113,11 +115,12 @@ int _mosquitto_handle_publish(struct mosquitto *mosq)
 
 	message->msg.payloadlen = mosq->in_packet.remaining_length - mosq->in_packet.pos;
 	if(message->msg.payloadlen){
-		message->msg.payload = _mosquitto_calloc(message->msg.payloadlen+1, sizeof(uint8_t));
+		message->msg.payload = _mosquitto_pool_alloc(mosq, message->msg.payloadlen+1);
 		if(!message->msg.payload){
 			_mosquitto_message_cleanup(&message);
 			return MOSQ_ERR_NOMEM;
 		}
+		((uint8_t *)message->msg.payload)[message->msg.payloadlen] = 0;
 		rc = _mosquitto_read_bytes(&mosq->in_packet, message->msg.payload, message->msg.payloadlen);
 		if(rc){
 			_mosquitto_message_cleanup(&message);
@@ -133,24 +136,22 @@ int _mosquitto_handle_publish(struct mosquitto *mosq)
 	message->timestamp = mosquitto_time();
 	switch(message->msg.qos){
 		case 0:
-			pthread_mutex_lock(&mosq->callback_mutex);
-			if(mosq->on_message){
+			on_message = mosq->on_message;
+			if(on_message){
 				mosq->in_callback = true;
-				mosq->on_message(mosq, mosq->userdata, &message->msg);
+				on_message(mosq, mosq->userdata, &message->msg);
 				mosq->in_callback = false;
 			}
-			pthread_mutex_unlock(&mosq->callback_mutex);
 			_mosquitto_message_cleanup(&message);
 			return MOSQ_ERR_SUCCESS;
 		case 1:
 			rc = _mosquitto_send_puback(mosq, message->msg.mid);
-			pthread_mutex_lock(&mosq->callback_mutex);
-			if(mosq->on_message){
+			on_message = mosq->on_message;
+			if(on_message){
 				mosq->in_callback = true;
-				mosq->on_message(mosq, mosq->userdata, &message->msg);
+				on_message(mosq, mosq->userdata, &message->msg);
 				mosq->in_callback = false;
 			}
-			pthread_mutex_unlock(&mosq->callback_mutex);
 			_mosquitto_message_cleanup(&message);
 			return rc;
 		case 2:
@@ -81,6 +81,9 @@ int _mosquitto_handle_pubackcomp(struct mosquitto *mosq, const char *type)
 {
 	uint16_t mid;
 	int rc;
+#ifndef WITH_BROKER
+	void (*on_publish)(struct mosquitto *, void *, int);
+#endif
 
 	assert(mosq);
 #ifdef WITH_STRICT_PROTOCOL
@@ -94,7 +97,7 @@ int _mosquitto_handle_pubackcomp(struct mosquitto *mosq, const char *type)
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received %s from %s (Mid: %d)", type, mosq->id, mid);
 
 	if(mid){
-		rc = mqtt3_db_message_delete(mosq, mid, mosq_md_out);
+		rc = mqtt3_db_message_delete(_mosquitto_get_db(), mosq, mid, mosq_md_out);
 		if(rc) return rc;
 	}
 #else
@@ -102,13 +105,12 @@ int _mosquitto_handle_pubackcomp(struct mosquitto *mosq, const char *type)
 
 	if(!_mosquitto_message_delete(mosq, mid, mosq_md_out)){
 		/* Only inform the client the message has been sent once. */
-		pthread_mutex_lock(&mosq->callback_mutex);
-		if(mosq->on_publish){
+		on_publish = mosq->on_publish;
+		if(on_publish){
 			mosq->in_callback = true;
-			mosq->on_publish(mosq, mosq->userdata, mid);
+			on_publish(mosq, mosq->userdata, mid);
 			mosq->in_callback = false;
 		}
-		pthread_mutex_unlock(&mosq->callback_mutex);
 	}
 #endif
 
@@ -131,7 +133,7 @@ int _mosquitto_handle_pubrec(struct mosquitto *mosq)
 #ifdef WITH_BROKER
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBREC from %s (Mid: %d)", mosq->id, mid);
 
-	rc = mqtt3_db_message_update(mosq, mid, mosq_md_out, mosq_ms_wait_for_pubcomp);
+	rc = mqtt3_db_message_update(_mosquitto_get_db(), mosq, mid, mosq_md_out, mosq_ms_wait_for_pubcomp);
 #else
 	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s received PUBREC (Mid: %d)", mosq->id, mid);
 
@@ -149,6 +151,7 @@ int _mosquitto_handle_pubrel(struct mosquitto_db *db, struct mosquitto *mosq)
 	uint16_t mid;
 #ifndef WITH_BROKER
 	struct mosquitto_message_all *message = NULL;
+	void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *);
 #endif
 	int rc;
 
@@ -178,13 +181,12 @@ int _mosquitto_handle_pubrel(struct mosquitto_db *db, struct mosquitto *mosq)
 	if(!_mosquitto_message_remove(mosq, mid, mosq_md_in, &message)){
 		/* Only pass the message on if we have removed it from the queue - this
 		 * prevents multiple callbacks for the same message. */
-		pthread_mutex_lock(&mosq->callback_mutex);
-		if(mosq->on_message){
+		on_message = mosq->on_message;
+		if(on_message){
 			mosq->in_callback = true;
-			mosq->on_message(mosq, mosq->userdata, &message->msg);
+			on_message(mosq, mosq->userdata, &message->msg);
 			mosq->in_callback = false;
 		}
-		pthread_mutex_unlock(&mosq->callback_mutex);
 		_mosquitto_message_cleanup(&message);
 	}
 #endif
@@ -54,7 +54,7 @@ int _mosquitto_send_connect(struct mosquitto *mosq, uint16_t keepalive, bool cle
 	assert(mosq);
 	assert(mosq->id);
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new(mosq);
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	payloadlen = 2+strlen(mosq->id);
@@ -73,9 +73,9 @@ int _mosquitto_send_connect(struct mosquitto *mosq, uint16_t keepalive, bool cle
 
 	packet->command = CONNECT;
 	packet->remaining_length = 12+payloadlen;
-	rc = _mosquitto_packet_alloc(packet);
+	rc = _mosquitto_packet_alloc(mosq, packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 
@@ -149,16 +149,16 @@ int _mosquitto_send_subscribe(struct mosquitto *mosq, int *mid, bool dup, const
 	assert(mosq);
 	assert(topic);
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new(mosq);
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packetlen = 2 + 2+strlen(topic) + 1;
 
 	packet->command = SUBSCRIBE | (dup<<3) | (1<<1);
 	packet->remaining_length = packetlen;
-	rc = _mosquitto_packet_alloc(packet);
+	rc = _mosquitto_packet_alloc(mosq, packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 
@@ -194,16 +194,16 @@ int _mosquitto_send_unsubscribe(struct mosquitto *mosq, int *mid, bool dup, cons
 	assert(mosq);
 	assert(topic);
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new(mosq);
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packetlen = 2 + 2+strlen(topic);
 
 	packet->command = UNSUBSCRIBE | (dup<<3) | (1<<1);
 	packet->remaining_length = packetlen;
-	rc = _mosquitto_packet_alloc(packet);
+	rc = _mosquitto_packet_alloc(mosq, packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 
@@ -37,6 +37,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "mqtt3_protocol.h"
 #include "memory_mosq.h"
 #include "net_mosq.h"
+#include "pool_mosq.h"
 #include "send_mosq.h"
 #include "time_mosq.h"
 #include "util_mosq.h"
@@ -99,12 +100,8 @@ int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *to
 #ifdef WITH_BROKER
 	size_t len;
 #ifdef WITH_BRIDGE
-	int i;
-	struct _mqtt3_bridge_topic *cur_topic;
-	bool match;
 	int rc;
 	char *mapped_topic = NULL;
-	char *topic_temp = NULL;
 #endif
 #endif
 	assert(mosq);
@@ -122,54 +119,16 @@ int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *to
 		}
 	}
 #ifdef WITH_BRIDGE
-	if(mosq->bridge && mosq->bridge->topics && mosq->bridge->topic_remapping){
-		for(i=0; i<mosq->bridge->topic_count; i++){
-			cur_topic = &mosq->bridge->topics[i];
-			if((cur_topic->direction == bd_both || cur_topic->direction == bd_out) 
-					&& (cur_topic->remote_prefix || cur_topic->local_prefix)){
-				/* Topic mapping required on this topic if the message matches */
-
-				rc = mosquitto_topic_matches_sub(cur_topic->local_topic, topic, &match);
-				if(rc){
-					return rc;
-				}
-				if(match){
-					mapped_topic = _mosquitto_strdup(topic);
-					if(!mapped_topic) return MOSQ_ERR_NOMEM;
-					if(cur_topic->local_prefix){
-						/* This prefix needs removing. */
-						if(!strncmp(cur_topic->local_prefix, mapped_topic, strlen(cur_topic->local_prefix))){
-							topic_temp = _mosquitto_strdup(mapped_topic+strlen(cur_topic->local_prefix));
-							_mosquitto_free(mapped_topic);
-							if(!topic_temp){
-								return MOSQ_ERR_NOMEM;
-							}
-							mapped_topic = topic_temp;
-						}
-					}
-
-					if(cur_topic->remote_prefix){
-						/* This prefix needs adding. */
-						len = strlen(mapped_topic) + strlen(cur_topic->remote_prefix)+1;
-						topic_temp = _mosquitto_calloc(len+1, sizeof(char));
-						if(!topic_temp){
-							_mosquitto_free(mapped_topic);
-							return MOSQ_ERR_NOMEM;
-						}
-						snprintf(topic_temp, len, "%s%s", cur_topic->remote_prefix, mapped_topic);
-						_mosquitto_free(mapped_topic);
-						mapped_topic = topic_temp;
-					}
-					_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, mapped_topic, (long)payloadlen);
+	rc = mqtt3_bridge_topic_remap_out(mosq, topic, &mapped_topic);
+	if(rc) return rc;
+	if(mapped_topic){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, mapped_topic, (long)payloadlen);
 #ifdef WITH_SYS_TREE
-					g_pub_bytes_sent += payloadlen;
+		g_pub_bytes_sent += payloadlen;
 #endif
-					rc =  _mosquitto_send_real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup);
-					_mosquitto_free(mapped_topic);
-					return rc;
-				}
-			}
-		}
+		rc =  _mosquitto_send_real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup);
+		_mosquitto_free(mapped_topic);
+		return rc;
 	}
 #endif
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
@@ -210,7 +169,7 @@ int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, ui
 	int rc;
 
 	assert(mosq);
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new(mosq);
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = command;
@@ -218,9 +177,9 @@ int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, ui
 		packet->command |= 8;
 	}
 	packet->remaining_length = 2;
-	rc = _mosquitto_packet_alloc(packet);
+	rc = _mosquitto_packet_alloc(mosq, packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 
@@ -237,15 +196,15 @@ int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 	int rc;
 
 	assert(mosq);
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new(mosq);
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = command;
 	packet->remaining_length = 0;
 
-	rc = _mosquitto_packet_alloc(packet);
+	rc = _mosquitto_packet_alloc(mosq, packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 
@@ -255,23 +214,38 @@ int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup)
 {
 	struct _mosquitto_packet *packet = NULL;
-	int packetlen;
 	int rc;
 
 	assert(mosq);
 	assert(topic);
 
+	rc = _mosquitto_publish_packet_new(mosq, &packet, mid, topic, payloadlen, payload, qos, retain, dup);
+	if(rc) return rc;
+
+	return _mosquitto_packet_queue(mosq, packet);
+}
+
+/* Create a PUBLISH packet ready for queueing, but don't queue it. */
+int _mosquitto_publish_packet_new(struct mosquitto *mosq, struct _mosquitto_packet **packet_out, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup)
+{
+	struct _mosquitto_packet *packet = NULL;
+	int packetlen;
+	int rc;
+
+	assert(packet_out);
+	assert(topic);
+
 	packetlen = 2+strlen(topic) + payloadlen;
 	if(qos > 0) packetlen += 2; /* For message id */
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new(mosq);
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->mid = mid;
 	packet->command = PUBLISH | ((dup&0x1)<<3) | (qos<<1) | retain;
 	packet->remaining_length = packetlen;
-	rc = _mosquitto_packet_alloc(packet);
+	rc = _mosquitto_packet_alloc(mosq, packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 	/* Variable header (topic string) */
@@ -285,5 +259,63 @@ int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const cha
 		_mosquitto_write_bytes(packet, payload, payloadlen);
 	}
 
-	return _mosquitto_packet_queue(mosq, packet);
+	*packet_out = packet;
+	return MOSQ_ERR_SUCCESS;
 }
+
+#ifndef WITH_BROKER
+/* Create one packet holding count QoS 0 PUBLISHes back to back, ready for
+ * queueing. The messages must have consecutive message ids, and
+ * packet_length must be the total length of the PUBLISHes. */
+int _mosquitto_publish_run_packet_new(struct mosquitto *mosq, struct _mosquitto_packet **packet_out, const struct mosquitto_publish_entry *messages, int count, uint32_t packet_length)
+{
+	struct _mosquitto_packet *packet = NULL;
+	uint32_t remaining_length;
+	uint16_t topiclen;
+	uint8_t byte;
+	int i;
+
+	assert(packet_out);
+	assert(messages);
+	assert(count > 0);
+
+	packet = _mosquitto_packet_new(mosq);
+	if(!packet) return MOSQ_ERR_NOMEM;
+
+	packet->payload = _mosquitto_pool_alloc(mosq, packet_length);
+	if(!packet->payload){
+		_mosquitto_packet_free(packet);
+		return MOSQ_ERR_NOMEM;
+	}
+	packet->mid = messages[0].mid;
+	packet->mid_count = count;
+	packet->command = PUBLISH;
+	packet->packet_length = packet_length;
+	packet->pos = 0;
+
+	for(i=0; i<count; i++){
+		topiclen = strlen(messages[i].topic);
+		remaining_length = 2+topiclen + messages[i].payloadlen;
+
+		/* Fixed header, as written by _mosquitto_packet_alloc(). */
+		_mosquitto_write_byte(packet, PUBLISH | messages[i].retain);
+		do{
+			byte = remaining_length % 128;
+			remaining_length = remaining_length / 128;
+			if(remaining_length > 0){
+				byte = byte | 0x80;
+			}
+			_mosquitto_write_byte(packet, byte);
+		}while(remaining_length > 0);
+
+		_mosquitto_write_string(packet, messages[i].topic, topiclen);
+		if(messages[i].payloadlen){
+			_mosquitto_write_bytes(packet, messages[i].payload, messages[i].payloadlen);
+		}
+	}
+	assert(packet->pos == packet_length);
+
+	*packet_out = packet;
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
@@ -30,10 +30,15 @@ POSSIBILITY OF SUCH DAMAGE.
 #define _SEND_MOSQ_H_
 
 #include "mosquitto.h"
+#include "mosquitto_internal.h"
 
 int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command);
 int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, uint16_t mid, bool dup);
 int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup);
+int _mosquitto_publish_packet_new(struct mosquitto *mosq, struct _mosquitto_packet **packet_out, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup);
+#ifndef WITH_BROKER
+int _mosquitto_publish_run_packet_new(struct mosquitto *mosq, struct _mosquitto_packet **packet_out, const struct mosquitto_publish_entry *messages, int count, uint32_t packet_length);
+#endif
 
 int _mosquitto_send_connect(struct mosquitto *mosq, uint16_t keepalive, bool clean_session);
 int _mosquitto_send_disconnect(struct mosquitto *mosq);
@@ -41,7 +41,7 @@ void *_mosquitto_thread_main(void *obj);
 int mosquitto_loop_start(struct mosquitto *mosq)
 {
 #ifdef WITH_THREADING
-	if(!mosq || mosq->threaded) return MOSQ_ERR_INVAL;
+	if(!mosq || mosq->threaded || mosq->reactor) return MOSQ_ERR_INVAL;
 
 	mosq->threaded = true;
 	pthread_create(&mosq->thread_id, NULL, _mosquitto_thread_main, mosq);
@@ -54,23 +54,10 @@ int mosquitto_loop_start(struct mosquitto *mosq)
 int mosquitto_loop_stop(struct mosquitto *mosq, bool force)
 {
 #ifdef WITH_THREADING
-#  ifndef WITH_BROKER
-	char sockpair_data = 0;
-#  endif
+	if(!mosq || !mosq->threaded || mosq->reactor) return MOSQ_ERR_INVAL;
 
-	if(!mosq || !mosq->threaded) return MOSQ_ERR_INVAL;
-
-
-	/* Write a single byte to sockpairW (connected to sockpairR) to break out
-	 * of select() if in threaded mode. */
-	if(mosq->sockpairW != INVALID_SOCKET){
-#ifndef WIN32
-		if(write(mosq->sockpairW, &sockpair_data, 1)){
-		}
-#else
-		send(mosq->sockpairW, &sockpair_data, 1, 0);
-#endif
-	}
+	/* Break out of select(). */
+	_mosquitto_wakeup(mosq);
 	
 	if(force){
 		pthread_cancel(mosq->thread_id);
@@ -38,6 +38,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #else
 #  include <unistd.h>
 #endif
+#include <stdint.h>
 #include <time.h>
 
 #include "mosquitto.h"
@@ -93,3 +94,31 @@ time_t mosquitto_time(void)
 #endif
 }
 
+uint64_t mosquitto_time_us(void)
+{
+#ifdef WIN32
+	if(tick64){
+		return (uint64_t)GetTickCount64()*1000;
+	}else{
+		return (uint64_t)GetTickCount()*1000;
+	}
+#elif _POSIX_TIMERS>0 && defined(_POSIX_MONOTONIC_CLOCK)
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec*1000000 + tp.tv_nsec/1000;
+#elif defined(__APPLE__)
+	static mach_timebase_info_data_t tb;
+	uint64_t ticks;
+
+	ticks = mach_absolute_time();
+
+	if(tb.denom == 0){
+		mach_timebase_info(&tb);
+	}
+	return ticks*tb.numer/tb.denom/1000;
+#else
+	return (uint64_t)time(NULL)*1000000;
+#endif
+}
+
@@ -31,5 +31,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define _TIME_MOSQ_H_
 
 time_t mosquitto_time(void);
+/* Monotonic time in microseconds, for measuring short intervals. */
+uint64_t mosquitto_time_us(void);
 
 #endif
@@ -32,6 +32,9 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifdef WIN32
 #include <winsock2.h>
+#else
+#include <sys/time.h>
+#include <unistd.h>
 #endif
 
 
@@ -45,9 +48,21 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifdef WITH_BROKER
 #include "mosquitto_broker.h"
+#else
+#include "pool_mosq.h"
 #endif
 
-int _mosquitto_packet_alloc(struct _mosquitto_packet *packet)
+/* Allocate a zeroed packet for sending to mosq. */
+struct _mosquitto_packet *_mosquitto_packet_new(struct mosquitto *mosq)
+{
+#ifdef WITH_BROKER
+	return _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+#else
+	return _mosquitto_pool_calloc(mosq, sizeof(struct _mosquitto_packet));
+#endif
+}
+
+int _mosquitto_packet_alloc(struct mosquitto *mosq, struct _mosquitto_packet *packet)
 {
 	uint8_t remaining_bytes[5], byte;
 	uint32_t remaining_length;
@@ -70,7 +85,11 @@ int _mosquitto_packet_alloc(struct _mosquitto_packet *packet)
 	}while(remaining_length > 0 && packet->remaining_count < 5);
 	if(packet->remaining_count == 5) return MOSQ_ERR_PAYLOAD_SIZE;
 	packet->packet_length = packet->remaining_length + 1 + packet->remaining_count;
+#ifdef WITH_BROKER
 	packet->payload = _mosquitto_malloc(sizeof(uint8_t)*packet->packet_length);
+#else
+	packet->payload = _mosquitto_pool_alloc(mosq, sizeof(uint8_t)*packet->packet_length);
+#endif
 	if(!packet->payload) return MOSQ_ERR_NOMEM;
 
 	packet->payload[0] = packet->command;
@@ -146,6 +165,76 @@ void _mosquitto_check_keepalive(struct mosquitto *mosq)
 	}
 }
 
+#ifndef WITH_BROKER
+/* Seed the state the reconnect jitter is drawn from. Each client has its
+ * own, mixed from the process id, the time and the client's address, so
+ * clients started together on many hosts, or in one process, pick different
+ * delays whether or not the application calls srand(). */
+void _mosquitto_reconnect_seed(struct mosquitto *mosq)
+{
+	uint32_t seed;
+#ifdef WIN32
+	seed = (uint32_t)GetCurrentProcessId() ^ (uint32_t)GetTickCount();
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	seed = (uint32_t)getpid() ^ (uint32_t)tv.tv_sec ^ ((uint32_t)tv.tv_usec << 12);
+#endif
+	seed ^= (uint32_t)((uintptr_t)mosq >> 4);
+	seed ^= (uint32_t)((uint64_t)(uintptr_t)mosq >> 32);
+
+	/* Spread the bits, as pids and addresses differ in few of them. */
+	seed ^= seed >> 16;
+	seed *= 0x85ebca6b;
+	seed ^= seed >> 13;
+	seed *= 0xc2b2ae35;
+	seed ^= seed >> 16;
+	if(seed == 0) seed = 0x9e3779b9;
+
+	mosq->reconnect_rand = seed;
+}
+
+/* Next value of the client's xorshift generator. Only the thread running
+ * the client's network loop calls this, so it needs no lock. */
+static uint32_t _mosquitto_reconnect_rand(struct mosquitto *mosq)
+{
+	uint32_t x = mosq->reconnect_rand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	mosq->reconnect_rand = x;
+	return x;
+}
+
+/* Return the number of milliseconds to wait before the next reconnect attempt
+ * and count the attempt in *reconnects. Used by mosquitto_loop_forever() and
+ * the reactor. */
+unsigned long _mosquitto_reconnect_delay(struct mosquitto *mosq, unsigned int *reconnects)
+{
+	unsigned long reconnect_delay;
+
+	if(mosq->reconnect_delay > 0 && mosq->reconnect_exponential_backoff){
+		reconnect_delay = mosq->reconnect_delay*(*reconnects)*(*reconnects);
+	}else{
+		reconnect_delay = mosq->reconnect_delay;
+	}
+
+	if(reconnect_delay > mosq->reconnect_delay_max){
+		reconnect_delay = mosq->reconnect_delay_max;
+	}else{
+		(*reconnects)++;
+	}
+
+	reconnect_delay *= 1000;
+	if(mosq->reconnect_jitter){
+		reconnect_delay += (unsigned long)_mosquitto_reconnect_rand(mosq) % (mosq->reconnect_jitter*1000UL + 1);
+	}
+	return reconnect_delay;
+}
+#endif
+
 uint16_t _mosquitto_mid_generate(struct mosquitto *mosq)
 {
 	assert(mosq);
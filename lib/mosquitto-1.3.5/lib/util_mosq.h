@@ -34,8 +34,13 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "tls_mosq.h"
 #include "mosquitto.h"
 
-int _mosquitto_packet_alloc(struct _mosquitto_packet *packet);
+struct _mosquitto_packet *_mosquitto_packet_new(struct mosquitto *mosq);
+int _mosquitto_packet_alloc(struct mosquitto *mosq, struct _mosquitto_packet *packet);
 void _mosquitto_check_keepalive(struct mosquitto *mosq);
+#ifndef WITH_BROKER
+void _mosquitto_reconnect_seed(struct mosquitto *mosq);
+unsigned long _mosquitto_reconnect_delay(struct mosquitto *mosq, unsigned int *reconnects);
+#endif
 uint16_t _mosquitto_mid_generate(struct mosquitto *mosq);
 int _mosquitto_topic_wildcard_len_check(const char *str);
 int _mosquitto_topic_wildcard_pos_check(const char *str);
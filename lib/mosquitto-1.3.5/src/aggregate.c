@@ -0,0 +1,462 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Built in aggregation plugin.
+ *
+ * Each aggregate option has the form
+ *
+ *   aggregate <window> <pattern> <output>
+ *
+ * Numeric messages on topics matching pattern are summarised over tumbling
+ * windows of window seconds. At the end of each window the sum, mean,
+ * minimum and maximum are published on <output>/sum, <output>/mean,
+ * <output>/min and <output>/max. The output topic can refer to the levels
+ * matched by the + wildcards in the pattern as %1 to %9, and these are what
+ * the messages are grouped by: each distinct output topic gets its own
+ * figures. For example
+ *
+ *   aggregate 10 org/+/cluster/+/node/+/plugin/pmu_pub/chnl/data/cpu/+/erg_pkg agg/%1/%2/erg_pkg
+ *
+ * adds up erg_pkg over every node and cpu of each cluster.
+ *
+ * Payloads are read as a number, optionally followed by ";" and anything
+ * else, which covers the "value;timestamp" messages of the examon
+ * publishers. The results are published in the same form with the end of
+ * the window as the timestamp. Windows are aligned to multiples of their
+ * length since the epoch so that brokers agree on them, and are closed at
+ * the first tick after they end.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <util_mosq.h>
+
+/* %1 to %9 may be used in the output topic. */
+#define AGGREGATE_CAPTURE_MAX 9
+/* The longest payload that is looked at for a number. */
+#define AGGREGATE_VALUE_MAX 64
+
+struct _aggregate_group{
+	/* The expanded output topic, the hash key. */
+	char *topic;
+	double sum;
+	double min;
+	double max;
+	long count;
+	UT_hash_handle hh;
+};
+
+struct _aggregate{
+	struct _aggregate *next;
+	int window;
+	time_t window_end;
+	char **levels;
+	int level_count;
+	char *output;
+	int wildcard_count;
+	struct _aggregate_group *groups;
+};
+
+struct _aggregate_data{
+	struct _aggregate *aggregates;
+	mosquitto_publish_plugin_publish_t publish;
+	/* Reused for expanding output topics. */
+	char *topic_buf;
+	int topic_buf_len;
+};
+
+struct _aggregate_capture{
+	const char *level;
+	int len;
+};
+
+static void _aggregate_free(struct _aggregate *aggregate)
+{
+	struct _aggregate_group *group, *tmp;
+	int i;
+
+	HASH_ITER(hh, aggregate->groups, group, tmp){
+		HASH_DELETE(hh, aggregate->groups, group);
+		_mosquitto_free(group->topic);
+		_mosquitto_free(group);
+	}
+	if(aggregate->levels){
+		for(i=0; i<aggregate->level_count; i++){
+			if(aggregate->levels[i]) _mosquitto_free(aggregate->levels[i]);
+		}
+		_mosquitto_free(aggregate->levels);
+	}
+	if(aggregate->output) _mosquitto_free(aggregate->output);
+	_mosquitto_free(aggregate);
+}
+
+static int _aggregate_output_check(const char *output, int wildcard_count)
+{
+	const char *c;
+
+	if(!output[0]) return MOSQ_ERR_INVAL;
+	if(_mosquitto_topic_wildcard_len_check(output) != MOSQ_ERR_SUCCESS) return MOSQ_ERR_INVAL;
+	for(c=output; c[0]; c++){
+		if(c[0] == '%'){
+			if(c[1] == '%'){
+				c++;
+			}else if(c[1] >= '1' && c[1] <= '9' && c[1]-'0' <= wildcard_count){
+				c++;
+			}else{
+				return MOSQ_ERR_INVAL;
+			}
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Split pattern into its levels. */
+static int _aggregate_levels(struct _aggregate *aggregate, const char *pattern)
+{
+	const char *end;
+	int len;
+	int count = 1;
+	int i;
+
+	for(end=pattern; end[0]; end++){
+		if(end[0] == '/') count++;
+	}
+	aggregate->levels = _mosquitto_calloc(count, sizeof(char *));
+	if(!aggregate->levels) return MOSQ_ERR_NOMEM;
+	aggregate->level_count = count;
+
+	for(i=0; i<count; i++){
+		end = strchr(pattern, '/');
+		len = end ? (int)(end - pattern) : (int)strlen(pattern);
+		aggregate->levels[i] = _mosquitto_malloc(len+1);
+		if(!aggregate->levels[i]) return MOSQ_ERR_NOMEM;
+		memcpy(aggregate->levels[i], pattern, len);
+		aggregate->levels[i][len] = '\0';
+		pattern = end ? end+1 : NULL;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct _aggregate *_aggregate_parse(const char *value, time_t now)
+{
+	struct _aggregate *aggregate;
+	char *buf, *window, *pattern, *output, *saveptr = NULL;
+	int i;
+
+	buf = _mosquitto_strdup(value);
+	if(!buf) return NULL;
+	window = strtok_r(buf, " ", &saveptr);
+	pattern = strtok_r(NULL, " ", &saveptr);
+	output = strtok_r(NULL, " ", &saveptr);
+	if(!window || !pattern || !output || atoi(window) < 1
+			|| _mosquitto_topic_wildcard_pos_check(pattern) != MOSQ_ERR_SUCCESS){
+
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid aggregate \"%s\".", value);
+		_mosquitto_free(buf);
+		return NULL;
+	}
+
+	aggregate = _mosquitto_calloc(1, sizeof(struct _aggregate));
+	if(!aggregate){
+		_mosquitto_free(buf);
+		return NULL;
+	}
+	aggregate->window = atoi(window);
+	aggregate->window_end = now - now%aggregate->window + aggregate->window;
+	if(_aggregate_levels(aggregate, pattern)){
+		_mosquitto_free(buf);
+		_aggregate_free(aggregate);
+		return NULL;
+	}
+	for(i=0; i<aggregate->level_count; i++){
+		if(!strcmp(aggregate->levels[i], "+")) aggregate->wildcard_count++;
+	}
+	if(_aggregate_output_check(output, aggregate->wildcard_count)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid aggregate output topic \"%s\".", output);
+		_mosquitto_free(buf);
+		_aggregate_free(aggregate);
+		return NULL;
+	}
+	aggregate->output = _mosquitto_strdup(output);
+	_mosquitto_free(buf);
+	if(!aggregate->output){
+		_aggregate_free(aggregate);
+		return NULL;
+	}
+	return aggregate;
+}
+
+/* Match topic against the pattern of aggregate, recording the levels matched
+ * by + wildcards. Returns true on a match. */
+static bool _aggregate_match(struct _aggregate *aggregate, const char *topic, struct _aggregate_capture *captures)
+{
+	const char *end;
+	int len;
+	int i;
+	int capture = 0;
+
+	/* Wildcards at the start of a pattern don't match $ topics. */
+	if(topic[0] == '$' && aggregate->levels[0][0] != '$') return false;
+
+	for(i=0; i<aggregate->level_count; i++){
+		if(!strcmp(aggregate->levels[i], "#")){
+			return true;
+		}
+		if(!topic) return false;
+
+		end = strchr(topic, '/');
+		len = end ? (int)(end - topic) : (int)strlen(topic);
+		if(!strcmp(aggregate->levels[i], "+")){
+			if(capture < AGGREGATE_CAPTURE_MAX){
+				captures[capture].level = topic;
+				captures[capture].len = len;
+			}
+			capture++;
+		}else if(strncmp(aggregate->levels[i], topic, len) || aggregate->levels[i][len] != '\0'){
+			return false;
+		}
+		topic = end ? end+1 : NULL;
+	}
+	return topic == NULL;
+}
+
+/* Expand the output topic of aggregate into the topic buffer. */
+static char *_aggregate_topic(struct _aggregate_data *data, struct _aggregate *aggregate, struct _aggregate_capture *captures)
+{
+	const char *c;
+	char *buf;
+	int len = 0;
+	int pos;
+
+	for(c=aggregate->output; c[0]; c++){
+		if(c[0] == '%' && c[1] == '%'){
+			c++;
+			len++;
+		}else if(c[0] == '%'){
+			c++;
+			len += captures[c[0]-'1'].len;
+		}else{
+			len++;
+		}
+	}
+	if(len+1 > data->topic_buf_len){
+		buf = _mosquitto_realloc(data->topic_buf, len+1);
+		if(!buf) return NULL;
+		data->topic_buf = buf;
+		data->topic_buf_len = len+1;
+	}
+
+	pos = 0;
+	for(c=aggregate->output; c[0]; c++){
+		if(c[0] == '%' && c[1] == '%'){
+			c++;
+			data->topic_buf[pos++] = '%';
+		}else if(c[0] == '%'){
+			c++;
+			memcpy(&data->topic_buf[pos], captures[c[0]-'1'].level, captures[c[0]-'1'].len);
+			pos += captures[c[0]-'1'].len;
+		}else{
+			data->topic_buf[pos++] = c[0];
+		}
+	}
+	data->topic_buf[pos] = '\0';
+	return data->topic_buf;
+}
+
+static int _aggregate_value(int payloadlen, const void *payload, double *value)
+{
+	char buf[AGGREGATE_VALUE_MAX];
+	char *end;
+
+	if(payloadlen <= 0) return MOSQ_ERR_INVAL;
+	if(payloadlen > AGGREGATE_VALUE_MAX-1) payloadlen = AGGREGATE_VALUE_MAX-1;
+	memcpy(buf, payload, payloadlen);
+	buf[payloadlen] = '\0';
+
+	*value = strtod(buf, &end);
+	if(end == buf || (end[0] != '\0' && end[0] != ';')) return MOSQ_ERR_INVAL;
+	if(isnan(*value) || isinf(*value)) return MOSQ_ERR_INVAL;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _aggregate_add(struct _aggregate *aggregate, const char *topic, double value)
+{
+	struct _aggregate_group *group;
+	int len = strlen(topic);
+
+	HASH_FIND(hh, aggregate->groups, topic, len, group);
+	if(!group){
+		group = _mosquitto_calloc(1, sizeof(struct _aggregate_group));
+		if(!group) return MOSQ_ERR_NOMEM;
+		group->topic = _mosquitto_strdup(topic);
+		if(!group->topic){
+			_mosquitto_free(group);
+			return MOSQ_ERR_NOMEM;
+		}
+		HASH_ADD_KEYPTR(hh, aggregate->groups, group->topic, len, group);
+	}
+	if(group->count == 0){
+		group->sum = value;
+		group->min = value;
+		group->max = value;
+	}else{
+		group->sum += value;
+		if(value < group->min) group->min = value;
+		if(value > group->max) group->max = value;
+	}
+	group->count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _aggregate_publish(struct _aggregate_data *data, struct _aggregate_group *group, const char *stat, double value, time_t timestamp)
+{
+	char topic[1024];
+	char payload[64];
+	int len;
+
+	if(snprintf(topic, sizeof(topic), "%s/%s", group->topic, stat) >= (int)sizeof(topic)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Aggregate topic %s too long.", group->topic);
+		return;
+	}
+	len = snprintf(payload, sizeof(payload), "%.15g;%ld", value, (long)timestamp);
+	data->publish(topic, 0, len, payload, false);
+}
+
+/* Publish the figures for the window that has just ended. Groups that had no
+ * messages in the window are dropped. */
+static void _aggregate_window_end(struct _aggregate_data *data, struct _aggregate *aggregate)
+{
+	struct _aggregate_group *group, *tmp;
+
+	HASH_ITER(hh, aggregate->groups, group, tmp){
+		if(group->count == 0){
+			HASH_DELETE(hh, aggregate->groups, group);
+			_mosquitto_free(group->topic);
+			_mosquitto_free(group);
+			continue;
+		}
+		_aggregate_publish(data, group, "sum", group->sum, aggregate->window_end);
+		_aggregate_publish(data, group, "mean", group->sum/group->count, aggregate->window_end);
+		_aggregate_publish(data, group, "min", group->min, aggregate->window_end);
+		_aggregate_publish(data, group, "max", group->max, aggregate->window_end);
+		group->count = 0;
+	}
+}
+
+int mqtt3_aggregate_plugin_init(void **user_data, struct mosquitto_publish_opt *opts, int opt_count, mosquitto_publish_plugin_publish_t publish)
+{
+	struct _aggregate_data *data;
+	struct _aggregate *aggregate, **tail;
+	time_t now = time(NULL);
+	int i;
+
+	data = _mosquitto_calloc(1, sizeof(struct _aggregate_data));
+	if(!data) return MOSQ_ERR_NOMEM;
+	data->publish = publish;
+
+	tail = &data->aggregates;
+	for(i=0; i<opt_count; i++){
+		if(strcmp(opts[i].key, "aggregate")) continue;
+
+		aggregate = _aggregate_parse(opts[i].value, now);
+		if(!aggregate){
+			mqtt3_aggregate_plugin_cleanup(data, opts, opt_count);
+			return MOSQ_ERR_INVAL;
+		}
+		*tail = aggregate;
+		tail = &aggregate->next;
+	}
+	*user_data = data;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_aggregate_plugin_cleanup(void *user_data, struct mosquitto_publish_opt *opts, int opt_count)
+{
+	struct _aggregate_data *data = user_data;
+	struct _aggregate *aggregate;
+
+	if(!data) return MOSQ_ERR_SUCCESS;
+
+	while(data->aggregates){
+		aggregate = data->aggregates;
+		data->aggregates = aggregate->next;
+		_aggregate_free(aggregate);
+	}
+	if(data->topic_buf) _mosquitto_free(data->topic_buf);
+	_mosquitto_free(data);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_aggregate_plugin_message(void *user_data, const char *clientid, const char *topic, int qos, int payloadlen, const void *payload, bool retain)
+{
+	struct _aggregate_data *data = user_data;
+	struct _aggregate *aggregate;
+	struct _aggregate_capture captures[AGGREGATE_CAPTURE_MAX];
+	char *group_topic;
+	double value;
+	bool have_value = false;
+
+	assert(data);
+
+	for(aggregate=data->aggregates; aggregate; aggregate=aggregate->next){
+		if(!_aggregate_match(aggregate, topic, captures)) continue;
+
+		if(!have_value){
+			if(_aggregate_value(payloadlen, payload, &value)) return MOSQ_ERR_INVAL;
+			have_value = true;
+		}
+		group_topic = _aggregate_topic(data, aggregate, captures);
+		if(!group_topic) return MOSQ_ERR_NOMEM;
+		if(_aggregate_add(aggregate, group_topic, value)) return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mqtt3_aggregate_plugin_tick(void *user_data, time_t now)
+{
+	struct _aggregate_data *data = user_data;
+	struct _aggregate *aggregate;
+
+	assert(data);
+
+	for(aggregate=data->aggregates; aggregate; aggregate=aggregate->next){
+		if(now >= aggregate->window_end){
+			_aggregate_window_end(data, aggregate);
+			aggregate->window_end = now - now%aggregate->window + aggregate->window;
+		}
+	}
+}
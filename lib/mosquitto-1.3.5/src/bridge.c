@@ -34,6 +34,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifndef WIN32
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
 #else
 #include <winsock2.h>
@@ -55,12 +56,18 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifdef WITH_BRIDGE
 
+static void _bridge_primary_probe_close(struct _mqtt3_bridge *bridge)
+{
+	if(bridge->primary_probe_sock != INVALID_SOCKET){
+		COMPAT_CLOSE(bridge->primary_probe_sock);
+		bridge->primary_probe_sock = INVALID_SOCKET;
+	}
+}
+
 int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge)
 {
-	int i;
 	struct mosquitto *new_context = NULL;
-	int null_index = -1;
-	struct mosquitto **tmp_contexts;
+	struct _clientid_index_hash *find_cih;
 	char hostname[256];
 	int len;
 	char *id;
@@ -86,38 +93,22 @@ int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge)
 		return MOSQ_ERR_NOMEM;
 	}
 
-	/* Search for existing id (possible from persistent db) and also look for a
-	 * gap in the db->contexts[] array in case the id isn't found. */
-	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i]){
-			if(!strcmp(db->contexts[i]->id, id)){
-				new_context = db->contexts[i];
-				break;
-			}
-		}else if(db->contexts[i] == NULL && null_index == -1){
-			null_index = i;
-			break;
-		}
+	/* Search for existing id (possible from persistent db). */
+	HASH_FIND_STR(db->clientid_index_hash, id, find_cih);
+	if(find_cih){
+		new_context = db->contexts[find_cih->db_context_index];
 	}
 	if(!new_context){
 		/* id wasn't found, so generate a new context */
 		new_context = mqtt3_context_init(-1);
 		if(!new_context){
+			_mosquitto_free(id);
 			return MOSQ_ERR_NOMEM;
 		}
-		if(null_index == -1){
-			/* There were no gaps in the db->contexts[] array, so need to append. */
-			db->context_count++;
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*db->context_count);
-			if(tmp_contexts){
-				db->contexts = tmp_contexts;
-				db->contexts[db->context_count-1] = new_context;
-			}else{
-				_mosquitto_free(new_context);
-				return MOSQ_ERR_NOMEM;
-			}
-		}else{
-			db->contexts[null_index] = new_context;
+		if(mqtt3_context_slot_add(db, new_context)){
+			_mosquitto_free(new_context);
+			_mosquitto_free(id);
+			return MOSQ_ERR_NOMEM;
 		}
 		new_context->id = id;
 	}else{
@@ -159,6 +150,7 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 
 	if(!context || !context->bridge) return MOSQ_ERR_INVAL;
 
+	_bridge_primary_probe_close(context->bridge);
 	context->state = mosq_cs_new;
 	context->sock = -1;
 	context->last_msg_in = mosquitto_time();
@@ -169,10 +161,10 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 	context->ping_t = 0;
 	context->bridge->lazy_reconnect = false;
 	mqtt3_bridge_packet_cleanup(context);
-	mqtt3_db_message_reconnect_reset(context);
+	mqtt3_db_message_reconnect_reset(db, context);
 
 	if(context->clean_session){
-		mqtt3_db_messages_delete(context);
+		mqtt3_db_messages_delete(db, context);
 	}
 
 	/* Delete all local subscriptions even for clean_session==false. We don't
@@ -226,6 +218,13 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 		return rc;
 	}
 
+	if(context->bridge->round_robin == false && context->bridge->cur_address != 0){
+		/* Connected to a secondary address, so keep checking the primary. */
+		mqtt3_timer_add(&context->bridge_timer, context->bridge->primary_retry+1);
+	}else{
+		mqtt3_timer_remove(&context->bridge_timer);
+	}
+
 	rc = _mosquitto_send_connect(context, context->keepalive, context->clean_session);
 	if(rc == MOSQ_ERR_SUCCESS){
 		return MOSQ_ERR_SUCCESS;
@@ -244,11 +243,100 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 	}
 }
 
+/* Look at how a connection attempt to the primary address is getting on,
+ * without waiting. Returns MOSQ_ERR_SUCCESS once connected,
+ * MOSQ_ERR_CONN_PENDING while still connecting, or an error. */
+static int _bridge_primary_probe_check(struct _mqtt3_bridge *bridge)
+{
+	struct pollfd pollfd;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	pollfd.fd = bridge->primary_probe_sock;
+	pollfd.events = POLLOUT;
+	pollfd.revents = 0;
+#ifndef WIN32
+	if(poll(&pollfd, 1, 0) == -1) return MOSQ_ERR_ERRNO;
+#else
+	if(WSAPoll(&pollfd, 1, 0) == SOCKET_ERROR) return MOSQ_ERR_ERRNO;
+#endif
+	if(!pollfd.revents) return MOSQ_ERR_CONN_PENDING;
+
+	if(getsockopt(bridge->primary_probe_sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len) || err){
+		return MOSQ_ERR_ERRNO;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Called from the bridge timer. Restarts an automatic bridge whose restart
+ * timeout has passed, or checks whether the primary address is available again
+ * for a bridge that is connected to a secondary address. */
+void mqtt3_bridge_timer_check(struct mosquitto_db *db, struct mosquitto *context, time_t now)
+{
+	struct _mqtt3_bridge *bridge = context->bridge;
+	int rc;
+
+	if(!bridge) return;
+
+	if(context->sock == INVALID_SOCKET){
+		if(bridge->start_type != bst_automatic || !bridge->restart_t) return;
+
+		if(now <= bridge->restart_t){
+			mqtt3_timer_add(&context->bridge_timer, bridge->restart_t+1);
+			return;
+		}
+		bridge->restart_t = 0;
+		if(mqtt3_bridge_connect(db, context) != MOSQ_ERR_SUCCESS){
+			/* Retry later. */
+			bridge->restart_t = now+bridge->restart_timeout;
+
+			bridge->cur_address++;
+			if(bridge->cur_address == bridge->address_count){
+				bridge->cur_address = 0;
+			}
+			mqtt3_timer_add(&context->bridge_timer, bridge->restart_t+1);
+		}
+	}else if(bridge->round_robin == false && bridge->cur_address != 0){
+		/* Connected to a secondary address, so find out whether the primary
+		 * is back. The connection attempt is started here and its result
+		 * picked up on later ticks, so the loop never waits on it. */
+		if(bridge->primary_probe_sock == INVALID_SOCKET){
+			if(now <= bridge->primary_retry){
+				mqtt3_timer_add(&context->bridge_timer, bridge->primary_retry+1);
+				return;
+			}
+			rc = _mosquitto_try_connect(bridge->addresses[0].address, bridge->addresses[0].port, &bridge->primary_probe_sock, NULL, false);
+			if(rc != MOSQ_ERR_SUCCESS){
+				bridge->primary_probe_sock = INVALID_SOCKET;
+				bridge->primary_retry = now + 5;
+				mqtt3_timer_add(&context->bridge_timer, bridge->primary_retry+1);
+				return;
+			}
+			bridge->primary_probe_t = now + 5;
+		}
+
+		rc = _bridge_primary_probe_check(bridge);
+		if(rc == MOSQ_ERR_SUCCESS){
+			_bridge_primary_probe_close(bridge);
+			_mosquitto_socket_close(context);
+			bridge->cur_address = bridge->address_count-1;
+		}else if(rc == MOSQ_ERR_CONN_PENDING && now < bridge->primary_probe_t){
+			mqtt3_timer_add(&context->bridge_timer, now+1);
+		}else{
+			_bridge_primary_probe_close(bridge);
+			bridge->primary_retry = now + 5;
+			mqtt3_timer_add(&context->bridge_timer, bridge->primary_retry+1);
+		}
+	}
+}
+
 void mqtt3_bridge_packet_cleanup(struct mosquitto *context)
 {
 	struct _mosquitto_packet *packet;
 	if(!context) return;
 
+	mqtt3_bridge_batch_free(context->bridge);
+
 	_mosquitto_packet_cleanup(context->current_out_packet);
     while(context->out_packet){
 		_mosquitto_packet_cleanup(context->out_packet);
@@ -260,4 +348,76 @@ void mqtt3_bridge_packet_cleanup(struct mosquitto *context)
 	_mosquitto_packet_cleanup(&(context->in_packet));
 }
 
+/* Release what a bridge holds outside of its connection, when its context is
+ * freed. */
+void mqtt3_bridge_cleanup(struct mosquitto *context)
+{
+	if(!context->bridge) return;
+
+	_bridge_primary_probe_close(context->bridge);
+	mqtt3_bridge_batch_free(context->bridge);
+}
+
+/* Find the topic a message on a local topic is published with on the remote
+ * broker. mapped_topic is left as NULL if no topic prefixes apply, in which
+ * case the local topic is used unchanged. */
+int mqtt3_bridge_topic_remap_out(struct mosquitto *context, const char *topic, char **mapped_topic)
+{
+	int i;
+	size_t len;
+	struct _mqtt3_bridge_topic *cur_topic;
+	bool match;
+	int rc;
+	char *topic_temp;
+
+	*mapped_topic = NULL;
+	if(!context->bridge || !context->bridge->topics || !context->bridge->topic_remapping){
+		return MOSQ_ERR_SUCCESS;
+	}
+	for(i=0; i<context->bridge->topic_count; i++){
+		cur_topic = &context->bridge->topics[i];
+		if((cur_topic->direction == bd_both || cur_topic->direction == bd_out) 
+				&& (cur_topic->remote_prefix || cur_topic->local_prefix)){
+			/* Topic mapping required on this topic if the message matches */
+
+			rc = mosquitto_topic_matches_sub(cur_topic->local_topic, topic, &match);
+			if(rc){
+				return rc;
+			}
+			if(match){
+				*mapped_topic = _mosquitto_strdup(topic);
+				if(!*mapped_topic) return MOSQ_ERR_NOMEM;
+				if(cur_topic->local_prefix){
+					/* This prefix needs removing. */
+					if(!strncmp(cur_topic->local_prefix, *mapped_topic, strlen(cur_topic->local_prefix))){
+						topic_temp = _mosquitto_strdup(*mapped_topic+strlen(cur_topic->local_prefix));
+						_mosquitto_free(*mapped_topic);
+						*mapped_topic = NULL;
+						if(!topic_temp){
+							return MOSQ_ERR_NOMEM;
+						}
+						*mapped_topic = topic_temp;
+					}
+				}
+
+				if(cur_topic->remote_prefix){
+					/* This prefix needs adding. */
+					len = strlen(*mapped_topic) + strlen(cur_topic->remote_prefix)+1;
+					topic_temp = _mosquitto_calloc(len+1, sizeof(char));
+					if(!topic_temp){
+						_mosquitto_free(*mapped_topic);
+						*mapped_topic = NULL;
+						return MOSQ_ERR_NOMEM;
+					}
+					snprintf(topic_temp, len, "%s%s", cur_topic->remote_prefix, *mapped_topic);
+					_mosquitto_free(*mapped_topic);
+					*mapped_topic = topic_temp;
+				}
+				return MOSQ_ERR_SUCCESS;
+			}
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
 #endif
@@ -0,0 +1,572 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Batched bridge messages.
+ *
+ * A bridge with bridge_batch_interval set doesn't send QoS 0 messages to
+ * the remote broker as a PUBLISH each. They are collected for up to that
+ * many milliseconds, or until the batch reaches BATCH_MAX bytes, and are
+ * then sent together as one QoS 0 PUBLISH on MQTT3_BRIDGE_BATCH_TOPIC. A
+ * broker receiving a batch unpacks it and handles each message in it as
+ * though the sender had published it on its own. QoS 1 and 2 messages are
+ * always sent individually, so they keep their acknowledgements.
+ *
+ * The payload of a batch is a header:
+ *
+ *   version       1 byte, BATCH_VERSION
+ *   flags         1 byte, BATCH_FLAG_ZLIB if the body is compressed
+ *   body length   4 bytes, length of the body before compression
+ *   count         4 bytes, number of messages in the body
+ *
+ * followed by the body, holding each message in turn:
+ *
+ *   topic ref     varint
+ *   prefix        varint, only if topic ref is 0
+ *   suffix length varint, only if topic ref is 0
+ *   suffix        only if topic ref is 0
+ *   flags         1 byte, BATCH_MSG_FLAG_RETAIN
+ *   payload len   varint
+ *   payload
+ *
+ * Each topic is only spelt out the first time it appears in a batch, with
+ * a topic ref of 0. It is given as the number of leading bytes it shares
+ * with the topic of the message before it, followed by the remainder, and
+ * is numbered from 1 in order of appearance. Later messages on the same
+ * topic give that number as their topic ref. The header integers are in
+ * network byte order and varints use the same encoding as the MQTT
+ * remaining length.
+ *
+ * With bridge_batch_compression set, the body is compressed with zlib when
+ * that makes it smaller.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WITH_BRIDGE_COMPRESSION
+#include <zlib.h>
+#endif
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <send_mosq.h>
+#include <time_mosq.h>
+#include <util_mosq.h>
+
+#ifdef WITH_BRIDGE
+
+#ifdef WITH_SYS_TREE
+extern uint64_t g_pub_bytes_sent;
+#endif
+
+#define BATCH_VERSION 1
+#define BATCH_FLAG_ZLIB 0x01
+#define BATCH_MSG_FLAG_RETAIN 0x01
+#define BATCH_HEADER_LEN 10
+/* Largest batch body. A batch is sent when the next message wouldn't fit,
+ * and a message too big for an empty batch is sent on its own. */
+#define BATCH_MAX 65536
+/* Most a message adds to a body besides its topic and payload: four
+ * varints and the flags. */
+#define BATCH_MSG_OVERHEAD 21
+
+struct _batch_topic{
+	UT_hash_handle hh;
+	char *topic;
+	uint32_t ref;
+};
+
+struct _mqtt3_bridge_batch{
+	/* Room for the header, followed by the body. */
+	uint8_t *buf;
+	uint32_t len;
+	uint32_t count;
+	struct _batch_topic *topics;
+	uint32_t topic_count;
+	const char *last_topic;
+	/* When the batch is due to be sent, from _batch_now(). */
+	long long deadline;
+};
+
+static long long _batch_now(void)
+{
+#ifdef WIN32
+	return GetTickCount64();
+#else
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (long long)tp.tv_sec*1000 + tp.tv_nsec/1000000;
+#endif
+}
+
+static void _batch_write_varint(struct _mqtt3_bridge_batch *batch, uint32_t value)
+{
+	uint8_t byte;
+
+	do{
+		byte = value % 128;
+		value = value / 128;
+		if(value > 0){
+			byte = byte | 0x80;
+		}
+		batch->buf[BATCH_HEADER_LEN + batch->len] = byte;
+		batch->len++;
+	}while(value > 0);
+}
+
+static int _batch_read_varint(const uint8_t *data, uint32_t len, uint32_t *pos, uint32_t *value)
+{
+	uint32_t mult = 1;
+	uint8_t byte;
+	int count = 0;
+
+	*value = 0;
+	do{
+		if(*pos >= len || count == 4) return MOSQ_ERR_PROTOCOL;
+		byte = data[*pos];
+		(*pos)++;
+		*value += (byte & 127) * mult;
+		mult *= 128;
+		count++;
+	}while((byte & 128) != 0);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _batch_write_uint32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = (value >> 24) & 0xFF;
+	buf[1] = (value >> 16) & 0xFF;
+	buf[2] = (value >> 8) & 0xFF;
+	buf[3] = value & 0xFF;
+}
+
+static uint32_t _batch_read_uint32(const uint8_t *buf)
+{
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static void _batch_reset(struct _mqtt3_bridge_batch *batch)
+{
+	struct _batch_topic *entry, *entry_tmp;
+
+	HASH_ITER(hh, batch->topics, entry, entry_tmp){
+		HASH_DELETE(hh, batch->topics, entry);
+		_mosquitto_free(entry->topic);
+		_mosquitto_free(entry);
+	}
+	batch->len = 0;
+	batch->count = 0;
+	batch->topic_count = 0;
+	batch->last_topic = NULL;
+}
+
+static int _batch_send(struct mosquitto *context)
+{
+	struct _mqtt3_bridge_batch *batch = context->bridge->batch;
+	uint8_t *frame;
+	uint32_t framelen;
+	uint8_t flags = 0;
+	int rc;
+#ifdef WITH_BRIDGE_COMPRESSION
+	uint8_t *zbuf = NULL;
+	uLongf zlen;
+#endif
+
+	if(!batch || batch->count == 0) return MOSQ_ERR_SUCCESS;
+
+	frame = batch->buf;
+	framelen = BATCH_HEADER_LEN + batch->len;
+#ifdef WITH_BRIDGE_COMPRESSION
+	if(context->bridge->batch_compression){
+		zlen = compressBound(batch->len);
+		zbuf = _mosquitto_malloc(BATCH_HEADER_LEN + zlen);
+		if(!zbuf) return MOSQ_ERR_NOMEM;
+		if(compress2(zbuf+BATCH_HEADER_LEN, &zlen, batch->buf+BATCH_HEADER_LEN, batch->len, Z_BEST_SPEED) == Z_OK
+				&& zlen < batch->len){
+
+			frame = zbuf;
+			framelen = BATCH_HEADER_LEN + zlen;
+			flags |= BATCH_FLAG_ZLIB;
+		}
+	}
+#endif
+	frame[0] = BATCH_VERSION;
+	frame[1] = flags;
+	_batch_write_uint32(&frame[2], batch->len);
+	_batch_write_uint32(&frame[6], batch->count);
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending batch of %ld messages to %s (%ld bytes, %ld uncompressed)", (long)batch->count, context->id, (long)framelen, (long)(BATCH_HEADER_LEN + batch->len));
+#ifdef WITH_SYS_TREE
+	g_pub_bytes_sent += framelen;
+#endif
+	rc = _mosquitto_send_real_publish(context, 0, MQTT3_BRIDGE_BATCH_TOPIC, framelen, frame, 0, false, false);
+#ifdef WITH_BRIDGE_COMPRESSION
+	if(zbuf) _mosquitto_free(zbuf);
+#endif
+	_batch_reset(batch);
+	return rc;
+}
+
+/* Add an outgoing QoS 0 message to the bridge's current batch, starting a new
+ * batch if there isn't one. */
+int mqtt3_bridge_batch_add(struct mosquitto *context, const char *topic, uint32_t payloadlen, const void *payload, bool retain)
+{
+	struct _mqtt3_bridge *bridge;
+	struct _mqtt3_bridge_batch *batch;
+	struct _batch_topic *entry;
+	const char *remote_topic;
+	char *mapped_topic = NULL;
+	uint32_t topiclen;
+	uint32_t prefix;
+	int rc;
+
+	assert(context);
+	assert(context->bridge);
+	assert(topic);
+
+	bridge = context->bridge;
+	if(context->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+
+	rc = mqtt3_bridge_topic_remap_out(context, topic, &mapped_topic);
+	if(rc) return rc;
+	remote_topic = mapped_topic?mapped_topic:topic;
+	topiclen = strlen(remote_topic);
+
+	if(topiclen + BATCH_MSG_OVERHEAD > BATCH_MAX || payloadlen > BATCH_MAX - topiclen - BATCH_MSG_OVERHEAD){
+		/* Too big for any batch, so send it alone, after anything already
+		 * batched so the order is kept. */
+		if(mapped_topic) _mosquitto_free(mapped_topic);
+		rc = _batch_send(context);
+		if(rc) return rc;
+		return _mosquitto_send_publish(context, 0, topic, payloadlen, payload, 0, retain, false);
+	}
+
+	if(!bridge->batch){
+		bridge->batch = _mosquitto_calloc(1, sizeof(struct _mqtt3_bridge_batch));
+		if(!bridge->batch){
+			if(mapped_topic) _mosquitto_free(mapped_topic);
+			return MOSQ_ERR_NOMEM;
+		}
+		bridge->batch->buf = _mosquitto_malloc(BATCH_HEADER_LEN + BATCH_MAX);
+		if(!bridge->batch->buf){
+			_mosquitto_free(bridge->batch);
+			bridge->batch = NULL;
+			if(mapped_topic) _mosquitto_free(mapped_topic);
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	batch = bridge->batch;
+
+	if(batch->len + topiclen + payloadlen + BATCH_MSG_OVERHEAD > BATCH_MAX){
+		rc = _batch_send(context);
+		if(rc){
+			if(mapped_topic) _mosquitto_free(mapped_topic);
+			return rc;
+		}
+	}
+	if(batch->count == 0){
+		batch->deadline = _batch_now() + bridge->batch_interval;
+	}
+
+	HASH_FIND(hh, batch->topics, remote_topic, topiclen, entry);
+	if(entry){
+		_batch_write_varint(batch, entry->ref);
+	}else{
+		entry = _mosquitto_calloc(1, sizeof(struct _batch_topic));
+		if(!entry){
+			if(mapped_topic) _mosquitto_free(mapped_topic);
+			return MOSQ_ERR_NOMEM;
+		}
+		if(mapped_topic){
+			entry->topic = mapped_topic;
+			mapped_topic = NULL;
+		}else{
+			entry->topic = _mosquitto_strdup(topic);
+			if(!entry->topic){
+				_mosquitto_free(entry);
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		batch->topic_count++;
+		entry->ref = batch->topic_count;
+		HASH_ADD_KEYPTR(hh, batch->topics, entry->topic, topiclen, entry);
+
+		prefix = 0;
+		if(batch->last_topic){
+			while(prefix < topiclen && batch->last_topic[prefix] == entry->topic[prefix]){
+				prefix++;
+			}
+		}
+		_batch_write_varint(batch, 0);
+		_batch_write_varint(batch, prefix);
+		_batch_write_varint(batch, topiclen - prefix);
+		memcpy(&batch->buf[BATCH_HEADER_LEN + batch->len], entry->topic + prefix, topiclen - prefix);
+		batch->len += topiclen - prefix;
+	}
+	batch->last_topic = entry->topic;
+
+	batch->buf[BATCH_HEADER_LEN + batch->len] = retain?BATCH_MSG_FLAG_RETAIN:0;
+	batch->len++;
+	_batch_write_varint(batch, payloadlen);
+	if(payloadlen){
+		memcpy(&batch->buf[BATCH_HEADER_LEN + batch->len], payload, payloadlen);
+		batch->len += payloadlen;
+	}
+	batch->count++;
+
+	if(mapped_topic) _mosquitto_free(mapped_topic);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Send the bridge's batch if it is due. */
+int mqtt3_bridge_batch_check(struct mosquitto *context)
+{
+	struct _mqtt3_bridge_batch *batch;
+
+	if(!context->bridge || !context->bridge->batch) return MOSQ_ERR_SUCCESS;
+
+	batch = context->bridge->batch;
+	if(batch->count > 0 && _batch_now() >= batch->deadline){
+		return _batch_send(context);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Milliseconds until the bridge's batch is due, or -1 if it has none. */
+int mqtt3_bridge_batch_timeout(struct mosquitto *context)
+{
+	struct _mqtt3_bridge_batch *batch;
+	long long remaining;
+
+	if(!context->bridge || !context->bridge->batch) return -1;
+
+	batch = context->bridge->batch;
+	if(batch->count == 0) return -1;
+
+	remaining = batch->deadline - _batch_now();
+	if(remaining < 0) return 0;
+	return (int)remaining;
+}
+
+/* Drop any unsent batch, as happens to other QoS 0 messages not yet written
+ * when a connection is lost. */
+void mqtt3_bridge_batch_free(struct _mqtt3_bridge *bridge)
+{
+	if(!bridge || !bridge->batch) return;
+
+	_batch_reset(bridge->batch);
+	_mosquitto_free(bridge->batch->buf);
+	_mosquitto_free(bridge->batch);
+	bridge->batch = NULL;
+}
+
+/* Handle one message from a received batch as handle_publish() does a QoS 0
+ * PUBLISH, $SYS accounting included. */
+static int _batch_message_handle(struct mosquitto_db *db, struct mosquitto *context, const char *topic, uint32_t payloadlen, const void *payload, int retain, uint64_t received_us)
+{
+	struct mosquitto_msg_store *stored = NULL;
+	char *topic_mount = NULL;
+	int len;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if(_mosquitto_topic_wildcard_len_check(topic) != MOSQ_ERR_SUCCESS){
+		return MOSQ_ERR_PROTOCOL;
+	}
+
+	if(context->listener && context->listener->mount_point){
+		len = strlen(context->listener->mount_point) + strlen(topic) + 1;
+		topic_mount = _mosquitto_calloc(len, sizeof(char));
+		if(!topic_mount) return MOSQ_ERR_NOMEM;
+		snprintf(topic_mount, len, "%s%s", context->listener->mount_point, topic);
+		topic = topic_mount;
+	}
+
+	if(db->config->message_size_limit && payloadlen > db->config->message_size_limit){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Dropped too large PUBLISH from %s (d0, q0, r%d, m0, '%s', ... (%ld bytes))", context->id, retain, topic, (long)payloadlen);
+		goto done;
+	}
+
+	rc = mosquitto_acl_check(db, context, topic, MOSQ_ACL_WRITE);
+	if(rc == MOSQ_ERR_ACL_DENIED){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Denied PUBLISH from %s (d0, q0, r%d, m0, '%s', ... (%ld bytes))", context->id, retain, topic, (long)payloadlen);
+		rc = MOSQ_ERR_SUCCESS;
+		goto done;
+	}else if(rc != MOSQ_ERR_SUCCESS){
+		goto done;
+	}
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d0, q0, r%d, m0, '%s', ... (%ld bytes))", context->id, retain, topic, (long)payloadlen);
+#ifdef WITH_SYS_TREE
+	if(db->config->sys_topic_prefix_count){
+		mqtt3_sys_topic_count(db, topic, payloadlen);
+	}
+#endif
+	if(mqtt3_db_message_store(db, context->id, 0, topic, 0, payloadlen, payload, retain, &stored, 0)){
+		rc = MOSQ_ERR_NOMEM;
+		goto done;
+	}
+	mqtt3_publish_plugin_message(db, context, stored);
+
+	stored->ref_count++;
+	if(mqtt3_db_messages_queue(db, context->id, topic, 0, retain, stored)) rc = MOSQ_ERR_NOMEM;
+#ifdef WITH_SYS_TREE
+	if(received_us){
+		stored->enqueued_us = mosquitto_time_us();
+		mqtt3_sys_latency_record(mlt_receive_enqueue, stored->enqueued_us - received_us);
+	}
+#endif
+	mqtt3_db_msg_store_deref(db, &stored);
+
+done:
+	if(topic_mount) _mosquitto_free(topic_mount);
+	return rc;
+}
+
+/* Unpack a batch received from a remote bridge and handle each message in
+ * it. A malformed batch is an error, and the client is disconnected.
+ * received_us is when the batch was read, or 0 if latencies aren't being
+ * measured; every message in it counts as received then. */
+int mqtt3_bridge_batch_handle(struct mosquitto_db *db, struct mosquitto *context, const uint8_t *frame, uint32_t framelen, uint64_t received_us)
+{
+	const uint8_t *body;
+	uint8_t *inflated = NULL;
+	uint32_t len, count;
+	uint32_t pos = 0;
+	uint32_t i;
+	uint32_t ref, prefix, suffixlen, payloadlen;
+	char **topics = NULL;
+	uint32_t topic_count = 0;
+	char *topic;
+	const char *last_topic = NULL;
+	size_t last_topiclen = 0;
+	uint8_t flags;
+	int rc = MOSQ_ERR_PROTOCOL;
+#ifdef WITH_BRIDGE_COMPRESSION
+	uLongf inflated_len;
+#endif
+
+	assert(db);
+	assert(context);
+
+	if(framelen < BATCH_HEADER_LEN || frame[0] != BATCH_VERSION) goto invalid;
+	flags = frame[1];
+	len = _batch_read_uint32(&frame[2]);
+	count = _batch_read_uint32(&frame[6]);
+	/* Each message takes at least three bytes. */
+	if(len > BATCH_MAX || count > len/3) goto invalid;
+
+	if(flags & BATCH_FLAG_ZLIB){
+#ifdef WITH_BRIDGE_COMPRESSION
+		inflated = _mosquitto_malloc(len+1);
+		if(!inflated) return MOSQ_ERR_NOMEM;
+		inflated_len = len;
+		if(uncompress(inflated, &inflated_len, &frame[BATCH_HEADER_LEN], framelen-BATCH_HEADER_LEN) != Z_OK
+				|| inflated_len != len){
+
+			goto invalid;
+		}
+		body = inflated;
+#else
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Compressed batch received from %s but compression support not available.", context->id);
+		return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+	}else{
+		if(framelen-BATCH_HEADER_LEN != len) goto invalid;
+		body = &frame[BATCH_HEADER_LEN];
+	}
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received batch of %ld messages from %s (%ld bytes)", (long)count, context->id, (long)framelen);
+	if(count == 0){
+		rc = MOSQ_ERR_SUCCESS;
+		goto cleanup;
+	}
+	topics = _mosquitto_calloc(count, sizeof(char *));
+	if(!topics){
+		rc = MOSQ_ERR_NOMEM;
+		goto cleanup;
+	}
+
+	for(i=0; i<count; i++){
+		if(_batch_read_varint(body, len, &pos, &ref)) goto invalid;
+		if(ref){
+			if(ref > topic_count) goto invalid;
+			topic = topics[ref-1];
+		}else{
+			if(_batch_read_varint(body, len, &pos, &prefix)) goto invalid;
+			if(_batch_read_varint(body, len, &pos, &suffixlen)) goto invalid;
+			if(prefix > last_topiclen || suffixlen > len-pos || prefix+suffixlen == 0) goto invalid;
+			if(memchr(&body[pos], 0, suffixlen)) goto invalid;
+
+			topic = _mosquitto_malloc(prefix+suffixlen+1);
+			if(!topic){
+				rc = MOSQ_ERR_NOMEM;
+				goto cleanup;
+			}
+			memcpy(topic, last_topic, prefix);
+			memcpy(&topic[prefix], &body[pos], suffixlen);
+			topic[prefix+suffixlen] = '\0';
+			pos += suffixlen;
+			topics[topic_count] = topic;
+			topic_count++;
+		}
+		last_topic = topic;
+		last_topiclen = strlen(topic);
+
+		if(pos >= len) goto invalid;
+		flags = body[pos];
+		pos++;
+		if(_batch_read_varint(body, len, &pos, &payloadlen)) goto invalid;
+		if(payloadlen > len-pos) goto invalid;
+
+		rc = _batch_message_handle(db, context, topic, payloadlen, &body[pos], flags & BATCH_MSG_FLAG_RETAIN, received_us);
+		if(rc == MOSQ_ERR_PROTOCOL) goto invalid;
+		if(rc) goto cleanup;
+		pos += payloadlen;
+	}
+	rc = MOSQ_ERR_SUCCESS;
+	goto cleanup;
+
+invalid:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Invalid batch from %s, disconnecting.", context->id);
+	rc = MOSQ_ERR_PROTOCOL;
+cleanup:
+	for(i=0; i<topic_count; i++){
+		_mosquitto_free(topics[i]);
+	}
+	if(topics) _mosquitto_free(topics);
+	if(inflated) _mosquitto_free(inflated);
+	return rc;
+}
+
+#endif
@@ -71,6 +71,7 @@ extern SERVICE_STATUS_HANDLE service_handle;
 static int _conf_parse_bool(char **token, const char *name, bool *value, char *saveptr);
 static int _conf_parse_int(char **token, const char *name, int *value, char *saveptr);
 static int _conf_parse_string(char **token, const char *name, char **value, char *saveptr);
+static int _conf_parse_queue_policy(char **token, const char *name, enum mqtt3_queue_policy *value, char *saveptr);
 static int _config_read_file(struct mqtt3_config *config, bool reload, const char *file, struct config_recurse *config_tmp, int level, int *lineno);
 
 static int _conf_attempt_resolve(const char *host, const char *text, int log, const char *msg)
@@ -122,6 +123,7 @@ static void _config_init_reload(struct mqtt3_config *config)
 	config->auto_id_prefix_len = 0;
 	config->autosave_interval = 1800;
 	config->autosave_on_changes = false;
+	config->autosave_fork = true;
 	if(config->clientid_prefixes) _mosquitto_free(config->clientid_prefixes);
 	config->connection_messages = true;
 	config->clientid_prefixes = NULL;
@@ -163,7 +165,7 @@ static void _config_init_reload(struct mqtt3_config *config)
 	config->psk_file = NULL;
 	config->queue_qos0_messages = false;
 	config->retry_interval = 20;
-	config->store_clean_interval = 10;
+	config->shared_subscription_policy = ssp_round_robin;
 	config->sys_interval = 10;
 	config->upgrade_outgoing_qos = false;
 	if(config->auth_options){
@@ -175,6 +177,14 @@ static void _config_init_reload(struct mqtt3_config *config)
 		config->auth_options = NULL;
 		config->auth_option_count = 0;
 	}
+	if(config->client_queue_policies){
+		for(i=0; i<config->client_queue_policy_count; i++){
+			_mosquitto_free(config->client_queue_policies[i].prefix);
+		}
+		_mosquitto_free(config->client_queue_policies);
+		config->client_queue_policies = NULL;
+		config->client_queue_policy_count = 0;
+	}
 }
 
 void mqtt3_config_init(struct mqtt3_config *config)
@@ -183,10 +193,13 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	_config_init_reload(config);
 	config->config_file = NULL;
 	config->daemon = false;
+	config->io_threads = 1;
+	config->persistence_journal = false;
 	config->default_listener.host = NULL;
 	config->default_listener.port = 0;
 	config->default_listener.max_connections = -1;
 	config->default_listener.mount_point = NULL;
+	config->default_listener.queue_policy = qp_drop_newest;
 	config->default_listener.socks = NULL;
 	config->default_listener.sock_count = 0;
 	config->default_listener.client_count = 0;
@@ -211,6 +224,14 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	config->bridge_count = 0;
 #endif
 	config->auth_plugin = NULL;
+	config->publish_plugin = NULL;
+	config->publish_options = NULL;
+	config->publish_option_count = 0;
+	config->aggregates = NULL;
+	config->aggregate_count = 0;
+	config->sys_topic_prefixes = NULL;
+	config->sys_topic_names = NULL;
+	config->sys_topic_prefix_count = 0;
 	config->verbose = false;
 	config->message_size_limit = 0;
 }
@@ -225,12 +246,28 @@ void mqtt3_config_cleanup(struct mqtt3_config *config)
 	if(config->acl_file) _mosquitto_free(config->acl_file);
 	if(config->auto_id_prefix) _mosquitto_free(config->auto_id_prefix);
 	if(config->clientid_prefixes) _mosquitto_free(config->clientid_prefixes);
+	if(config->client_queue_policies){
+		for(i=0; i<config->client_queue_policy_count; i++){
+			_mosquitto_free(config->client_queue_policies[i].prefix);
+		}
+		_mosquitto_free(config->client_queue_policies);
+	}
 	if(config->config_file) _mosquitto_free(config->config_file);
 	if(config->password_file) _mosquitto_free(config->password_file);
 	if(config->persistence_location) _mosquitto_free(config->persistence_location);
 	if(config->persistence_file) _mosquitto_free(config->persistence_file);
 	if(config->persistence_filepath) _mosquitto_free(config->persistence_filepath);
 	if(config->psk_file) _mosquitto_free(config->psk_file);
+	if(config->sys_topic_prefixes){
+		for(i=0; i<config->sys_topic_prefix_count; i++){
+			_mosquitto_free(config->sys_topic_prefixes[i]);
+			if(config->sys_topic_names) _mosquitto_free(config->sys_topic_names[i]);
+		}
+		_mosquitto_free(config->sys_topic_prefixes);
+	}
+	if(config->sys_topic_names){
+		_mosquitto_free(config->sys_topic_names);
+	}
 	if(config->listeners){
 		for(i=0; i<config->listener_count; i++){
 			if(config->listeners[i].host) _mosquitto_free(config->listeners[i].host);
@@ -292,6 +329,24 @@ void mqtt3_config_cleanup(struct mqtt3_config *config)
 		config->auth_options = NULL;
 		config->auth_option_count = 0;
 	}
+	if(config->publish_plugin) _mosquitto_free(config->publish_plugin);
+	if(config->publish_options){
+		for(i=0; i<config->publish_option_count; i++){
+			_mosquitto_free(config->publish_options[i].key);
+			_mosquitto_free(config->publish_options[i].value);
+		}
+		_mosquitto_free(config->publish_options);
+		config->publish_options = NULL;
+		config->publish_option_count = 0;
+	}
+	if(config->aggregates){
+		for(i=0; i<config->aggregate_count; i++){
+			_mosquitto_free(config->aggregates[i]);
+		}
+		_mosquitto_free(config->aggregates);
+		config->aggregates = NULL;
+		config->aggregate_count = 0;
+	}
 	if(config->log_fptr){
 		fclose(config->log_fptr);
 		config->log_fptr = NULL;
@@ -386,7 +441,8 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 			|| config->default_listener.host
 			|| config->default_listener.port
 			|| config->default_listener.max_connections != -1
-			|| config->default_listener.mount_point){
+			|| config->default_listener.mount_point
+			|| config->default_listener.queue_policy != qp_drop_newest){
 
 		config->listener_count++;
 		config->listeners = _mosquitto_realloc(config->listeners, sizeof(struct _mqtt3_listener)*config->listener_count);
@@ -410,6 +466,7 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 			config->listeners[config->listener_count-1].mount_point = NULL;
 		}
 		config->listeners[config->listener_count-1].max_connections = config->default_listener.max_connections;
+		config->listeners[config->listener_count-1].queue_policy = config->default_listener.queue_policy;
 		config->listeners[config->listener_count-1].client_count = 0;
 		config->listeners[config->listener_count-1].socks = NULL;
 		config->listeners[config->listener_count-1].sock_count = 0;
@@ -494,6 +551,7 @@ int mqtt3_config_read(struct mqtt3_config *config, bool reload)
 	}
 
 	mqtt3_db_limits_set(cr.max_inflight_messages, cr.max_queued_messages);
+	mqtt3_db_retry_interval_set(config->retry_interval);
 
 #ifdef WITH_BRIDGE
 	for(i=0; i<config->bridge_count; i++){
@@ -540,6 +598,7 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 	time_t expiration_mult;
 	char *key;
 	char *conf_file;
+	char *window, *pattern, *output, *aggregate;
 #ifdef WIN32
 	HANDLE fh;
 	char dirpath[MAX_PATH];
@@ -621,6 +680,34 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "aggregate")){
+					if(reload) continue; // Plugins are only loaded once.
+					window = strtok_r(NULL, " ", &saveptr);
+					pattern = strtok_r(NULL, " ", &saveptr);
+					output = strtok_r(NULL, " ", &saveptr);
+					if(!window || !pattern || !output || strtok_r(NULL, " ", &saveptr)){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid aggregate value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(atoi(window) < 1){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid aggregate window (%s).", window);
+						return MOSQ_ERR_INVAL;
+					}
+					len = strlen(window) + strlen(pattern) + strlen(output) + 3;
+					aggregate = _mosquitto_malloc(len);
+					if(!aggregate){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+						return MOSQ_ERR_NOMEM;
+					}
+					snprintf(aggregate, len, "%s %s %s", window, pattern, output);
+					config->aggregate_count++;
+					config->aggregates = _mosquitto_realloc(config->aggregates, config->aggregate_count*sizeof(char *));
+					if(!config->aggregates){
+						_mosquitto_free(aggregate);
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+						return MOSQ_ERR_NOMEM;
+					}
+					config->aggregates[config->aggregate_count-1] = aggregate;
 				}else if(!strcmp(token, "allow_anonymous")){
 					if(_conf_parse_bool(&token, "allow_anonymous", &config->allow_anonymous, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "allow_duplicate_messages")){
@@ -674,12 +761,45 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					if(config->autosave_interval < 0) config->autosave_interval = 0;
 				}else if(!strcmp(token, "autosave_on_changes")){
 					if(_conf_parse_bool(&token, "autosave_on_changes", &config->autosave_on_changes, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "autosave_fork")){
+					if(_conf_parse_bool(&token, "autosave_fork", &config->autosave_fork, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "bind_address")){
 					if(reload) continue; // Listener not valid for reloading.
 					if(_conf_parse_string(&token, "default listener bind_address", &config->default_listener.host, saveptr)) return MOSQ_ERR_INVAL;
 					if(_conf_attempt_resolve(config->default_listener.host, "bind_address", MOSQ_LOG_ERR, "Error")){
 						return MOSQ_ERR_INVAL;
 					}
+				}else if(!strcmp(token, "bridge_batch_compression")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(_conf_parse_bool(&token, "bridge_batch_compression", &cur_bridge->batch_compression, saveptr)) return MOSQ_ERR_INVAL;
+#  ifndef WITH_BRIDGE_COMPRESSION
+					if(cur_bridge->batch_compression){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge compression support not available.");
+					}
+#  endif
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_batch_interval")){
+#ifdef WITH_BRIDGE
+					if(reload) continue; // FIXME
+					if(!cur_bridge){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(_conf_parse_int(&token, "bridge_batch_interval", &cur_bridge->batch_interval, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_bridge->batch_interval < 0 || cur_bridge->batch_interval > 60000){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge_batch_interval value (%d).", cur_bridge->batch_interval);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
 				}else if(!strcmp(token, "bridge_cafile")){
 #if defined(WITH_BRIDGE) && defined(WITH_TLS)
 					if(reload) continue; // FIXME
@@ -973,6 +1093,24 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "client_queue_policy")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(!token){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty client_queue_policy value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					config->client_queue_policy_count++;
+					config->client_queue_policies = _mosquitto_realloc(config->client_queue_policies, config->client_queue_policy_count*sizeof(struct mqtt3_client_queue_policy));
+					if(!config->client_queue_policies){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+						return MOSQ_ERR_NOMEM;
+					}
+					config->client_queue_policies[config->client_queue_policy_count-1].prefix = _mosquitto_strdup(token);
+					if(!config->client_queue_policies[config->client_queue_policy_count-1].prefix){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+						return MOSQ_ERR_NOMEM;
+					}
+					if(_conf_parse_queue_policy(&token, "client_queue_policy", &config->client_queue_policies[config->client_queue_policy_count-1].policy, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "clientid_prefixes")){
 					if(reload){
 						if(config->clientid_prefixes){
@@ -1006,6 +1144,7 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						cur_bridge->restart_timeout = 30;
 						cur_bridge->threshold = 10;
 						cur_bridge->try_private = true;
+						cur_bridge->primary_probe_sock = INVALID_SOCKET;
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty connection value in configuration.");
 						return MOSQ_ERR_INVAL;
@@ -1103,6 +1242,17 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						closedir(dh);
 #endif
 					}
+				}else if(!strcmp(token, "io_threads")){
+#ifdef WITH_IO_THREADS
+					if(reload) continue; // Threads are only started once.
+					if(_conf_parse_int(&token, "io_threads", &config->io_threads, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->io_threads < 1 || config->io_threads > MQTT3_IO_THREADS_MAX){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid io_threads value (%d).", config->io_threads);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: I/O thread support not available.");
+#endif
 				}else if(!strcmp(token, "keepalive_interval")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1343,6 +1493,9 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					if(_conf_parse_bool(&token, token, &config->persistence, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_file")){
 					if(_conf_parse_string(&token, "persistence_file", &config->persistence_file, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_journal")){
+					if(reload) continue; // The journal is only opened at startup.
+					if(_conf_parse_bool(&token, "persistence_journal", &config->persistence_journal, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_location")){
 					if(_conf_parse_string(&token, "persistence_location", &config->persistence_location, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistent_client_expiration")){
@@ -1407,6 +1560,45 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS/TLS-PSK support not available.");
 #endif
+				}else if(!strncmp(token, "publish_opt_", 12)){
+					if(reload) continue; // Plugins are only loaded once.
+					if(strlen(token) < 15){
+						/* publish_opt_ == 12, + one digit key == 13, + one space == 14, + one value == 15 */
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid publish_opt_ config option.");
+						return MOSQ_ERR_INVAL;
+					}
+					key = _mosquitto_strdup(&token[12]);
+					if(!key){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory");
+						return MOSQ_ERR_NOMEM;
+					}else if(strlen(key) == 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid publish_opt_ config option.");
+						return MOSQ_ERR_INVAL;
+					}
+					token += 12+strlen(key)+1;
+					if(token[0]){
+						config->publish_option_count++;
+						config->publish_options = _mosquitto_realloc(config->publish_options, config->publish_option_count*sizeof(struct mosquitto_publish_opt));
+						if(!config->publish_options){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+						config->publish_options[config->publish_option_count-1].key = key;
+						config->publish_options[config->publish_option_count-1].value = _mosquitto_strdup(token);
+						if(!config->publish_options[config->publish_option_count-1].value){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty %s value in configuration.", key);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "publish_plugin")){
+					if(reload) continue; // Plugins are only loaded once.
+					if(_conf_parse_string(&token, "publish_plugin", &config->publish_plugin, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "queue_policy")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_queue_policy(&token, "queue_policy", &cur_listener->queue_policy, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "queue_qos0_messages")){
 					if(_conf_parse_bool(&token, token, &config->queue_qos0_messages, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "require_certificate")){
@@ -1448,6 +1640,21 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "shared_subscription_policy")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "round_robin")){
+							config->shared_subscription_policy = ssp_round_robin;
+						}else if(!strcmp(token, "topic_hash")){
+							config->shared_subscription_policy = ssp_topic_hash;
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid shared_subscription_policy value in configuration (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty shared_subscription_policy value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "start_type")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1478,17 +1685,55 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
 				}else if(!strcmp(token, "store_clean_interval")){
-					if(_conf_parse_int(&token, "store_clean_interval", &config->store_clean_interval, saveptr)) return MOSQ_ERR_INVAL;
-					if(config->store_clean_interval < 0 || config->store_clean_interval > 65535){
-						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid store_clean_interval value (%d).", config->store_clean_interval);
-						return MOSQ_ERR_INVAL;
-					}
+					/* Unreferenced messages are now freed immediately. */
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: store_clean_interval is no longer needed.");
 				}else if(!strcmp(token, "sys_interval")){
 					if(_conf_parse_int(&token, "sys_interval", &config->sys_interval, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->sys_interval < 0 || config->sys_interval > 65535){
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid sys_interval value (%d).", config->sys_interval);
 						return MOSQ_ERR_INVAL;
 					}
+				}else if(!strcmp(token, "sys_topic_prefix")){
+					if(reload) continue; // Counters are kept per prefix for the life of the broker.
+					pattern = strtok_r(NULL, " ", &saveptr);
+					output = strtok_r(NULL, " ", &saveptr);
+					if(!pattern){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty sys_topic_prefix value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(strchr(pattern, '#') || pattern[strlen(pattern)-1] == '/' || _mosquitto_topic_wildcard_pos_check(pattern) != MOSQ_ERR_SUCCESS){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid sys_topic_prefix value (%s).", pattern);
+						return MOSQ_ERR_INVAL;
+					}
+					if(output && (strpbrk(output, "+#") || output[0] == '/' || output[strlen(output)-1] == '/' || strtok_r(NULL, " ", &saveptr))){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid sys_topic_prefix name (%s).", output);
+						return MOSQ_ERR_INVAL;
+					}
+					pattern = _mosquitto_strdup(pattern);
+					/* Without a name, the counters are published under the
+					 * pattern with each + written as _. */
+					output = _mosquitto_strdup(output ? output : pattern);
+					if(!pattern || !output){
+						if(pattern) _mosquitto_free(pattern);
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+						return MOSQ_ERR_NOMEM;
+					}
+					for(key=output; *key; key++){
+						if(*key == '+') *key = '_';
+					}
+					config->sys_topic_prefixes = _mosquitto_realloc(config->sys_topic_prefixes, (config->sys_topic_prefix_count+1)*sizeof(char *));
+					if(config->sys_topic_prefixes){
+						config->sys_topic_names = _mosquitto_realloc(config->sys_topic_names, (config->sys_topic_prefix_count+1)*sizeof(char *));
+					}
+					if(!config->sys_topic_prefixes || !config->sys_topic_names){
+						_mosquitto_free(pattern);
+						_mosquitto_free(output);
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+						return MOSQ_ERR_NOMEM;
+					}
+					config->sys_topic_prefixes[config->sys_topic_prefix_count] = pattern;
+					config->sys_topic_names[config->sys_topic_prefix_count] = output;
+					config->sys_topic_prefix_count++;
 				}else if(!strcmp(token, "threshold")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1773,3 +2018,25 @@ static int _conf_parse_string(char **token, const char *name, char **value, char
 	}
 	return MOSQ_ERR_SUCCESS;
 }
+
+static int _conf_parse_queue_policy(char **token, const char *name, enum mqtt3_queue_policy *value, char *saveptr)
+{
+	*token = strtok_r(NULL, " ", &saveptr);
+	if(*token){
+		if(!strcmp(*token, "drop_newest")){
+			*value = qp_drop_newest;
+		}else if(!strcmp(*token, "drop_oldest")){
+			*value = qp_drop_oldest;
+		}else if(!strcmp(*token, "conflate")){
+			*value = qp_conflate;
+		}else{
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid %s value in configuration (%s).", name, *token);
+			return MOSQ_ERR_INVAL;
+		}
+	}else{
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty %s value in configuration.", name);
+		return MOSQ_ERR_INVAL;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
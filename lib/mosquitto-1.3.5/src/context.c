@@ -37,6 +37,10 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "uthash.h"
 
+#ifdef WITH_SYS_TREE
+extern int g_clients_expired;
+#endif
+
 struct mosquitto *mqtt3_context_init(int sock)
 {
 	struct mosquitto *context;
@@ -59,6 +63,10 @@ struct mosquitto *mqtt3_context_init(int sock)
 	context->password = NULL;
 	context->listener = NULL;
 	context->acl_list = NULL;
+	context->acl_expanded = NULL;
+	context->acl_cache = NULL;
+	context->acl_cache_hand = NULL;
+	context->acl_cache_count = 0;
 	/* is_bridge records whether this client is a bridge or not. This could be
 	 * done by looking at context->bridge for bridges that we create ourself,
 	 * but incoming bridges need some other way of being recorded. */
@@ -85,9 +93,20 @@ struct mosquitto *mqtt3_context_init(int sock)
 	context->last_msg = NULL;
 	context->msg_count = 0;
 	context->msg_count12 = 0;
+	context->queue_policy = qp_drop_newest;
+	context->msg_topics = NULL;
 #ifdef WITH_TLS
 	context->ssl = NULL;
 #endif
+	mqtt3_timer_init(&context->keepalive_timer, context, mosq_tt_keepalive);
+	mqtt3_timer_init(&context->retry_timer, context, mosq_tt_retry);
+	mqtt3_timer_init(&context->expire_timer, context, mosq_tt_expire);
+	mqtt3_timer_init(&context->bridge_timer, context, mosq_tt_bridge);
+	if(sock != -1){
+		/* Clients that never send CONNECT are timed out using the default
+		 * keepalive. */
+		mqtt3_timer_add(&context->keepalive_timer, context->last_msg_in + (time_t)(context->keepalive)*3/2);
+	}
 
 	return context;
 }
@@ -101,11 +120,15 @@ struct mosquitto *mqtt3_context_init(int sock)
 void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, bool do_free)
 {
 	struct _mosquitto_packet *packet;
-	struct mosquitto_client_msg *msg, *next;
 	struct _clientid_index_hash *find_cih;
 
 	if(!context) return;
 
+	mqtt3_timer_remove(&context->keepalive_timer);
+	mqtt3_timer_remove(&context->retry_timer);
+	mqtt3_timer_remove(&context->expire_timer);
+	mqtt3_timer_remove(&context->bridge_timer);
+
 	if(context->username){
 		_mosquitto_free(context->username);
 		context->username = NULL;
@@ -122,6 +145,7 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		if(context->bridge->password){
 			context->bridge->password = NULL;
 		}
+		mqtt3_bridge_cleanup(context);
 	}
 #endif
 #ifdef WITH_TLS
@@ -140,7 +164,7 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 	}
 	if(context->clean_session && db){
 		mqtt3_subs_clean_session(db, context, &db->subs);
-		mqtt3_db_messages_delete(context);
+		mqtt3_db_messages_delete(db, context);
 	}
 	if(context->address){
 		_mosquitto_free(context->address);
@@ -162,6 +186,7 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		_mosquitto_free(context->id);
 		context->id = NULL;
 	}
+	mosquitto_acl_context_cleanup_default(context);
 	_mosquitto_packet_cleanup(&(context->in_packet));
 	_mosquitto_packet_cleanup(context->current_out_packet);
 	context->current_out_packet = NULL;
@@ -178,15 +203,7 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		context->will = NULL;
 	}
 	if(do_free || context->clean_session){
-		msg = context->msgs;
-		while(msg){
-			next = msg->next;
-			msg->store->ref_count--;
-			_mosquitto_free(msg);
-			msg = next;
-		}
-		context->msgs = NULL;
-		context->last_msg = NULL;
+		mqtt3_db_messages_delete(db, context);
 	}
 	if(do_free){
 		_mosquitto_free(context);
@@ -211,6 +228,119 @@ void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *ctxt)
 		ctxt->listener = NULL;
 	}
 	ctxt->disconnect_t = mosquitto_time();
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_journal_client(db, ctxt);
+#endif
 	_mosquitto_socket_close(ctxt);
+	mqtt3_timer_remove(&ctxt->keepalive_timer);
+	mqtt3_context_expiry_schedule(db, ctxt);
+}
+
+/* Called from the keepalive timer. Disconnects the client if it has exceeded
+ * keepalive*1.5, otherwise reschedules based on the last message received. */
+void mqtt3_context_keepalive_check(struct mosquitto_db *db, struct mosquitto *context, time_t now)
+{
+	time_t deadline;
+
+	/* Local bridges never time out in this fashion. */
+	if(context->sock == INVALID_SOCKET || !context->keepalive || context->bridge){
+		return;
+	}
+
+	deadline = context->last_msg_in + (time_t)(context->keepalive)*3/2;
+	if(now < deadline){
+		mqtt3_timer_add(&context->keepalive_timer, deadline);
+		return;
+	}
+
+	if(db->config->connection_messages == true){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client %s has exceeded timeout, disconnecting.", context->id);
+	}
+	/* Client has exceeded keepalive*1.5 */
+	mqtt3_context_disconnect(db, context);
+}
+
+/* Schedule expiry of a disconnected persistent client, if
+ * persistent_client_expiration is set. */
+void mqtt3_context_expiry_schedule(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(context->clean_session || context->bridge || db->config->persistent_client_expiration <= 0){
+		mqtt3_timer_remove(&context->expire_timer);
+		return;
+	}
+	mqtt3_timer_add(&context->expire_timer, context->disconnect_t+db->config->persistent_client_expiration+1);
 }
 
+/* Called from the expiry timer. If this is a persistent client and the last
+ * time it connected was longer than persistent_client_expiration seconds ago,
+ * expire it and clean up. */
+void mqtt3_context_expiry_check(struct mosquitto_db *db, struct mosquitto *context, time_t now)
+{
+	if(context->sock != INVALID_SOCKET || context->clean_session || context->bridge
+			|| db->config->persistent_client_expiration <= 0){
+		return;
+	}
+
+	if(now > context->disconnect_t+db->config->persistent_client_expiration){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Expiring persistent client %s due to timeout.", context->id);
+#ifdef WITH_SYS_TREE
+		g_clients_expired++;
+#endif
+		assert(db->contexts[context->db_index] == context);
+#ifdef WITH_PERSISTENCE
+		mqtt3_db_journal_client_delete(db, context);
+#endif
+		context->clean_session = true;
+		mqtt3_context_slot_remove(db, context);
+		mqtt3_context_cleanup(db, context, true);
+	}else{
+		mqtt3_context_expiry_schedule(db, context);
+	}
+}
+
+/* Place a context in db->contexts, reusing a free slot if there is one and
+ * otherwise growing the array geometrically, so that a storm of new
+ * connections is handled in linear time. */
+int mqtt3_context_slot_add(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto **tmp_contexts;
+	int *tmp_free;
+	int alloc;
+	int i;
+
+	if(db->context_free_count > 0){
+		db->context_free_count--;
+		i = db->context_free[db->context_free_count];
+	}else{
+		if(db->context_count == db->context_alloc){
+			alloc = db->context_alloc ? db->context_alloc*2 : 64;
+			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto *)*alloc);
+			if(!tmp_contexts) return MOSQ_ERR_NOMEM;
+			db->contexts = tmp_contexts;
+			tmp_free = _mosquitto_realloc(db->context_free, sizeof(int)*alloc);
+			if(!tmp_free) return MOSQ_ERR_NOMEM;
+			db->context_free = tmp_free;
+			db->context_alloc = alloc;
+		}
+		i = db->context_count;
+		db->context_count++;
+	}
+	db->contexts[i] = context;
+	context->db_index = i;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Remove a context from db->contexts and make its slot available for reuse.
+ * This does not free the context. */
+void mqtt3_context_slot_remove(struct mosquitto_db *db, struct mosquitto *context)
+{
+	int i = context->db_index;
+
+	if(i < 0 || i >= db->context_count || db->contexts[i] != context) return;
+
+	db->contexts[i] = NULL;
+	db->context_free[db->context_free_count] = i;
+	db->context_free_count++;
+	context->db_index = -1;
+}
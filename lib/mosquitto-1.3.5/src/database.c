@@ -29,18 +29,23 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <config.h>
 
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
+#include <net_mosq.h>
 #include <send_mosq.h>
 #include <time_mosq.h>
 
 static int max_inflight = 20;
 static int max_queued = 100;
+static int retry_interval = 20;
 #ifdef WITH_SYS_TREE
 extern unsigned long g_msgs_dropped;
+extern unsigned long g_msgs_dropped_oldest;
+extern unsigned long g_msgs_conflated;
 #endif
 
 int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
@@ -52,15 +57,17 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 
 	db->last_db_id = 0;
 
-	db->context_count = 1;
-	db->contexts = _mosquitto_malloc(sizeof(struct mosquitto*)*db->context_count);
-	if(!db->contexts) return MOSQ_ERR_NOMEM;
-	db->contexts[0] = NULL;
+	db->contexts = NULL;
+	db->context_count = 0;
+	db->context_alloc = 0;
+	db->context_free = NULL;
+	db->context_free_count = 0;
 	// Initialize the hashtable
 	db->clientid_index_hash = NULL;
 
 	db->subs.next = NULL;
 	db->subs.subs = NULL;
+	db->subs.shared = NULL;
 	db->subs.topic = "";
 
 	child = _mosquitto_malloc(sizeof(struct _mosquitto_subhier));
@@ -74,9 +81,11 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
 	}
+	child->topic_len = 0;
+	child->hash = mqtt3_topic_level_hash("", 0);
 	child->subs = NULL;
+	child->shared = NULL;
 	child->children = NULL;
-	child->retained = NULL;
 	db->subs.children = child;
 
 	child = _mosquitto_malloc(sizeof(struct _mosquitto_subhier));
@@ -90,39 +99,58 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
 	}
+	child->topic_len = 4;
+	child->hash = mqtt3_topic_level_hash("$SYS", 4);
 	child->subs = NULL;
+	child->shared = NULL;
 	child->children = NULL;
-	child->retained = NULL;
 	db->subs.children->next = child;
 
+	memset(&db->retains, 0, sizeof(struct _mosquitto_retainhier));
+	db->retained_count = 0;
+
 	db->unpwd = NULL;
 
 #ifdef WITH_PERSISTENCE
 	if(config->persistence && config->persistence_filepath){
 		if(mqtt3_db_restore(db)) return 1;
+		if(config->persistence_journal){
+			if(mqtt3_db_journal_open(db)) return 1;
+		}
 	}
 #endif
 
 	return rc;
 }
 
-static void subhier_clean(struct _mosquitto_subhier *subhier)
+static void subleaf_clean(struct _mosquitto_subleaf *leaf)
+{
+	struct _mosquitto_subleaf *nextleaf;
+
+	while(leaf){
+		nextleaf = leaf->next;
+		_mosquitto_free(leaf);
+		leaf = nextleaf;
+	}
+}
+
+static void subhier_clean(struct mosquitto_db *db, struct _mosquitto_subhier *subhier)
 {
 	struct _mosquitto_subhier *next;
-	struct _mosquitto_subleaf *leaf, *nextleaf;
+	struct _mosquitto_subshared *shared, *nextshared;
 
 	while(subhier){
 		next = subhier->next;
-		leaf = subhier->subs;
-		while(leaf){
-			nextleaf = leaf->next;
-			_mosquitto_free(leaf);
-			leaf = nextleaf;
+		subleaf_clean(subhier->subs);
+		shared = subhier->shared;
+		while(shared){
+			nextshared = shared->next;
+			subleaf_clean(shared->subs);
+			_mosquitto_free(shared->name);
+			_mosquitto_free(shared);
+			shared = nextshared;
 		}
-		if(subhier->retained){
-			subhier->retained->ref_count--;
-		}
-		subhier_clean(subhier->children);
+		subhier_clean(db, subhier->children);
 		if(subhier->topic) _mosquitto_free(subhier->topic);
 
 		_mosquitto_free(subhier);
@@ -132,8 +160,11 @@ static void subhier_clean(struct _mosquitto_subhier *subhier)
 
 int mqtt3_db_close(struct mosquitto_db *db)
 {
-	subhier_clean(db->subs.children);
+	subhier_clean(db, db->subs.children);
+	mqtt3_retain_clean(db);
 	mqtt3_db_store_clean(db);
+	mqtt3_topic_cleanup();
+	mqtt3_pool_cleanup();
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -163,14 +194,54 @@ int mqtt3_db_client_count(struct mosquitto_db *db, unsigned int *count, unsigned
 	return MOSQ_ERR_SUCCESS;
 }
 
-static void _message_remove(struct mosquitto *context, struct mosquitto_client_msg **msg, struct mosquitto_client_msg *last)
+/* Drop the index entry for msg, if it is the one its topic points to. */
+static void _message_topic_remove(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	struct _mosquitto_msg_topic *entry;
+
+	if(!context->msg_topics || msg->direction != mosq_md_out || !msg->store->topic){
+		return;
+	}
+	HASH_FIND_PTR(context->msg_topics, &msg->store->topic, entry);
+	if(entry && entry->msg == msg){
+		HASH_DELETE(hh, context->msg_topics, entry);
+		mqtt3_pool_free(entry, sizeof(struct _mosquitto_msg_topic));
+	}
+}
+
+/* Point the index entry for the topic of msg at msg, which is the newest
+ * outgoing message on that topic. */
+static int _message_topic_add(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	struct _mosquitto_msg_topic *entry;
+	struct _mosquitto_topic *topic = msg->store->topic;
+
+	if(!topic) return MOSQ_ERR_SUCCESS;
+
+	HASH_FIND_PTR(context->msg_topics, &topic, entry);
+	if(!entry){
+		entry = mqtt3_pool_alloc(sizeof(struct _mosquitto_msg_topic));
+		if(!entry) return MOSQ_ERR_NOMEM;
+		entry->topic = topic;
+		HASH_ADD_PTR(context->msg_topics, topic, entry);
+	}
+	entry->msg = msg;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Remove msg, which follows last in the client's list (or is first if last
+ * is NULL), and move msg on to the message after it. */
+void mqtt3_db_message_remove(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg **msg, struct mosquitto_client_msg *last)
 {
 	if(!context || !msg || !(*msg)){
 		return;
 	}
 
-	/* FIXME - it would be nice to be able to remove the stored message here if ref_count==0 */
-	(*msg)->store->ref_count--;
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_journal_client_msg_delete(db, context, *msg);
+#endif
+	_message_topic_remove(context, *msg);
+	mqtt3_db_msg_store_deref(db, &(*msg)->store);
 	if(last){
 		last->next = (*msg)->next;
 		if(!last->next){
@@ -186,7 +257,7 @@ static void _message_remove(struct mosquitto *context, struct mosquitto_client_m
 	if((*msg)->qos > 0){
 		context->msg_count12--;
 	}
-	_mosquitto_free(*msg);
+	mqtt3_pool_free(*msg, sizeof(struct mosquitto_client_msg));
 	if(last){
 		*msg = last->next;
 	}else{
@@ -194,7 +265,142 @@ static void _message_remove(struct mosquitto *context, struct mosquitto_client_m
 	}
 }
 
-int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
+static bool _message_waiting(struct mosquitto_client_msg *msg)
+{
+	switch(msg->state){
+		case mosq_ms_wait_for_puback:
+		case mosq_ms_wait_for_pubrec:
+		case mosq_ms_wait_for_pubrel:
+		case mosq_ms_wait_for_pubcomp:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/* Make sure the retry timer for context will fire no later than the retry
+ * deadline of msg. Timestamps only ever move forwards, so a timer that is
+ * already pending is never later than this one would be. */
+static void _message_retry_arm(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	if(_message_waiting(msg) && !mqtt3_timer_pending(&context->retry_timer)){
+		mqtt3_timer_add(&context->retry_timer, msg->timestamp + retry_interval + 1);
+	}
+}
+
+/* Outgoing messages that haven't been passed to the network yet. Only these
+ * can be dropped or replaced by the queue policies. */
+static bool _message_unsent(struct mosquitto_client_msg *msg)
+{
+	return msg->direction == mosq_md_out
+		&& (msg->state == mosq_ms_queued || msg->state == mosq_ms_publish_qos0);
+}
+
+/* Whether a new message of this QoS would overflow the client's queue.
+ * Connected clients get QoS 0 messages straight away unless their last write
+ * filled the socket and they have a drop_oldest or conflate policy, in which
+ * case they wait in the queue too; see _messages_write(). Under the default
+ * policy QoS 0 messages for connected clients are never limited. */
+static bool _message_queue_full(struct mosquitto *context, int qos)
+{
+	if(max_queued == 0){
+		return false;
+	}else if(context->sock == INVALID_SOCKET){
+		return context->msg_count12 >= max_queued;
+	}else if(qos == 0){
+		return context->queue_policy != qp_drop_newest
+			&& context->current_out_packet
+			&& context->msg_count - context->msg_count12 >= max_queued;
+	}else{
+		return max_inflight > 0 && context->msg_count12 - max_inflight >= max_queued;
+	}
+}
+
+/* Make room for a new message of this QoS by removing the oldest unsent one
+ * that counts against the same limit. Returns false if there is none. */
+static bool _message_drop_oldest(struct mosquitto_db *db, struct mosquitto *context, int qos)
+{
+	struct mosquitto_client_msg *tail, *last = NULL;
+	bool qos12 = context->sock == INVALID_SOCKET || qos > 0;
+
+	tail = context->msgs;
+	while(tail){
+		if(_message_unsent(tail) && (tail->qos > 0) == qos12){
+			mqtt3_db_message_remove(db, context, &tail, last);
+			return true;
+		}
+		last = tail;
+		tail = tail->next;
+	}
+	return false;
+}
+
+/* For the conflate policy: if the newest outgoing message on the topic of
+ * stored hasn't been sent yet and has the same QoS, make it carry stored
+ * instead. The message keeps its place in the queue. */
+static bool _message_conflate(struct mosquitto_db *db, struct mosquitto *context, int qos, bool retain, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_msg_topic *entry;
+	struct mosquitto_client_msg *msg;
+
+	if(!context->msg_topics || !stored->topic) return false;
+
+	HASH_FIND_PTR(context->msg_topics, &stored->topic, entry);
+	if(!entry) return false;
+	msg = entry->msg;
+	if(msg->qos != qos || !_message_unsent(msg)) return false;
+
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_journal_client_msg_delete(db, context, msg);
+	if(msg->state == mosq_ms_queued){
+		db->persistence_changes++;
+	}
+#endif
+	stored->ref_count++;
+	mqtt3_db_msg_store_deref(db, &msg->store);
+	msg->store = stored;
+	msg->retain = retain;
+	msg->timestamp = mosquitto_time();
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_journal_client_msg(db, context, msg);
+#endif
+	return true;
+}
+
+static void _message_dropping(struct mosquitto *context)
+{
+	if(context->is_dropping == false){
+		context->is_dropping = true;
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE,
+				"Outgoing messages are being dropped for client %s.",
+				context->id);
+	}
+}
+
+/* Record which client ids this message has been sent to so we can avoid
+ * duplicates. */
+static int _message_dest_id_add(struct mosquitto *context, struct mosquitto_msg_store *stored)
+{
+	char **dest_ids;
+
+	/* The array grows in powers of two so that a message going to many
+	 * clients doesn't need a realloc() for every one of them. */
+	if(stored->dest_id_count == 0 || (stored->dest_id_count >= 4 && !(stored->dest_id_count & (stored->dest_id_count-1)))){
+		dest_ids = _mosquitto_realloc(stored->dest_ids, sizeof(char *)*(stored->dest_id_count?stored->dest_id_count*2:4));
+		if(!dest_ids){
+			return MOSQ_ERR_NOMEM;
+		}
+		stored->dest_ids = dest_ids;
+	}
+	stored->dest_ids[stored->dest_id_count] = mqtt3_pool_strdup(context->id);
+	if(!stored->dest_ids[stored->dest_id_count]){
+		return MOSQ_ERR_NOMEM;
+	}
+	stored->dest_id_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_db_message_delete(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
 {
 	struct mosquitto_client_msg *tail, *last = NULL;
 	int msg_index = 0;
@@ -222,12 +428,13 @@ int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosqui
 			}else{
 				if(tail->qos == 2){
 					tail->state = mosq_ms_wait_for_pubrel;
+					_message_retry_arm(context, tail);
 				}
 			}
 		}
 		if(tail->mid == mid && tail->direction == dir){
 			msg_index--;
-			_message_remove(context, &tail, last);
+			mqtt3_db_message_remove(db, context, &tail, last);
 			deleted = true;
 		}else{
 			last = tail;
@@ -247,7 +454,6 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	enum mosquitto_msg_state state = mosq_ms_invalid;
 	int rc = 0;
 	int i;
-	char **dest_ids;
 
 	assert(stored);
 	if(!context) return MOSQ_ERR_INVAL;
@@ -282,6 +488,33 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 		}
 	}
 
+	if(dir == mosq_md_out && context->queue_policy == qp_conflate
+			&& _message_conflate(db, context, qos, retain, stored)){
+
+#ifdef WITH_SYS_TREE
+		g_msgs_conflated++;
+#endif
+		if(db->config->allow_duplicate_messages == false && retain == false){
+			return _message_dest_id_add(context, stored);
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(_message_queue_full(context, qos)){
+		_message_dropping(context);
+#ifdef WITH_SYS_TREE
+		g_msgs_dropped++;
+#endif
+		if(dir == mosq_md_in || context->queue_policy == qp_drop_newest
+				|| !_message_drop_oldest(db, context, qos)){
+
+			/* Dropping message due to full queue. */
+			return 2;
+		}
+#ifdef WITH_SYS_TREE
+		g_msgs_dropped_oldest++;
+#endif
+	}
+
 	if(context->sock != INVALID_SOCKET){
 		if(qos == 0 || max_inflight == 0 || context->msg_count12 < max_inflight){
 			if(dir == mosq_md_out){
@@ -303,37 +536,12 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 					return 1;
 				}
 			}
-		}else if(max_queued == 0 || context->msg_count12-max_inflight < max_queued){
+		}else{
 			state = mosq_ms_queued;
 			rc = 2;
-		}else{
-			/* Dropping message due to full queue. */
-			if(context->is_dropping == false){
-				context->is_dropping = true;
-				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE,
-						"Outgoing messages are being dropped for client %s.",
-						context->id);
-			}
-#ifdef WITH_SYS_TREE
-			g_msgs_dropped++;
-#endif
-			return 2;
 		}
 	}else{
-		if(max_queued > 0 && context->msg_count12 >= max_queued){
-#ifdef WITH_SYS_TREE
-			g_msgs_dropped++;
-#endif
-			if(context->is_dropping == false){
-				context->is_dropping = true;
-				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE,
-						"Outgoing messages are being dropped for client %s.",
-						context->id);
-			}
-			return 2;
-		}else{
-			state = mosq_ms_queued;
-		}
+		state = mosq_ms_queued;
 	}
 	assert(state != mosq_ms_invalid);
 
@@ -343,7 +551,7 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	}
 #endif
 
-	msg = _mosquitto_malloc(sizeof(struct mosquitto_client_msg));
+	msg = mqtt3_pool_alloc(sizeof(struct mosquitto_client_msg));
 	if(!msg) return MOSQ_ERR_NOMEM;
 	msg->next = NULL;
 	msg->store = stored;
@@ -366,24 +574,24 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	if(qos > 0){
 		context->msg_count12++;
 	}
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_journal_client_msg(db, context, msg);
+#endif
+	_message_retry_arm(context, msg);
+	if(dir == mosq_md_out && context->queue_policy == qp_conflate){
+		if(_message_topic_add(context, msg)){
+			return MOSQ_ERR_NOMEM;
+		}
+	}
 
 	if(db->config->allow_duplicate_messages == false && dir == mosq_md_out && retain == false){
-		/* Record which client ids this message has been sent to so we can avoid duplicates.
-		 * Outgoing messages only.
+		/* Outgoing messages only.
 		 * If retain==true then this is a stale retained message and so should be
 		 * sent regardless. FIXME - this does mean retained messages will received
 		 * multiple times for overlapping subscriptions, although this is only the
 		 * case for SUBSCRIPTION with multiple subs in so is a minor concern.
 		 */
-		dest_ids = _mosquitto_realloc(stored->dest_ids, sizeof(char *)*(stored->dest_id_count+1));
-		if(dest_ids){
-			stored->dest_ids = dest_ids;
-			stored->dest_id_count++;
-			stored->dest_ids[stored->dest_id_count-1] = _mosquitto_strdup(context->id);
-			if(!stored->dest_ids[stored->dest_id_count-1]){
-				return MOSQ_ERR_NOMEM;
-			}
-		}else{
+		if(_message_dest_id_add(context, stored)){
 			return MOSQ_ERR_NOMEM;
 		}
 	}
@@ -399,7 +607,7 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	return rc;
 }
 
-int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, enum mosquitto_msg_state state)
+int mqtt3_db_message_update(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, enum mosquitto_msg_state state)
 {
 	struct mosquitto_client_msg *tail;
 
@@ -408,6 +616,10 @@ int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosqui
 		if(tail->mid == mid && tail->direction == dir){
 			tail->state = state;
 			tail->timestamp = mosquitto_time();
+			_message_retry_arm(context, tail);
+#ifdef WITH_PERSISTENCE
+			mqtt3_db_journal_client_msg_update(db, context, tail);
+#endif
 			return MOSQ_ERR_SUCCESS;
 		}
 		tail = tail->next;
@@ -415,18 +627,22 @@ int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosqui
 	return 1;
 }
 
-int mqtt3_db_messages_delete(struct mosquitto *context)
+int mqtt3_db_messages_delete(struct mosquitto_db *db, struct mosquitto *context)
 {
 	struct mosquitto_client_msg *tail, *next;
+	struct _mosquitto_msg_topic *entry, *entry_tmp;
 
 	if(!context) return MOSQ_ERR_INVAL;
 
+	HASH_ITER(hh, context->msg_topics, entry, entry_tmp){
+		HASH_DELETE(hh, context->msg_topics, entry);
+		mqtt3_pool_free(entry, sizeof(struct _mosquitto_msg_topic));
+	}
 	tail = context->msgs;
 	while(tail){
-		/* FIXME - it would be nice to be able to remove the stored message here if rec_count==0 */
-		tail->store->ref_count--;
+		mqtt3_db_msg_store_deref(db, &tail->store);
 		next = tail->next;
-		_mosquitto_free(tail);
+		mqtt3_pool_free(tail, sizeof(struct mosquitto_client_msg));
 		tail = next;
 	}
 	context->msgs = NULL;
@@ -441,6 +657,7 @@ int mqtt3_db_messages_easy_queue(struct mosquitto_db *db, struct mosquitto *cont
 {
 	struct mosquitto_msg_store *stored;
 	char *source_id;
+	int rc;
 
 	assert(db);
 
@@ -453,7 +670,13 @@ int mqtt3_db_messages_easy_queue(struct mosquitto_db *db, struct mosquitto *cont
 	}
 	if(mqtt3_db_message_store(db, source_id, 0, topic, qos, payloadlen, payload, retain, &stored, 0)) return 1;
 
-	return mqtt3_db_messages_queue(db, source_id, topic, qos, retain, stored);
+	/* Hold a reference while queueing so the message is freed straight away
+	 * if nobody ends up with a copy. */
+	stored->ref_count++;
+	rc = mqtt3_db_messages_queue(db, source_id, topic, qos, retain, stored);
+	mqtt3_db_msg_store_deref(db, &stored);
+
+	return rc;
 }
 
 int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t source_mid, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain, struct mosquitto_msg_store **stored, dbid_t store_id)
@@ -463,18 +686,17 @@ int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t
 	assert(db);
 	assert(stored);
 
-	temp = _mosquitto_malloc(sizeof(struct mosquitto_msg_store));
+	temp = mqtt3_pool_alloc(sizeof(struct mosquitto_msg_store));
 	if(!temp) return MOSQ_ERR_NOMEM;
 
-	temp->next = db->msg_store;
 	temp->ref_count = 0;
 	if(source){
-		temp->source_id = _mosquitto_strdup(source);
+		temp->source_id = mqtt3_pool_strdup(source);
 	}else{
-		temp->source_id = _mosquitto_strdup("");
+		temp->source_id = mqtt3_pool_strdup("");
 	}
 	if(!temp->source_id){
-		_mosquitto_free(temp);
+		mqtt3_pool_free(temp, sizeof(struct mosquitto_msg_store));
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
 	}
@@ -483,42 +705,46 @@ int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t
 	temp->msg.qos = qos;
 	temp->msg.retain = retain;
 	if(topic){
-		temp->msg.topic = _mosquitto_strdup(topic);
-		if(!temp->msg.topic){
-			_mosquitto_free(temp->source_id);
-			_mosquitto_free(temp);
+		temp->topic = mqtt3_topic_intern(topic);
+		if(!temp->topic){
+			mqtt3_pool_strfree(temp->source_id);
+			mqtt3_pool_free(temp, sizeof(struct mosquitto_msg_store));
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
+		temp->msg.topic = temp->topic->topic;
 	}else{
+		temp->topic = NULL;
 		temp->msg.topic = NULL;
 	}
 	temp->msg.payloadlen = payloadlen;
-	if(payloadlen){
+	if(payloadlen <= MQTT3_STORE_INLINE_PAYLOAD){
+		temp->msg.payload = payloadlen?temp->payload_inline:NULL;
+	}else{
 		temp->msg.payload = _mosquitto_malloc(sizeof(char)*payloadlen);
 		if(!temp->msg.payload){
-			if(temp->source_id) _mosquitto_free(temp->source_id);
-			if(temp->msg.topic) _mosquitto_free(temp->msg.topic);
-			if(temp->msg.payload) _mosquitto_free(temp->msg.payload);
-			_mosquitto_free(temp);
+			mqtt3_pool_strfree(temp->source_id);
+			mqtt3_topic_release(temp->topic);
+			mqtt3_pool_free(temp, sizeof(struct mosquitto_msg_store));
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
-		memcpy(temp->msg.payload, payload, sizeof(char)*payloadlen);
-	}else{
-		temp->msg.payload = NULL;
 	}
-
-	if(!temp->source_id || (payloadlen && !temp->msg.payload)){
-		if(temp->source_id) _mosquitto_free(temp->source_id);
-		if(temp->msg.topic) _mosquitto_free(temp->msg.topic);
-		if(temp->msg.payload) _mosquitto_free(temp->msg.payload);
-		_mosquitto_free(temp);
-		return 1;
+	if(payloadlen){
+		memcpy(temp->msg.payload, payload, sizeof(char)*payloadlen);
 	}
 	temp->dest_ids = NULL;
 	temp->dest_id_count = 0;
-	db->msg_store_count++;
+	temp->qos0_packet = NULL;
+	temp->journaled = false;
+	temp->enqueued_us = 0;
+	temp->prev = NULL;
+	temp->next = db->msg_store;
+	if(db->msg_store){
+		db->msg_store->prev = temp;
+	}
 	db->msg_store = temp;
+	db->msg_store_count++;
 	(*stored) = temp;
 
 	if(!store_id){
@@ -551,7 +777,7 @@ int mqtt3_db_message_store_find(struct mosquitto *context, uint16_t mid, struct
 
 /* Called on reconnect to set outgoing messages to a sensible state and force a
  * retry, and to set incoming messages to expect an appropriate retry. */
-int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
+int mqtt3_db_message_reconnect_reset(struct mosquitto_db *db, struct mosquitto *context)
 {
 	struct mosquitto_client_msg *msg;
 	struct mosquitto_client_msg *prev = NULL;
@@ -590,10 +816,11 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
 			if(msg->qos != 2){
 				/* Anything <QoS 2 can be completely retried by the client at
 				 * no harm. */
-				_message_remove(context, &msg, prev);
+				mqtt3_db_message_remove(db, context, &msg, prev);
 			}else{
 				/* Message state can be preserved here because it should match
 				 * whatever the client has got. */
+				_message_retry_arm(context, msg);
 			}
 		}
 		prev = msg;
@@ -630,24 +857,20 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
 	return MOSQ_ERR_SUCCESS;
 }
 
-int mqtt3_db_message_timeout_check(struct mosquitto_db *db, unsigned int timeout)
+void mqtt3_db_message_timeout_check(struct mosquitto_db *db, struct mosquitto *context, time_t now)
 {
-	int i;
 	time_t threshold;
+	time_t next = 0;
 	enum mosquitto_msg_state new_state;
-	struct mosquitto *context;
 	struct mosquitto_client_msg *msg;
 
-	threshold = mosquitto_time() - timeout;
-	
-	for(i=0; i<db->context_count; i++){
-		context = db->contexts[i];
-		if(!context) continue;
+	threshold = now - db->config->retry_interval;
 
-		msg = context->msgs;
-		while(msg){
-			new_state = mosq_ms_invalid;
-			if(msg->timestamp < threshold && msg->state != mosq_ms_queued){
+	msg = context->msgs;
+	while(msg){
+		if(_message_waiting(msg)){
+			if(msg->timestamp < threshold){
+				new_state = mosq_ms_invalid;
 				switch(msg->state){
 					case mosq_ms_wait_for_puback:
 						new_state = mosq_ms_publish_qos1;
@@ -664,17 +887,18 @@ int mqtt3_db_message_timeout_check(struct mosquitto_db *db, unsigned int timeout
 					default:
 						break;
 				}
-				if(new_state != mosq_ms_invalid){
-					msg->timestamp = mosquitto_time();
-					msg->state = new_state;
-					msg->dup = true;
-				}
+				msg->timestamp = now;
+				msg->state = new_state;
+				msg->dup = true;
+			}else if(!next || msg->timestamp + db->config->retry_interval + 1 < next){
+				next = msg->timestamp + db->config->retry_interval + 1;
 			}
-			msg = msg->next;
 		}
+		msg = msg->next;
+	}
+	if(next){
+		mqtt3_timer_add(&context->retry_timer, next);
 	}
-
-	return MOSQ_ERR_SUCCESS;
 }
 
 int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
@@ -710,6 +934,7 @@ int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context,
 				if(tail->qos == 2){
 					_mosquitto_send_pubrec(context, tail->mid);
 					tail->state = mosq_ms_wait_for_pubrel;
+					_message_retry_arm(context, tail);
 				}
 			}
 		}
@@ -724,7 +949,12 @@ int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context,
 			 * keep resending it. That means we don't send it to other
 			 * clients. */
 			if(!topic || !mqtt3_db_messages_queue(db, source_id, topic, qos, retain, tail->store)){
-				_message_remove(context, &tail, last);
+#ifdef WITH_SYS_TREE
+				if(topic && db->config->sys_interval){
+					tail->store->enqueued_us = mosquitto_time_us();
+				}
+#endif
+				mqtt3_db_message_remove(db, context, &tail, last);
 				deleted = true;
 			}else{
 				return 1;
@@ -744,7 +974,19 @@ int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context,
 	}
 }
 
-int mqtt3_db_message_write(struct mosquitto *context)
+#ifdef WITH_SYS_TREE
+/* Mark the PUBLISH just queued for msg with the time its message was queued
+ * to subscribers, so the wait to be written can be measured. Retained and
+ * resent messages are left out as that wait isn't the broker's doing. */
+static void _message_packet_stamp(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	if(msg->store->enqueued_us && !msg->retain && !msg->dup && context->out_packet_last){
+		context->out_packet_last->enqueued_us = msg->store->enqueued_us;
+	}
+}
+#endif
+
+static int _messages_write(struct mosquitto_db *db, struct mosquitto *context)
 {
 	int rc;
 	struct mosquitto_client_msg *tail, *last = NULL;
@@ -756,18 +998,21 @@ int mqtt3_db_message_write(struct mosquitto *context)
 	uint32_t payloadlen;
 	const void *payload;
 	int msg_count = 0;
-
-	if(!context || context->sock == -1
-			|| (context->state == mosq_cs_connected && !context->id)){
-		return MOSQ_ERR_INVAL;
-	}
+	/* The socket filled up last time, so leave QoS 0 messages queued, where
+	 * a drop_oldest or conflate policy applies to them, until it has
+	 * drained. */
+	bool backlogged = context->queue_policy != qp_drop_newest
+		&& context->current_out_packet != NULL;
 
 	tail = context->msgs;
 	while(tail){
 		if(tail->direction == mosq_md_in){
 			msg_count++;
 		}
-		if(tail->state != mosq_ms_queued){
+		if(tail->state == mosq_ms_publish_qos0 && backlogged){
+			last = tail;
+			tail = tail->next;
+		}else if(tail->state != mosq_ms_queued){
 			mid = tail->mid;
 			retries = tail->dup;
 			retain = tail->retain;
@@ -778,9 +1023,24 @@ int mqtt3_db_message_write(struct mosquitto *context)
 
 			switch(tail->state){
 				case mosq_ms_publish_qos0:
-					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
+#ifdef WITH_BRIDGE
+					if(context->bridge && context->bridge->batch_interval){
+						rc = mqtt3_bridge_batch_add(context, topic, payloadlen, payload, retain);
+					}else
+#endif
+					if(!retain && !retries){
+						rc = _mosquitto_send_publish_shared(context, tail->store);
+					}else{
+						rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
+					}
 					if(!rc){
-						_message_remove(context, &tail, last);
+#ifdef WITH_SYS_TREE
+#  ifdef WITH_BRIDGE
+						if(!context->bridge || !context->bridge->batch_interval)
+#  endif
+						_message_packet_stamp(context, tail);
+#endif
+						mqtt3_db_message_remove(db, context, &tail, last);
 					}else{
 						return rc;
 					}
@@ -789,9 +1049,13 @@ int mqtt3_db_message_write(struct mosquitto *context)
 				case mosq_ms_publish_qos1:
 					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
 					if(!rc){
+#ifdef WITH_SYS_TREE
+						_message_packet_stamp(context, tail);
+#endif
 						tail->timestamp = mosquitto_time();
 						tail->dup = 1; /* Any retry attempts are a duplicate. */
 						tail->state = mosq_ms_wait_for_puback;
+						_message_retry_arm(context, tail);
 					}else{
 						return rc;
 					}
@@ -802,9 +1066,13 @@ int mqtt3_db_message_write(struct mosquitto *context)
 				case mosq_ms_publish_qos2:
 					rc = _mosquitto_send_publish(context, mid, topic, payloadlen, payload, qos, retain, retries);
 					if(!rc){
+#ifdef WITH_SYS_TREE
+						_message_packet_stamp(context, tail);
+#endif
 						tail->timestamp = mosquitto_time();
 						tail->dup = 1; /* Any retry attempts are a duplicate. */
 						tail->state = mosq_ms_wait_for_pubrec;
+						_message_retry_arm(context, tail);
 					}else{
 						return rc;
 					}
@@ -816,6 +1084,7 @@ int mqtt3_db_message_write(struct mosquitto *context)
 					rc = _mosquitto_send_pubrec(context, mid);
 					if(!rc){
 						tail->state = mosq_ms_wait_for_pubrel;
+						_message_retry_arm(context, tail);
 					}else{
 						return rc;
 					}
@@ -827,6 +1096,7 @@ int mqtt3_db_message_write(struct mosquitto *context)
 					rc = _mosquitto_send_pubrel(context, mid, true);
 					if(!rc){
 						tail->state = mosq_ms_wait_for_pubcomp;
+						_message_retry_arm(context, tail);
 					}else{
 						return rc;
 					}
@@ -838,6 +1108,7 @@ int mqtt3_db_message_write(struct mosquitto *context)
 					rc = _mosquitto_send_pubcomp(context, mid);
 					if(!rc){
 						tail->state = mosq_ms_wait_for_pubrel;
+						_message_retry_arm(context, tail);
 					}else{
 						return rc;
 					}
@@ -866,39 +1137,87 @@ int mqtt3_db_message_write(struct mosquitto *context)
 	return MOSQ_ERR_SUCCESS;
 }
 
-void mqtt3_db_store_clean(struct mosquitto_db *db)
+int mqtt3_db_message_write(struct mosquitto_db *db, struct mosquitto *context)
+{
+	int rc;
+
+	if(!context || context->sock == -1
+			|| (context->state == mosq_cs_connected && !context->id)){
+		return MOSQ_ERR_INVAL;
+	}
+
+	/* Queue everything that is ready and then write it out together, so a
+	 * client with many pending messages costs one write call rather than
+	 * one per packet. */
+	context->out_packet_held = true;
+	rc = _messages_write(db, context);
+#ifdef WITH_BRIDGE
+	if(!rc) rc = mqtt3_bridge_batch_check(context);
+#endif
+	context->out_packet_held = false;
+	if(rc) return rc;
+
+#ifdef WITH_IO_THREADS
+	if(context->out_packet_deferred) return MOSQ_ERR_SUCCESS;
+#endif
+	return _mosquitto_packet_write(context);
+}
+
+static void _msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *store)
 {
-	/* FIXME - this may not be necessary if checks are made when messages are removed. */
-	struct mosquitto_msg_store *tail, *last = NULL;
 	int i;
+
+	if(store->prev){
+		store->prev->next = store->next;
+	}else{
+		db->msg_store = store->next;
+	}
+	if(store->next){
+		store->next->prev = store->prev;
+	}
+	db->msg_store_count--;
+
+	mqtt3_pool_strfree(store->source_id);
+	if(store->dest_ids){
+		for(i=0; i<store->dest_id_count; i++){
+			mqtt3_pool_strfree(store->dest_ids[i]);
+		}
+		_mosquitto_free(store->dest_ids);
+	}
+	mqtt3_topic_release(store->topic);
+	if(store->msg.payload != store->payload_inline) _mosquitto_free(store->msg.payload);
+	if(store->qos0_packet) _mosquitto_shared_packet_release(store->qos0_packet);
+	mqtt3_pool_free(store, sizeof(struct mosquitto_msg_store));
+}
+
+void mqtt3_db_msg_store_deref(struct mosquitto_db *db, struct mosquitto_msg_store **store)
+{
+	assert(db);
+	assert(store);
+
+	(*store)->ref_count--;
+	if((*store)->ref_count == 0){
+		_msg_store_remove(db, *store);
+	}
+	*store = NULL;
+}
+
+/* Free any stored messages that have no references. Messages are normally
+ * freed as soon as their last reference is dropped, so this is only needed
+ * after restoring a persistent database, where stored messages are loaded
+ * before anything refers to them, and at shutdown. */
+void mqtt3_db_store_clean(struct mosquitto_db *db)
+{
+	struct mosquitto_msg_store *tail, *next;
 	assert(db);
 
 	tail = db->msg_store;
 	while(tail){
+		next = tail->next;
 		if(tail->ref_count == 0){
-			if(tail->source_id) _mosquitto_free(tail->source_id);
-			if(tail->dest_ids){
-				for(i=0; i<tail->dest_id_count; i++){
-					if(tail->dest_ids[i]) _mosquitto_free(tail->dest_ids[i]);
-				}
-				_mosquitto_free(tail->dest_ids);
-			}
-			if(tail->msg.topic) _mosquitto_free(tail->msg.topic);
-			if(tail->msg.payload) _mosquitto_free(tail->msg.payload);
-			if(last){
-				last->next = tail->next;
-				_mosquitto_free(tail);
-				tail = last->next;
-			}else{
-				db->msg_store = tail->next;
-				_mosquitto_free(tail);
-				tail = db->msg_store;
-			}
-			db->msg_store_count--;
-		}else{
-			last = tail;
-			tail = tail->next;
+			_msg_store_remove(db, tail);
 		}
+		tail = next;
 	}
 }
 
@@ -908,6 +1227,11 @@ void mqtt3_db_limits_set(int inflight, int queued)
 	max_queued = queued;
 }
 
+void mqtt3_db_retry_interval_set(int interval)
+{
+	retry_interval = interval;
+}
+
 void mqtt3_db_vacuum(void)
 {
 	/* FIXME - reimplement? */
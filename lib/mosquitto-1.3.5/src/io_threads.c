@@ -0,0 +1,237 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* I/O threads.
+ *
+ * With io_threads greater than one, the socket reads and writes for plain
+ * (non-TLS) clients are shared between the main thread and a pool of
+ * helper threads. Everything else - parsing packets, routing messages, the
+ * subscription tree, the message store and persistence - stays on the main
+ * thread, none of which has any locking.
+ *
+ * Each loop iteration the main thread hands over a list of clients whose
+ * sockets are readable, then a list of clients with output waiting. The
+ * jobs are split between the threads by position in the list, the main
+ * thread takes its share too, and it waits for every thread to finish
+ * before looking at the results. While a list is being worked on the main
+ * thread touches nothing but its own jobs, so a job's client belongs to
+ * exactly one thread. A job only uses the client's socket, receive buffer
+ * and packet queue, never any global state.
+ *
+ * Short lists aren't worth waking the threads for and are done on the main
+ * thread alone.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <config.h>
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <net_mosq.h>
+
+/* The broker is built against dummypthread.h, which turns these into
+ * nothing. Here they are wanted. */
+#undef pthread_create
+#undef pthread_join
+#undef pthread_mutex_init
+#undef pthread_mutex_destroy
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+
+/* Lists shorter than this many jobs per thread are done on the main thread
+ * alone. */
+#define IO_JOBS_PER_THREAD_MIN 8
+
+enum _io_op {
+	io_op_read = 0,
+	io_op_write = 1
+};
+
+static pthread_t *io_threads = NULL;
+/* Number of helper threads, not counting the main thread. */
+static int io_thread_count = 0;
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done_cond = PTHREAD_COND_INITIALIZER;
+/* Bumped each time a list is handed over. */
+static unsigned long io_generation = 0;
+/* Helper threads still working on the current list. */
+static int io_pending = 0;
+static bool io_stop = false;
+static enum _io_op io_op;
+static struct mqtt3_io_job *io_jobs;
+static int io_job_count;
+
+static void _io_job_run(enum _io_op op, struct mqtt3_io_job *job)
+{
+	if(op == io_op_read){
+		/* Data left over from the last read is handled before the socket
+		 * is read again. */
+		if(job->context->in_buf_pos == job->context->in_buf_len){
+			job->rc = _mosquitto_packet_fill(job->context);
+		}
+	}else{
+		job->rc = _mosquitto_packet_flush(job->context, &job->written);
+	}
+}
+
+/* Do the share of the current list belonging to thread index, where the main
+ * thread is index 0. */
+static void _io_jobs_run(int index)
+{
+	int i;
+
+	for(i=index; i<io_job_count; i+=io_thread_count+1){
+		_io_job_run(io_op, &io_jobs[i]);
+	}
+}
+
+static void *_io_thread_main(void *arg)
+{
+	int index = (int)(intptr_t)arg;
+	unsigned long generation = 0;
+
+	pthread_mutex_lock(&io_mutex);
+	while(1){
+		while(!io_stop && generation == io_generation){
+			pthread_cond_wait(&io_start_cond, &io_mutex);
+		}
+		if(io_stop) break;
+		generation = io_generation;
+		pthread_mutex_unlock(&io_mutex);
+
+		_io_jobs_run(index);
+
+		pthread_mutex_lock(&io_mutex);
+		io_pending--;
+		if(io_pending == 0){
+			pthread_cond_signal(&io_done_cond);
+		}
+	}
+	pthread_mutex_unlock(&io_mutex);
+
+	return NULL;
+}
+
+static void _io_dispatch(enum _io_op op, struct mqtt3_io_job *jobs, int count)
+{
+	int i;
+
+	if(count < (io_thread_count+1)*IO_JOBS_PER_THREAD_MIN){
+		for(i=0; i<count; i++){
+			_io_job_run(op, &jobs[i]);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&io_mutex);
+	io_op = op;
+	io_jobs = jobs;
+	io_job_count = count;
+	io_pending = io_thread_count;
+	io_generation++;
+	pthread_cond_broadcast(&io_start_cond);
+	pthread_mutex_unlock(&io_mutex);
+
+	_io_jobs_run(0);
+
+	pthread_mutex_lock(&io_mutex);
+	while(io_pending > 0){
+		pthread_cond_wait(&io_done_cond, &io_mutex);
+	}
+	io_jobs = NULL;
+	io_job_count = 0;
+	pthread_mutex_unlock(&io_mutex);
+}
+
+int mqtt3_io_threads_start(int thread_count)
+{
+	sigset_t sigblock, origsig;
+	int i;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	assert(!io_threads);
+
+	if(thread_count <= 1) return MOSQ_ERR_SUCCESS;
+
+	io_threads = _mosquitto_calloc(thread_count-1, sizeof(pthread_t));
+	if(!io_threads) return MOSQ_ERR_NOMEM;
+
+	/* Signals are only for the main thread; the threads inherit this mask. */
+	sigfillset(&sigblock);
+	pthread_sigmask(SIG_SETMASK, &sigblock, &origsig);
+	io_stop = false;
+	for(i=0; i<thread_count-1; i++){
+		if(pthread_create(&io_threads[i], NULL, _io_thread_main, (void *)(intptr_t)(i+1))){
+			rc = MOSQ_ERR_ERRNO;
+			break;
+		}
+		io_thread_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+
+	if(rc){
+		mqtt3_io_threads_stop();
+	}
+	return rc;
+}
+
+void mqtt3_io_threads_stop(void)
+{
+	int i;
+
+	if(!io_threads) return;
+
+	pthread_mutex_lock(&io_mutex);
+	io_stop = true;
+	pthread_cond_broadcast(&io_start_cond);
+	pthread_mutex_unlock(&io_mutex);
+
+	for(i=0; i<io_thread_count; i++){
+		pthread_join(io_threads[i], NULL);
+	}
+	_mosquitto_free(io_threads);
+	io_threads = NULL;
+	io_thread_count = 0;
+}
+
+void mqtt3_io_threads_read(struct mqtt3_io_job *jobs, int count)
+{
+	_io_dispatch(io_op_read, jobs, count);
+}
+
+void mqtt3_io_threads_write(struct mqtt3_io_job *jobs, int count)
+{
+	_io_dispatch(io_op_write, jobs, count);
+}
@@ -56,18 +56,20 @@ extern bool flag_db_backup;
 #endif
 extern bool flag_tree_print;
 extern int run;
-#ifdef WITH_SYS_TREE
-extern int g_clients_expired;
+#if defined(WITH_IO_THREADS) && defined(WITH_SYS_TREE)
+extern uint64_t g_bytes_sent;
 #endif
 
 static void loop_handle_errors(struct mosquitto_db *db, struct pollfd *pollfds);
 static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pollfds);
+#ifdef WITH_IO_THREADS
+static void loop_handle_reads_writes_threaded(struct mosquitto_db *db, struct pollfd *pollfds, struct mqtt3_io_job **jobs, int *jobs_alloc);
+#endif
 
 int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock_count, int listener_max)
 {
 	time_t start_time = mosquitto_time();
 	time_t last_backup = mosquitto_time();
-	time_t last_store_clean = mosquitto_time();
 	time_t now;
 	int time_count;
 	int fdcount;
@@ -78,9 +80,15 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 	struct pollfd *pollfds = NULL;
 	int pollfd_count = 0;
 	int pollfd_index;
+	int poll_timeout;
+	struct mosquitto *context;
 #ifdef WITH_BRIDGE
-	int bridge_sock;
 	int rc;
+	int batch_timeout;
+#endif
+#ifdef WITH_IO_THREADS
+	struct mqtt3_io_job *io_jobs = NULL;
+	int io_jobs_alloc = 0;
 #endif
 
 #ifndef WIN32
@@ -114,7 +122,15 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 			pollfd_index++;
 		}
 
+		/* Keepalive, message retry, persistent client expiry and bridge
+		 * restart deadlines are all held in the timer wheel, so only the
+		 * timers that are actually due get looked at here. */
+		now = mosquitto_time();
+		mqtt3_timer_process(db, now);
+		mqtt3_topic_idle_expire(now);
+
 		time_count = 0;
+		poll_timeout = 100;
 		for(i=0; i<db->context_count; i++){
 			if(db->contexts[i]){
 				if(time_count > 0){
@@ -129,42 +145,34 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 #ifdef WITH_BRIDGE
 					if(db->contexts[i]->bridge){
 						_mosquitto_check_keepalive(db->contexts[i]);
-						if(db->contexts[i]->bridge->round_robin == false
-								&& db->contexts[i]->bridge->cur_address != 0
-								&& now > db->contexts[i]->bridge->primary_retry){
-
-							/* FIXME - this should be non-blocking */
-							if(_mosquitto_try_connect(db->contexts[i]->bridge->addresses[0].address, db->contexts[i]->bridge->addresses[0].port, &bridge_sock, NULL, true) == MOSQ_ERR_SUCCESS){
-								COMPAT_CLOSE(bridge_sock);
-								_mosquitto_socket_close(db->contexts[i]);
-								db->contexts[i]->bridge->cur_address = db->contexts[i]->bridge->address_count-1;
-							}
-						}
 					}
 #endif
-
-					/* Local bridges never time out in this fashion. */
-					if(!(db->contexts[i]->keepalive) 
-							|| db->contexts[i]->bridge
-							|| now - db->contexts[i]->last_msg_in < (time_t)(db->contexts[i]->keepalive)*3/2){
-
-						if(mqtt3_db_message_write(db->contexts[i]) == MOSQ_ERR_SUCCESS){
-							pollfds[pollfd_index].fd = db->contexts[i]->sock;
-							pollfds[pollfd_index].events = POLLIN;
-							pollfds[pollfd_index].revents = 0;
-							if(db->contexts[i]->current_out_packet){
-								pollfds[pollfd_index].events |= POLLOUT;
+					/* Bridges restarted by their timer above may still be waiting
+					 * for CONNACK, so hold their queued messages until then. */
+					if((db->contexts[i]->bridge && db->contexts[i]->state == mosq_cs_new)
+							|| mqtt3_db_message_write(db, db->contexts[i]) == MOSQ_ERR_SUCCESS){
+						pollfds[pollfd_index].fd = db->contexts[i]->sock;
+						pollfds[pollfd_index].events = POLLIN;
+						pollfds[pollfd_index].revents = 0;
+						if(db->contexts[i]->current_out_packet || db->contexts[i]->out_packet){
+							pollfds[pollfd_index].events |= POLLOUT;
+						}
+						if(db->contexts[i]->in_buf_pos < db->contexts[i]->in_buf_len){
+							/* Already received, so don't wait for the socket. */
+							poll_timeout = 0;
+						}
+#ifdef WITH_BRIDGE
+						if(db->contexts[i]->bridge){
+							/* Wake up in time to send a waiting batch. */
+							batch_timeout = mqtt3_bridge_batch_timeout(db->contexts[i]);
+							if(batch_timeout >= 0 && batch_timeout < poll_timeout){
+								poll_timeout = batch_timeout;
 							}
-							db->contexts[i]->pollfd_index = pollfd_index;
-							pollfd_index++;
-						}else{
-							mqtt3_context_disconnect(db, db->contexts[i]);
 						}
+#endif
+						db->contexts[i]->pollfd_index = pollfd_index;
+						pollfd_index++;
 					}else{
-						if(db->config->connection_messages == true){
-							_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client %s has exceeded timeout, disconnecting.", db->contexts[i]->id);
-						}
-						/* Client has exceeded keepalive*1.5 */
 						mqtt3_context_disconnect(db, db->contexts[i]);
 					}
 				}else{
@@ -180,6 +188,9 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 							if(db->contexts[i]->bridge->round_robin == false && db->contexts[i]->bridge->cur_address != 0){
 								db->contexts[i]->bridge->primary_retry = now + 5;
 							}
+							if(db->contexts[i]->bridge->start_type == bst_automatic){
+								mqtt3_timer_add(&db->contexts[i]->bridge_timer, db->contexts[i]->bridge->restart_t+1);
+							}
 						}else{
 							if(db->contexts[i]->bridge->start_type == bst_lazy && db->contexts[i]->bridge->lazy_reconnect){
 								rc = mqtt3_bridge_connect(db, db->contexts[i]);
@@ -190,49 +201,13 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 									}
 								}
 							}
-							if(db->contexts[i]->bridge->start_type == bst_automatic && now > db->contexts[i]->bridge->restart_t){
-								db->contexts[i]->bridge->restart_t = 0;
-								rc = mqtt3_bridge_connect(db, db->contexts[i]);
-								if(rc == MOSQ_ERR_SUCCESS){
-									pollfds[pollfd_index].fd = db->contexts[i]->sock;
-									pollfds[pollfd_index].events = POLLIN;
-									pollfds[pollfd_index].revents = 0;
-									if(db->contexts[i]->current_out_packet){
-										pollfds[pollfd_index].events |= POLLOUT;
-									}
-									db->contexts[i]->pollfd_index = pollfd_index;
-									pollfd_index++;
-								}else{
-									/* Retry later. */
-									db->contexts[i]->bridge->restart_t = now+db->contexts[i]->bridge->restart_timeout;
-
-									db->contexts[i]->bridge->cur_address++;
-									if(db->contexts[i]->bridge->cur_address == db->contexts[i]->bridge->address_count){
-										db->contexts[i]->bridge->cur_address = 0;
-									}
-								}
-							}
 						}
 					}else{
 #endif
 						if(db->contexts[i]->clean_session == true){
-							mqtt3_context_cleanup(db, db->contexts[i], true);
-							db->contexts[i] = NULL;
-						}else if(db->config->persistent_client_expiration > 0){
-							/* This is a persistent client, check to see if the
-							 * last time it connected was longer than
-							 * persistent_client_expiration seconds ago. If so,
-							 * expire it and clean up.
-							 */
-							if(now > db->contexts[i]->disconnect_t+db->config->persistent_client_expiration){
-								_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Expiring persistent client %s due to timeout.", db->contexts[i]->id);
-#ifdef WITH_SYS_TREE
-								g_clients_expired++;
-#endif
-								db->contexts[i]->clean_session = true;
-								mqtt3_context_cleanup(db, db->contexts[i], true);
-								db->contexts[i] = NULL;
-							}
+							context = db->contexts[i];
+							mqtt3_context_slot_remove(db, context);
+							mqtt3_context_cleanup(db, context, true);
 						}
 #ifdef WITH_BRIDGE
 					}
@@ -241,19 +216,28 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 			}
 		}
 
-		mqtt3_db_message_timeout_check(db, db->config->retry_interval);
-
 #ifndef WIN32
 		sigprocmask(SIG_SETMASK, &sigblock, &origsig);
-		fdcount = poll(pollfds, pollfd_index, 100);
+		fdcount = poll(pollfds, pollfd_index, poll_timeout);
 		sigprocmask(SIG_SETMASK, &origsig, NULL);
 #else
-		fdcount = WSAPoll(pollfds, pollfd_index, 100);
+		fdcount = WSAPoll(pollfds, pollfd_index, poll_timeout);
 #endif
+		/* Ticked before anything is read so that plugins finish a second
+		 * before being shown messages from the next one. */
+		mqtt3_publish_plugin_tick(db, time(NULL));
 		if(fdcount == -1){
 			loop_handle_errors(db, pollfds);
 		}else{
+#ifdef WITH_IO_THREADS
+			if(db->config->io_threads > 1){
+				loop_handle_reads_writes_threaded(db, pollfds, &io_jobs, &io_jobs_alloc);
+			}else{
+				loop_handle_reads_writes(db, pollfds);
+			}
+#else
 			loop_handle_reads_writes(db, pollfds);
+#endif
 
 			for(i=0; i<listensock_count; i++){
 				if(pollfds[i].revents & (POLLIN | POLLPRI)){
@@ -263,33 +247,37 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 			}
 		}
 #ifdef WITH_PERSISTENCE
+		mqtt3_db_journal_flush(db);
+		mqtt3_db_backup_check(db, false);
 		if(db->config->persistence && db->config->autosave_interval){
 			if(db->config->autosave_on_changes){
 				if(db->persistence_changes > db->config->autosave_interval){
-					mqtt3_db_backup(db, false, false);
+					mqtt3_db_backup_background(db);
 					db->persistence_changes = 0;
 				}
 			}else{
 				if(last_backup + db->config->autosave_interval < mosquitto_time()){
-					mqtt3_db_backup(db, false, false);
+					mqtt3_db_backup_background(db);
 					last_backup = mosquitto_time();
 				}
 			}
 		}
 #endif
-		if(!db->config->store_clean_interval || last_store_clean + db->config->store_clean_interval < mosquitto_time()){
-			mqtt3_db_store_clean(db);
-			last_store_clean = mosquitto_time();
-		}
 #ifdef WITH_PERSISTENCE
 		if(flag_db_backup){
-			mqtt3_db_backup(db, false, false);
+			mqtt3_db_backup_background(db);
 			flag_db_backup = false;
 		}
 #endif
 		if(flag_reload){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Reloading config.");
 			mqtt3_config_read(db->config, true);
+			/* persistent_client_expiration may have changed. */
+			for(i=0; i<db->context_count; i++){
+				if(db->contexts[i] && db->contexts[i]->sock == INVALID_SOCKET){
+					mqtt3_context_expiry_schedule(db, db->contexts[i]);
+				}
+			}
 			mosquitto_security_cleanup(db, true);
 			mosquitto_security_init(db, true);
 			mosquitto_security_apply(db);
@@ -303,6 +291,9 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 	}
 
 	if(pollfds) _mosquitto_free(pollfds);
+#ifdef WITH_IO_THREADS
+	if(io_jobs) _mosquitto_free(io_jobs);
+#endif
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -334,43 +325,177 @@ static void loop_handle_errors(struct mosquitto_db *db, struct pollfd *pollfds)
 	}
 }
 
-static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pollfds)
+/* Write, read and check for errors on a single client. */
+static void loop_handle_context(struct mosquitto_db *db, int i, struct pollfd *pollfds)
 {
-	int i;
-
-	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
-			assert(pollfds[db->contexts[i]->pollfd_index].fd == db->contexts[i]->sock);
+	if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
+		assert(pollfds[db->contexts[i]->pollfd_index].fd == db->contexts[i]->sock);
 #ifdef WITH_TLS
-			if(pollfds[db->contexts[i]->pollfd_index].revents & POLLOUT ||
-					db->contexts[i]->want_write ||
-					(db->contexts[i]->ssl && db->contexts[i]->state == mosq_cs_new)){
+		if(pollfds[db->contexts[i]->pollfd_index].revents & POLLOUT ||
+				db->contexts[i]->want_write ||
+				(db->contexts[i]->ssl && db->contexts[i]->state == mosq_cs_new)){
 #else
-			if(pollfds[db->contexts[i]->pollfd_index].revents & POLLOUT){
+		if(pollfds[db->contexts[i]->pollfd_index].revents & POLLOUT){
 #endif
-				if(_mosquitto_packet_write(db->contexts[i])){
-					do_disconnect(db, i);
-				}
+			if(_mosquitto_packet_write(db->contexts[i])){
+				do_disconnect(db, i);
 			}
 		}
-		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
-			assert(pollfds[db->contexts[i]->pollfd_index].fd == db->contexts[i]->sock);
+	}
+	if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
+		assert(pollfds[db->contexts[i]->pollfd_index].fd == db->contexts[i]->sock);
 #ifdef WITH_TLS
-			if(pollfds[db->contexts[i]->pollfd_index].revents & POLLIN ||
-					(db->contexts[i]->ssl && db->contexts[i]->state == mosq_cs_new)){
+		if(pollfds[db->contexts[i]->pollfd_index].revents & POLLIN ||
+				db->contexts[i]->in_buf_pos < db->contexts[i]->in_buf_len ||
+				(db->contexts[i]->ssl && db->contexts[i]->state == mosq_cs_new)){
 #else
-			if(pollfds[db->contexts[i]->pollfd_index].revents & POLLIN){
+		if(pollfds[db->contexts[i]->pollfd_index].revents & POLLIN ||
+				db->contexts[i]->in_buf_pos < db->contexts[i]->in_buf_len){
 #endif
-				if(_mosquitto_packet_read(db, db->contexts[i])){
+			if(_mosquitto_packet_read(db, db->contexts[i])){
+				do_disconnect(db, i);
+			}
+		}
+	}
+	if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
+		if(pollfds[db->contexts[i]->pollfd_index].revents & (POLLERR | POLLNVAL)){
+			do_disconnect(db, i);
+		}
+	}
+}
+
+static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pollfds)
+{
+	int i;
+
+	for(i=0; i<db->context_count; i++){
+		loop_handle_context(db, i, pollfds);
+	}
+}
+
+#ifdef WITH_IO_THREADS
+static int loop_io_jobs_reserve(struct mosquitto_db *db, struct mqtt3_io_job **jobs, int *jobs_alloc)
+{
+	struct mqtt3_io_job *tmp;
+
+	if(*jobs_alloc < db->context_count){
+		tmp = _mosquitto_realloc(*jobs, sizeof(struct mqtt3_io_job)*db->context_count);
+		if(!tmp) return MOSQ_ERR_NOMEM;
+		*jobs = tmp;
+		*jobs_alloc = db->context_count;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* As loop_handle_reads_writes(), but with the socket reads and writes of
+ * clients marked out_packet_deferred done by the I/O threads. Every readable
+ * socket is read in one go, then the data received is handled here client by
+ * client, queueing replies and forwarded messages as it goes. Then
+ * everything queued is written out in one go. Other clients are handled as
+ * before. */
+static void loop_handle_reads_writes_threaded(struct mosquitto_db *db, struct pollfd *pollfds, struct mqtt3_io_job **jobs, int *jobs_alloc)
+{
+	struct mosquitto *context;
+	struct mqtt3_io_job *job;
+	struct pollfd *pollfd;
+	int count;
+	int i;
+
+	if(loop_io_jobs_reserve(db, jobs, jobs_alloc)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		loop_handle_reads_writes(db, pollfds);
+		return;
+	}
+
+	count = 0;
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(!context || context->sock == INVALID_SOCKET) continue;
+
+		if(!context->out_packet_deferred){
+			loop_handle_context(db, i, pollfds);
+			continue;
+		}
+		pollfd = &pollfds[context->pollfd_index];
+		assert(pollfd->fd == context->sock);
+		if(pollfd->revents & POLLIN || context->in_buf_pos < context->in_buf_len){
+			if(!context->in_buf){
+				context->in_buf = _mosquitto_malloc(MOSQ_READ_BUF_SIZE);
+				if(!context->in_buf){
 					do_disconnect(db, i);
+					continue;
 				}
 			}
+			job = &(*jobs)[count++];
+			job->context = context;
+			job->sock = context->sock;
+			job->revents = pollfd->revents;
+			job->rc = MOSQ_ERR_SUCCESS;
+			job->written = 0;
+		}else if(pollfd->revents & (POLLERR | POLLNVAL)){
+			do_disconnect(db, i);
 		}
-		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
-			if(pollfds[db->contexts[i]->pollfd_index].revents & (POLLERR | POLLNVAL)){
-				do_disconnect(db, i);
+	}
+
+	mqtt3_io_threads_read(*jobs, count);
+
+	for(i=0; i<count; i++){
+		job = &(*jobs)[i];
+		context = job->context;
+		if(context->sock != job->sock){
+			/* Taken over by a new connection from the same client id while
+			 * handling an earlier job, so what was read is from the old
+			 * connection. */
+			context->in_buf_refilled = false;
+			continue;
+		}
+		if(job->rc || _mosquitto_packet_read(db, context)){
+			do_disconnect(db, context->db_index);
+		}else if(context->sock != INVALID_SOCKET && job->revents & (POLLERR | POLLNVAL)){
+			do_disconnect(db, context->db_index);
+		}
+	}
+
+	if(loop_io_jobs_reserve(db, jobs, jobs_alloc)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return;
+	}
+
+	count = 0;
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(!context || context->sock == INVALID_SOCKET || !context->out_packet_deferred) continue;
+		if(!context->current_out_packet && !context->out_packet) continue;
+
+		if(context->pollfd_index >= 0){
+			pollfd = &pollfds[context->pollfd_index];
+			if(pollfd->events & POLLOUT && !(pollfd->revents & POLLOUT)){
+				/* Still full from before. */
+				continue;
 			}
 		}
+		job = &(*jobs)[count++];
+		job->context = context;
+		job->sock = context->sock;
+		job->revents = 0;
+		job->rc = MOSQ_ERR_SUCCESS;
+		job->written = 0;
 	}
-}
 
+	mqtt3_io_threads_write(*jobs, count);
+
+	for(i=0; i<count; i++){
+		job = &(*jobs)[i];
+		context = job->context;
+#ifdef WITH_SYS_TREE
+		g_bytes_sent += job->written;
+#endif
+		if(context->sock != job->sock) continue;
+
+		/* Frees the packets that were written and counts them. */
+		if(job->rc || _mosquitto_packet_write(context)){
+			do_disconnect(db, context->db_index);
+		}
+	}
+}
+#endif
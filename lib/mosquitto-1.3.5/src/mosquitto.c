@@ -254,6 +254,8 @@ int main(int argc, char *argv[])
 	if(rc) return rc;
 	rc = mosquitto_security_init(&int_db, false);
 	if(rc) return rc;
+	rc = mqtt3_publish_plugin_init(&int_db);
+	if(rc) return rc;
 
 #ifdef WITH_SYS_TREE
 	if(config.sys_interval > 0){
@@ -327,14 +329,27 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+#ifdef WITH_IO_THREADS
+	if(mqtt3_io_threads_start(config.io_threads)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start I/O threads.");
+		return 1;
+	}
+#endif
+
 	run = 1;
 	rc = mosquitto_main_loop(&int_db, listensock, listensock_count, listener_max);
 
+#ifdef WITH_IO_THREADS
+	mqtt3_io_threads_stop();
+#endif
+	mqtt3_publish_plugin_cleanup(&int_db);
+
 	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "mosquitto version %s terminating", VERSION);
 	mqtt3_log_close();
 
 #ifdef WITH_PERSISTENCE
 	if(config.persistence){
+		mqtt3_db_backup_check(&int_db, true);
 		mqtt3_db_backup(&int_db, true, true);
 	}
 #endif
@@ -346,7 +361,12 @@ int main(int argc, char *argv[])
 	}
 	_mosquitto_free(int_db.contexts);
 	int_db.contexts = NULL;
+	_mosquitto_free(int_db.context_free);
+	int_db.context_free = NULL;
 	mqtt3_db_close(&int_db);
+#ifdef WITH_SYS_TREE
+	mqtt3_sys_cleanup();
+#endif
 
 	if(listensock){
 		for(i=0; i<listensock_count; i++){
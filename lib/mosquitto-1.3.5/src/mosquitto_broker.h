@@ -35,6 +35,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <mosquitto_internal.h>
 #include <mosquitto_plugin.h>
+#include <mosquitto_publish_plugin.h>
 #include <mosquitto.h>
 #include "tls_mosq.h"
 #include "uthash.h"
@@ -52,14 +53,39 @@ POSSIBILITY OF SUCH DAMAGE.
 #define MQTT3_LOG_TOPIC 0x10
 #define MQTT3_LOG_ALL 0xFF
 
+/* Payloads up to this size are stored inside the message store entry rather
+ * than in a separate allocation. */
+#define MQTT3_STORE_INLINE_PAYLOAD 40
+
+/* Upper limit for the io_threads option. */
+#define MQTT3_IO_THREADS_MAX 64
+
+/* Topic bridges publish batches of messages on, see bridge_batch.c. */
+#define MQTT3_BRIDGE_BATCH_TOPIC "$bridge/batch"
+
 typedef uint64_t dbid_t;
 
+/* The latencies measured for the $SYS tree, see sys_tree.c. */
+enum mqtt3_latency_type{
+	mlt_receive_enqueue = 0,
+	mlt_enqueue_write = 1
+};
+
+/* What happens when an outgoing message arrives for a client whose queue is
+ * full, see database.c. */
+enum mqtt3_queue_policy{
+	qp_drop_newest = 0,
+	qp_drop_oldest = 1,
+	qp_conflate = 2
+};
+
 struct _mqtt3_listener {
 	int fd;
 	char *host;
 	uint16_t port;
 	int max_connections;
 	char *mount_point;
+	enum mqtt3_queue_policy queue_policy;
 	int *socks;
 	int sock_count;
 	int client_count;
@@ -78,6 +104,19 @@ struct _mqtt3_listener {
 #endif
 };
 
+/* How the member of a shared subscription group that receives a message is
+ * chosen, see subs.c. */
+enum mqtt3_shared_sub_policy{
+	ssp_round_robin = 0,
+	ssp_topic_hash = 1
+};
+
+/* Queue policy for the clients whose ids start with prefix. */
+struct mqtt3_client_queue_policy {
+	char *prefix;
+	enum mqtt3_queue_policy policy;
+};
+
 struct mqtt3_config {
 	char *config_file;
 	char *acl_file;
@@ -88,10 +127,14 @@ struct mqtt3_config {
 	int auto_id_prefix_len;
 	int autosave_interval;
 	bool autosave_on_changes;
+	bool autosave_fork;
 	char *clientid_prefixes;
+	struct mqtt3_client_queue_policy *client_queue_policies;
+	int client_queue_policy_count;
 	bool connection_messages;
 	bool daemon;
 	struct _mqtt3_listener default_listener;
+	int io_threads;
 	struct _mqtt3_listener *listeners;
 	int listener_count;
 	int log_dest;
@@ -105,13 +148,19 @@ struct mqtt3_config {
 	char *persistence_location;
 	char *persistence_file;
 	char *persistence_filepath;
+	bool persistence_journal;
 	time_t persistent_client_expiration;
 	char *pid_file;
 	char *psk_file;
 	bool queue_qos0_messages;
 	int retry_interval;
-	int store_clean_interval;
+	enum mqtt3_shared_sub_policy shared_subscription_policy;
 	int sys_interval;
+	/* Each is the pattern of a sys_topic_prefix option, and the name its
+	 * counters are published under. */
+	char **sys_topic_prefixes;
+	char **sys_topic_names;
+	int sys_topic_prefix_count;
 	bool upgrade_outgoing_qos;
 	char *user;
 	bool verbose;
@@ -122,6 +171,12 @@ struct mqtt3_config {
 	char *auth_plugin;
 	struct mosquitto_auth_opt *auth_options;
 	int auth_option_count;
+	char *publish_plugin;
+	struct mosquitto_publish_opt *publish_options;
+	int publish_option_count;
+	/* Each is the value of an aggregate option. */
+	char **aggregates;
+	int aggregate_count;
 };
 
 struct _mosquitto_subleaf {
@@ -131,23 +186,84 @@ struct _mosquitto_subleaf {
 	int qos;
 };
 
+/* The members of one shared subscription group on a topic filter. Each
+ * message matching the filter goes to only one of them. */
+struct _mosquitto_subshared {
+	struct _mosquitto_subshared *next;
+	struct _mosquitto_subleaf *subs;
+	char *name;
+	int sub_count;
+	unsigned int next_sub;
+};
+
 struct _mosquitto_subhier {
 	struct _mosquitto_subhier *children;
 	struct _mosquitto_subhier *next;
 	struct _mosquitto_subleaf *subs;
+	struct _mosquitto_subshared *shared;
 	char *topic;
+	/* Length and mqtt3_topic_level_hash() of topic. */
+	int topic_len;
+	uint32_t hash;
+};
+
+/* One level of an interned topic. */
+struct _mosquitto_topic_level {
+	uint32_t hash;
+	uint16_t start;
+	uint16_t len;
+};
+
+/* A distinct topic, shared by everything that refers to it. See
+ * topic_intern.c. */
+struct _mosquitto_topic {
+	UT_hash_handle hh;
+	int ref_count;
+	int len;
+	int level_count;
+	/* 1 if levels starts with the empty level the subscription tree puts in
+	 * front of topics not beginning with $, otherwise 0. */
+	int first_level;
+	uint32_t hash;
+	struct _mosquitto_topic_level *levels;
+	char *topic;
+	/* Links in the list of entries without references, see
+	 * topic_intern.c, and when the entry joined it. */
+	struct _mosquitto_topic *idle_prev;
+	struct _mosquitto_topic *idle_next;
+	time_t idle_since;
+};
+
+/* One topic level in the index of retained messages, see retain.c. */
+struct _mosquitto_retainhier {
+	struct _mosquitto_retainhier *parent;
+	struct _mosquitto_retainhier *children;
 	struct mosquitto_msg_store *retained;
+	char *topic;
+	UT_hash_handle hh;
 };
 
 struct mosquitto_msg_store{
 	struct mosquitto_msg_store *next;
+	struct mosquitto_msg_store *prev;
 	dbid_t db_id;
 	int ref_count;
 	char *source_id;
 	char **dest_ids;
 	int dest_id_count;
 	uint16_t source_mid;
+	/* msg.topic is the string of this, or both are NULL. */
+	struct _mosquitto_topic *topic;
 	struct mosquitto_message msg;
+	/* Serialised QoS 0, non-retained PUBLISH, built on first use and shared
+	 * by every recipient. */
+	struct _mosquitto_shared_packet *qos0_packet;
+	/* Already written to the current persistence journal. */
+	bool journaled;
+	/* When the message was queued for its subscribers, in microseconds, or 0
+	 * if its latency isn't being measured. See sys_tree.c. */
+	uint64_t enqueued_us;
+	uint8_t payload_inline[MQTT3_STORE_INLINE_PAYLOAD];
 };
 
 struct mosquitto_client_msg{
@@ -162,6 +278,15 @@ struct mosquitto_client_msg{
 	bool dup;
 };
 
+/* Index entry for the waiting outgoing message on one topic, kept for clients
+ * with the conflate queue policy. The key is the interned topic of
+ * msg->store. */
+struct _mosquitto_msg_topic{
+	UT_hash_handle hh;
+	struct _mosquitto_topic *topic;
+	struct mosquitto_client_msg *msg;
+};
+
 struct _mosquitto_unpwd{
 	char *username;
 	char *password;
@@ -187,6 +312,17 @@ struct _mosquitto_acl_user{
 	struct _mosquitto_acl *acl;
 };
 
+/* Result of an earlier ACL check on a topic for one client. The entry holds
+ * a reference to the topic, which is the key. */
+struct _mosquitto_acl_cache{
+	struct _mosquitto_topic *topic;
+	int checked;
+	int allowed;
+	/* Set on every hit, cleared as the eviction hand passes. */
+	bool referenced;
+	UT_hash_handle hh;
+};
+
 struct _mosquitto_auth_plugin{
 	void *lib;
 	void *user_data;
@@ -200,6 +336,21 @@ struct _mosquitto_auth_plugin{
 	int (*psk_key_get)(void *user_data, const char *hint, const char *identity, char *key, int max_key_len);
 };
 
+struct _mosquitto_publish_plugin{
+	struct _mosquitto_publish_plugin *next;
+	/* Used in log messages. */
+	const char *name;
+	/* NULL for a plugin built in to the broker. */
+	void *lib;
+	void *user_data;
+	struct mosquitto_publish_opt *opts;
+	int opt_count;
+	int (*plugin_init)(void **user_data, struct mosquitto_publish_opt *opts, int opt_count, mosquitto_publish_plugin_publish_t publish);
+	int (*plugin_cleanup)(void *user_data, struct mosquitto_publish_opt *opts, int opt_count);
+	int (*message)(void *user_data, const char *clientid, const char *topic, int qos, int payloadlen, const void *payload, bool retain);
+	void (*tick)(void *user_data, time_t now);
+};
+
 struct _clientid_index_hash{
 	/* this is the key */
 	char *id;
@@ -211,18 +362,27 @@ struct _clientid_index_hash{
 struct mosquitto_db{
 	dbid_t last_db_id;
 	struct _mosquitto_subhier subs;
+	struct _mosquitto_retainhier retains;
 	struct _mosquitto_unpwd *unpwd;
 	struct _mosquitto_acl_user *acl_list;
 	struct _mosquitto_acl *acl_patterns;
 	struct _mosquitto_unpwd *psk_id;
 	struct mosquitto **contexts;
 	struct _clientid_index_hash *clientid_index_hash;
+	/* number of slots in use in contexts, including NULL slots */
 	int context_count;
+	int context_alloc;
+	/* stack of NULL slot indices below context_count */
+	int *context_free;
+	int context_free_count;
 	struct mosquitto_msg_store *msg_store;
 	int msg_store_count;
 	struct mqtt3_config *config;
 	int persistence_changes;
 	struct _mosquitto_auth_plugin auth_plugin;
+	struct _mosquitto_publish_plugin *publish_plugins;
+	/* Wall clock time the publish plugins were last ticked. */
+	time_t publish_plugin_tick;
 	int subscription_count;
 	int retained_count;
 };
@@ -280,6 +440,15 @@ struct _mqtt3_bridge{
 	bool lazy_reconnect;
 	bool try_private;
 	bool try_private_accepted;
+	/* Milliseconds QoS 0 messages are collected for before being sent as
+	 * one batch, see bridge_batch.c. Zero sends them individually. */
+	int batch_interval;
+	bool batch_compression;
+	struct _mqtt3_bridge_batch *batch;
+	/* Connection attempt to the primary address while connected to a
+	 * secondary one, and the time it is given up on. */
+	int primary_probe_sock;
+	time_t primary_probe_t;
 #ifdef WITH_TLS
 	char *tls_cafile;
 	char *tls_capath;
@@ -322,6 +491,7 @@ void mqtt3_config_cleanup(struct mqtt3_config *config);
  * ============================================================ */
 int _mosquitto_send_connack(struct mosquitto *context, int result);
 int _mosquitto_send_suback(struct mosquitto *context, uint16_t mid, uint32_t payloadlen, const void *payload);
+int _mosquitto_send_publish_shared(struct mosquitto *context, struct mosquitto_msg_store *stored);
 
 /* ============================================================
  * Network functions
@@ -348,45 +518,138 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db);
 int mqtt3_db_close(struct mosquitto_db *db);
 #ifdef WITH_PERSISTENCE
 int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown);
+int mqtt3_db_backup_background(struct mosquitto_db *db);
+void mqtt3_db_backup_check(struct mosquitto_db *db, bool wait);
 int mqtt3_db_restore(struct mosquitto_db *db);
+int mqtt3_db_journal_open(struct mosquitto_db *db);
+void mqtt3_db_journal_flush(struct mosquitto_db *db);
+void mqtt3_db_journal_client(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_db_journal_client_delete(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_db_journal_client_msg(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void mqtt3_db_journal_client_msg_update(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void mqtt3_db_journal_client_msg_delete(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void mqtt3_db_journal_sub(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos);
+void mqtt3_db_journal_sub_delete(struct mosquitto_db *db, struct mosquitto *context, const char *sub);
+void mqtt3_db_journal_retain(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
 #endif
 int mqtt3_db_client_count(struct mosquitto_db *db, unsigned int *count, unsigned int *inactive_count);
 void mqtt3_db_limits_set(int inflight, int queued);
+void mqtt3_db_retry_interval_set(int interval);
 /* Return the number of in-flight messages in count. */
 int mqtt3_db_message_count(int *count);
-int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir);
+int mqtt3_db_message_delete(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir);
 int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored);
 int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir);
-int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, enum mosquitto_msg_state state);
-int mqtt3_db_message_write(struct mosquitto *context);
-int mqtt3_db_messages_delete(struct mosquitto *context);
+void mqtt3_db_message_remove(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg **msg, struct mosquitto_client_msg *last);
+int mqtt3_db_message_update(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, enum mosquitto_msg_state state);
+int mqtt3_db_message_write(struct mosquitto_db *db, struct mosquitto *context);
+int mqtt3_db_messages_delete(struct mosquitto_db *db, struct mosquitto *context);
 int mqtt3_db_messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain);
 int mqtt3_db_messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
 int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t source_mid, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain, struct mosquitto_msg_store **stored, dbid_t store_id);
 int mqtt3_db_message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_msg_store **stored);
-/* Check all messages waiting on a client reply and resend if timeout has been exceeded. */
-int mqtt3_db_message_timeout_check(struct mosquitto_db *db, unsigned int timeout);
-int mqtt3_db_message_reconnect_reset(struct mosquitto *context);
-int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos);
+/* Drop a reference to a stored message, freeing it immediately once nothing
+ * refers to it. *store is set to NULL. */
+void mqtt3_db_msg_store_deref(struct mosquitto_db *db, struct mosquitto_msg_store **store);
+/* Check the messages of a client that are waiting on a reply and resend if
+ * the retry interval has been exceeded. Called from the client retry timer. */
+void mqtt3_db_message_timeout_check(struct mosquitto_db *db, struct mosquitto *context, time_t now);
+int mqtt3_db_message_reconnect_reset(struct mosquitto_db *db, struct mosquitto *context);
 void mqtt3_db_store_clean(struct mosquitto_db *db);
 void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_time);
+void mqtt3_sys_latency_record(enum mqtt3_latency_type type, uint64_t usec);
+void mqtt3_sys_topic_count(struct mosquitto_db *db, const char *topic, uint32_t payloadlen);
+void mqtt3_sys_cleanup(void);
 void mqtt3_db_vacuum(void);
 
 /* ============================================================
  * Subscription functions
  * ============================================================ */
+/* Check whether sub is a shared subscription, $share/<group>/<filter>. If so,
+ * *group and *group_len are set to the group name and *filter to the start of
+ * the filter within sub.
+ * Returns MOSQ_ERR_SUCCESS for a shared subscription, MOSQ_ERR_NOT_FOUND for
+ * any other subscription, or MOSQ_ERR_INVAL if the group or filter is
+ * missing or the group contains a wildcard. */
+int mqtt3_sub_shared_parse(const char *sub, const char **group, int *group_len, const char **filter);
 int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root);
 int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root);
 int mqtt3_sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *root, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
 void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level);
 int mqtt3_subs_clean_session(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *root);
 
+/* ============================================================
+ * Retained message functions
+ * ============================================================ */
+int mqtt3_retain_store(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos);
+void mqtt3_retain_clean(struct mosquitto_db *db);
+
 /* ============================================================
  * Context functions
  * ============================================================ */
 struct mosquitto *mqtt3_context_init(int sock);
 void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, bool do_free);
 void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_context_keepalive_check(struct mosquitto_db *db, struct mosquitto *context, time_t now);
+void mqtt3_context_expiry_schedule(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_context_expiry_check(struct mosquitto_db *db, struct mosquitto *context, time_t now);
+int mqtt3_context_slot_add(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_context_slot_remove(struct mosquitto_db *db, struct mosquitto *context);
+
+/* ============================================================
+ * Memory pool functions
+ * ============================================================ */
+void *mqtt3_pool_alloc(size_t size);
+void *mqtt3_pool_calloc(size_t size);
+char *mqtt3_pool_strdup(const char *s);
+void mqtt3_pool_free(void *mem, size_t size);
+void mqtt3_pool_strfree(char *s);
+void mqtt3_pool_cleanup(void);
+
+/* ============================================================
+ * Topic intern functions
+ * ============================================================ */
+struct _mosquitto_topic *mqtt3_topic_intern(const char *str);
+void mqtt3_topic_release(struct _mosquitto_topic *topic);
+void mqtt3_topic_idle_expire(time_t now);
+void mqtt3_topic_cleanup(void);
+uint32_t mqtt3_topic_level_hash(const char *level, int len);
+
+/* ============================================================
+ * Timer functions
+ * ============================================================ */
+void mqtt3_timer_init(struct _mosquitto_timer *timer, struct mosquitto *context, enum mosquitto_timer_type type);
+void mqtt3_timer_add(struct _mosquitto_timer *timer, time_t expiry);
+void mqtt3_timer_remove(struct _mosquitto_timer *timer);
+bool mqtt3_timer_pending(struct _mosquitto_timer *timer);
+void mqtt3_timer_process(struct mosquitto_db *db, time_t now);
+
+#ifdef WITH_IO_THREADS
+/* ============================================================
+ * I/O thread functions
+ * ============================================================ */
+/* A socket read or write to be done for one client by the I/O threads. sock
+ * is the client's socket when the job was made; if the client has a
+ * different socket by the time the result is looked at, the result belongs
+ * to a connection that has since gone and is ignored. */
+struct mqtt3_io_job {
+	struct mosquitto *context;
+	int sock;
+	short revents;
+	int rc;
+	ssize_t written;
+};
+
+/* Start thread_count-1 threads to share socket I/O with the main thread. */
+int mqtt3_io_threads_start(int thread_count);
+void mqtt3_io_threads_stop(void);
+/* Refill the receive buffer of each job's client from its socket, unless it
+ * still holds data. */
+void mqtt3_io_threads_read(struct mqtt3_io_job *jobs, int count);
+/* Write out as much of each job's client's queued output as possible. */
+void mqtt3_io_threads_write(struct mqtt3_io_job *jobs, int count);
+#endif
 
 /* ============================================================
  * Logging functions
@@ -402,6 +665,14 @@ int _mosquitto_log_printf(struct mosquitto *mosq, int level, const char *fmt, ..
 int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge);
 int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context);
 void mqtt3_bridge_packet_cleanup(struct mosquitto *context);
+void mqtt3_bridge_timer_check(struct mosquitto_db *db, struct mosquitto *context, time_t now);
+void mqtt3_bridge_cleanup(struct mosquitto *context);
+int mqtt3_bridge_topic_remap_out(struct mosquitto *context, const char *topic, char **mapped_topic);
+int mqtt3_bridge_batch_add(struct mosquitto *context, const char *topic, uint32_t payloadlen, const void *payload, bool retain);
+int mqtt3_bridge_batch_check(struct mosquitto *context);
+int mqtt3_bridge_batch_timeout(struct mosquitto *context);
+void mqtt3_bridge_batch_free(struct _mqtt3_bridge *bridge);
+int mqtt3_bridge_batch_handle(struct mosquitto_db *db, struct mosquitto *context, const uint8_t *frame, uint32_t framelen, uint64_t received_us);
 #endif
 
 /* ============================================================
@@ -414,6 +685,7 @@ int mosquitto_security_init(struct mosquitto_db *db, bool reload);
 int mosquitto_security_apply(struct mosquitto_db *db);
 int mosquitto_security_cleanup(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
+int mosquitto_acl_check_topic(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_topic *topic, int access);
 int mosquitto_unpwd_check(struct mosquitto_db *db, const char *username, const char *password);
 int mosquitto_psk_key_get(struct mosquitto_db *db, const char *hint, const char *identity, char *key, int max_key_len);
 
@@ -421,9 +693,26 @@ int mosquitto_security_init_default(struct mosquitto_db *db, bool reload);
 int mosquitto_security_apply_default(struct mosquitto_db *db);
 int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
+int mosquitto_acl_check_default_topic(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_topic *topic, int access);
+int mosquitto_acl_context_init_default(struct mosquitto_db *db, struct mosquitto *context);
+void mosquitto_acl_context_cleanup_default(struct mosquitto *context);
 int mosquitto_unpwd_check_default(struct mosquitto_db *db, const char *username, const char *password);
 int mosquitto_psk_key_get_default(struct mosquitto_db *db, const char *hint, const char *identity, char *key, int max_key_len);
 
+/* ============================================================
+ * Publish plugin related functions
+ * ============================================================ */
+int mqtt3_publish_plugin_init(struct mosquitto_db *db);
+void mqtt3_publish_plugin_cleanup(struct mosquitto_db *db);
+void mqtt3_publish_plugin_message(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_store *stored);
+void mqtt3_publish_plugin_tick(struct mosquitto_db *db, time_t now);
+
+/* The built in aggregation plugin, configured with the aggregate option. */
+int mqtt3_aggregate_plugin_init(void **user_data, struct mosquitto_publish_opt *opts, int opt_count, mosquitto_publish_plugin_publish_t publish);
+int mqtt3_aggregate_plugin_cleanup(void *user_data, struct mosquitto_publish_opt *opts, int opt_count);
+int mqtt3_aggregate_plugin_message(void *user_data, const char *clientid, const char *topic, int qos, int payloadlen, const void *payload, bool retain);
+void mqtt3_aggregate_plugin_tick(void *user_data, time_t now);
+
 /* ============================================================
  * Window service related functions
  * ============================================================ */
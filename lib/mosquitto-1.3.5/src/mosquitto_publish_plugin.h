@@ -0,0 +1,164 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MOSQUITTO_PUBLISH_PLUGIN_H
+#define MOSQUITTO_PUBLISH_PLUGIN_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#define MOSQ_PUBLISH_PLUGIN_VERSION 1
+
+struct mosquitto_publish_opt {
+	char *key;
+	char *value;
+};
+
+/*
+ * A publish plugin is shown every message published to the broker by a
+ * client or a bridge, and can publish messages of its own. To create one you
+ * must include this file then implement the functions listed below. The
+ * resulting code should then be compiled as a shared library in the same way
+ * as an authentication plugin:
+ *
+ * gcc -I<path to mosquitto_publish_plugin.h> -fPIC -shared plugin.c -o plugin.so
+ *
+ * All of the functions are called from the main broker thread, so they must
+ * not block.
+ */
+
+/*
+ * Type: mosquitto_publish_plugin_publish_t
+ *
+ * The function passed to <mosquitto_publish_plugin_init>, which the plugin
+ * calls to publish a message. The message is delivered to subscribers as
+ * though the broker had published it. It is not shown to any publish plugin.
+ *
+ * Parameters:
+ *
+ *	topic :      The topic to publish on. Must not contain wildcards.
+ *	qos :        The QoS to publish with, 0, 1 or 2.
+ *	payloadlen : The length of payload in bytes.
+ *	payload :    The message payload.
+ *	retain :     Set to true to make the message retained.
+ *
+ * Return value:
+ *	Return 0 on success
+ *	Return >0 on failure.
+ */
+typedef int (*mosquitto_publish_plugin_publish_t)(const char *topic, int qos, int payloadlen, const void *payload, bool retain);
+
+/*
+ * Function: mosquitto_publish_plugin_version
+ *
+ * The broker will call this function immediately after loading the plugin to
+ * check it is a supported plugin version. Your code must simply return
+ * MOSQ_PUBLISH_PLUGIN_VERSION.
+ */
+int mosquitto_publish_plugin_version(void);
+
+/*
+ * Function: mosquitto_publish_plugin_init
+ *
+ * Called after the plugin has been loaded and
+ * <mosquitto_publish_plugin_version> has been called. This will only ever be
+ * called once and can be used to initialise the plugin.
+ *
+ * Parameters:
+ *
+ *	user_data : The pointer set here will be passed to the other plugin
+ *	            functions.
+ *	opts :      Pointer to an array of struct mosquitto_publish_opt, which
+ *	            provides the plugin options defined in the configuration file.
+ *	opt_count : The number of elements in the opts array.
+ *	publish :   The function to call to publish a message. It may be kept and
+ *	            called from any of the other plugin functions.
+ *
+ * Return value:
+ *	Return 0 on success
+ *	Return >0 on failure.
+ */
+int mosquitto_publish_plugin_init(void **user_data, struct mosquitto_publish_opt *opts, int opt_count, mosquitto_publish_plugin_publish_t publish);
+
+/*
+ * Function: mosquitto_publish_plugin_cleanup
+ *
+ * Called when the broker is shutting down. This will only ever be called once.
+ *
+ * Parameters:
+ *
+ *	user_data : The pointer provided in <mosquitto_publish_plugin_init>.
+ *	opts :      Pointer to an array of struct mosquitto_publish_opt, which
+ *	            provides the plugin options defined in the configuration file.
+ *	opt_count : The number of elements in the opts array.
+ *
+ * Return value:
+ *	Return 0 on success
+ *	Return >0 on failure.
+ */
+int mosquitto_publish_plugin_cleanup(void *user_data, struct mosquitto_publish_opt *opts, int opt_count);
+
+/*
+ * Function: mosquitto_publish_plugin_message
+ *
+ * Called once for each message published to the broker, after it has passed
+ * the ACL check and been stored, and before it is delivered. Messages
+ * published by the broker itself, including those in the $SYS hierarchy and
+ * those published by plugins, are not passed to this function. The message
+ * cannot be changed and the function has no say in whether it is delivered.
+ *
+ * Parameters:
+ *
+ *	user_data :  The pointer provided in <mosquitto_publish_plugin_init>.
+ *	clientid :   The id of the client or bridge that published the message.
+ *	topic :      The topic of the message.
+ *	qos :        The QoS of the message.
+ *	payloadlen : The length of payload in bytes.
+ *	payload :    The message payload, which is not NULL terminated.
+ *	retain :     True if the message was published with the retain flag.
+ *
+ * Return value:
+ *	Return 0 on success
+ *	Return >0 on failure. Failures are logged but don't affect the message.
+ */
+int mosquitto_publish_plugin_message(void *user_data, const char *clientid, const char *topic, int qos, int payloadlen, const void *payload, bool retain);
+
+/*
+ * Function: mosquitto_publish_plugin_tick
+ *
+ * Called once a second, for plugins that publish at intervals.
+ *
+ * Parameters:
+ *
+ *	user_data : The pointer provided in <mosquitto_publish_plugin_init>.
+ *	now :       The current wall clock time.
+ */
+void mosquitto_publish_plugin_tick(void *user_data, time_t now);
+
+#endif
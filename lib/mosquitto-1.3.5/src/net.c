@@ -81,7 +81,6 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 	int i;
 	int j;
 	int new_sock = -1;
-	struct mosquitto **tmp_contexts = NULL;
 	struct mosquitto *new_context;
 #ifdef WITH_TLS
 	BIO *bio;
@@ -184,27 +183,23 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 		}
 #endif
 
-		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New connection from %s on port %d.", new_context->address, new_context->listener->port);
-		for(i=0; i<db->context_count; i++){
-			if(db->contexts[i] == NULL){
-				db->contexts[i] = new_context;
-				break;
-			}
+#ifdef WITH_IO_THREADS
+		/* TLS connections are always handled by the main thread. */
+		if(db->config->io_threads > 1){
+#  ifdef WITH_TLS
+			new_context->out_packet_deferred = !new_context->ssl;
+#  else
+			new_context->out_packet_deferred = true;
+#  endif
 		}
-		if(i==db->context_count){
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*(db->context_count+1));
-			if(tmp_contexts){
-				db->context_count++;
-				db->contexts = tmp_contexts;
-				db->contexts[i] = new_context;
-			}else{
-				// Out of memory
-				mqtt3_context_cleanup(NULL, new_context, true);
-				return -1;
-			}
+#endif
+
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New connection from %s on port %d.", new_context->address, new_context->listener->port);
+		if(mqtt3_context_slot_add(db, new_context)){
+			// Out of memory
+			mqtt3_context_cleanup(NULL, new_context, true);
+			return -1;
 		}
-		// If we got here then the context's DB index is "i" regardless of how we got here
-		new_context->db_index = i;
 
 #ifdef WITH_WRAP
 	}
@@ -388,6 +383,8 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 			/* Use even less memory per SSL connection. */
 			SSL_CTX_set_mode(listener->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
 #endif
+			/* A retried write may come from a different coalescing buffer. */
+			SSL_CTX_set_mode(listener->ssl_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 			snprintf(buf, 256, "mosquitto-%d", listener->port);
 			SSL_CTX_set_session_id_context(listener->ssl_ctx, (unsigned char *)buf, strlen(buf));
 
@@ -487,6 +484,8 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 				COMPAT_CLOSE(sock);
 				return 1;
 			}
+			/* A retried write may come from a different coalescing buffer. */
+			SSL_CTX_set_mode(listener->ssl_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 			SSL_CTX_set_psk_server_callback(listener->ssl_ctx, psk_server_callback);
 			if(listener->psk_hint){
 				rc = SSL_CTX_use_psk_identity_hint(listener->ssl_ctx, listener->psk_hint);
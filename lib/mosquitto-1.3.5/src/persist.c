@@ -33,6 +33,10 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifndef WIN32
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #endif
 #include <assert.h>
 #include <errno.h>
@@ -47,7 +51,30 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <time_mosq.h>
 #include "util_mosq.h"
 
+/* Size of the stdio buffer used when writing the database, so that the many
+ * small chunk writes turn into a few large write() calls. */
+#define DB_WRITE_BUFFER_SIZE 262144
+
 static uint32_t db_version;
+#ifndef WIN32
+static pid_t backup_pid = 0;
+/* Journal generation the running background save folds in. */
+static uint32_t backup_folded = 0;
+#endif
+
+/* The journal is a sequence of files named <persistence file>.journal.<gen>.
+ * Each snapshot records the generation of the journal that was opened when
+ * it was taken. Every older generation is folded into the snapshot and can be
+ * removed once the snapshot has been written. */
+static FILE *journal_fptr = NULL;
+static uint32_t journal_gen = 0;
+static uint32_t journal_folded = 0;
+
+/* Stored messages by db_id, only used while restoring. Open addressing,
+ * restore_store_alloc is a power of two. */
+static struct mosquitto_msg_store **restore_stores = NULL;
+static size_t restore_store_alloc = 0;
+static size_t restore_store_count = 0;
 
 
 static int _db_restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos);
@@ -55,15 +82,13 @@ static int _db_restore_sub(struct mosquitto_db *db, const char *client_id, const
 static struct mosquitto *_db_find_or_add_context(struct mosquitto_db *db, const char *client_id, uint16_t last_mid)
 {
 	struct mosquitto *context;
-	struct mosquitto **tmp_contexts;
-	int i;
+	struct _clientid_index_hash *find_cih;
+	struct _clientid_index_hash *new_cih;
 
 	context = NULL;
-	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i] && !strcmp(db->contexts[i]->id, client_id)){
-			context = db->contexts[i];
-			break;
-		}
+	HASH_FIND_STR(db->clientid_index_hash, client_id, find_cih);
+	if(find_cih){
+		context = db->contexts[find_cih->db_context_index];
 	}
 	if(!context){
 		context = mqtt3_context_init(-1);
@@ -71,25 +96,16 @@ static struct mosquitto *_db_find_or_add_context(struct mosquitto_db *db, const
 
 		context->clean_session = false;
 
-		for(i=0; i<db->context_count; i++){
-			if(!db->contexts[i]){
-				db->contexts[i] = context;
-				break;
-			}
-		}
-		if(i==db->context_count){
-			db->context_count++;
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*db->context_count);
-			if(tmp_contexts){
-				db->contexts = tmp_contexts;
-				db->contexts[db->context_count-1] = context;
-			}else{
-				mqtt3_context_cleanup(db, context, true);
-				return NULL;
-			}
-		}
 		context->id = _mosquitto_strdup(client_id);
-		context->db_index = i;
+		new_cih = _mosquitto_malloc(sizeof(struct _clientid_index_hash));
+		if(!context->id || !new_cih || mqtt3_context_slot_add(db, context)){
+			if(new_cih) _mosquitto_free(new_cih);
+			mqtt3_context_cleanup(db, context, true);
+			return NULL;
+		}
+		new_cih->id = context->id;
+		new_cih->db_context_index = context->db_index;
+		HASH_ADD_KEYPTR(hh, db->clientid_index_hash, context->id, strlen(context->id), new_cih);
 	}
 	if(last_mid){
 		context->last_mid = last_mid;
@@ -97,12 +113,56 @@ static struct mosquitto *_db_find_or_add_context(struct mosquitto_db *db, const
 	return context;
 }
 
-static int mqtt3_db_client_messages_write(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context)
+static int _db_client_msg_chunk_write(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
 {
 	uint32_t length;
 	dbid_t i64temp;
 	uint16_t i16temp, slen;
 	uint8_t i8temp;
+
+	slen = strlen(context->id);
+
+	length = htonl(sizeof(dbid_t) + sizeof(uint16_t) + sizeof(uint8_t) +
+			sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t) +
+			sizeof(uint8_t) + 2+slen);
+
+	i16temp = htons(DB_CHUNK_CLIENT_MSG);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, context->id, slen);
+
+	i64temp = cmsg->store->db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+
+	i16temp = htons(cmsg->mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+
+	i8temp = (uint8_t )cmsg->qos;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->retain;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->direction;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->state;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->dup;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int mqtt3_db_client_messages_write(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context)
+{
 	struct mosquitto_client_msg *cmsg;
 
 	assert(db);
@@ -111,42 +171,75 @@ static int mqtt3_db_client_messages_write(struct mosquitto_db *db, FILE *db_fptr
 
 	cmsg = context->msgs;
 	while(cmsg){
-		slen = strlen(context->id);
+		if(_db_client_msg_chunk_write(db_fptr, context, cmsg)) return 1;
+		cmsg = cmsg->next;
+	}
 
-		length = htonl(sizeof(dbid_t) + sizeof(uint16_t) + sizeof(uint8_t) +
-				sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t) +
-				sizeof(uint8_t) + 2+slen);
+	return MOSQ_ERR_SUCCESS;
+}
 
-		i16temp = htons(DB_CHUNK_CLIENT_MSG);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, &length, sizeof(uint32_t));
+static int _db_msg_store_chunk_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
+{
+	uint32_t length;
+	dbid_t i64temp;
+	uint32_t i32temp;
+	uint16_t i16temp, slen;
+	uint8_t i8temp;
+	bool force_no_retain;
 
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, context->id, slen);
+	if(!strncmp(stored->msg.topic, "$SYS", 4)){
+		/* Don't save $SYS messages as retained otherwise they can give
+		 * misleading information when reloaded. They should still be saved
+		 * because a disconnected durable client may have them in their
+		 * queue. */
+		force_no_retain = true;
+	}else{
+		force_no_retain = false;
+	}
+	length = htonl(sizeof(dbid_t) + 2+strlen(stored->source_id) +
+			sizeof(uint16_t) + sizeof(uint16_t) +
+			2+strlen(stored->msg.topic) + sizeof(uint32_t) +
+			stored->msg.payloadlen + sizeof(uint8_t) + sizeof(uint8_t));
 
-		i64temp = cmsg->store->db_id;
-		write_e(db_fptr, &i64temp, sizeof(dbid_t));
+	i16temp = htons(DB_CHUNK_MSG_STORE);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
 
-		i16temp = htons(cmsg->mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	i64temp = stored->db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
 
-		i8temp = (uint8_t )cmsg->qos;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	slen = strlen(stored->source_id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	if(slen){
+		write_e(db_fptr, stored->source_id, slen);
+	}
 
-		i8temp = (uint8_t )cmsg->retain;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	i16temp = htons(stored->source_mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
 
-		i8temp = (uint8_t )cmsg->direction;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	i16temp = htons(stored->msg.mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
 
-		i8temp = (uint8_t )cmsg->state;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	slen = strlen(stored->msg.topic);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, stored->msg.topic, slen);
 
-		i8temp = (uint8_t )cmsg->dup;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	i8temp = (uint8_t )stored->msg.qos;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
 
-		cmsg = cmsg->next;
+	if(force_no_retain == false){
+		i8temp = (uint8_t )stored->msg.retain;
+	}else{
+		i8temp = 0;
+	}
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i32temp = htonl(stored->msg.payloadlen);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	if(stored->msg.payloadlen){
+		write_e(db_fptr, stored->msg.payload, (unsigned int)stored->msg.payloadlen);
 	}
 
 	return MOSQ_ERR_SUCCESS;
@@ -155,79 +248,40 @@ error:
 	return 1;
 }
 
-
 static int mqtt3_db_message_store_write(struct mosquitto_db *db, FILE *db_fptr)
 {
-	uint32_t length;
-	dbid_t i64temp;
-	uint32_t i32temp;
-	uint16_t i16temp, slen;
-	uint8_t i8temp;
 	struct mosquitto_msg_store *stored;
-	bool force_no_retain;
 
 	assert(db);
 	assert(db_fptr);
 
 	stored = db->msg_store;
 	while(stored){
-		if(!strncmp(stored->msg.topic, "$SYS", 4)){
-			/* Don't save $SYS messages as retained otherwise they can give
-			 * misleading information when reloaded. They should still be saved
-			 * because a disconnected durable client may have them in their
-			 * queue. */
-			force_no_retain = true;
-		}else{
-			force_no_retain = false;
-		}
-		length = htonl(sizeof(dbid_t) + 2+strlen(stored->source_id) +
-				sizeof(uint16_t) + sizeof(uint16_t) +
-				2+strlen(stored->msg.topic) + sizeof(uint32_t) +
-				stored->msg.payloadlen + sizeof(uint8_t) + sizeof(uint8_t));
-
-		i16temp = htons(DB_CHUNK_MSG_STORE);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, &length, sizeof(uint32_t));
-
-		i64temp = stored->db_id;
-		write_e(db_fptr, &i64temp, sizeof(dbid_t));
-
-		slen = strlen(stored->source_id);
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		if(slen){
-			write_e(db_fptr, stored->source_id, slen);
-		}
-
-		i16temp = htons(stored->source_mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-
-		i16temp = htons(stored->msg.mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+		if(_db_msg_store_chunk_write(db_fptr, stored)) return 1;
+		stored = stored->next;
+	}
 
-		slen = strlen(stored->msg.topic);
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, stored->msg.topic, slen);
+	return MOSQ_ERR_SUCCESS;
+}
 
-		i8temp = (uint8_t )stored->msg.qos;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+static int _db_client_chunk_write(FILE *db_fptr, struct mosquitto *context)
+{
+	uint16_t i16temp, slen;
+	uint32_t length;
 
-		if(force_no_retain == false){
-			i8temp = (uint8_t )stored->msg.retain;
-		}else{
-			i8temp = 0;
-		}
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	length = htonl(2+strlen(context->id) + sizeof(uint16_t) + sizeof(time_t));
 
-		i32temp = htonl(stored->msg.payloadlen);
-		write_e(db_fptr, &i32temp, sizeof(uint32_t));
-		if(stored->msg.payloadlen){
-			write_e(db_fptr, stored->msg.payload, (unsigned int)stored->msg.payloadlen);
-		}
+	i16temp = htons(DB_CHUNK_CLIENT);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
 
-		stored = stored->next;
-	}
+	slen = strlen(context->id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, context->id, slen);
+	i16temp = htons(context->last_mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &(context->disconnect_t), sizeof(time_t));
 
 	return MOSQ_ERR_SUCCESS;
 error:
@@ -239,8 +293,6 @@ static int mqtt3_db_client_write(struct mosquitto_db *db, FILE *db_fptr)
 {
 	int i;
 	struct mosquitto *context;
-	uint16_t i16temp, slen;
-	uint32_t length;
 
 	assert(db);
 	assert(db_fptr);
@@ -248,38 +300,71 @@ static int mqtt3_db_client_write(struct mosquitto_db *db, FILE *db_fptr)
 	for(i=0; i<db->context_count; i++){
 		context = db->contexts[i];
 		if(context && context->clean_session == false){
-			length = htonl(2+strlen(context->id) + sizeof(uint16_t) + sizeof(time_t));
-
-			i16temp = htons(DB_CHUNK_CLIENT);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
-
-			slen = strlen(context->id);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, context->id, slen);
-			i16temp = htons(context->last_mid);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &(context->disconnect_t), sizeof(time_t));
-
+			if(_db_client_chunk_write(db_fptr, context)) return 1;
 			if(mqtt3_db_client_messages_write(db, db_fptr, context)) return 1;
 		}
 	}
 
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_sub_chunk_write(FILE *db_fptr, const char *client_id, const char *topic, uint8_t qos)
+{
+	uint32_t length;
+	uint16_t i16temp;
+	size_t slen;
+
+	length = htonl(2+strlen(client_id) + 2+strlen(topic) + sizeof(uint8_t));
+
+	i16temp = htons(DB_CHUNK_SUB);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	slen = strlen(client_id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, client_id, slen);
+
+	slen = strlen(topic);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, topic, slen);
+
+	write_e(db_fptr, &qos, sizeof(uint8_t));
+
 	return MOSQ_ERR_SUCCESS;
 error:
 	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
 	return 1;
 }
 
-static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct _mosquitto_subhier *node, const char *topic)
+static int _db_retain_chunk_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
 {
-	struct _mosquitto_subhier *subhier;
-	struct _mosquitto_subleaf *sub;
-	char *thistopic;
 	uint32_t length;
 	uint16_t i16temp;
 	dbid_t i64temp;
+
+	length = htonl(sizeof(dbid_t));
+
+	i16temp = htons(DB_CHUNK_RETAIN);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &length, sizeof(uint32_t));
+
+	i64temp = stored->db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct _mosquitto_subhier *node, const char *topic)
+{
+	struct _mosquitto_subhier *subhier;
+	struct _mosquitto_subleaf *sub;
+	struct _mosquitto_subshared *shared;
+	char *thistopic, *sharedtopic;
 	size_t slen;
 
 	slen = strlen(topic) + strlen(node->topic) + 2;
@@ -294,38 +379,36 @@ static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct
 	sub = node->subs;
 	while(sub){
 		if(sub->context->clean_session == false){
-			length = htonl(2+strlen(sub->context->id) + 2+strlen(thistopic) + sizeof(uint8_t));
-
-			i16temp = htons(DB_CHUNK_SUB);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
-
-			slen = strlen(sub->context->id);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, sub->context->id, slen);
-
-			slen = strlen(thistopic);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, thistopic, slen);
-
-			write_e(db_fptr, &sub->qos, sizeof(uint8_t));
+			if(_db_sub_chunk_write(db_fptr, sub->context->id, thistopic, sub->qos)){
+				_mosquitto_free(thistopic);
+				return 1;
+			}
 		}
 		sub = sub->next;
 	}
-	if(node->retained){
-		if(strncmp(node->retained->msg.topic, "$SYS", 4)){
-			/* Don't save $SYS messages. */
-			length = htonl(sizeof(dbid_t));
 
-			i16temp = htons(DB_CHUNK_RETAIN);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
-
-			i64temp = node->retained->db_id;
-			write_e(db_fptr, &i64temp, sizeof(dbid_t));
+	shared = node->shared;
+	while(shared){
+		slen = strlen("$share//") + strlen(shared->name) + strlen(thistopic) + 1;
+		sharedtopic = _mosquitto_malloc(slen);
+		if(!sharedtopic){
+			_mosquitto_free(thistopic);
+			return MOSQ_ERR_NOMEM;
 		}
+		snprintf(sharedtopic, slen, "$share/%s/%s", shared->name, thistopic);
+		sub = shared->subs;
+		while(sub){
+			if(sub->context->clean_session == false){
+				if(_db_sub_chunk_write(db_fptr, sub->context->id, sharedtopic, sub->qos)){
+					_mosquitto_free(sharedtopic);
+					_mosquitto_free(thistopic);
+					return 1;
+				}
+			}
+			sub = sub->next;
+		}
+		_mosquitto_free(sharedtopic);
+		shared = shared->next;
 	}
 
 	subhier = node->children;
@@ -335,9 +418,22 @@ static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct
 	}
 	_mosquitto_free(thistopic);
 	return MOSQ_ERR_SUCCESS;
-error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	return 1;
+}
+
+static int _db_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct _mosquitto_retainhier *node)
+{
+	struct _mosquitto_retainhier *child, *tmp;
+
+	HASH_ITER(hh, node->children, child, tmp){
+		if(child->retained && strncmp(child->retained->msg.topic, "$SYS", 4)){
+			/* Don't save $SYS messages. */
+			if(_db_retain_chunk_write(db_fptr, child->retained)) return 1;
+		}
+		if(child->children){
+			if(_db_retain_write(db, db_fptr, child)) return 1;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
 }
 
 static int mqtt3_db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr)
@@ -350,10 +446,10 @@ static int mqtt3_db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr)
 		subhier = subhier->next;
 	}
 	
-	return MOSQ_ERR_SUCCESS;
+	return _db_retain_write(db, db_fptr, &db->retains);
 }
 
-int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
+static int _db_backup_write(struct mosquitto_db *db, bool shutdown)
 {
 	int rc = 0;
 	FILE *db_fptr = NULL;
@@ -367,11 +463,7 @@ int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
 	char *outfile = NULL;
 	int len;
 
-	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
 	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
-	if(cleanup){
-		mqtt3_db_store_clean(db);
-	}
 
 	len = strlen(db->config->persistence_filepath)+5;
 	outfile = _mosquitto_calloc(len+1, 1);
@@ -385,6 +477,7 @@ int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
 		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, unable to open %s for writing.", outfile);
 		goto error;
 	}
+	setvbuf(db_fptr, NULL, _IOFBF, DB_WRITE_BUFFER_SIZE);
 
 	/* Header */
 	write_e(db_fptr, magic, 15);
@@ -406,6 +499,15 @@ int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
 	i64temp = db->last_db_id;
 	write_e(db_fptr, &i64temp, sizeof(dbid_t));
 
+	if(db->config->persistence_journal){
+		i16temp = htons(DB_CHUNK_JOURNAL);
+		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+		i32temp = htonl(sizeof(uint32_t));
+		write_e(db_fptr, &i32temp, sizeof(uint32_t));
+		i32temp = htonl(journal_gen);
+		write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	}
+
 	if(mqtt3_db_message_store_write(db, db_fptr)){
 		goto error;
 	}
@@ -434,301 +536,681 @@ error:
 	return 1;
 }
 
-static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id, uint16_t mid, uint8_t qos, uint8_t retain, uint8_t direction, uint8_t state, uint8_t dup, uint64_t store_id)
+static char *_db_journal_path(struct mosquitto_db *db, uint32_t gen)
 {
-	struct mosquitto_client_msg *cmsg;
-	struct mosquitto_msg_store *store;
-	struct mosquitto *context;
+	char *path;
+	int len;
 
-	cmsg = _mosquitto_calloc(1, sizeof(struct mosquitto_client_msg));
-	if(!cmsg){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
+	len = strlen(db->config->persistence_filepath) + strlen(".journal.") + 11;
+	path = _mosquitto_malloc(len);
+	if(!path) return NULL;
+	snprintf(path, len, "%s.journal.%u", db->config->persistence_filepath, gen);
 
-	cmsg->store = NULL;
-	cmsg->mid = mid;
-	cmsg->qos = qos;
-	cmsg->retain = retain;
-	cmsg->direction = direction;
-	cmsg->state = state;
-	cmsg->dup = dup;
+	return path;
+}
 
-	store = db->msg_store;
-	while(store){
-		if(store->db_id == store_id){
-			cmsg->store = store;
-			cmsg->store->ref_count++;
-			break;
-		}
-		store = store->next;
-	}
-	if(!cmsg->store){
-		_mosquitto_free(cmsg);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
-		return 1;
+static int _db_journal_open(struct mosquitto_db *db)
+{
+	uint32_t db_version_w = htonl(MOSQ_DB_VERSION);
+	uint32_t crc = htonl(0);
+	char *path;
+
+	path = _db_journal_path(db, journal_gen);
+	if(!path){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
 	}
-	context = _db_find_or_add_context(db, client_id, 0);
-	if(!context){
-		_mosquitto_free(cmsg);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+	journal_fptr = _mosquitto_fopen(path, "wb");
+	if(!journal_fptr){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open journal %s: %s.", path, strerror(errno));
+		_mosquitto_free(path);
 		return 1;
 	}
-	if(context->msgs){
-		context->last_msg->next = cmsg;
-	}else{
-		context->msgs = cmsg;
-	}
-	cmsg->next = NULL;
-	context->last_msg = cmsg;
+	_mosquitto_free(path);
+	setvbuf(journal_fptr, NULL, _IOFBF, DB_WRITE_BUFFER_SIZE);
+
+	write_e(journal_fptr, magic, 15);
+	write_e(journal_fptr, &crc, sizeof(uint32_t));
+	write_e(journal_fptr, &db_version_w, sizeof(uint32_t));
 
 	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	fclose(journal_fptr);
+	journal_fptr = NULL;
+	return 1;
 }
 
-static int _db_client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+/* A journal write failed. Stop journalling until the next snapshot, which
+ * will contain everything the journal is missing. */
+static void _db_journal_error(void)
 {
-	uint16_t i16temp, slen, last_mid;
-	char *client_id = NULL;
-	int rc = 0;
-	struct mosquitto *context;
-	time_t disconnect_t;
-	struct _clientid_index_hash *new_cih;
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to write to journal, journalling suspended until the next save.");
+	fclose(journal_fptr);
+	journal_fptr = NULL;
+}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(!slen){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
-		fclose(db_fptr);
-		return 1;
+/* Close the current journal and, if reopen is true, start the next
+ * generation. Returns the generation that a snapshot taken now folds in. */
+static uint32_t _db_journal_rotate(struct mosquitto_db *db, bool reopen)
+{
+	if(!db->config->persistence_journal) return journal_folded;
+
+	if(journal_fptr){
+		fclose(journal_fptr);
+		journal_fptr = NULL;
 	}
-	client_id = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!client_id){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+	journal_gen++;
+	if(reopen){
+		_db_journal_open(db);
 	}
-	read_e(db_fptr, client_id, slen);
+	return journal_gen;
+}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	last_mid = ntohs(i16temp);
+/* A snapshot folding in every generation before folded has been written, so
+ * those journals are no longer needed. */
+static void _db_journal_fold(struct mosquitto_db *db, uint32_t folded)
+{
+	char *path;
 
-	if(db_version == 2){
-		disconnect_t = mosquitto_time();
-	}else{
-		read_e(db_fptr, &disconnect_t, sizeof(time_t));
+	for(; journal_folded < folded; journal_folded++){
+		path = _db_journal_path(db, journal_folded);
+		if(path){
+			remove(path);
+			_mosquitto_free(path);
+		}
 	}
+}
 
-	context = _db_find_or_add_context(db, client_id, last_mid);
-	if(context){
+int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
+{
+	uint32_t folded;
+	int rc;
+
+	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+	if(cleanup){
+		mqtt3_db_store_clean(db);
+	}
+
+	folded = _db_journal_rotate(db, !shutdown);
+	rc = _db_backup_write(db, shutdown);
+	if(!rc){
+		_db_journal_fold(db, folded);
+	}
+	return rc;
+}
+
+/* Save the database without stopping the main loop. The save is done by a
+ * forked child working on a copy-on-write snapshot of the broker's memory,
+ * so the parent carries on serving clients. Falls back to a normal save if
+ * autosave_fork is false, on Windows, or if the fork fails. */
+int mqtt3_db_backup_background(struct mosquitto_db *db)
+{
+#ifndef WIN32
+	pid_t pid;
+	uint32_t folded;
+	int rc;
+
+	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+
+	if(db->config->autosave_fork){
+		mqtt3_db_backup_check(db, false);
+		if(backup_pid > 0){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Database save already in progress, skipping.");
+			return MOSQ_ERR_SUCCESS;
+		}
+		folded = _db_journal_rotate(db, true);
+		fflush(NULL);
+		pid = fork();
+		if(pid == 0){
+			/* The journal belongs to the parent. */
+			journal_fptr = NULL;
+			rc = _db_backup_write(db, false);
+			fflush(NULL);
+			_exit(rc ? 1 : 0);
+		}else if(pid > 0){
+			backup_pid = pid;
+			backup_folded = folded;
+			return MOSQ_ERR_SUCCESS;
+		}
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to fork for database save: %s.", strerror(errno));
+		rc = _db_backup_write(db, false);
+		if(!rc){
+			_db_journal_fold(db, folded);
+		}
+		return rc;
+	}
+#endif
+	return mqtt3_db_backup(db, false, false);
+}
+
+/* Reap a finished background save, if there is one. If wait is true, block
+ * until any save in progress has completed. */
+void mqtt3_db_backup_check(struct mosquitto_db *db, bool wait)
+{
+#ifndef WIN32
+	int status;
+	pid_t rc;
+
+	if(backup_pid <= 0) return;
+
+	rc = waitpid(backup_pid, &status, wait?0:WNOHANG);
+	if(rc == 0 || (rc == -1 && errno == EINTR)) return;
+
+	if(rc == -1){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to check database save: %s.", strerror(errno));
+	}else if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Background database save failed.");
+	}else{
+		_db_journal_fold(db, backup_folded);
+	}
+	backup_pid = 0;
+#endif
+}
+
+/* Start journalling. Called once the database has been restored. */
+int mqtt3_db_journal_open(struct mosquitto_db *db)
+{
+	uint32_t gen;
+	char *path;
+
+	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+
+	/* Journals from an earlier run that the restore didn't use, for example
+	 * because the snapshot was written with journalling disabled, must not
+	 * be replayed after a later crash. */
+	for(gen=journal_gen+1; ; gen++){
+		path = _db_journal_path(db, gen);
+		if(!path) break;
+		if(remove(path)){
+			_mosquitto_free(path);
+			break;
+		}
+		_mosquitto_free(path);
+	}
+	return _db_journal_open(db);
+}
+
+/* Hand buffered journal records to the operating system. Called once per
+ * pass of the main loop. */
+void mqtt3_db_journal_flush(struct mosquitto_db *db)
+{
+	if(!journal_fptr) return;
+
+	if(fflush(journal_fptr)){
+		_db_journal_error();
+	}
+}
+
+static int _db_journal_store(struct mosquitto_msg_store *stored)
+{
+	if(stored->journaled) return MOSQ_ERR_SUCCESS;
+
+	if(_db_msg_store_chunk_write(journal_fptr, stored)) return 1;
+	stored->journaled = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Write a chunk made of a client id, optionally followed by a client message
+ * mid and direction, and a state. */
+static int _db_journal_client_record(uint16_t chunk, struct mosquitto *context, struct mosquitto_client_msg *cmsg, bool with_state)
+{
+	uint32_t length;
+	uint16_t i16temp, slen;
+	uint8_t i8temp;
+
+	slen = strlen(context->id);
+	length = 2+slen;
+	if(cmsg){
+		length += sizeof(uint16_t) + sizeof(uint8_t);
+		if(with_state) length += sizeof(uint8_t);
+	}
+	length = htonl(length);
+
+	i16temp = htons(chunk);
+	write_e(journal_fptr, &i16temp, sizeof(uint16_t));
+	write_e(journal_fptr, &length, sizeof(uint32_t));
+
+	i16temp = htons(slen);
+	write_e(journal_fptr, &i16temp, sizeof(uint16_t));
+	write_e(journal_fptr, context->id, slen);
+
+	if(cmsg){
+		i16temp = htons(cmsg->mid);
+		write_e(journal_fptr, &i16temp, sizeof(uint16_t));
+		i8temp = (uint8_t )cmsg->direction;
+		write_e(journal_fptr, &i8temp, sizeof(uint8_t));
+		if(with_state){
+			i8temp = (uint8_t )cmsg->state;
+			write_e(journal_fptr, &i8temp, sizeof(uint8_t));
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+void mqtt3_db_journal_client(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(!journal_fptr || context->clean_session || !context->id) return;
+
+	if(_db_client_chunk_write(journal_fptr, context)){
+		_db_journal_error();
+	}
+}
+
+void mqtt3_db_journal_client_delete(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(!journal_fptr || !context->id) return;
+
+	if(_db_journal_client_record(DB_CHUNK_CLIENT_DEL, context, NULL, false)){
+		_db_journal_error();
+	}
+}
+
+/* QoS 0 messages all share mid 0, so they can't be told apart in later
+ * records and are only saved by snapshots. */
+void mqtt3_db_journal_client_msg(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	if(!journal_fptr || context->clean_session || !context->id || cmsg->qos == 0) return;
+
+	if(_db_journal_store(cmsg->store) || _db_client_msg_chunk_write(journal_fptr, context, cmsg)){
+		_db_journal_error();
+	}
+}
+
+void mqtt3_db_journal_client_msg_update(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	if(!journal_fptr || context->clean_session || !context->id || cmsg->qos == 0) return;
+
+	if(_db_journal_client_record(DB_CHUNK_CLIENT_MSG_UPDATE, context, cmsg, true)){
+		_db_journal_error();
+	}
+}
+
+void mqtt3_db_journal_client_msg_delete(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	if(!journal_fptr || context->clean_session || !context->id || cmsg->qos == 0) return;
+
+	if(_db_journal_client_record(DB_CHUNK_CLIENT_MSG_DEL, context, cmsg, false)){
+		_db_journal_error();
+	}
+}
+
+void mqtt3_db_journal_sub(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos)
+{
+	if(!journal_fptr || context->clean_session || !context->id) return;
+
+	if(_db_sub_chunk_write(journal_fptr, context->id, sub, (uint8_t)qos)){
+		_db_journal_error();
+	}
+}
+
+void mqtt3_db_journal_sub_delete(struct mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	uint32_t length;
+	uint16_t i16temp, slen;
+
+	if(!journal_fptr || context->clean_session || !context->id) return;
+
+	length = htonl(2+strlen(context->id) + 2+strlen(sub));
+
+	i16temp = htons(DB_CHUNK_SUB_DEL);
+	write_e(journal_fptr, &i16temp, sizeof(uint16_t));
+	write_e(journal_fptr, &length, sizeof(uint32_t));
+
+	slen = strlen(context->id);
+	i16temp = htons(slen);
+	write_e(journal_fptr, &i16temp, sizeof(uint16_t));
+	write_e(journal_fptr, context->id, slen);
+
+	slen = strlen(sub);
+	i16temp = htons(slen);
+	write_e(journal_fptr, &i16temp, sizeof(uint16_t));
+	write_e(journal_fptr, sub, slen);
+
+	return;
+error:
+	_db_journal_error();
+}
+
+/* A retained message was set or, if it has no payload, cleared. */
+void mqtt3_db_journal_retain(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	if(!journal_fptr || !strncmp(stored->msg.topic, "$SYS", 4)) return;
+
+	if(_db_journal_store(stored) || _db_retain_chunk_write(journal_fptr, stored)){
+		_db_journal_error();
+	}
+}
+
+static size_t _db_store_hash(dbid_t db_id, size_t mask)
+{
+	return (size_t)(((db_id ^ (db_id >> 31)) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+/* Make room for count more entries in the db_id to stored message table used
+ * while restoring. */
+static int _db_store_table_reserve(size_t count)
+{
+	struct mosquitto_msg_store **old;
+	size_t old_alloc, alloc, i, h;
+
+	if((restore_store_count + count)*2 <= restore_store_alloc) return MOSQ_ERR_SUCCESS;
+
+	alloc = restore_store_alloc ? restore_store_alloc : 1024;
+	while(alloc < (restore_store_count + count)*2){
+		alloc *= 2;
+	}
+	old = restore_stores;
+	old_alloc = restore_store_alloc;
+	restore_stores = _mosquitto_calloc(alloc, sizeof(struct mosquitto_msg_store *));
+	if(!restore_stores){
+		restore_stores = old;
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	restore_store_alloc = alloc;
+	for(i=0; i<old_alloc; i++){
+		if(old[i]){
+			h = _db_store_hash(old[i]->db_id, alloc-1);
+			while(restore_stores[h]){
+				h = (h+1) & (alloc-1);
+			}
+			restore_stores[h] = old[i];
+		}
+	}
+	if(old) _mosquitto_free(old);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* The table holds a reference to every stored message until the restore is
+ * finished, so that a message a journal drops and later refers to again
+ * isn't freed in between. */
+static int _db_store_table_add(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	size_t h;
+
+	if(_db_store_table_reserve(1)) return MOSQ_ERR_NOMEM;
+
+	h = _db_store_hash(stored->db_id, restore_store_alloc-1);
+	while(restore_stores[h]){
+		if(restore_stores[h]->db_id == stored->db_id){
+			/* Saved again by a journal after the snapshot was taken. */
+			mqtt3_db_msg_store_deref(db, &restore_stores[h]);
+			restore_store_count--;
+			break;
+		}
+		h = (h+1) & (restore_store_alloc-1);
+	}
+	stored->ref_count++;
+	restore_stores[h] = stored;
+	restore_store_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct mosquitto_msg_store *_db_store_table_find(dbid_t db_id)
+{
+	size_t h;
+
+	if(!restore_store_alloc) return NULL;
+
+	h = _db_store_hash(db_id, restore_store_alloc-1);
+	while(restore_stores[h]){
+		if(restore_stores[h]->db_id == db_id){
+			return restore_stores[h];
+		}
+		h = (h+1) & (restore_store_alloc-1);
+	}
+	return NULL;
+}
+
+/* Drop the table's references, freeing stored messages that nothing else
+ * refers to. */
+static void _db_store_table_release(struct mosquitto_db *db)
+{
+	size_t i;
+
+	for(i=0; i<restore_store_alloc; i++){
+		if(restore_stores[i]){
+			mqtt3_db_msg_store_deref(db, &restore_stores[i]);
+		}
+	}
+	if(restore_stores) _mosquitto_free(restore_stores);
+	restore_stores = NULL;
+	restore_store_alloc = 0;
+	restore_store_count = 0;
+}
+
+static int _db_read(struct _db_reader *rd, void *buf, size_t len)
+{
+	if((size_t)(rd->end - rd->pos) < len) return 1;
+
+	memcpy(buf, rd->pos, len);
+	rd->pos += len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Read a string with a 16 bit length prefix into a new NUL terminated
+ * buffer. */
+static int _db_read_string(struct _db_reader *rd, char **str)
+{
+	uint16_t i16temp, slen;
+
+	*str = NULL;
+	read_e(rd, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	if((size_t)(rd->end - rd->pos) < slen) return 1;
+
+	*str = _mosquitto_malloc(slen+1);
+	if(!*str){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(*str, rd->pos, slen);
+	(*str)[slen] = '\0';
+	rd->pos += slen;
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id, uint16_t mid, uint8_t qos, uint8_t retain, uint8_t direction, uint8_t state, uint8_t dup, uint64_t store_id)
+{
+	struct mosquitto_client_msg *cmsg;
+	struct mosquitto_msg_store *store;
+	struct mosquitto *context;
+
+	store = _db_store_table_find(store_id);
+	if(!store){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+		return 1;
+	}
+	context = _db_find_or_add_context(db, client_id, 0);
+	if(!context){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+		return 1;
+	}
+
+	cmsg = mqtt3_pool_calloc(sizeof(struct mosquitto_client_msg));
+	if(!cmsg){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+
+	cmsg->store = store;
+	cmsg->store->ref_count++;
+	cmsg->mid = mid;
+	cmsg->qos = qos;
+	cmsg->retain = retain;
+	cmsg->direction = direction;
+	cmsg->state = state;
+	cmsg->dup = dup;
+
+	if(context->msgs){
+		context->last_msg->next = cmsg;
+	}else{
+		context->msgs = cmsg;
+	}
+	cmsg->next = NULL;
+	context->last_msg = cmsg;
+	context->msg_count++;
+	if(cmsg->qos > 0){
+		context->msg_count12++;
+	}
+	if(direction == mosq_md_out && mid){
+		/* Journals record outgoing messages sent after the client chunk
+		 * that holds last_mid. */
+		context->last_mid = mid;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_client_chunk_restore(struct mosquitto_db *db, struct _db_reader *rd)
+{
+	uint16_t i16temp, last_mid;
+	char *client_id = NULL;
+	int rc = 0;
+	struct mosquitto *context;
+	time_t disconnect_t;
+
+	if(_db_read_string(rd, &client_id) || !client_id[0]) goto error;
+
+	read_e(rd, &i16temp, sizeof(uint16_t));
+	last_mid = ntohs(i16temp);
+
+	if(db_version == 2){
+		disconnect_t = mosquitto_time();
+	}else{
+		read_e(rd, &disconnect_t, sizeof(time_t));
+	}
+
+	context = _db_find_or_add_context(db, client_id, last_mid);
+	if(context){
 		context->disconnect_t = disconnect_t;
+		mqtt3_context_expiry_schedule(db, context);
 	}else{
 		rc = 1;
 	}
 
 	_mosquitto_free(client_id);
 
-	if(!rc){
-		new_cih = _mosquitto_malloc(sizeof(struct _clientid_index_hash));
-		if(!new_cih){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
-		}
-		new_cih->id = context->id;
-		new_cih->db_context_index = context->db_index;
-		HASH_ADD_KEYPTR(hh, db->clientid_index_hash, context->id, strlen(context->id), new_cih);
-	}
 	return rc;
 error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	fclose(db_fptr);
 	if(client_id) _mosquitto_free(client_id);
 	return 1;
 }
 
-static int _db_client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_client_msg_chunk_restore(struct mosquitto_db *db, struct _db_reader *rd)
 {
 	dbid_t i64temp, store_id;
-	uint16_t i16temp, slen, mid;
+	uint16_t i16temp, mid;
 	uint8_t qos, retain, direction, state, dup;
 	char *client_id = NULL;
 	int rc;
-	char err[256];
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(!slen){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
-		fclose(db_fptr);
-		return 1;
-	}
-	client_id = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!client_id){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-	read_e(db_fptr, client_id, slen);
+	if(_db_read_string(rd, &client_id) || !client_id[0]) goto error;
 
-	read_e(db_fptr, &i64temp, sizeof(dbid_t));
+	read_e(rd, &i64temp, sizeof(dbid_t));
 	store_id = i64temp;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	read_e(rd, &i16temp, sizeof(uint16_t));
 	mid = ntohs(i16temp);
 
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	read_e(db_fptr, &retain, sizeof(uint8_t));
-	read_e(db_fptr, &direction, sizeof(uint8_t));
-	read_e(db_fptr, &state, sizeof(uint8_t));
-	read_e(db_fptr, &dup, sizeof(uint8_t));
+	read_e(rd, &qos, sizeof(uint8_t));
+	read_e(rd, &retain, sizeof(uint8_t));
+	read_e(rd, &direction, sizeof(uint8_t));
+	read_e(rd, &state, sizeof(uint8_t));
+	read_e(rd, &dup, sizeof(uint8_t));
 
 	rc = _db_client_msg_restore(db, client_id, mid, qos, retain, direction, state, dup, store_id);
 	_mosquitto_free(client_id);
 
 	return rc;
 error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	fclose(db_fptr);
 	if(client_id) _mosquitto_free(client_id);
 	return 1;
 }
 
-static int _db_msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_msg_store_chunk_restore(struct mosquitto_db *db, struct _db_reader *rd)
 {
 	dbid_t i64temp, store_id;
 	uint32_t i32temp, payloadlen;
-	uint16_t i16temp, slen, source_mid;
-	uint8_t qos, retain, *payload = NULL;
+	uint16_t i16temp, source_mid;
+	uint8_t qos, retain;
 	char *source_id = NULL;
 	char *topic = NULL;
 	int rc = 0;
 	struct mosquitto_msg_store *stored = NULL;
-	char err[256];
 
-	read_e(db_fptr, &i64temp, sizeof(dbid_t));
+	read_e(rd, &i64temp, sizeof(dbid_t));
 	store_id = i64temp;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(slen){
-		source_id = _mosquitto_calloc(slen+1, sizeof(char));
-		if(!source_id){
-			fclose(db_fptr);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
-		}
-		read_e(db_fptr, source_id, slen);
-	}
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	if(_db_read_string(rd, &source_id)) goto error;
+	read_e(rd, &i16temp, sizeof(uint16_t));
 	source_mid = ntohs(i16temp);
 
 	/* This is the mid - don't need it */
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	read_e(rd, &i16temp, sizeof(uint16_t));
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(slen){
-		topic = _mosquitto_calloc(slen+1, sizeof(char));
-		if(!topic){
-			fclose(db_fptr);
-			if(source_id) _mosquitto_free(source_id);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
-		}
-		read_e(db_fptr, topic, slen);
-	}else{
+	if(_db_read_string(rd, &topic)) goto error;
+	if(!topic[0]){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid msg_store chunk when restoring persistent database.");
-		fclose(db_fptr);
-		if(source_id) _mosquitto_free(source_id);
-		return 1;
+		goto error;
 	}
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	read_e(db_fptr, &retain, sizeof(uint8_t));
-	
-	read_e(db_fptr, &i32temp, sizeof(uint32_t));
+	read_e(rd, &qos, sizeof(uint8_t));
+	read_e(rd, &retain, sizeof(uint8_t));
+
+	read_e(rd, &i32temp, sizeof(uint32_t));
 	payloadlen = ntohl(i32temp);
+	if((size_t)(rd->end - rd->pos) < payloadlen) goto error;
 
-	if(payloadlen){
-		payload = _mosquitto_malloc(payloadlen);
-		if(!payload){
-			fclose(db_fptr);
-			if(source_id) _mosquitto_free(source_id);
-			_mosquitto_free(topic);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
+	/* The payload is copied straight out of the mapped file. */
+	rc = mqtt3_db_message_store(db, source_id, source_mid, topic, qos, payloadlen, rd->pos, retain, &stored, store_id);
+	rd->pos += payloadlen;
+	if(!rc){
+		if(store_id > db->last_db_id){
+			/* Stored after the snapshot was taken. */
+			db->last_db_id = store_id;
 		}
-		read_e(db_fptr, payload, payloadlen);
+		rc = _db_store_table_add(db, stored);
 	}
-
-	rc = mqtt3_db_message_store(db, source_id, source_mid, topic, qos, payloadlen, payload, retain, &stored, store_id);
-	if(source_id) _mosquitto_free(source_id);
+	_mosquitto_free(source_id);
 	_mosquitto_free(topic);
-	_mosquitto_free(payload);
 
 	return rc;
 error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	fclose(db_fptr);
 	if(source_id) _mosquitto_free(source_id);
 	if(topic) _mosquitto_free(topic);
-	if(payload) _mosquitto_free(payload);
 	return 1;
 }
 
-static int _db_retain_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_retain_chunk_restore(struct mosquitto_db *db, struct _db_reader *rd)
 {
-	dbid_t i64temp, store_id;
+	dbid_t i64temp;
 	struct mosquitto_msg_store *store;
-	char err[256];
 
-	if(fread(&i64temp, sizeof(dbid_t), 1, db_fptr) != 1){
-		strerror_r(errno, err, 256);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-		fclose(db_fptr);
-		return 1;
-	}
-	store_id = i64temp;
-	store = db->msg_store;
-	while(store){
-		if(store->db_id == store_id){
-			mqtt3_db_messages_queue(db, NULL, store->msg.topic, store->msg.qos, store->msg.retain, store);
-			break;
-		}
-		store = store->next;
+	read_e(rd, &i64temp, sizeof(dbid_t));
+	store = _db_store_table_find(i64temp);
+	if(store && store->msg.retain){
+		return mqtt3_retain_store(db, store);
 	}
 	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
 }
 
-static int _db_sub_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_sub_chunk_restore(struct mosquitto_db *db, struct _db_reader *rd)
 {
-	uint16_t i16temp, slen;
 	uint8_t qos;
-	char *client_id;
-	char *topic;
+	char *client_id = NULL;
+	char *topic = NULL;
 	int rc = 0;
-	char err[256];
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	client_id = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!client_id){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-	read_e(db_fptr, client_id, slen);
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	topic = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!topic){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		_mosquitto_free(client_id);
-		return MOSQ_ERR_NOMEM;
-	}
-	read_e(db_fptr, topic, slen);
-	read_e(db_fptr, &qos, sizeof(uint8_t));
+	if(_db_read_string(rd, &client_id)) goto error;
+	if(_db_read_string(rd, &topic)) goto error;
+	read_e(rd, &qos, sizeof(uint8_t));
 	if(_db_restore_sub(db, client_id, topic, qos)){
 		rc = 1;
 	}
@@ -737,108 +1219,356 @@ static int _db_sub_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 
 	return rc;
 error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	fclose(db_fptr);
+	if(client_id) _mosquitto_free(client_id);
+	if(topic) _mosquitto_free(topic);
 	return 1;
 }
 
-int mqtt3_db_restore(struct mosquitto_db *db)
+/* Read a client id and find the matching context. The context is NULL if the
+ * client no longer exists. */
+static int _db_chunk_context_read(struct mosquitto_db *db, struct _db_reader *rd, struct mosquitto **context)
 {
-	FILE *fptr;
-	char header[15];
-	int rc = 0;
-	uint32_t crc;
+	struct _clientid_index_hash *find_cih;
+	char *client_id;
+
+	*context = NULL;
+	if(_db_read_string(rd, &client_id)) return 1;
+
+	HASH_FIND_STR(db->clientid_index_hash, client_id, find_cih);
+	if(find_cih){
+		*context = db->contexts[find_cih->db_context_index];
+	}
+	_mosquitto_free(client_id);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_sub_del_chunk_restore(struct mosquitto_db *db, struct _db_reader *rd)
+{
+	struct mosquitto *context;
+	char *topic;
+
+	if(_db_chunk_context_read(db, rd, &context)) return 1;
+	if(_db_read_string(rd, &topic)) return 1;
+	if(context){
+		mqtt3_sub_remove(db, context, topic, &db->subs);
+	}
+	_mosquitto_free(topic);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_client_msg_update_chunk_restore(struct mosquitto_db *db, struct _db_reader *rd, bool delete)
+{
+	struct mosquitto *context;
+	struct mosquitto_client_msg *cmsg;
+	uint16_t i16temp, mid;
+	uint8_t direction, state = 0;
+
+	if(_db_chunk_context_read(db, rd, &context)) return 1;
+	read_e(rd, &i16temp, sizeof(uint16_t));
+	mid = ntohs(i16temp);
+	read_e(rd, &direction, sizeof(uint8_t));
+	if(!delete){
+		read_e(rd, &state, sizeof(uint8_t));
+	}
+	if(!context) return MOSQ_ERR_SUCCESS;
+
+	if(delete){
+		mqtt3_db_message_delete(db, context, mid, direction);
+	}else{
+		for(cmsg=context->msgs; cmsg; cmsg=cmsg->next){
+			if(cmsg->mid == mid && cmsg->direction == direction){
+				cmsg->state = state;
+				break;
+			}
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+static int _db_client_del_chunk_restore(struct mosquitto_db *db, struct _db_reader *rd)
+{
+	struct mosquitto *context;
+
+	if(_db_chunk_context_read(db, rd, &context)) return 1;
+	if(context){
+		context->clean_session = true;
+		mqtt3_context_slot_remove(db, context);
+		mqtt3_context_cleanup(db, context, true);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Restore every chunk in a snapshot or journal. The chunk headers are
+ * indexed first, which finds where the complete chunks end and sizes the
+ * stored message table once, then each chunk is restored with a reader
+ * limited to its own length. The last record of a journal may have been cut
+ * short by a crash. */
+static int _db_chunks_restore(struct mosquitto_db *db, struct _db_reader *rd, bool journal)
+{
+	struct _db_reader chunk_rd;
+	const uint8_t *pos;
+	size_t store_count = 0;
 	dbid_t i64temp;
 	uint32_t i32temp, length;
 	uint16_t i16temp, chunk;
 	uint8_t i8temp;
-	ssize_t rlen;
-	char err[256];
+	int rc;
 
-	assert(db);
-	assert(db->config);
-	assert(db->config->persistence_filepath);
+	pos = rd->pos;
+	while(rd->end - pos >= (ssize_t)(sizeof(uint16_t) + sizeof(uint32_t))){
+		memcpy(&i16temp, pos, sizeof(uint16_t));
+		memcpy(&i32temp, pos+sizeof(uint16_t), sizeof(uint32_t));
+		length = ntohl(i32temp);
+		if((size_t)(rd->end - pos) - sizeof(uint16_t) - sizeof(uint32_t) < length){
+			break;
+		}
+		if(ntohs(i16temp) == DB_CHUNK_MSG_STORE){
+			store_count++;
+		}
+		pos += sizeof(uint16_t) + sizeof(uint32_t) + length;
+	}
+	if(pos != rd->end){
+		if(!journal){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+			return 1;
+		}
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Incomplete record at end of persistence journal. Ignoring.");
+		rd->end = pos;
+	}
+	if(_db_store_table_reserve(store_count)) return 1;
+
+	while(rd->pos < rd->end){
+		memcpy(&i16temp, rd->pos, sizeof(uint16_t));
+		chunk = ntohs(i16temp);
+		memcpy(&i32temp, rd->pos+sizeof(uint16_t), sizeof(uint32_t));
+		length = ntohl(i32temp);
+		chunk_rd.pos = rd->pos + sizeof(uint16_t) + sizeof(uint32_t);
+		chunk_rd.end = chunk_rd.pos + length;
+		rd->pos = chunk_rd.end;
+
+		rc = 0;
+		switch(chunk){
+			case DB_CHUNK_CFG:
+				read_e(&chunk_rd, &i8temp, sizeof(uint8_t)); // shutdown
+				read_e(&chunk_rd, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
+				if(i8temp != sizeof(dbid_t)){
+					_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
+							i8temp, (unsigned long)sizeof(dbid_t));
+					return 1;
+				}
+				read_e(&chunk_rd, &i64temp, sizeof(dbid_t));
+				db->last_db_id = i64temp;
+				break;
+
+			case DB_CHUNK_JOURNAL:
+				read_e(&chunk_rd, &i32temp, sizeof(uint32_t));
+				journal_folded = ntohl(i32temp);
+				journal_gen = journal_folded;
+				break;
+
+			case DB_CHUNK_MSG_STORE:
+				rc = _db_msg_store_chunk_restore(db, &chunk_rd);
+				break;
+
+			case DB_CHUNK_CLIENT_MSG:
+				rc = _db_client_msg_chunk_restore(db, &chunk_rd);
+				break;
+
+			case DB_CHUNK_RETAIN:
+				rc = _db_retain_chunk_restore(db, &chunk_rd);
+				break;
+
+			case DB_CHUNK_SUB:
+				rc = _db_sub_chunk_restore(db, &chunk_rd);
+				break;
+
+			case DB_CHUNK_CLIENT:
+				rc = _db_client_chunk_restore(db, &chunk_rd);
+				break;
+
+			case DB_CHUNK_SUB_DEL:
+				rc = _db_sub_del_chunk_restore(db, &chunk_rd);
+				break;
+
+			case DB_CHUNK_CLIENT_MSG_UPDATE:
+				rc = _db_client_msg_update_chunk_restore(db, &chunk_rd, false);
+				break;
+
+			case DB_CHUNK_CLIENT_MSG_DEL:
+				rc = _db_client_msg_update_chunk_restore(db, &chunk_rd, true);
+				break;
+
+			case DB_CHUNK_CLIENT_DEL:
+				rc = _db_client_del_chunk_restore(db, &chunk_rd);
+				break;
+
+			default:
+				_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
+				break;
+		}
+		if(rc){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore chunk \"%d\" from persistent database.", chunk);
+			return rc;
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+/* Restore a snapshot or journal. The file is mapped into memory rather than
+ * read a field at a time; where mmap() isn't available it is read into a
+ * buffer in one go. Returns MOSQ_ERR_NOT_FOUND if the file doesn't exist. */
+static int _db_file_restore(struct mosquitto_db *db, const char *path, bool journal)
+{
+	FILE *fptr;
+	struct stat st;
+	struct _db_reader rd;
+	uint8_t *data = NULL;
+	size_t len;
+	bool mapped = false;
+	char header[15];
+	uint32_t crc;
+	uint32_t i32temp;
+	int rc = 1;
 
-	fptr = _mosquitto_fopen(db->config->persistence_filepath, "rb");
-	if(fptr == NULL) return MOSQ_ERR_SUCCESS;
-	read_e(fptr, &header, 15);
-	if(!memcmp(header, magic, 15)){
-		// Restore DB as normal
-		read_e(fptr, &crc, sizeof(uint32_t));
-		read_e(fptr, &i32temp, sizeof(uint32_t));
-		db_version = ntohl(i32temp);
-		/* IMPORTANT - this is where compatibility checks are made.
-		 * Is your DB change still compatible with previous versions?
-		 */
-		if(db_version > MOSQ_DB_VERSION && db_version != 0){
-			if(db_version == 2){
-				/* Addition of disconnect_t to client chunk in v3. */
-			}else{
+	fptr = _mosquitto_fopen(path, "rb");
+	if(!fptr) return MOSQ_ERR_NOT_FOUND;
+	if(fstat(fileno(fptr), &st) < 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+		fclose(fptr);
+		return 1;
+	}
+	len = st.st_size;
+	if(journal && len < 15 + 2*sizeof(uint32_t)){
+		/* Created but never written to. */
+		fclose(fptr);
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(len){
+#ifndef WIN32
+		data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(fptr), 0);
+		if(data != MAP_FAILED){
+			madvise(data, len, MADV_WILLNEED);
+			mapped = true;
+		}else{
+			data = NULL;
+		}
+#endif
+		if(!data){
+			data = _mosquitto_malloc(len);
+			if(!data){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+				fclose(fptr);
+				return MOSQ_ERR_NOMEM;
+			}
+			if(fread(data, 1, len, fptr) != len){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+				_mosquitto_free(data);
 				fclose(fptr);
-				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version %d (need version %d).", db_version, MOSQ_DB_VERSION);
 				return 1;
 			}
 		}
+	}
+	fclose(fptr);
 
-		while(rlen = fread(&i16temp, sizeof(uint16_t), 1, fptr), rlen == 1){
-			chunk = ntohs(i16temp);
-			read_e(fptr, &i32temp, sizeof(uint32_t));
-			length = ntohl(i32temp);
-			switch(chunk){
-				case DB_CHUNK_CFG:
-					read_e(fptr, &i8temp, sizeof(uint8_t)); // shutdown
-					read_e(fptr, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
-					if(i8temp != sizeof(dbid_t)){
-						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
-								i8temp, (unsigned long)sizeof(dbid_t));
-						fclose(fptr);
-						return 1;
-					}
-					read_e(fptr, &i64temp, sizeof(dbid_t));
-					db->last_db_id = i64temp;
-					break;
-
-				case DB_CHUNK_MSG_STORE:
-					if(_db_msg_store_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_CLIENT_MSG:
-					if(_db_client_msg_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_RETAIN:
-					if(_db_retain_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_SUB:
-					if(_db_sub_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_CLIENT:
-					if(_db_client_chunk_restore(db, fptr)) return 1;
-					break;
-
-				default:
-					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
-					fseek(fptr, length, SEEK_CUR);
-					break;
-			}
-		}
-		if(rlen < 0) goto error;
-	}else{
+	rd.pos = data;
+	rd.end = data + len;
+
+	read_e(&rd, &header, 15);
+	if(memcmp(header, magic, 15)){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database. Unrecognised file format.");
-		rc = 1;
+		goto cleanup;
+	}
+	read_e(&rd, &crc, sizeof(uint32_t));
+	read_e(&rd, &i32temp, sizeof(uint32_t));
+	db_version = ntohl(i32temp);
+	/* IMPORTANT - this is where compatibility checks are made.
+	 * Is your DB change still compatible with previous versions?
+	 */
+	if(db_version > MOSQ_DB_VERSION && db_version != 0){
+		if(db_version == 2){
+			/* Addition of disconnect_t to client chunk in v3. */
+		}else{
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version %d (need version %d).", db_version, MOSQ_DB_VERSION);
+			goto cleanup;
+		}
 	}
 
-	fclose(fptr);
+	rc = _db_chunks_restore(db, &rd, journal);
+	goto cleanup;
 
-	return rc;
 error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	if(fptr) fclose(fptr);
-	return 1;
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database. Unrecognised file format.");
+cleanup:
+#ifndef WIN32
+	if(mapped){
+		munmap(data, len);
+		data = NULL;
+	}
+#endif
+	if(data) _mosquitto_free(data);
+	return rc;
+}
+
+int mqtt3_db_restore(struct mosquitto_db *db)
+{
+	char *path;
+	bool have_snapshot = false;
+	int rc;
+
+	assert(db);
+	assert(db->config);
+	assert(db->config->persistence_filepath);
+
+	journal_gen = 0;
+	journal_folded = 0;
+	rc = _db_file_restore(db, db->config->persistence_filepath, false);
+	if(rc == MOSQ_ERR_SUCCESS){
+		have_snapshot = true;
+	}else if(rc != MOSQ_ERR_NOT_FOUND){
+		_db_store_table_release(db);
+		return 1;
+	}
+
+	if(db->config->persistence_journal){
+		if(have_snapshot && journal_gen == 0){
+			/* The snapshot has no journal chunk, which always holds a
+			 * generation of at least 1, so it was written with journalling
+			 * disabled and any journals present are stale. */
+		}else{
+			/* Replay every journal written since the snapshot was taken. */
+			while(1){
+				path = _db_journal_path(db, journal_gen);
+				if(!path){
+					_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+					_db_store_table_release(db);
+					return MOSQ_ERR_NOMEM;
+				}
+				rc = _db_file_restore(db, path, true);
+				if(rc == MOSQ_ERR_SUCCESS){
+					_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Replayed persistence journal %s.", path);
+				}
+				_mosquitto_free(path);
+				if(rc == MOSQ_ERR_NOT_FOUND) break;
+				if(rc){
+					_db_store_table_release(db);
+					return 1;
+				}
+				journal_gen++;
+			}
+		}
+	}
+
+	/* Stored messages that no client or retained topic refers to are freed
+	 * here. */
+	_db_store_table_release(db);
+
+	return MOSQ_ERR_SUCCESS;
 }
 
 static int _db_restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos)
@@ -40,9 +40,22 @@ const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','
 #define DB_CHUNK_RETAIN 4
 #define DB_CHUNK_SUB 5
 #define DB_CHUNK_CLIENT 6
+/* Journal generation that a snapshot has folded in. */
+#define DB_CHUNK_JOURNAL 7
+/* Journal only chunks. */
+#define DB_CHUNK_SUB_DEL 8
+#define DB_CHUNK_CLIENT_MSG_UPDATE 9
+#define DB_CHUNK_CLIENT_MSG_DEL 10
+#define DB_CHUNK_CLIENT_DEL 11
 /* End DB read/write */
 
-#define read_e(f, b, c) if(fread(b, 1, c, f) != c){ goto error; }
+/* Position in a persistence file that has been loaded into memory. */
+struct _db_reader{
+	const uint8_t *pos;
+	const uint8_t *end;
+};
+
+#define read_e(r, b, c) if(_db_read(r, b, c)){ goto error; }
 #define write_e(f, b, c) if(fwrite(b, 1, c, f) != c){ goto error; }
 
 #endif
@@ -0,0 +1,181 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Size classed slab allocator for small, short lived broker records.
+ *
+ * Every incoming PUBLISH results in a message store entry (plus its source
+ * id and topic) and a client message record per recipient. Passing each of
+ * these through malloc() is a significant cost at high message rates and
+ * fragments the heap of a long running broker. Instead, requests of up to
+ * POOL_MAX_SIZE bytes are rounded up to a multiple of POOL_GRANULARITY and
+ * served from a free list for that size class. Free lists are refilled a slab
+ * at a time. Slabs are only returned to the system by mqtt3_pool_cleanup().
+ *
+ * The caller must pass the same size to mqtt3_pool_free() that it passed to
+ * mqtt3_pool_alloc(). Larger requests are passed straight through to
+ * _mosquitto_malloc()/_mosquitto_free().
+ */
+
+#include <string.h>
+
+#include <config.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+
+#define POOL_GRANULARITY 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE/POOL_GRANULARITY)
+#define POOL_SLAB_SIZE 16384
+
+#define POOL_CLASS(size) (((size)+POOL_GRANULARITY-1)/POOL_GRANULARITY - 1)
+
+struct _pool_item{
+	struct _pool_item *next;
+};
+
+/* Header at the start of each slab, padded so that items stay aligned. */
+union _pool_slab{
+	union _pool_slab *next;
+	uint8_t pad[POOL_GRANULARITY];
+};
+
+static struct _pool_item *free_lists[POOL_CLASSES];
+static union _pool_slab *slabs = NULL;
+
+static int _pool_refill(int class)
+{
+	union _pool_slab *slab;
+	struct _pool_item *item;
+	size_t item_size;
+	uint8_t *pos;
+	int count;
+	int i;
+
+	slab = _mosquitto_malloc(POOL_SLAB_SIZE);
+	if(!slab) return MOSQ_ERR_NOMEM;
+
+	slab->next = slabs;
+	slabs = slab;
+
+	item_size = (class+1)*POOL_GRANULARITY;
+	count = (POOL_SLAB_SIZE - sizeof(union _pool_slab))/item_size;
+	pos = (uint8_t *)(slab+1);
+	for(i=0; i<count; i++){
+		item = (struct _pool_item *)pos;
+		item->next = free_lists[class];
+		free_lists[class] = item;
+		pos += item_size;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void *mqtt3_pool_alloc(size_t size)
+{
+	struct _pool_item *item;
+	int class;
+
+	if(size == 0 || size > POOL_MAX_SIZE){
+		return _mosquitto_malloc(size);
+	}
+
+	class = POOL_CLASS(size);
+	if(!free_lists[class] && _pool_refill(class)){
+		return NULL;
+	}
+	item = free_lists[class];
+	free_lists[class] = item->next;
+	return item;
+}
+
+void *mqtt3_pool_calloc(size_t size)
+{
+	void *mem;
+
+	mem = mqtt3_pool_alloc(size);
+	if(mem){
+		memset(mem, 0, size);
+	}
+	return mem;
+}
+
+char *mqtt3_pool_strdup(const char *s)
+{
+	size_t len;
+	char *str;
+
+	len = strlen(s)+1;
+	str = mqtt3_pool_alloc(len);
+	if(str){
+		memcpy(str, s, len);
+	}
+	return str;
+}
+
+void mqtt3_pool_free(void *mem, size_t size)
+{
+	struct _pool_item *item;
+	int class;
+
+	if(!mem) return;
+
+	if(size == 0 || size > POOL_MAX_SIZE){
+		_mosquitto_free(mem);
+		return;
+	}
+
+	class = POOL_CLASS(size);
+	item = mem;
+	item->next = free_lists[class];
+	free_lists[class] = item;
+}
+
+void mqtt3_pool_strfree(char *s)
+{
+	if(!s) return;
+
+	mqtt3_pool_free(s, strlen(s)+1);
+}
+
+/* Release every slab. Anything still allocated from the pools is invalid
+ * afterwards, so this must only be called at shutdown. */
+void mqtt3_pool_cleanup(void)
+{
+	union _pool_slab *slab;
+	int i;
+
+	while(slabs){
+		slab = slabs;
+		slabs = slabs->next;
+		_mosquitto_free(slab);
+	}
+	for(i=0; i<POOL_CLASSES; i++){
+		free_lists[i] = NULL;
+	}
+}
@@ -0,0 +1,249 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Publish plugins.
+ *
+ * A publish plugin is shown each message published by a client or bridge and
+ * can publish messages of its own, see mosquitto_publish_plugin.h. One plugin
+ * may be loaded from a shared library with the publish_plugin option. The
+ * aggregation plugin in aggregate.c is built in and is added when there are
+ * aggregate options, being given one "aggregate" option for each.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <util_mosq.h>
+#include "lib_load.h"
+
+typedef int (*FUNC_publish_plugin_version)(void);
+typedef int (*FUNC_publish_plugin_init)(void **, struct mosquitto_publish_opt *, int, mosquitto_publish_plugin_publish_t);
+typedef int (*FUNC_publish_plugin_cleanup)(void *, struct mosquitto_publish_opt *, int);
+typedef int (*FUNC_publish_plugin_message)(void *, const char *, const char *, int, int, const void *, bool);
+typedef void (*FUNC_publish_plugin_tick)(void *, time_t);
+
+extern struct mosquitto_db int_db;
+
+static char aggregate_key[] = "aggregate";
+
+static int _publish_plugin_publish(const char *topic, int qos, int payloadlen, const void *payload, bool retain)
+{
+	if(!topic || !topic[0]) return MOSQ_ERR_INVAL;
+	if(qos < 0 || qos > 2) return MOSQ_ERR_INVAL;
+	if(payloadlen < 0 || (payloadlen > 0 && !payload)) return MOSQ_ERR_INVAL;
+	if(_mosquitto_topic_wildcard_len_check(topic) != MOSQ_ERR_SUCCESS) return MOSQ_ERR_INVAL;
+
+	return mqtt3_db_messages_easy_queue(&int_db, NULL, topic, qos, payloadlen, payload, retain);
+}
+
+static struct _mosquitto_publish_plugin *_publish_plugin_load(const char *path)
+{
+	struct _mosquitto_publish_plugin *plugin;
+	void *lib;
+	int (*plugin_version)(void) = NULL;
+	int version;
+
+	lib = LIB_LOAD(path);
+	if(!lib){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
+				"Error: Unable to load publish plugin \"%s\".", path);
+		return NULL;
+	}
+
+	if(!(plugin_version = (FUNC_publish_plugin_version)LIB_SYM(lib, "mosquitto_publish_plugin_version"))){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
+				"Error: Unable to load publish plugin function mosquitto_publish_plugin_version().");
+		LIB_CLOSE(lib);
+		return NULL;
+	}
+	version = plugin_version();
+	if(version != MOSQ_PUBLISH_PLUGIN_VERSION){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
+				"Error: Incorrect publish plugin version (got %d, expected %d).",
+				version, MOSQ_PUBLISH_PLUGIN_VERSION);
+		LIB_CLOSE(lib);
+		return NULL;
+	}
+
+	plugin = _mosquitto_calloc(1, sizeof(struct _mosquitto_publish_plugin));
+	if(!plugin){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		LIB_CLOSE(lib);
+		return NULL;
+	}
+
+	if(!(plugin->plugin_init = (FUNC_publish_plugin_init)LIB_SYM(lib, "mosquitto_publish_plugin_init"))){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
+				"Error: Unable to load publish plugin function mosquitto_publish_plugin_init().");
+		goto error;
+	}
+	if(!(plugin->plugin_cleanup = (FUNC_publish_plugin_cleanup)LIB_SYM(lib, "mosquitto_publish_plugin_cleanup"))){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
+				"Error: Unable to load publish plugin function mosquitto_publish_plugin_cleanup().");
+		goto error;
+	}
+	if(!(plugin->message = (FUNC_publish_plugin_message)LIB_SYM(lib, "mosquitto_publish_plugin_message"))){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
+				"Error: Unable to load publish plugin function mosquitto_publish_plugin_message().");
+		goto error;
+	}
+	if(!(plugin->tick = (FUNC_publish_plugin_tick)LIB_SYM(lib, "mosquitto_publish_plugin_tick"))){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
+				"Error: Unable to load publish plugin function mosquitto_publish_plugin_tick().");
+		goto error;
+	}
+	plugin->name = path;
+	plugin->lib = lib;
+	return plugin;
+
+error:
+	_mosquitto_free(plugin);
+	LIB_CLOSE(lib);
+	return NULL;
+}
+
+static struct _mosquitto_publish_plugin *_publish_plugin_aggregate(struct mqtt3_config *config)
+{
+	struct _mosquitto_publish_plugin *plugin;
+	int i;
+
+	plugin = _mosquitto_calloc(1, sizeof(struct _mosquitto_publish_plugin));
+	if(!plugin) return NULL;
+
+	plugin->opts = _mosquitto_calloc(config->aggregate_count, sizeof(struct mosquitto_publish_opt));
+	if(!plugin->opts){
+		_mosquitto_free(plugin);
+		return NULL;
+	}
+	for(i=0; i<config->aggregate_count; i++){
+		plugin->opts[i].key = aggregate_key;
+		plugin->opts[i].value = config->aggregates[i];
+	}
+	plugin->opt_count = config->aggregate_count;
+	plugin->name = "aggregate";
+	plugin->plugin_init = mqtt3_aggregate_plugin_init;
+	plugin->plugin_cleanup = mqtt3_aggregate_plugin_cleanup;
+	plugin->message = mqtt3_aggregate_plugin_message;
+	plugin->tick = mqtt3_aggregate_plugin_tick;
+	return plugin;
+}
+
+static void _publish_plugin_free(struct _mosquitto_publish_plugin *plugin)
+{
+	if(plugin->lib){
+		LIB_CLOSE(plugin->lib);
+	}else if(plugin->opts){
+		/* Built in plugins own their option array, not its contents. */
+		_mosquitto_free(plugin->opts);
+	}
+	_mosquitto_free(plugin);
+}
+
+int mqtt3_publish_plugin_init(struct mosquitto_db *db)
+{
+	struct _mosquitto_publish_plugin *plugin, **tail;
+	int rc;
+
+	db->publish_plugins = NULL;
+	tail = &db->publish_plugins;
+
+	if(db->config->aggregate_count){
+		plugin = _publish_plugin_aggregate(db->config);
+		if(!plugin){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		*tail = plugin;
+		tail = &plugin->next;
+	}
+	if(db->config->publish_plugin){
+		plugin = _publish_plugin_load(db->config->publish_plugin);
+		if(!plugin) return 1;
+		plugin->opts = db->config->publish_options;
+		plugin->opt_count = db->config->publish_option_count;
+		*tail = plugin;
+		tail = &plugin->next;
+	}
+
+	for(plugin=db->publish_plugins; plugin; plugin=plugin->next){
+		rc = plugin->plugin_init(&plugin->user_data, plugin->opts, plugin->opt_count, _publish_plugin_publish);
+		if(rc){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
+					"Error: Publish plugin %s returned %d when initialising.", plugin->name, rc);
+			return rc;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mqtt3_publish_plugin_cleanup(struct mosquitto_db *db)
+{
+	struct _mosquitto_publish_plugin *plugin;
+
+	while(db->publish_plugins){
+		plugin = db->publish_plugins;
+		db->publish_plugins = plugin->next;
+
+		plugin->plugin_cleanup(plugin->user_data, plugin->opts, plugin->opt_count);
+		_publish_plugin_free(plugin);
+	}
+}
+
+/* Show a newly stored message from context to every publish plugin. */
+void mqtt3_publish_plugin_message(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_publish_plugin *plugin;
+	int rc;
+
+	for(plugin=db->publish_plugins; plugin; plugin=plugin->next){
+		rc = plugin->message(plugin->user_data, context->id, stored->msg.topic,
+				stored->msg.qos, stored->msg.payloadlen, stored->msg.payload, stored->msg.retain);
+		if(rc){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG,
+					"Publish plugin %s returned %d for message on %s.", plugin->name, rc, stored->msg.topic);
+		}
+	}
+}
+
+/* Called every pass of the main loop, ticks the plugins once a second. */
+void mqtt3_publish_plugin_tick(struct mosquitto_db *db, time_t now)
+{
+	struct _mosquitto_publish_plugin *plugin;
+
+	if(!db->publish_plugins || now == db->publish_plugin_tick) return;
+	db->publish_plugin_tick = now;
+
+	for(plugin=db->publish_plugins; plugin; plugin=plugin->next){
+		plugin->tick(plugin->user_data, now);
+	}
+}
@@ -38,6 +38,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <memory_mosq.h>
 #include <read_handle.h>
 #include <send_mosq.h>
+#include <time_mosq.h>
 #include <util_mosq.h>
 
 #ifdef WITH_SYS_TREE
@@ -98,6 +99,9 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 	struct mosquitto_msg_store *stored = NULL;
 	int len;
 	char *topic_mount;
+#if defined(WITH_SYS_TREE) || defined(WITH_BRIDGE)
+	uint64_t received_us = 0;
+#endif
 #ifdef WITH_BRIDGE
 	char *topic_temp;
 	int i;
@@ -105,6 +109,11 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 	bool match;
 #endif
 
+#ifdef WITH_SYS_TREE
+	if(db->config->sys_interval){
+		received_us = mosquitto_time_us();
+	}
+#endif
 	dup = (header & 0x08)>>3;
 	qos = (header & 0x06)>>1;
 	if(qos == 3){
@@ -125,6 +134,15 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 		return 1;
 	}
 #ifdef WITH_BRIDGE
+	if(qos == 0 && !context->bridge && !strcmp(topic, MQTT3_BRIDGE_BATCH_TOPIC)){
+		/* A batch of messages from a remote bridge, see bridge_batch.c. */
+		_mosquitto_free(topic);
+		payloadlen = context->in_packet.remaining_length - context->in_packet.pos;
+#ifdef WITH_SYS_TREE
+		g_pub_bytes_received += payloadlen;
+#endif
+		return mqtt3_bridge_batch_handle(db, context, &context->in_packet.payload[context->in_packet.pos], payloadlen, received_us);
+	}
 	if(context->bridge && context->bridge->topics && context->bridge->topic_remapping){
 		for(i=0; i<context->bridge->topic_count; i++){
 			cur_topic = &context->bridge->topics[i];
@@ -228,6 +246,11 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 	}
 
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+#ifdef WITH_SYS_TREE
+	if(db->config->sys_topic_prefix_count){
+		mqtt3_sys_topic_count(db, topic, payloadlen);
+	}
+#endif
 	if(qos > 0){
 		mqtt3_db_message_store_find(context, mid, &stored);
 	}
@@ -238,9 +261,13 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 			if(payload) _mosquitto_free(payload);
 			return 1;
 		}
+		mqtt3_publish_plugin_message(db, context, stored);
 	}else{
 		dup = 1;
 	}
+	/* Hold a reference until the message has been queued, so it is freed
+	 * here if nothing else wants it. */
+	stored->ref_count++;
 	switch(qos){
 		case 0:
 			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)) rc = 1;
@@ -264,6 +291,15 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 			}
 			break;
 	}
+#ifdef WITH_SYS_TREE
+	if(received_us && qos < 2){
+		/* Stamped once routing, the read ACL checks and queueing are done.
+		 * QoS 2 messages are queued on PUBREL, which the client decides. */
+		stored->enqueued_us = mosquitto_time_us();
+		mqtt3_sys_latency_record(mlt_receive_enqueue, stored->enqueued_us - received_us);
+	}
+#endif
+	mqtt3_db_msg_store_deref(db, &stored);
 	_mosquitto_free(topic);
 	if(payload) _mosquitto_free(payload);
 
@@ -282,7 +318,9 @@ process_bad_message:
 				if(mqtt3_db_message_store(db, context->id, mid, NULL, qos, 0, NULL, false, &stored, 0)){
 					return 1;
 				}
+				stored->ref_count++;
 				res = mqtt3_db_message_insert(db, context, mid, mosq_md_in, qos, false, stored);
+				mqtt3_db_msg_store_deref(db, &stored);
 			}else{
 				res = 0;
 			}
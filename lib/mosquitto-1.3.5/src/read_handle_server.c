@@ -58,7 +58,6 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	char *username = NULL, *password = NULL;
 	int i;
 	int rc;
-	struct _mosquitto_acl_user *acl_tail;
 	struct mosquitto_client_msg *msg_tail, *msg_prev;
 	int slen;
 #ifdef WITH_TLS
@@ -402,6 +401,12 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Client %s already connected, closing old connection.", client_id);
 			}
 		}
+#ifdef WITH_PERSISTENCE
+		if(!db->contexts[i]->clean_session && clean_session){
+			/* The persistent session is discarded. */
+			mqtt3_db_journal_client_delete(db, db->contexts[i]);
+		}
+#endif
 		db->contexts[i]->clean_session = clean_session;
 		mqtt3_context_cleanup(db, db->contexts[i], false);
 		db->contexts[i]->state = mosq_cs_connected;
@@ -412,12 +417,22 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 		db->contexts[i]->last_msg_out = mosquitto_time();
 		db->contexts[i]->keepalive = context->keepalive;
 		db->contexts[i]->pollfd_index = context->pollfd_index;
+#ifdef WITH_IO_THREADS
+		db->contexts[i]->out_packet_deferred = context->out_packet_deferred;
+#endif
 #ifdef WITH_TLS
 		db->contexts[i]->ssl = context->ssl;
 #endif
 		if(context->username){
 			db->contexts[i]->username = _mosquitto_strdup(context->username);
 		}
+		/* Anything the client sent after CONNECT may already be buffered. */
+		db->contexts[i]->in_buf = context->in_buf;
+		db->contexts[i]->in_buf_pos = context->in_buf_pos;
+		db->contexts[i]->in_buf_len = context->in_buf_len;
+		context->in_buf = NULL;
+		context->in_buf_pos = 0;
+		context->in_buf_len = 0;
 		context->sock = -1;
 #ifdef WITH_TLS
 		context->ssl = NULL;
@@ -425,7 +440,7 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 		context->state = mosq_cs_disconnecting;
 		context = db->contexts[i];
 		if(context->msgs){
-			mqtt3_db_message_reconnect_reset(context);
+			mqtt3_db_message_reconnect_reset(db, context);
 		}
 	}
 
@@ -434,32 +449,42 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	context->clean_session = clean_session;
 	context->ping_t = 0;
 	context->is_dropping = false;
+	if(context->listener){
+		context->queue_policy = context->listener->queue_policy;
+	}
+	for(i=0; i<db->config->client_queue_policy_count; i++){
+		if(!strncmp(context->id, db->config->client_queue_policies[i].prefix, strlen(db->config->client_queue_policies[i].prefix))){
+			context->queue_policy = db->config->client_queue_policies[i].policy;
+			break;
+		}
+	}
+	if(context->keepalive){
+		mqtt3_timer_add(&context->keepalive_timer, context->last_msg_in + (time_t)(context->keepalive)*3/2);
+	}else{
+		mqtt3_timer_remove(&context->keepalive_timer);
+	}
 	if((protocol_version&0x80) == 0x80){
 		context->is_bridge = true;
 	}
 
+	/* Associate user with its ACL, assuming we have ACLs loaded. */
+	if(mosquitto_acl_context_init_default(db, context)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		mqtt3_context_disconnect(db, context);
+		rc = MOSQ_ERR_NOMEM;
+		goto handle_connect_error;
+	}
+
 	/* Remove any queued messages that are no longer allowed through ACL,
 	 * assuming a possible change of username. */
 
 	msg_tail = context->msgs;
 	msg_prev = NULL;
 	while(msg_tail){
-		if(msg_tail->direction == mosq_md_out){
-			if(mosquitto_acl_check(db, context, msg_tail->store->msg.topic, MOSQ_ACL_READ) == MOSQ_ERR_ACL_DENIED){
-				msg_tail->store->ref_count--;
-				if(msg_prev){
-					msg_prev->next = msg_tail->next;
-					_mosquitto_free(msg_tail);
-					msg_tail = msg_prev->next;
-				}else{
-					context->msgs = context->msgs->next;
-					_mosquitto_free(msg_tail);
-					msg_tail = context->msgs;
-				}
-			}else{
-				msg_prev = msg_tail;
-				msg_tail = msg_tail->next;
-			}
+		if(msg_tail->direction == mosq_md_out
+				&& mosquitto_acl_check_topic(db, context, msg_tail->store->topic, MOSQ_ACL_READ) == MOSQ_ERR_ACL_DENIED){
+
+			mqtt3_db_message_remove(db, context, &msg_tail, msg_prev);
 		}else{
 			msg_prev = msg_tail;
 			msg_tail = msg_tail->next;
@@ -481,28 +506,9 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 #ifdef WITH_PERSISTENCE
 	if(!clean_session){
 		db->persistence_changes++;
+		mqtt3_db_journal_client(db, context);
 	}
 #endif
-	/* Associate user with its ACL, assuming we have ACLs loaded. */
-	if(db->acl_list){
-		acl_tail = db->acl_list;
-		while(acl_tail){
-			if(context->username){
-				if(acl_tail->username && !strcmp(context->username, acl_tail->username)){
-					context->acl_list = acl_tail;
-					break;
-				}
-			}else{
-				if(acl_tail->username == NULL){
-					context->acl_list = acl_tail;
-					break;
-				}
-			}
-			acl_tail = acl_tail->next;
-		}
-	}else{
-		context->acl_list = NULL;
-	}
 
 	if(will_struct){
 		if(mosquitto_acl_check(db, context, will_topic, MOSQ_ACL_WRITE) != MOSQ_ERR_SUCCESS){
@@ -585,6 +591,9 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 	uint32_t payloadlen = 0;
 	int len;
 	char *sub_mount;
+	bool shared;
+	const char *group, *filter;
+	int group_len;
 
 	if(!context) return MOSQ_ERR_INVAL;
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received SUBSCRIBE from %s", context->id);
@@ -612,13 +621,15 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 				if(payload) _mosquitto_free(payload);
 				return 1;
 			}
-			if(_mosquitto_topic_wildcard_pos_check(sub)){
+			rc2 = mqtt3_sub_shared_parse(sub, &group, &group_len, &filter);
+			if(_mosquitto_topic_wildcard_pos_check(sub) || rc2 == MOSQ_ERR_INVAL){
 				_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Invalid subscription string from %s, disconnecting.",
 					context->address);
 				_mosquitto_free(sub);
 				if(payload) _mosquitto_free(payload);
 				return 1;
 			}
+			shared = (rc2 == MOSQ_ERR_SUCCESS);
 
 			if(_mosquitto_read_byte(&context->in_packet, &qos)){
 				_mosquitto_free(sub);
@@ -640,7 +651,12 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 					if(payload) _mosquitto_free(payload);
 					return MOSQ_ERR_NOMEM;
 				}
-				snprintf(sub_mount, len, "%s%s", context->listener->mount_point, sub);
+				if(shared){
+					/* The mount point applies to the filter, after $share/<group>/. */
+					snprintf(sub_mount, len, "%.*s%s%s", (int)(filter - sub), sub, context->listener->mount_point, filter);
+				}else{
+					snprintf(sub_mount, len, "%s%s", context->listener->mount_point, sub);
+				}
 				_mosquitto_free(sub);
 				sub = sub_mount;
 
@@ -678,7 +694,8 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 			if(qos != 0x80){
 				rc2 = mqtt3_sub_add(db, context, sub, qos, &db->subs);
 				if(rc2 == MOSQ_ERR_SUCCESS){
-					if(mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
+					/* Shared subscriptions don't receive retained messages. */
+					if(!shared && mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
 				}else if(rc2 != -1){
 					rc = rc2;
 				}
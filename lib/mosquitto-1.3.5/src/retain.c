@@ -0,0 +1,274 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Index of retained messages.
+ *
+ * Retained messages are kept in a trie with one node per topic level, apart
+ * from the subscription tree. The children of each node are held in a hash
+ * table keyed on the level name, so looking up a topic costs one hash lookup
+ * per level however many siblings there are. A subscription is matched
+ * against the trie level by level: a plain level is a single lookup, a +
+ * visits every child of the node and a # visits the whole subtree beneath
+ * it. Levels are compared in place, so matching allocates nothing.
+ *
+ * As with subscriptions, wildcards in the first level don't match topics
+ * beginning with $.
+ *
+ * Nodes that hold no retained message and have no children are removed when
+ * a retained message is cleared.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <util_mosq.h>
+
+/* Retained messages matching a subscription, collected before any of them
+ * are queued. */
+struct _retain_matches {
+	struct mosquitto_msg_store **msgs;
+	int count;
+	int alloc;
+};
+
+static int _retain_match_add(struct _retain_matches *matches, struct mosquitto_msg_store *stored)
+{
+	struct mosquitto_msg_store **msgs;
+	int alloc;
+
+	if(matches->count == matches->alloc){
+		alloc = matches->alloc ? matches->alloc*2 : 16;
+		msgs = _mosquitto_realloc(matches->msgs, sizeof(struct mosquitto_msg_store *)*alloc);
+		if(!msgs) return MOSQ_ERR_NOMEM;
+		matches->msgs = msgs;
+		matches->alloc = alloc;
+	}
+	matches->msgs[matches->count++] = stored;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Add every retained message beneath node. */
+static int _retain_match_all(struct _mosquitto_retainhier *node, bool top, struct _retain_matches *matches)
+{
+	struct _mosquitto_retainhier *child, *tmp;
+
+	HASH_ITER(hh, node->children, child, tmp){
+		if(top && child->topic[0] == '$') continue;
+
+		if(child->retained){
+			if(_retain_match_add(matches, child->retained)) return MOSQ_ERR_NOMEM;
+		}
+		if(child->children){
+			if(_retain_match_all(child, false, matches)) return MOSQ_ERR_NOMEM;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Match sub, which starts at the level below node, against the children of
+ * node. */
+static int _retain_search(struct _mosquitto_retainhier *node, const char *sub, bool top, struct _retain_matches *matches)
+{
+	struct _mosquitto_retainhier *child, *tmp;
+	const char *end;
+	size_t len;
+
+	end = strchr(sub, '/');
+	len = end ? (size_t)(end - sub) : strlen(sub);
+
+	if(len == 1 && sub[0] == '#'){
+		/* foo/# also matches foo itself. */
+		if(!top && node->retained){
+			if(_retain_match_add(matches, node->retained)) return MOSQ_ERR_NOMEM;
+		}
+		return _retain_match_all(node, top, matches);
+	}else if(len == 1 && sub[0] == '+'){
+		HASH_ITER(hh, node->children, child, tmp){
+			if(top && child->topic[0] == '$') continue;
+
+			if(end){
+				if(_retain_search(child, end+1, false, matches)) return MOSQ_ERR_NOMEM;
+			}else if(child->retained){
+				if(_retain_match_add(matches, child->retained)) return MOSQ_ERR_NOMEM;
+			}
+		}
+	}else{
+		HASH_FIND(hh, node->children, sub, len, child);
+		if(child){
+			if(end){
+				return _retain_search(child, end+1, false, matches);
+			}else if(child->retained){
+				return _retain_match_add(matches, child->retained);
+			}
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _retain_process(struct mosquitto_db *db, struct mosquitto_msg_store *retained, struct mosquitto *context, int sub_qos)
+{
+	int rc = 0;
+	int qos;
+	uint16_t mid;
+
+	rc = mosquitto_acl_check_topic(db, context, retained->topic, MOSQ_ACL_READ);
+	if(rc == MOSQ_ERR_ACL_DENIED){
+		return MOSQ_ERR_SUCCESS;
+	}else if(rc != MOSQ_ERR_SUCCESS){
+		return rc;
+	}
+
+	qos = retained->msg.qos;
+
+	if(qos > sub_qos) qos = sub_qos;
+	if(qos > 0){
+		mid = _mosquitto_mid_generate(context);
+	}else{
+		mid = 0;
+	}
+	return mqtt3_db_message_insert(db, context, mid, mosq_md_out, qos, true, retained);
+}
+
+/* Queue the retained messages matching a new subscription for a client. All
+ * of the matches are found before any are queued, so the trie is walked in
+ * one go and then the client's queue is filled in one go. */
+int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos)
+{
+	struct _retain_matches matches;
+	int i;
+	int rc;
+
+	assert(db);
+	assert(context);
+	assert(sub);
+
+	memset(&matches, 0, sizeof(struct _retain_matches));
+	rc = _retain_search(&db->retains, sub, true, &matches);
+	if(!rc){
+		for(i=0; i<matches.count; i++){
+			if(_retain_process(db, matches.msgs[i], context, sub_qos) == 1){
+				rc = 1;
+			}
+		}
+	}
+	if(matches.msgs) _mosquitto_free(matches.msgs);
+
+	return rc;
+}
+
+/* Make stored the retained message for its topic, or clear the retained
+ * message for the topic if stored has no payload. */
+int mqtt3_retain_store(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_retainhier *node, *child, *parent;
+	const char *topic, *end;
+	size_t len;
+
+	assert(db);
+	assert(stored);
+
+	node = &db->retains;
+	topic = stored->msg.topic;
+	while(topic){
+		end = strchr(topic, '/');
+		len = end ? (size_t)(end - topic) : strlen(topic);
+
+		HASH_FIND(hh, node->children, topic, len, child);
+		if(!child){
+			if(!stored->msg.payloadlen){
+				/* Nothing retained here to clear. */
+				return MOSQ_ERR_SUCCESS;
+			}
+			child = _mosquitto_calloc(1, sizeof(struct _mosquitto_retainhier));
+			if(!child) return MOSQ_ERR_NOMEM;
+			child->topic = _mosquitto_malloc(len+1);
+			if(!child->topic){
+				_mosquitto_free(child);
+				return MOSQ_ERR_NOMEM;
+			}
+			memcpy(child->topic, topic, len);
+			child->topic[len] = '\0';
+			child->parent = node;
+			HASH_ADD_KEYPTR(hh, node->children, child->topic, len, child);
+		}
+		node = child;
+		topic = end ? end+1 : NULL;
+	}
+
+	/* Take the new reference before dropping the old one, in case they are
+	 * the same message. */
+	if(stored->msg.payloadlen){
+		stored->ref_count++;
+		db->retained_count++;
+	}
+	if(node->retained){
+		mqtt3_db_msg_store_deref(db, &node->retained);
+		db->retained_count--;
+	}
+	if(stored->msg.payloadlen){
+		node->retained = stored;
+	}else{
+		while(node != &db->retains && !node->retained && !node->children){
+			parent = node->parent;
+			HASH_DELETE(hh, parent->children, node);
+			_mosquitto_free(node->topic);
+			_mosquitto_free(node);
+			node = parent;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _retain_clean(struct mosquitto_db *db, struct _mosquitto_retainhier *node)
+{
+	struct _mosquitto_retainhier *child, *tmp;
+
+	HASH_ITER(hh, node->children, child, tmp){
+		HASH_DELETE(hh, node->children, child);
+		_retain_clean(db, child);
+		if(child->retained){
+			mqtt3_db_msg_store_deref(db, &child->retained);
+		}
+		_mosquitto_free(child->topic);
+		_mosquitto_free(child);
+	}
+}
+
+/* Free the whole index, dropping its references to retained messages. */
+void mqtt3_retain_clean(struct mosquitto_db *db)
+{
+	assert(db);
+
+	_retain_clean(db, &db->retains);
+	db->retained_count = 0;
+}
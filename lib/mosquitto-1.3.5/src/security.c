@@ -214,6 +214,15 @@ int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, cons
 	}
 }
 
+int mosquitto_acl_check_topic(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_topic *topic, int access)
+{
+	if(!db->auth_plugin.lib){
+		return mosquitto_acl_check_default_topic(db, context, topic, access);
+	}else{
+		return db->auth_plugin.acl_check(db->auth_plugin.user_data, context->id, context->username, topic->topic, access);
+	}
+}
+
 int mosquitto_unpwd_check(struct mosquitto_db *db, const char *username, const char *password)
 {
 	if(!db->auth_plugin.lib){
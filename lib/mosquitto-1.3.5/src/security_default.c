@@ -39,6 +39,7 @@ POSSIBILITY OF SUCH DAMAGE.
 static int _aclfile_parse(struct mosquitto_db *db);
 static int _unpwd_file_parse(struct mosquitto_db *db);
 static int _acl_cleanup(struct mosquitto_db *db, bool reload);
+static void _free_acl(struct _mosquitto_acl *acl);
 static int _unpwd_cleanup(struct _mosquitto_unpwd **unpwd, bool reload);
 static int _psk_file_parse(struct mosquitto_db *db);
 #ifdef WITH_TLS
@@ -226,19 +227,157 @@ int _add_acl_pattern(struct mosquitto_db *db, const char *topic, int access)
 	return MOSQ_ERR_SUCCESS;
 }
 
-int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+/* Number of topics whose ACL result is remembered for each client. Once the
+ * cache is full, entries are evicted one at a time, see _acl_cache_victim(). */
+#define ACL_CACHE_MAX 1024
+
+/* Expand %c and %u in a pattern ACL for a client. Returns NULL if the pattern
+ * can't apply to it, or on out of memory. */
+static char *_acl_pattern_expand(struct _mosquitto_acl *pattern, struct mosquitto *context)
 {
 	char *local_acl;
-	struct _mosquitto_acl *acl_root;
-	bool result;
 	int i;
 	int len, tlen, clen, ulen;
 	char *s;
 
-	if(!db || !context || !topic) return MOSQ_ERR_INVAL;
-	if(!db->acl_list && !db->acl_patterns) return MOSQ_ERR_SUCCESS;
-	if(context->bridge) return MOSQ_ERR_SUCCESS;
-	if(!context->acl_list && !db->acl_patterns) return MOSQ_ERR_ACL_DENIED;
+	if(pattern->ucount && !context->username) return NULL;
+
+	tlen = strlen(pattern->topic);
+	clen = strlen(context->id);
+	if(context->username){
+		ulen = strlen(context->username);
+		len = tlen + pattern->ccount*(clen-2) + pattern->ucount*(ulen-2);
+	}else{
+		ulen = 0;
+		len = tlen + pattern->ccount*(clen-2);
+	}
+	local_acl = _mosquitto_malloc(len+1);
+	if(!local_acl) return NULL;
+	s = local_acl;
+	for(i=0; i<tlen; i++){
+		if(i<tlen-1 && pattern->topic[i] == '%'){
+			if(pattern->topic[i+1] == 'c'){
+				i++;
+				strncpy(s, context->id, clen);
+				s+=clen;
+				continue;
+			}else if(context->username && pattern->topic[i+1] == 'u'){
+				i++;
+				strncpy(s, context->username, ulen);
+				s+=ulen;
+				continue;
+			}
+		}
+		s[0] = pattern->topic[i];
+		s++;
+	}
+	local_acl[len] = '\0';
+
+	return local_acl;
+}
+
+/* Attach the ACLs for a client's username and expand the pattern ACLs for
+ * it, so that checks need do no more than match topics. Any cached results
+ * are forgotten. Called on connect and when ACLs are reloaded. */
+int mosquitto_acl_context_init_default(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct _mosquitto_acl_user *acl_tail;
+	struct _mosquitto_acl *pattern, *acl, *last = NULL;
+
+	if(!db || !context) return MOSQ_ERR_INVAL;
+
+	mosquitto_acl_context_cleanup_default(context);
+
+	context->acl_list = NULL;
+	acl_tail = db->acl_list;
+	while(acl_tail){
+		if(context->username){
+			if(acl_tail->username && !strcmp(context->username, acl_tail->username)){
+				context->acl_list = acl_tail;
+				break;
+			}
+		}else{
+			if(acl_tail->username == NULL){
+				context->acl_list = acl_tail;
+				break;
+			}
+		}
+		acl_tail = acl_tail->next;
+	}
+
+	if(!context->id) return MOSQ_ERR_SUCCESS;
+
+	/* Keep the patterns in their original order. */
+	for(pattern = db->acl_patterns; pattern; pattern = pattern->next){
+		if(pattern->ucount && !context->username) continue;
+
+		acl = _mosquitto_calloc(1, sizeof(struct _mosquitto_acl));
+		if(!acl) return MOSQ_ERR_NOMEM;
+		acl->topic = _acl_pattern_expand(pattern, context);
+		if(!acl->topic){
+			_mosquitto_free(acl);
+			return MOSQ_ERR_NOMEM;
+		}
+		acl->access = pattern->access;
+		if(last){
+			last->next = acl;
+		}else{
+			context->acl_expanded = acl;
+		}
+		last = acl;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _acl_cache_clear(struct mosquitto *context)
+{
+	struct _mosquitto_acl_cache *entry, *tmp;
+
+	HASH_ITER(hh, context->acl_cache, entry, tmp){
+		HASH_DELETE(hh, context->acl_cache, entry);
+		mqtt3_topic_release(entry->topic);
+		_mosquitto_free(entry);
+	}
+	context->acl_cache_hand = NULL;
+	context->acl_cache_count = 0;
+}
+
+/* CLOCK eviction for a full cache: look at the entry under the hand. If it
+ * has been hit since the hand last passed, clear its bit and return NULL so
+ * the new topic is not cached. Otherwise remove it from the cache and return
+ * it to be reused. A miss thus costs at most one step of the hand, and topics
+ * that keep being hit stay cached when a client sees more topics than fit. */
+static struct _mosquitto_acl_cache *_acl_cache_victim(struct mosquitto *context)
+{
+	struct _mosquitto_acl_cache *entry;
+
+	entry = context->acl_cache_hand;
+	if(!entry) entry = context->acl_cache;
+
+	context->acl_cache_hand = entry->hh.next;
+	if(entry->referenced){
+		entry->referenced = false;
+		return NULL;
+	}
+	HASH_DELETE(hh, context->acl_cache, entry);
+	mqtt3_topic_release(entry->topic);
+	context->acl_cache_count--;
+	return entry;
+}
+
+void mosquitto_acl_context_cleanup_default(struct mosquitto *context)
+{
+	if(!context) return;
+
+	_free_acl(context->acl_expanded);
+	context->acl_expanded = NULL;
+	_acl_cache_clear(context);
+}
+
+static int _acl_check_lists(struct mosquitto *context, const char *topic, int access)
+{
+	struct _mosquitto_acl *acl_root;
+	bool result;
 
 	if(context->acl_list){
 		acl_root = context->acl_list->acl;
@@ -265,62 +404,84 @@ int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *conte
 		acl_root = acl_root->next;
 	}
 
-	acl_root = db->acl_patterns;
-	/* Loop through all pattern ACLs. */
-	clen = strlen(context->id);
+	/* Loop through all pattern ACLs, as expanded for this client. */
+	acl_root = context->acl_expanded;
 	while(acl_root){
-		tlen = strlen(acl_root->topic);
-
-		if(acl_root->ucount && !context->username){
-			acl_root = acl_root->next;
-			continue;
-		}
-
-		if(context->username){
-			ulen = strlen(context->username);
-			len = tlen + acl_root->ccount*(clen-2) + acl_root->ucount*(ulen-2);
-		}else{
-			ulen = 0;
-			len = tlen + acl_root->ccount*(clen-2);
-		}
-		local_acl = malloc(len+1);
-		if(!local_acl) return 1; // FIXME
-		s = local_acl;
-		for(i=0; i<tlen; i++){
-			if(i<tlen-1 && acl_root->topic[i] == '%'){
-				if(acl_root->topic[i+1] == 'c'){
-					i++;
-					strncpy(s, context->id, clen);
-					s+=clen;
-					continue;
-				}else if(context->username && acl_root->topic[i+1] == 'u'){
-					i++;
-					strncpy(s, context->username, ulen);
-					s+=ulen;
-					continue;
-				}
-			}
-			s[0] = acl_root->topic[i];
-			s++;
-		}
-		local_acl[len] = '\0';
-
-		mosquitto_topic_matches_sub(local_acl, topic, &result);
+		mosquitto_topic_matches_sub(acl_root->topic, topic, &result);
 		if(result){
 			if(access & acl_root->access){
 				/* And access is allowed. */
 				return MOSQ_ERR_SUCCESS;
 			}
 		}
-
-		_mosquitto_free(local_acl);
-
 		acl_root = acl_root->next;
 	}
 
 	return MOSQ_ERR_ACL_DENIED;
 }
 
+int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+{
+	struct _mosquitto_topic *interned;
+	int rc;
+
+	if(!db || !context || !topic) return MOSQ_ERR_INVAL;
+	if(!db->acl_list && !db->acl_patterns) return MOSQ_ERR_SUCCESS;
+	if(context->bridge) return MOSQ_ERR_SUCCESS;
+	if(!context->acl_list && !db->acl_patterns) return MOSQ_ERR_ACL_DENIED;
+
+	interned = mqtt3_topic_intern(topic);
+	if(!interned) return _acl_check_lists(context, topic, access);
+
+	rc = mosquitto_acl_check_default_topic(db, context, interned, access);
+	mqtt3_topic_release(interned);
+	return rc;
+}
+
+/* As mosquitto_acl_check_default(), for an interned topic. Results are
+ * cached per client, keyed on the topic entry. */
+int mosquitto_acl_check_default_topic(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_topic *topic, int access)
+{
+	struct _mosquitto_acl_cache *entry;
+	int rc;
+
+	if(!db || !context || !topic) return MOSQ_ERR_INVAL;
+	if(!db->acl_list && !db->acl_patterns) return MOSQ_ERR_SUCCESS;
+	if(context->bridge) return MOSQ_ERR_SUCCESS;
+	if(!context->acl_list && !db->acl_patterns) return MOSQ_ERR_ACL_DENIED;
+
+	HASH_FIND_PTR(context->acl_cache, &topic, entry);
+	if(entry){
+		entry->referenced = true;
+		if((entry->checked & access) == access){
+			return (entry->allowed & access) == access ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED;
+		}
+	}
+
+	rc = _acl_check_lists(context, topic->topic, access);
+
+	if(!entry){
+		if(context->acl_cache_count >= ACL_CACHE_MAX){
+			entry = _acl_cache_victim(context);
+			if(!entry) return rc;
+			memset(entry, 0, sizeof(struct _mosquitto_acl_cache));
+		}else{
+			entry = _mosquitto_calloc(1, sizeof(struct _mosquitto_acl_cache));
+			if(!entry) return rc;
+		}
+		entry->topic = topic;
+		topic->ref_count++;
+		HASH_ADD_PTR(context->acl_cache, topic, entry);
+		context->acl_cache_count++;
+	}
+	entry->checked |= access;
+	if(rc == MOSQ_ERR_SUCCESS){
+		entry->allowed |= access;
+	}
+
+	return rc;
+}
+
 static int _aclfile_parse(struct mosquitto_db *db)
 {
 	FILE *aclfile;
@@ -446,18 +607,20 @@ static int _acl_cleanup(struct mosquitto_db *db, bool reload)
 	struct _mosquitto_acl_user *user_tail;
 
 	if(!db) return MOSQ_ERR_INVAL;
-	if(!db->acl_list) return MOSQ_ERR_SUCCESS;
+	if(!db->acl_list && !db->acl_patterns) return MOSQ_ERR_SUCCESS;
 
 	/* As we're freeing ACLs, we must clear context->acl_list to ensure no
-	 * invalid memory accesses take place later.
+	 * invalid memory accesses take place later. Expanded patterns and cached
+	 * results are thrown away too.
 	 * This *requires* the ACLs to be reapplied after _acl_cleanup()
 	 * is called if we are reloading the config. If this is not done, all 
 	 * access will be denied to currently connected clients.
 	 */
 	if(db->contexts){
 		for(i=0; i<db->context_count; i++){
-			if(db->contexts[i] && db->contexts[i]->acl_list){
+			if(db->contexts[i]){
 				db->contexts[i]->acl_list = NULL;
+				mosquitto_acl_context_cleanup_default(db->contexts[i]);
 			}
 		}
 	}
@@ -703,7 +866,6 @@ static int _unpwd_cleanup(struct _mosquitto_unpwd **root, bool reload)
  */
 int mosquitto_security_apply_default(struct mosquitto_db *db)
 {
-	struct _mosquitto_acl_user *acl_user_tail;
 	bool allow_anonymous;
 	int i;
 
@@ -727,25 +889,7 @@ int mosquitto_security_apply_default(struct mosquitto_db *db)
 					continue;
 				}
 				/* Check for ACLs and apply to user. */
-				if(db->acl_list){
-  					acl_user_tail = db->acl_list;
-					while(acl_user_tail){
-						if(acl_user_tail->username){
-							if(db->contexts[i]->username){
-								if(!strcmp(acl_user_tail->username, db->contexts[i]->username)){
-									db->contexts[i]->acl_list = acl_user_tail;
-									break;
-								}
-							}
-						}else{
-							if(!db->contexts[i]->username){
-								db->contexts[i]->acl_list = acl_user_tail;
-								break;
-							}
-						}
-						acl_user_tail = acl_user_tail->next;
-					}
-				}
+				mosquitto_acl_context_init_default(db, db->contexts[i]);
 			}
 		}
 	}
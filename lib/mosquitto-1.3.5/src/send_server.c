@@ -27,13 +27,22 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <assert.h>
+#include <string.h>
+
 #include <config.h>
 
 #include <mosquitto_broker.h>
 #include <mqtt3_protocol.h>
 #include <memory_mosq.h>
+#include <net_mosq.h>
+#include <send_mosq.h>
 #include <util_mosq.h>
 
+#ifdef WITH_SYS_TREE
+extern uint64_t g_pub_bytes_sent;
+#endif
+
 int _mosquitto_send_connack(struct mosquitto *context, int result)
 {
 	struct _mosquitto_packet *packet = NULL;
@@ -47,14 +56,14 @@ int _mosquitto_send_connack(struct mosquitto *context, int result)
 		}
 	}
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new(context);
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = CONNACK;
 	packet->remaining_length = 2;
-	rc = _mosquitto_packet_alloc(packet);
+	rc = _mosquitto_packet_alloc(context, packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 	packet->payload[packet->pos+0] = 0;
@@ -70,14 +79,14 @@ int _mosquitto_send_suback(struct mosquitto *context, uint16_t mid, uint32_t pay
 
 	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending SUBACK to %s", context->id);
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new(context);
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = SUBACK;
 	packet->remaining_length = 2+payloadlen;
-	rc = _mosquitto_packet_alloc(packet);
+	rc = _mosquitto_packet_alloc(context, packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 	_mosquitto_write_uint16(packet, mid);
@@ -87,3 +96,74 @@ int _mosquitto_send_suback(struct mosquitto *context, uint16_t mid, uint32_t pay
 
 	return _mosquitto_packet_queue(context, packet);
 }
+
+static int _shared_publish_encode(struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_shared_packet *shared;
+	struct _mosquitto_packet packet;
+	int rc;
+
+	shared = _mosquitto_calloc(1, sizeof(struct _mosquitto_shared_packet));
+	if(!shared) return MOSQ_ERR_NOMEM;
+
+	memset(&packet, 0, sizeof(struct _mosquitto_packet));
+	packet.command = PUBLISH;
+	packet.remaining_length = 2+strlen(stored->msg.topic) + stored->msg.payloadlen;
+	rc = _mosquitto_packet_alloc(NULL, &packet);
+	if(rc){
+		_mosquitto_free(shared);
+		return rc;
+	}
+	_mosquitto_write_string(&packet, stored->msg.topic, strlen(stored->msg.topic));
+	if(stored->msg.payloadlen){
+		_mosquitto_write_bytes(&packet, stored->msg.payload, stored->msg.payloadlen);
+	}
+
+	shared->ref_count = 1; /* Held by the store. */
+	shared->packet_length = packet.packet_length;
+	shared->payload = packet.payload;
+	stored->qos0_packet = shared;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Send a stored message as a QoS 0 PUBLISH with retain and dup unset. The wire
+ * bytes are the same for every client that receives the message this way, so
+ * it is serialised once and the buffer is shared by all outgoing packets.
+ * Clients that need the topic rewritten (mount points, bridge remapping) fall
+ * back to a normal publish. */
+int _mosquitto_send_publish_shared(struct mosquitto *context, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_packet *packet = NULL;
+	int rc;
+
+	assert(context);
+	assert(stored);
+
+	if(context->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+
+	if((context->listener && context->listener->mount_point) || context->bridge){
+		return _mosquitto_send_publish(context, 0, stored->msg.topic, stored->msg.payloadlen, stored->msg.payload, 0, false, false);
+	}
+
+	if(!stored->qos0_packet){
+		rc = _shared_publish_encode(stored);
+		if(rc) return rc;
+	}
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d0, q0, r0, m0, '%s', ... (%ld bytes))", context->id, stored->msg.topic, (long)stored->msg.payloadlen);
+#ifdef WITH_SYS_TREE
+	g_pub_bytes_sent += stored->msg.payloadlen;
+#endif
+
+	packet = _mosquitto_packet_new(context);
+	if(!packet) return MOSQ_ERR_NOMEM;
+
+	packet->command = PUBLISH;
+	packet->packet_length = stored->qos0_packet->packet_length;
+	packet->payload = stored->qos0_packet->payload;
+	packet->shared = stored->qos0_packet;
+	packet->shared->ref_count++;
+
+	return _mosquitto_packet_queue(context, packet);
+}
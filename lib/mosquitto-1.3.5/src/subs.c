@@ -73,81 +73,136 @@ struct _sub_token {
 	char *topic;
 };
 
-static int _subs_process(struct mosquitto_db *db, struct _mosquitto_subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
+/* Queue a message for one subscriber. */
+static int _subs_send(struct mosquitto_db *db, struct _mosquitto_subleaf *leaf, int qos, int retain, struct mosquitto_msg_store *stored)
 {
-	int rc = 0;
-	int rc2;
 	int client_qos, msg_qos;
 	uint16_t mid;
-	struct _mosquitto_subleaf *leaf;
 	bool client_retain;
 
-	leaf = hier->subs;
+	client_qos = leaf->qos;
 
-	if(retain && set_retain){
-#ifdef WITH_PERSISTENCE
-		if(strncmp(topic, "$SYS", 4)){
-			/* Retained messages count as a persistence change, but only if
-			 * they aren't for $SYS. */
-			db->persistence_changes++;
-		}
-#endif
-		if(hier->retained){
-			hier->retained->ref_count--;
-			/* FIXME - it would be nice to be able to remove the message from the store at this point if ref_count == 0 */
-			db->retained_count--;
-		}
-		if(stored->msg.payloadlen){
-			hier->retained = stored;
-			hier->retained->ref_count++;
-			db->retained_count++;
+	if(db->config->upgrade_outgoing_qos){
+		msg_qos = client_qos;
+	}else{
+		if(qos > client_qos){
+			msg_qos = client_qos;
 		}else{
-			hier->retained = NULL;
+			msg_qos = qos;
 		}
 	}
+	if(msg_qos){
+		mid = _mosquitto_mid_generate(leaf->context);
+	}else{
+		mid = 0;
+	}
+	if(leaf->context->is_bridge){
+		/* If we know the client is a bridge then we should set retain
+		 * even if the message is fresh. If we don't do this, retained
+		 * messages won't be propagated. */
+		client_retain = retain;
+	}else{
+		/* Client is not a bridge and this isn't a stale message so
+		 * retain should be false. */
+		client_retain = false;
+	}
+	if(mqtt3_db_message_insert(db, leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored) == 1) return 1;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Shared subscriptions.
+ *
+ * A subscription to $share/<group>/<filter> makes the client a member of the
+ * named group on that filter. A message matching the filter goes to only one
+ * member of each group, so a set of consumers can split a busy stream of
+ * messages between them rather than each receiving all of it. Groups are
+ * kept on the tree node for their filter next to the ordinary subscribers,
+ * so matching costs the same as for an ordinary subscription.
+ *
+ * With shared_subscription_policy round_robin the members take turns. With
+ * topic_hash the member is chosen from a hash of the topic, so all messages
+ * on one topic go to the same member, in order, for as long as the group
+ * doesn't change. Either way a connected member is preferred over a
+ * disconnected one with a persistent session, and members the ACLs don't
+ * allow to read the topic are passed over.
+ *
+ * Retained messages are not sent when a shared subscription is made.
+ */
+
+static int _subs_shared_process(struct mosquitto_db *db, struct _mosquitto_subshared *shared, const char *source_id, struct _mosquitto_topic *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_subleaf *leaf, *chosen = NULL;
+	int start;
+	int i;
+	int rc2;
+
+	if(!shared->sub_count) return MOSQ_ERR_SUCCESS;
+
+	if(db->config->shared_subscription_policy == ssp_topic_hash){
+		start = topic->hash % (unsigned int)shared->sub_count;
+	}else{
+		start = shared->next_sub++ % (unsigned int)shared->sub_count;
+	}
+	leaf = shared->subs;
+	for(i=0; i<start; i++){
+		leaf = leaf->next;
+	}
+
+	/* Go round the group once from the starting member. */
+	for(i=0; i<shared->sub_count; i++){
+		if(!leaf->context->is_bridge || strcmp(leaf->context->id, source_id)){
+			rc2 = mosquitto_acl_check_topic(db, leaf->context, topic, MOSQ_ACL_READ);
+			if(rc2 == MOSQ_ERR_SUCCESS){
+				if(leaf->context->sock != INVALID_SOCKET){
+					chosen = leaf;
+					break;
+				}else if(!chosen){
+					chosen = leaf;
+				}
+			}else if(rc2 != MOSQ_ERR_ACL_DENIED){
+				return 1; /* Application error */
+			}
+		}
+		leaf = leaf->next ? leaf->next : shared->subs;
+	}
+	if(!chosen) return MOSQ_ERR_SUCCESS;
+
+	return _subs_send(db, chosen, qos, retain, stored);
+}
+
+static int _subs_process(struct mosquitto_db *db, struct _mosquitto_subhier *hier, const char *source_id, struct _mosquitto_topic *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{
+	int rc = 0;
+	int rc2;
+	struct _mosquitto_subleaf *leaf;
+	struct _mosquitto_subshared *shared;
+
+	leaf = hier->subs;
+
 	while(source_id && leaf){
 		if(leaf->context->is_bridge && !strcmp(leaf->context->id, source_id)){
 			leaf = leaf->next;
 			continue;
 		}
 		/* Check for ACL topic access. */
-		rc2 = mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ);
+		rc2 = mosquitto_acl_check_topic(db, leaf->context, topic, MOSQ_ACL_READ);
 		if(rc2 == MOSQ_ERR_ACL_DENIED){
 			leaf = leaf->next;
 			continue;
 		}else if(rc2 == MOSQ_ERR_SUCCESS){
-			client_qos = leaf->qos;
-
-			if(db->config->upgrade_outgoing_qos){
-				msg_qos = client_qos;
-			}else{
-				if(qos > client_qos){
-					msg_qos = client_qos;
-				}else{
-					msg_qos = qos;
-				}
-			}
-			if(msg_qos){
-				mid = _mosquitto_mid_generate(leaf->context);
-			}else{
-				mid = 0;
-			}
-			if(leaf->context->is_bridge){
-				/* If we know the client is a bridge then we should set retain
-				 * even if the message is fresh. If we don't do this, retained
-				 * messages won't be propagated. */
-				client_retain = retain;
-			}else{
-				/* Client is not a bridge and this isn't a stale message so
-				 * retain should be false. */
-				client_retain = false;
-			}
-			if(mqtt3_db_message_insert(db, leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored) == 1) rc = 1;
+			if(_subs_send(db, leaf, qos, retain, stored) == 1) rc = 1;
 		}else{
 			return 1; /* Application error */
 		}
 		leaf = leaf->next;
 	}
+
+	shared = hier->shared;
+	while(source_id && shared){
+		rc2 = _subs_shared_process(db, shared, source_id, topic, qos, retain, stored);
+		if(rc2) rc = rc2;
+		shared = shared->next;
+	}
 	return rc;
 }
 
@@ -242,39 +297,129 @@ cleanup:
 	return 1;
 }
 
-static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
+static int _sub_leaf_add(struct mosquitto_db *db, struct mosquitto *context, int qos, struct _mosquitto_subleaf **head)
 {
-	struct _mosquitto_subhier *branch, *last = NULL;
 	struct _mosquitto_subleaf *leaf, *last_leaf;
 
+	leaf = *head;
+	last_leaf = NULL;
+	while(leaf){
+		if(!strcmp(leaf->context->id, context->id)){
+			/* Client making a second subscription to same topic. Only
+			 * need to update QoS. Return -1 to indicate this to the
+			 * calling function. */
+			leaf->qos = qos;
+			return -1;
+		}
+		last_leaf = leaf;
+		leaf = leaf->next;
+	}
+	leaf = _mosquitto_malloc(sizeof(struct _mosquitto_subleaf));
+	if(!leaf) return MOSQ_ERR_NOMEM;
+	leaf->next = NULL;
+	leaf->context = context;
+	leaf->qos = qos;
+	if(last_leaf){
+		last_leaf->next = leaf;
+		leaf->prev = last_leaf;
+	}else{
+		*head = leaf;
+		leaf->prev = NULL;
+	}
+	db->subscription_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Remove the subscription of context from the list at *head, if it has one.
+ * Returns true if a subscription was removed. */
+static bool _sub_leaf_remove(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subleaf **head)
+{
+	struct _mosquitto_subleaf *leaf;
+
+	leaf = *head;
+	while(leaf){
+		if(leaf->context == context){
+			db->subscription_count--;
+			if(leaf->prev){
+				leaf->prev->next = leaf->next;
+			}else{
+				*head = leaf->next;
+			}
+			if(leaf->next){
+				leaf->next->prev = leaf->prev;
+			}
+			_mosquitto_free(leaf);
+			return true;
+		}
+		leaf = leaf->next;
+	}
+	return false;
+}
+
+static struct _mosquitto_subshared *_sub_shared_find(struct _mosquitto_subhier *subhier, const char *group)
+{
+	struct _mosquitto_subshared *shared;
+
+	shared = subhier->shared;
+	while(shared){
+		if(!strcmp(shared->name, group)) return shared;
+		shared = shared->next;
+	}
+	return NULL;
+}
+
+/* Remove context from the shared subscription group, freeing the group if it
+ * is left empty. */
+static void _sub_shared_remove(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *subhier, struct _mosquitto_subshared *shared)
+{
+	struct _mosquitto_subshared *prev;
+
+	if(!_sub_leaf_remove(db, context, &shared->subs)) return;
+
+	shared->sub_count--;
+	if(shared->subs) return;
+
+	if(subhier->shared == shared){
+		subhier->shared = shared->next;
+	}else{
+		prev = subhier->shared;
+		while(prev->next != shared){
+			prev = prev->next;
+		}
+		prev->next = shared->next;
+	}
+	_mosquitto_free(shared->name);
+	_mosquitto_free(shared);
+}
+
+static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *group)
+{
+	struct _mosquitto_subhier *branch, *last = NULL;
+	struct _mosquitto_subshared *shared;
+	int rc;
+
 	if(!tokens){
 		if(context){
-			leaf = subhier->subs;
-			last_leaf = NULL;
-			while(leaf){
-				if(!strcmp(leaf->context->id, context->id)){
-					/* Client making a second subscription to same topic. Only
-					 * need to update QoS. Return -1 to indicate this to the
-					 * calling function. */
-					leaf->qos = qos;
-					return -1;
+			if(!group){
+				return _sub_leaf_add(db, context, qos, &subhier->subs);
+			}
+			shared = _sub_shared_find(subhier, group);
+			if(!shared){
+				shared = _mosquitto_calloc(1, sizeof(struct _mosquitto_subshared));
+				if(!shared) return MOSQ_ERR_NOMEM;
+				shared->name = _mosquitto_strdup(group);
+				if(!shared->name){
+					_mosquitto_free(shared);
+					return MOSQ_ERR_NOMEM;
 				}
-				last_leaf = leaf;
-				leaf = leaf->next;
+				shared->next = subhier->shared;
+				subhier->shared = shared;
 			}
-			leaf = _mosquitto_malloc(sizeof(struct _mosquitto_subleaf));
-			if(!leaf) return MOSQ_ERR_NOMEM;
-			leaf->next = NULL;
-			leaf->context = context;
-			leaf->qos = qos;
-			if(last_leaf){
-				last_leaf->next = leaf;
-				leaf->prev = last_leaf;
-			}else{
-				subhier->subs = leaf;
-				leaf->prev = NULL;
+			rc = _sub_leaf_add(db, context, qos, &shared->subs);
+			if(rc == MOSQ_ERR_SUCCESS){
+				shared->sub_count++;
 			}
-			db->subscription_count++;
+			return rc;
 		}
 		return MOSQ_ERR_SUCCESS;
 	}
@@ -282,7 +427,7 @@ static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos,
 	branch = subhier->children;
 	while(branch){
 		if(!strcmp(branch->topic, tokens->topic)){
-			return _sub_add(db, context, qos, branch, tokens->next);
+			return _sub_add(db, context, qos, branch, tokens->next, group);
 		}
 		last = branch;
 		branch = branch->next;
@@ -295,36 +440,29 @@ static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos,
 		_mosquitto_free(branch);
 		return MOSQ_ERR_NOMEM;
 	}
+	branch->topic_len = strlen(branch->topic);
+	branch->hash = mqtt3_topic_level_hash(branch->topic, branch->topic_len);
 	if(!last){
 		subhier->children = branch;
 	}else{
 		last->next = branch;
 	}
-	return _sub_add(db, context, qos, branch, tokens->next);
+	return _sub_add(db, context, qos, branch, tokens->next, group);
 }
 
-static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
+static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *group)
 {
 	struct _mosquitto_subhier *branch, *last = NULL;
-	struct _mosquitto_subleaf *leaf;
+	struct _mosquitto_subshared *shared;
 
 	if(!tokens){
-		leaf = subhier->subs;
-		while(leaf){
-			if(leaf->context==context){
-				db->subscription_count--;
-				if(leaf->prev){
-					leaf->prev->next = leaf->next;
-				}else{
-					subhier->subs = leaf->next;
-				}
-				if(leaf->next){
-					leaf->next->prev = leaf->prev;
-				}
-				_mosquitto_free(leaf);
-				return MOSQ_ERR_SUCCESS;
+		if(group){
+			shared = _sub_shared_find(subhier, group);
+			if(shared){
+				_sub_shared_remove(db, context, subhier, shared);
 			}
-			leaf = leaf->next;
+		}else{
+			_sub_leaf_remove(db, context, &subhier->subs);
 		}
 		return MOSQ_ERR_SUCCESS;
 	}
@@ -332,8 +470,8 @@ static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struc
 	branch = subhier->children;
 	while(branch){
 		if(!strcmp(branch->topic, tokens->topic)){
-			_sub_remove(db, context, branch, tokens->next);
-			if(!branch->children && !branch->subs && !branch->retained){
+			_sub_remove(db, context, branch, tokens->next, group);
+			if(!branch->children && !branch->subs && !branch->shared){
 				if(last){
 					last->next = branch->next;
 				}else{
@@ -350,53 +488,108 @@ static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struc
 	return MOSQ_ERR_SUCCESS;
 }
 
-static void _sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
+/* Whether a subscription tree node is for the given level of a topic. The
+ * hashes rule out almost every node that isn't, without looking at the
+ * strings. */
+static bool _sub_level_matches(struct _mosquitto_subhier *branch, struct _mosquitto_topic *topic, int level)
+{
+	struct _mosquitto_topic_level *tlevel = &topic->levels[level];
+
+	return branch->hash == tlevel->hash
+		&& branch->topic_len == tlevel->len
+		&& !memcmp(branch->topic, &topic->topic[tlevel->start], tlevel->len);
+}
+
+static void _sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _mosquitto_topic *topic, int level, const char *source_id, int qos, int retain, struct mosquitto_msg_store *stored)
 {
 	/* FIXME - need to take into account source_id if the client is a bridge */
 	struct _mosquitto_subhier *branch;
-	bool sr;
 
 	branch = subhier->children;
 	while(branch){
-		sr = set_retain;
-
-		if(tokens && tokens->topic && (!strcmp(branch->topic, tokens->topic) || !strcmp(branch->topic, "+"))){
+		if(level < topic->level_count && (_sub_level_matches(branch, topic, level)
+					|| (branch->topic_len == 1 && branch->topic[0] == '+'))){
 			/* The topic matches this subscription.
 			 * Doesn't include # wildcards */
-			if(!strcmp(branch->topic, "+")){
-				/* Don't set a retained message where + is in the hierarchy. */
-				sr = false;
+			_sub_search(db, branch, topic, level+1, source_id, qos, retain, stored);
+			if(level+1 == topic->level_count){
+				_subs_process(db, branch, source_id, topic, qos, retain, stored);
 			}
-			_sub_search(db, branch, tokens->next, source_id, topic, qos, retain, stored, sr);
-			if(!tokens->next){
-				_subs_process(db, branch, source_id, topic, qos, retain, stored, sr);
-			}
-		}else if(!strcmp(branch->topic, "#") && !branch->children){
+		}else if(branch->topic_len == 1 && branch->topic[0] == '#' && !branch->children){
 			/* The topic matches due to a # wildcard - process the
 			 * subscriptions but *don't* return. Although this branch has ended
 			 * there may still be other subscriptions to deal with.
 			 */
-			_subs_process(db, branch, source_id, topic, qos, retain, stored, false);
+			_subs_process(db, branch, source_id, topic, qos, retain, stored);
 		}
 		branch = branch->next;
 	}
 }
 
+int mqtt3_sub_shared_parse(const char *sub, const char **group, int *group_len, const char **filter)
+{
+	const char *end;
+
+	assert(sub);
+
+	if(strncmp(sub, "$share/", 7)) return MOSQ_ERR_NOT_FOUND;
+
+	*group = &sub[7];
+	end = strchr(*group, '/');
+	if(!end || end == *group || end[1] == '\0') return MOSQ_ERR_INVAL;
+	*group_len = end - *group;
+	if(memchr(*group, '+', *group_len) || memchr(*group, '#', *group_len)){
+		return MOSQ_ERR_INVAL;
+	}
+	*filter = end+1;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Split sub into the filter and, for a shared subscription, a copy of the
+ * group name. */
+static int _sub_shared_split(const char *sub, const char **filter, char **group)
+{
+	const char *group_start;
+	int group_len;
+	int rc;
+
+	*group = NULL;
+	rc = mqtt3_sub_shared_parse(sub, &group_start, &group_len, filter);
+	if(rc == MOSQ_ERR_NOT_FOUND){
+		*filter = sub;
+		return MOSQ_ERR_SUCCESS;
+	}else if(rc){
+		return rc;
+	}
+	*group = _mosquitto_malloc(group_len+1);
+	if(!(*group)) return MOSQ_ERR_NOMEM;
+	memcpy(*group, group_start, group_len);
+	(*group)[group_len] = '\0';
+	return MOSQ_ERR_SUCCESS;
+}
+
 int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root)
 {
 	int rc = 0;
 	struct _mosquitto_subhier *subhier, *child;
 	struct _sub_token *tokens = NULL, *tail;
+	const char *filter;
+	char *group;
 
 	assert(root);
 	assert(sub);
 
-	if(_sub_topic_tokenise(sub, &tokens)) return 1;
+	rc = _sub_shared_split(sub, &filter, &group);
+	if(rc) return rc;
+	if(_sub_topic_tokenise(filter, &tokens)){
+		if(group) _mosquitto_free(group);
+		return 1;
+	}
 
 	subhier = root->children;
 	while(subhier){
 		if(!strcmp(subhier->topic, tokens->topic)){
-			rc = _sub_add(db, context, qos, subhier, tokens);
+			rc = _sub_add(db, context, qos, subhier, tokens, group);
 			break;
 		}
 		subhier = subhier->next;
@@ -412,9 +605,11 @@ int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
+		child->topic_len = strlen(child->topic);
+		child->hash = mqtt3_topic_level_hash(child->topic, child->topic_len);
 		child->subs = NULL;
+		child->shared = NULL;
 		child->children = NULL;
-		child->retained = NULL;
 		if(db->subs.children){
 			child->next = db->subs.children;
 		}else{
@@ -422,7 +617,7 @@ int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char
 		}
 		db->subs.children = child;
 
-		rc = _sub_add(db, context, qos, child, tokens);
+		rc = _sub_add(db, context, qos, child, tokens, group);
 	}
 
 	while(tokens){
@@ -431,8 +626,14 @@ int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char
 		_mosquitto_free(tokens);
 		tokens = tail;
 	}
+	if(group) _mosquitto_free(group);
 	/* We aren't worried about -1 (already subscribed) return codes. */
 	if(rc == -1) rc = MOSQ_ERR_SUCCESS;
+#ifdef WITH_PERSISTENCE
+	if(!rc && context){
+		mqtt3_db_journal_sub(db, context, sub, qos);
+	}
+#endif
 	return rc;
 }
 
@@ -441,16 +642,23 @@ int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const c
 	int rc = 0;
 	struct _mosquitto_subhier *subhier;
 	struct _sub_token *tokens = NULL, *tail;
+	const char *filter;
+	char *group;
 
 	assert(root);
 	assert(sub);
 
-	if(_sub_topic_tokenise(sub, &tokens)) return 1;
+	rc = _sub_shared_split(sub, &filter, &group);
+	if(rc) return rc;
+	if(_sub_topic_tokenise(filter, &tokens)){
+		if(group) _mosquitto_free(group);
+		return 1;
+	}
 
 	subhier = root->children;
 	while(subhier){
 		if(!strcmp(subhier->topic, tokens->topic)){
-			rc = _sub_remove(db, context, subhier, tokens);
+			rc = _sub_remove(db, context, subhier, tokens, group);
 			break;
 		}
 		subhier = subhier->next;
@@ -462,6 +670,10 @@ int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const c
 		_mosquitto_free(tokens);
 		tokens = tail;
 	}
+	if(group) _mosquitto_free(group);
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_journal_sub_delete(db, context, sub);
+#endif
 
 	return rc;
 }
@@ -470,32 +682,29 @@ int mqtt3_db_messages_queue(struct mosquitto_db *db, const char *source_id, cons
 {
 	int rc = 0;
 	struct _mosquitto_subhier *subhier;
-	struct _sub_token *tokens = NULL, *tail;
 
 	assert(db);
 	assert(topic);
+	assert(stored && stored->topic);
 
-	if(_sub_topic_tokenise(topic, &tokens)) return 1;
-
+	if(retain){
+#ifdef WITH_PERSISTENCE
+		if(strncmp(topic, "$SYS", 4)){
+			/* Retained messages count as a persistence change, but only if
+			 * they aren't for $SYS. */
+			db->persistence_changes++;
+		}
+		mqtt3_db_journal_retain(db, stored);
+#endif
+		rc = mqtt3_retain_store(db, stored);
+	}
 	subhier = db->subs.children;
 	while(subhier){
-		if(!strcmp(subhier->topic, tokens->topic)){
-			if(retain){
-				/* We have a message that needs to be retained, so ensure that the subscription
-				 * tree for its topic exists.
-				 */
-				_sub_add(db, NULL, 0, subhier, tokens);
-			}
-			_sub_search(db, subhier, tokens, source_id, topic, qos, retain, stored, true);
+		if(_sub_level_matches(subhier, stored->topic, 0)){
+			_sub_search(db, subhier, stored->topic, 0, source_id, qos, retain, stored);
 		}
 		subhier = subhier->next;
 	}
-	while(tokens){
-		tail = tokens->next;
-		_mosquitto_free(tokens->topic);
-		_mosquitto_free(tokens);
-		tokens = tail;
-	}
 
 	return rc;
 }
@@ -504,34 +713,23 @@ static int _subs_clean_session(struct mosquitto_db *db, struct mosquitto *contex
 {
 	int rc = 0;
 	struct _mosquitto_subhier *child, *last = NULL;
-	struct _mosquitto_subleaf *leaf, *next;
+	struct _mosquitto_subshared *shared, *next_shared;
 
 	if(!root) return MOSQ_ERR_SUCCESS;
 
-	leaf = root->subs;
-	while(leaf){
-		if(leaf->context == context){
-			db->subscription_count--;
-			if(leaf->prev){
-				leaf->prev->next = leaf->next;
-			}else{
-				root->subs = leaf->next;
-			}
-			if(leaf->next){
-				leaf->next->prev = leaf->prev;
-			}
-			next = leaf->next;
-			_mosquitto_free(leaf);
-			leaf = next;
-		}else{
-			leaf = leaf->next;
-		}
+	_sub_leaf_remove(db, context, &root->subs);
+
+	shared = root->shared;
+	while(shared){
+		next_shared = shared->next;
+		_sub_shared_remove(db, context, root, shared);
+		shared = next_shared;
 	}
 
 	child = root->children;
 	while(child){
 		_subs_clean_session(db, context, child);
-		if(!child->children && !child->subs && !child->retained){
+		if(!child->children && !child->subs && !child->shared){
 			if(last){
 				last->next = child->next;
 			}else{
@@ -572,6 +770,7 @@ void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level)
 	int i;
 	struct _mosquitto_subhier *branch;
 	struct _mosquitto_subleaf *leaf;
+	struct _mosquitto_subshared *shared;
 
 	for(i=0; i<level*2; i++){
 		printf(" ");
@@ -586,8 +785,14 @@ void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level)
 		}
 		leaf = leaf->next;
 	}
-	if(root->retained){
-		printf(" (r)");
+	shared = root->shared;
+	while(shared){
+		leaf = shared->subs;
+		while(leaf){
+			printf(" ($share/%s %s, %d)", shared->name, leaf->context->id, leaf->qos);
+			leaf = leaf->next;
+		}
+		shared = shared->next;
 	}
 	printf("\n");
 
@@ -597,100 +802,3 @@ void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level)
 		branch = branch->next;
 	}
 }
-
-static int _retain_process(struct mosquitto_db *db, struct mosquitto_msg_store *retained, struct mosquitto *context, const char *sub, int sub_qos)
-{
-	int rc = 0;
-	int qos;
-	uint16_t mid;
-
-	rc = mosquitto_acl_check(db, context, retained->msg.topic, MOSQ_ACL_READ);
-	if(rc == MOSQ_ERR_ACL_DENIED){
-		return MOSQ_ERR_SUCCESS;
-	}else if(rc != MOSQ_ERR_SUCCESS){
-		return rc;
-	}
-
-	qos = retained->msg.qos;
-
-	if(qos > sub_qos) qos = sub_qos;
-	if(qos > 0){
-		mid = _mosquitto_mid_generate(context);
-	}else{
-		mid = 0;
-	}
-	return mqtt3_db_message_insert(db, context, mid, mosq_md_out, qos, true, retained);
-}
-
-static int _retain_search(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, struct _sub_token *tokens, struct mosquitto *context, const char *sub, int sub_qos, int level)
-{
-	struct _mosquitto_subhier *branch;
-	int flag = 0;
-
-	branch = subhier->children;
-	while(branch){
-		/* Subscriptions with wildcards in aren't really valid topics to publish to
-		 * so they can't have retained messages.
-		 */
-		if(!strcmp(tokens->topic, "#") && !tokens->next){
-			/* Set flag to indicate that we should check for retained messages
-			 * on "foo" when we are subscribing to e.g. "foo/#" and then exit
-			 * this function and return to an earlier _retain_search().
-			 */
-			flag = -1;
-			if(branch->retained){
-				_retain_process(db, branch->retained, context, sub, sub_qos);
-			}
-			if(branch->children){
-				_retain_search(db, branch, tokens, context, sub, sub_qos, level+1);
-			}
-		}else if(strcmp(branch->topic, "+") && (!strcmp(branch->topic, tokens->topic) || !strcmp(tokens->topic, "+"))){
-			if(tokens->next){
-				if(_retain_search(db, branch, tokens->next, context, sub, sub_qos, level+1) == -1
-						|| (!branch->next && tokens->next && !strcmp(tokens->next->topic, "#") && level>0)){
-
-					if(branch->retained){
-						_retain_process(db, branch->retained, context, sub, sub_qos);
-					}
-				}
-			}else{
-				if(branch->retained){
-					_retain_process(db, branch->retained, context, sub, sub_qos);
-				}
-			}
-		}
-
-		branch = branch->next;
-	}
-	return flag;
-}
-
-int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos)
-{
-	struct _mosquitto_subhier *subhier;
-	struct _sub_token *tokens = NULL, *tail;
-
-	assert(db);
-	assert(context);
-	assert(sub);
-
-	if(_sub_topic_tokenise(sub, &tokens)) return 1;
-
-	subhier = db->subs.children;
-	while(subhier){
-		if(!strcmp(subhier->topic, tokens->topic)){
-			_retain_search(db, subhier, tokens, context, sub, sub_qos, 0);
-			break;
-		}
-		subhier = subhier->next;
-	}
-	while(tokens){
-		tail = tokens->next;
-		_mosquitto_free(tokens->topic);
-		_mosquitto_free(tokens);
-		tokens = tail;
-	}
-
-	return MOSQ_ERR_SUCCESS;
-}
-
@@ -31,6 +31,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <config.h>
 
@@ -49,10 +50,45 @@ unsigned long g_msgs_sent = 0;
 unsigned long g_pub_msgs_received = 0;
 unsigned long g_pub_msgs_sent = 0;
 unsigned long g_msgs_dropped = 0;
+unsigned long g_msgs_dropped_oldest = 0;
+unsigned long g_msgs_conflated = 0;
 int g_clients_expired = 0;
 unsigned int g_socket_connections = 0;
 unsigned int g_connection_count = 0;
 
+#define LATENCY_BUCKETS 128
+
+/* Log-linear latency histogram, in microseconds. Values below 4 have a bucket
+ * each and every power of two range above that is split into four equal
+ * buckets, so a percentile is known to within 25% at any scale. The counts
+ * are for the current $SYS interval only. */
+struct _sys_latency{
+	unsigned long buckets[LATENCY_BUCKETS];
+	unsigned long count;
+	uint64_t max;
+	/* count, p50, p90, p99 and max as last published. */
+	uint64_t published[5];
+};
+
+/* Messages received on topics matching one sys_topic_prefix pattern. */
+struct _sys_topic_stats{
+	/* $SYS/broker/topics/<name>/, with room for the rest of each topic. */
+	char *sys_topic;
+	int sys_topic_len;
+	unsigned long msgs_received;
+	uint64_t bytes_received;
+	unsigned long msgs_last;
+	uint64_t bytes_last;
+	double msgs_load1;
+	double bytes_load1;
+};
+
+static struct _sys_latency latency[2];
+static const char *latency_names[2] = {"receive-enqueue", "enqueue-write"};
+/* One for each sys_topic_prefix option, in the same order. */
+static struct _sys_topic_stats *topic_stats = NULL;
+static int topic_stats_count = 0;
+
 static void _sys_update_clients(struct mosquitto_db *db, char *buf)
 {
 	static unsigned int client_count = -1;
@@ -116,6 +152,213 @@ static void _sys_update_memory(struct mosquitto_db *db, char *buf)
 }
 #endif
 
+static int _latency_bucket(uint64_t usec)
+{
+	int msb = 0;
+	uint64_t v = usec;
+	int i;
+
+	if(usec < 4) return (int)usec;
+
+	while(v >>= 1) msb++;
+	i = (msb-1)*4 + (int)((usec >> (msb-2)) & 3);
+	return i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS-1;
+}
+
+/* The largest value that falls in bucket i. */
+static uint64_t _latency_bucket_max(int i)
+{
+	int shift;
+
+	if(i < 4) return i;
+
+	shift = i/4 - 1;
+	return ((uint64_t)(4 + i%4) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+void mqtt3_sys_latency_record(enum mqtt3_latency_type type, uint64_t usec)
+{
+	struct _sys_latency *hist = &latency[type];
+
+	hist->buckets[_latency_bucket(usec)]++;
+	hist->count++;
+	if(usec > hist->max){
+		hist->max = usec;
+	}
+}
+
+static uint64_t _latency_percentile(struct _sys_latency *hist, int percent)
+{
+	unsigned long target, sum = 0;
+	uint64_t value;
+	int i;
+
+	target = (hist->count*percent + 99)/100;
+	for(i=0; i<LATENCY_BUCKETS; i++){
+		sum += hist->buckets[i];
+		if(sum >= target) break;
+	}
+	value = _latency_bucket_max(i);
+	return value < hist->max ? value : hist->max;
+}
+
+/* Publish $SYS/broker/latency/<name>/{count,p50,p90,p99,max} for the interval
+ * just ended and start the next one. */
+static void _sys_update_latency(struct mosquitto_db *db, char *buf)
+{
+	static const char *stats[5] = {"count", "p50", "p90", "p99", "max"};
+	char topic[BUFLEN];
+	struct _sys_latency *hist;
+	uint64_t values[5];
+	int i, j;
+
+	for(i=0; i<2; i++){
+		hist = &latency[i];
+		values[0] = hist->count;
+		if(hist->count){
+			values[1] = _latency_percentile(hist, 50);
+			values[2] = _latency_percentile(hist, 90);
+			values[3] = _latency_percentile(hist, 99);
+			values[4] = hist->max;
+		}
+		/* Without messages there's no latency to report, so leave the last
+		 * values in place. */
+		for(j=0; j<(hist->count?5:1); j++){
+			if(values[j] != hist->published[j]){
+				hist->published[j] = values[j];
+				snprintf(topic, BUFLEN, "$SYS/broker/latency/%s/%s", latency_names[i], stats[j]);
+				snprintf(buf, BUFLEN, "%llu", (unsigned long long)values[j]);
+				mqtt3_db_messages_easy_queue(db, NULL, topic, 2, strlen(buf), buf, 1);
+			}
+		}
+		memset(hist->buckets, 0, sizeof(hist->buckets));
+		hist->count = 0;
+		hist->max = 0;
+	}
+}
+
+/* Returns true if the start of topic matches pattern, a sequence of topic
+ * levels in which + matches any single level. */
+static bool _topic_prefix_match(const char *pattern, const char *topic)
+{
+	const char *p = pattern;
+	const char *t = topic;
+
+	while(*p){
+		if(p[0] == '+' && (p[1] == '/' || p[1] == '\0')){
+			while(*t && *t != '/') t++;
+			p++;
+		}else{
+			while(*p && *p != '/'){
+				if(*p != *t) return false;
+				p++;
+				t++;
+			}
+			if(*t && *t != '/') return false;
+		}
+		if(*p == '/'){
+			if(*t != '/') return false;
+			p++;
+			t++;
+		}
+	}
+	return true;
+}
+
+static int _topic_stats_init(struct mosquitto_db *db)
+{
+	int i;
+	char *name;
+
+	topic_stats = _mosquitto_calloc(db->config->sys_topic_prefix_count, sizeof(struct _sys_topic_stats));
+	if(!topic_stats) return MOSQ_ERR_NOMEM;
+	topic_stats_count = db->config->sys_topic_prefix_count;
+
+	for(i=0; i<topic_stats_count; i++){
+		name = db->config->sys_topic_names[i];
+		/* Long enough for "load/messages/received/1min". */
+		topic_stats[i].sys_topic = _mosquitto_malloc(strlen("$SYS/broker/topics//") + strlen(name) + 30);
+		if(!topic_stats[i].sys_topic) return MOSQ_ERR_NOMEM;
+		topic_stats[i].sys_topic_len = sprintf(topic_stats[i].sys_topic, "$SYS/broker/topics/%s/", name);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Count a message received on topic against the first sys_topic_prefix
+ * pattern that matches it. All the topics a pattern matches share its
+ * counters. */
+void mqtt3_sys_topic_count(struct mosquitto_db *db, const char *topic, uint32_t payloadlen)
+{
+	int i;
+
+	if(!topic_stats && _topic_stats_init(db)) return;
+
+	for(i=0; i<topic_stats_count; i++){
+		if(_topic_prefix_match(db->config->sys_topic_prefixes[i], topic)){
+			topic_stats[i].msgs_received++;
+			topic_stats[i].bytes_received += payloadlen;
+			return;
+		}
+	}
+}
+
+static void _sys_topic_publish(struct mosquitto_db *db, struct _sys_topic_stats *stats, const char *suffix, const char *buf)
+{
+	strcpy(&stats->sys_topic[stats->sys_topic_len], suffix);
+	mqtt3_db_messages_easy_queue(db, NULL, stats->sys_topic, 2, strlen(buf), buf, 1);
+}
+
+static void _sys_update_topics(struct mosquitto_db *db, char *buf, double i_mult, double exponent)
+{
+	struct _sys_topic_stats *stats;
+	double msgs_interval, bytes_interval, new_value;
+	int i;
+
+	for(i=0; i<topic_stats_count; i++){
+		stats = &topic_stats[i];
+		if(!stats->sys_topic) continue;
+
+		msgs_interval = (stats->msgs_received - stats->msgs_last)*i_mult;
+		bytes_interval = (stats->bytes_received - stats->bytes_last)*i_mult;
+
+		if(stats->msgs_received != stats->msgs_last){
+			stats->msgs_last = stats->msgs_received;
+			snprintf(buf, BUFLEN, "%lu", stats->msgs_received);
+			_sys_topic_publish(db, stats, "messages/received", buf);
+
+			stats->bytes_last = stats->bytes_received;
+			snprintf(buf, BUFLEN, "%llu", (unsigned long long)stats->bytes_received);
+			_sys_topic_publish(db, stats, "bytes/received", buf);
+		}
+
+		new_value = msgs_interval + exponent*(stats->msgs_load1 - msgs_interval);
+		if(fabs(new_value - stats->msgs_load1) >= 0.01){
+			snprintf(buf, BUFLEN, "%.2f", new_value);
+			_sys_topic_publish(db, stats, "load/messages/received/1min", buf);
+		}
+		stats->msgs_load1 = new_value;
+
+		new_value = bytes_interval + exponent*(stats->bytes_load1 - bytes_interval);
+		if(fabs(new_value - stats->bytes_load1) >= 0.01){
+			snprintf(buf, BUFLEN, "%.2f", new_value);
+			_sys_topic_publish(db, stats, "load/bytes/received/1min", buf);
+		}
+		stats->bytes_load1 = new_value;
+	}
+}
+
+void mqtt3_sys_cleanup(void)
+{
+	int i;
+
+	for(i=0; i<topic_stats_count; i++){
+		if(topic_stats[i].sys_topic) _mosquitto_free(topic_stats[i].sys_topic);
+	}
+	if(topic_stats) _mosquitto_free(topic_stats);
+	topic_stats = NULL;
+	topic_stats_count = 0;
+}
+
 static void calc_load(struct mosquitto_db *db, char *buf, const char *topic, double exponent, double interval, double *current)
 {
 	double new_value;
@@ -145,6 +388,8 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 	static unsigned long msgs_received = -1;
 	static unsigned long msgs_sent = -1;
 	static unsigned long publish_dropped = -1;
+	static unsigned long publish_dropped_oldest = -1;
+	static unsigned long publish_conflated = -1;
 	static unsigned long pub_msgs_received = -1;
 	static unsigned long pub_msgs_sent = -1;
 	static unsigned long long bytes_received = -1;
@@ -202,6 +447,7 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/uptime", 2, strlen(buf), buf, 1);
 
 		_sys_update_clients(db, buf);
+		_sys_update_latency(db, buf);
 		if(last_update > 0){
 			i_mult = 60.0/(double)(now-last_update);
 
@@ -232,6 +478,7 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 			calc_load(db, buf, "$SYS/broker/load/bytes/sent/1min", exponent, bytes_sent_interval, &bytes_sent_load1);
 			calc_load(db, buf, "$SYS/broker/load/sockets/1min", exponent, socket_interval, &socket_load1);
 			calc_load(db, buf, "$SYS/broker/load/connections/1min", exponent, connection_interval, &connection_load1);
+			_sys_update_topics(db, buf, i_mult, exponent);
 
 			/* 5 minute load */
 			exponent = exp(-1.0*(now-last_update)/300.0);
@@ -298,6 +545,23 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 			publish_dropped = g_msgs_dropped;
 			snprintf(buf, BUFLEN, "%lu", publish_dropped);
 			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/dropped", 2, strlen(buf), buf, 1);
+
+			/* Split by queue policy: the new message is dropped unless the
+			 * policy removed an older one instead. */
+			snprintf(buf, BUFLEN, "%lu", g_msgs_dropped - g_msgs_dropped_oldest);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/dropped/newest", 2, strlen(buf), buf, 1);
+		}
+
+		if(publish_dropped_oldest != g_msgs_dropped_oldest){
+			publish_dropped_oldest = g_msgs_dropped_oldest;
+			snprintf(buf, BUFLEN, "%lu", publish_dropped_oldest);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/dropped/oldest", 2, strlen(buf), buf, 1);
+		}
+
+		if(publish_conflated != g_msgs_conflated){
+			publish_conflated = g_msgs_conflated;
+			snprintf(buf, BUFLEN, "%lu", publish_conflated);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/conflated", 2, strlen(buf), buf, 1);
 		}
 
 		if(pub_msgs_received != g_pub_msgs_received){
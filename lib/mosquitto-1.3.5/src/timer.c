@@ -0,0 +1,225 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Hierarchical timer wheel used for broker housekeeping.
+ *
+ * Keepalive deadlines, QoS retry deadlines, persistent client expiry and
+ * bridge restarts used to be found by scanning every context (and every
+ * message of every context) on each pass of the main loop. Instead, each
+ * context carries a small number of timer entries that are placed in the
+ * wheel below. Processing the wheel only touches the slots for the seconds
+ * that have elapsed, so the cost is proportional to the number of expiring
+ * timers rather than to the number of clients.
+ *
+ * The resolution is one second, matching mosquitto_time(). The first level
+ * has 256 slots of one second, each subsequent level has 64 slots covering
+ * the whole of the previous level. Timers further away than the last level
+ * can represent are clamped; every handler rechecks its own deadline, so an
+ * early expiry simply results in the timer being rescheduled.
+ */
+
+#include <assert.h>
+
+#include <config.h>
+
+#include <mosquitto_broker.h>
+#include <time_mosq.h>
+
+#define TW_ROOT_BITS 8
+#define TW_LEVEL_BITS 6
+#define TW_ROOT_SIZE (1<<TW_ROOT_BITS)
+#define TW_LEVEL_SIZE (1<<TW_LEVEL_BITS)
+#define TW_ROOT_MASK (TW_ROOT_SIZE-1)
+#define TW_LEVEL_MASK (TW_LEVEL_SIZE-1)
+#define TW_LEVELS 3
+#define TW_MAX_DELTA (((time_t)1<<(TW_ROOT_BITS+TW_LEVELS*TW_LEVEL_BITS))-1)
+
+#define TW_LEVEL_INDEX(t, n) ((int)(((t) >> (TW_ROOT_BITS+(n)*TW_LEVEL_BITS)) & TW_LEVEL_MASK))
+
+static struct _mosquitto_timer *wheel_root[TW_ROOT_SIZE];
+static struct _mosquitto_timer *wheel_level[TW_LEVELS][TW_LEVEL_SIZE];
+/* The next tick to be processed. Everything before this has expired. */
+static time_t wheel_now = 0;
+
+static void _timer_link(struct _mosquitto_timer **head, struct _mosquitto_timer *timer)
+{
+	timer->next = *head;
+	if(timer->next){
+		timer->next->pprev = &timer->next;
+	}
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void _timer_insert(struct _mosquitto_timer *timer)
+{
+	time_t expiry = timer->expiry;
+	time_t delta;
+
+	if(expiry < wheel_now){
+		expiry = wheel_now;
+	}
+	delta = expiry - wheel_now;
+	if(delta > TW_MAX_DELTA){
+		expiry = wheel_now + TW_MAX_DELTA;
+		delta = TW_MAX_DELTA;
+	}
+
+	if(delta < TW_ROOT_SIZE){
+		_timer_link(&wheel_root[expiry & TW_ROOT_MASK], timer);
+	}else if(delta < (time_t)1<<(TW_ROOT_BITS+TW_LEVEL_BITS)){
+		_timer_link(&wheel_level[0][TW_LEVEL_INDEX(expiry, 0)], timer);
+	}else if(delta < (time_t)1<<(TW_ROOT_BITS+2*TW_LEVEL_BITS)){
+		_timer_link(&wheel_level[1][TW_LEVEL_INDEX(expiry, 1)], timer);
+	}else{
+		_timer_link(&wheel_level[2][TW_LEVEL_INDEX(expiry, 2)], timer);
+	}
+}
+
+/* Move every timer in a higher level slot down to the level below. Returns the
+ * slot index so the caller knows whether the next level up must also be
+ * cascaded. */
+static int _timer_cascade(int level)
+{
+	struct _mosquitto_timer *list, *timer;
+	int index;
+
+	index = TW_LEVEL_INDEX(wheel_now, level);
+	list = wheel_level[level][index];
+	wheel_level[level][index] = NULL;
+	while(list){
+		timer = list;
+		list = list->next;
+		_timer_insert(timer);
+	}
+	return index;
+}
+
+static void _timer_fire(struct mosquitto_db *db, struct _mosquitto_timer *timer, time_t now)
+{
+	switch(timer->type){
+		case mosq_tt_keepalive:
+			mqtt3_context_keepalive_check(db, timer->context, now);
+			break;
+		case mosq_tt_retry:
+			mqtt3_db_message_timeout_check(db, timer->context, now);
+			break;
+		case mosq_tt_expire:
+			mqtt3_context_expiry_check(db, timer->context, now);
+			break;
+		case mosq_tt_bridge:
+#ifdef WITH_BRIDGE
+			mqtt3_bridge_timer_check(db, timer->context, now);
+#endif
+			break;
+	}
+}
+
+void mqtt3_timer_init(struct _mosquitto_timer *timer, struct mosquitto *context, enum mosquitto_timer_type type)
+{
+	assert(timer);
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->context = context;
+	timer->expiry = 0;
+	timer->type = type;
+}
+
+/* Schedule timer to expire at time expiry. If the timer is already pending it
+ * is rescheduled. */
+void mqtt3_timer_add(struct _mosquitto_timer *timer, time_t expiry)
+{
+	assert(timer);
+
+	if(!wheel_now){
+		wheel_now = mosquitto_time();
+	}
+	mqtt3_timer_remove(timer);
+	timer->expiry = expiry;
+	_timer_insert(timer);
+}
+
+void mqtt3_timer_remove(struct _mosquitto_timer *timer)
+{
+	assert(timer);
+
+	if(!timer->pprev) return;
+
+	*(timer->pprev) = timer->next;
+	if(timer->next){
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+bool mqtt3_timer_pending(struct _mosquitto_timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+/* Expire all timers due at or before now. Handlers may freely add or remove
+ * timers, including other timers from the slot currently being processed. */
+void mqtt3_timer_process(struct mosquitto_db *db, time_t now)
+{
+	struct _mosquitto_timer *expired;
+	struct _mosquitto_timer *timer;
+	int index;
+	int level;
+
+	if(!wheel_now){
+		wheel_now = now;
+	}
+
+	while(wheel_now <= now){
+		index = wheel_now & TW_ROOT_MASK;
+		if(!index){
+			for(level=0; level<TW_LEVELS; level++){
+				if(_timer_cascade(level)) break;
+			}
+		}
+
+		expired = wheel_root[index];
+		if(expired){
+			expired->pprev = &expired;
+		}
+		wheel_root[index] = NULL;
+
+		/* Advance before running handlers, so a handler that reschedules for
+		 * "now" ends up in the next tick rather than a full revolution away. */
+		wheel_now++;
+
+		while(expired){
+			timer = expired;
+			mqtt3_timer_remove(timer);
+			_timer_fire(db, timer, now);
+		}
+	}
+}
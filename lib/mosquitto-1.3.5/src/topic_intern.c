@@ -0,0 +1,230 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Interned topics.
+ *
+ * Publishers such as monitoring agents send on the same set of topics over
+ * and over. Rather than every stored message having its own copy of its
+ * topic, and every step of routing splitting and comparing that copy again,
+ * each distinct topic is held once in a table of reference counted
+ * struct _mosquitto_topic. Along with the string, the entry records where
+ * each topic level starts, how long it is and a hash of it, so that the
+ * subscription tree can be walked without touching the string for levels
+ * that don't match. Because there is only ever one entry for a topic, the
+ * entry's address can be used as a key in place of the string, as the ACL
+ * cache and the conflate queue index do.
+ *
+ * The levels are those the subscription tree uses: a topic that doesn't
+ * start with $ has an extra empty level in front, see first_level.
+ *
+ * An entry whose last reference is released is not freed straight away.
+ * Most topics are published again within seconds, often with no
+ * subscription, retained message or ACL cache entry holding them in between,
+ * and rebuilding the entry each time would cost more than it saves. Instead
+ * it goes on an idle list, oldest first, and is taken off again if the topic
+ * comes back. mqtt3_topic_idle_expire(), called from the main loop, frees
+ * the entries that have been idle for TOPIC_IDLE_TIME seconds, and no more
+ * than TOPIC_IDLE_MAX are kept at once.
+ */
+
+#include <string.h>
+
+#include <config.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+
+#define TOPIC_IDLE_TIME 60
+#define TOPIC_IDLE_MAX 65536
+
+static struct _mosquitto_topic *topics = NULL;
+static struct _mosquitto_topic *idle_head = NULL;
+static struct _mosquitto_topic *idle_tail = NULL;
+static int idle_count = 0;
+/* The time as of the last mqtt3_topic_idle_expire(), which is close enough
+ * for stamping idle entries. */
+static time_t idle_now = 0;
+
+uint32_t mqtt3_topic_level_hash(const char *level, int len)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for(i=0; i<len; i++){
+		hash ^= (unsigned char)level[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static size_t _topic_size(int len, int level_count)
+{
+	return sizeof(struct _mosquitto_topic)
+		+ level_count*sizeof(struct _mosquitto_topic_level)
+		+ len + 1;
+}
+
+static struct _mosquitto_topic *_topic_new(const char *str, int len)
+{
+	struct _mosquitto_topic *topic;
+	struct _mosquitto_topic_level *level;
+	int level_count;
+	int first_level;
+	int start;
+	int i;
+
+	first_level = str[0] != '$' ? 1 : 0;
+	level_count = first_level + 1;
+	for(i=0; i<len; i++){
+		if(str[i] == '/') level_count++;
+	}
+
+	topic = mqtt3_pool_alloc(_topic_size(len, level_count));
+	if(!topic) return NULL;
+
+	topic->ref_count = 0;
+	topic->idle_prev = NULL;
+	topic->idle_next = NULL;
+	topic->len = len;
+	topic->level_count = level_count;
+	topic->first_level = first_level;
+	topic->levels = (struct _mosquitto_topic_level *)(topic+1);
+	topic->topic = (char *)(&topic->levels[level_count]);
+	memcpy(topic->topic, str, len+1);
+	topic->hash = mqtt3_topic_level_hash(str, len);
+
+	level = topic->levels;
+	if(first_level){
+		level->start = 0;
+		level->len = 0;
+		level->hash = mqtt3_topic_level_hash("", 0);
+		level++;
+	}
+	start = 0;
+	for(i=0; i<=len; i++){
+		if(str[i] == '/' || str[i] == '\0'){
+			level->start = start;
+			level->len = i - start;
+			level->hash = mqtt3_topic_level_hash(&str[start], i - start);
+			level++;
+			start = i+1;
+		}
+	}
+
+	HASH_ADD_KEYPTR(hh, topics, topic->topic, len, topic);
+	return topic;
+}
+
+static void _topic_idle_unlink(struct _mosquitto_topic *topic)
+{
+	if(topic->idle_prev){
+		topic->idle_prev->idle_next = topic->idle_next;
+	}else{
+		idle_head = topic->idle_next;
+	}
+	if(topic->idle_next){
+		topic->idle_next->idle_prev = topic->idle_prev;
+	}else{
+		idle_tail = topic->idle_prev;
+	}
+	topic->idle_prev = NULL;
+	topic->idle_next = NULL;
+	idle_count--;
+}
+
+/* Free an idle entry. */
+static void _topic_free(struct _mosquitto_topic *topic)
+{
+	_topic_idle_unlink(topic);
+	HASH_DELETE(hh, topics, topic);
+	mqtt3_pool_free(topic, _topic_size(topic->len, topic->level_count));
+}
+
+/* Return the interned entry for str, with a reference held for the caller,
+ * or NULL if out of memory. */
+struct _mosquitto_topic *mqtt3_topic_intern(const char *str)
+{
+	struct _mosquitto_topic *topic;
+	size_t len;
+
+	len = strlen(str);
+	if(len > 65535) return NULL;
+
+	HASH_FIND(hh, topics, str, len, topic);
+	if(!topic){
+		topic = _topic_new(str, (int)len);
+		if(!topic) return NULL;
+	}else if(topic->ref_count == 0){
+		_topic_idle_unlink(topic);
+	}
+	topic->ref_count++;
+	return topic;
+}
+
+void mqtt3_topic_release(struct _mosquitto_topic *topic)
+{
+	if(!topic) return;
+
+	topic->ref_count--;
+	if(topic->ref_count == 0){
+		topic->idle_since = idle_now;
+		topic->idle_prev = idle_tail;
+		topic->idle_next = NULL;
+		if(idle_tail){
+			idle_tail->idle_next = topic;
+		}else{
+			idle_head = topic;
+		}
+		idle_tail = topic;
+		idle_count++;
+
+		if(idle_count > TOPIC_IDLE_MAX){
+			_topic_free(idle_head);
+		}
+	}
+}
+
+/* Free the entries that have had no references for TOPIC_IDLE_TIME
+ * seconds. */
+void mqtt3_topic_idle_expire(time_t now)
+{
+	idle_now = now;
+	while(idle_head && idle_head->idle_since + TOPIC_IDLE_TIME <= now){
+		_topic_free(idle_head);
+	}
+}
+
+/* Free every entry without references, for shutdown. */
+void mqtt3_topic_cleanup(void)
+{
+	while(idle_head){
+		_topic_free(idle_head);
+	}
+}
@@ -0,0 +1,54 @@
+#!/usr/bin/env python
+
+# Test whether a client that stops sending packets is disconnected after
+# keepalive*1.5 seconds, and that a PINGREQ resets the timeout.
+
+import inspect, os, sys
+import os
+import subprocess
+import socket
+import sys
+import time
+
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 2
+connect_packet = mosq_test.gen_connect("keepalive-timeout-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+broker = subprocess.Popen(['../../src/mosquitto', '-p', '1888'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=10)
+    time.sleep(2)
+    sock.send(pingreq_packet)
+
+    if mosq_test.expect_packet(sock, "pingresp", pingresp_packet):
+        start = time.time()
+        # The broker should now close the connection after roughly
+        # keepalive*1.5 seconds of silence.
+        if sock.recv(1) == "" and time.time() - start > keepalive:
+            rc = 0
+        else:
+            print("FAIL: Connection not closed after keepalive timeout.")
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
+
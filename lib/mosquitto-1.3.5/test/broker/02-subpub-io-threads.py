@@ -0,0 +1,81 @@
+#!/usr/bin/env python
+
+# Test whether a broker using I/O threads delivers a QoS 2 message to enough
+# QoS 1 subscribers that their reads and writes are shared between the
+# threads, and completes each of the QoS flows.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+mid = 53
+keepalive = 60
+sub_count = 40
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "subpub/io/threads", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+publish_packet = mosq_test.gen_publish("subpub/io/threads", qos=2, mid=mid, payload="message")
+pubrec_packet = mosq_test.gen_pubrec(mid)
+pubrel_packet = mosq_test.gen_pubrel(mid)
+pubcomp_packet = mosq_test.gen_pubcomp(mid)
+
+publish1_packet = mosq_test.gen_publish("subpub/io/threads", qos=1, mid=1, payload="message")
+puback1_packet = mosq_test.gen_puback(1)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '02-subpub-io-threads.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    subs = []
+    for i in range(sub_count):
+        connect_packet = mosq_test.gen_connect("subpub-io-threads-test"+str(i), keepalive=keepalive)
+        subs.append(mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20))
+
+    # Subscribe all at once, so the broker has many sockets to read together.
+    for sock in subs:
+        sock.send(subscribe_packet)
+    ok = True
+    for sock in subs:
+        ok = ok and mosq_test.expect_packet(sock, "suback", suback_packet)
+
+    if ok:
+        connect_packet = mosq_test.gen_connect("subpub-io-threads-pub", keepalive=keepalive)
+        pub = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+        pub.send(publish_packet)
+
+        if mosq_test.expect_packet(pub, "pubrec", pubrec_packet):
+            pub.send(pubrel_packet)
+            if mosq_test.expect_packet(pub, "pubcomp", pubcomp_packet):
+                for sock in subs:
+                    ok = ok and mosq_test.expect_packet(sock, "publish", publish1_packet)
+                if ok:
+                    for sock in subs:
+                        sock.send(puback1_packet)
+                    # The broker is still answering after the acks.
+                    pub.send(mosq_test.gen_pingreq())
+                    if mosq_test.expect_packet(pub, "pingresp", mosq_test.gen_pingresp()):
+                        rc = 0
+        pub.close()
+
+    for sock in subs:
+        sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
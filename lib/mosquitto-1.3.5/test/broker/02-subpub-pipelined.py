@@ -0,0 +1,59 @@
+#!/usr/bin/env python
+
+# Test whether several packets sent together in a single write are all
+# handled. A persistent client reconnects and sends its CONNECT, SUBSCRIBE and
+# two PUBLISH messages at once, which must survive the reconnection being
+# moved on to the client's existing session.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+mid = 19
+keepalive = 60
+connect_packet = mosq_test.gen_connect("subpub-pipelined-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "subpub/pipelined", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish1_packet = mosq_test.gen_publish("subpub/pipelined", qos=0, payload="message1")
+publish2_packet = mosq_test.gen_publish("subpub/pipelined", qos=0, payload="message2")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-p', '1888'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.close()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(10)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet + subscribe_packet + publish1_packet + publish2_packet)
+
+    if mosq_test.expect_packet(sock, "connack", connack_packet):
+        if mosq_test.expect_packet(sock, "suback", suback_packet):
+            if mosq_test.expect_packet(sock, "publish1", publish1_packet):
+                if mosq_test.expect_packet(sock, "publish2", publish2_packet):
+                    rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
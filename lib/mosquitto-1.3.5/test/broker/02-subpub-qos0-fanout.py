@@ -0,0 +1,72 @@
+#!/usr/bin/env python
+
+# Test whether a message published to several QoS 0 subscribers, and one QoS 1
+# subscriber, is delivered correctly to each of them.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+mid = 53
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe0_packet = mosq_test.gen_subscribe(mid, "subpub/fanout", 0)
+suback0_packet = mosq_test.gen_suback(mid, 0)
+subscribe1_packet = mosq_test.gen_subscribe(mid, "subpub/fanout", 1)
+suback1_packet = mosq_test.gen_suback(mid, 1)
+
+publish_packet = mosq_test.gen_publish("subpub/fanout", qos=1, mid=mid, payload="message")
+puback_packet = mosq_test.gen_puback(mid)
+publish0_packet = mosq_test.gen_publish("subpub/fanout", qos=0, payload="message")
+publish1_packet = mosq_test.gen_publish("subpub/fanout", qos=1, mid=1, payload="message")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-p', '1888'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    subs = []
+    for i in range(3):
+        connect_packet = mosq_test.gen_connect("subpub-fanout-test"+str(i), keepalive=keepalive)
+        subs.append(mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20))
+
+    ok = True
+    for i in range(2):
+        subs[i].send(subscribe0_packet)
+        ok = ok and mosq_test.expect_packet(subs[i], "suback", suback0_packet)
+    subs[2].send(subscribe1_packet)
+    ok = ok and mosq_test.expect_packet(subs[2], "suback", suback1_packet)
+
+    if ok:
+        connect_packet = mosq_test.gen_connect("subpub-fanout-pub", keepalive=keepalive)
+        pub = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+        pub.send(publish_packet)
+
+        if mosq_test.expect_packet(pub, "puback", puback_packet):
+            if mosq_test.expect_packet(subs[0], "publish", publish0_packet) \
+                    and mosq_test.expect_packet(subs[1], "publish", publish0_packet) \
+                    and mosq_test.expect_packet(subs[2], "publish", publish1_packet):
+                rc = 0
+        pub.close()
+
+    for sock in subs:
+        sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
+
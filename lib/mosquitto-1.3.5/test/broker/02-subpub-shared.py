@@ -0,0 +1,132 @@
+#!/usr/bin/env python
+
+# Test whether messages matching a shared subscription group are shared out
+# between its members in turn while an ordinary subscriber receives them all,
+# that a member leaving the group stops receiving messages, and that shared
+# subscriptions don't receive retained messages.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def recv_all(sock, length):
+    data = ""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            break
+        data = data + chunk
+    return data
+
+def expect_nothing(sock):
+    sock.settimeout(0.5)
+    try:
+        sock.recv(1)
+    except socket.timeout:
+        return True
+    print("FAIL: Received unexpected data.")
+    return False
+
+rc = 1
+mid = 53
+keepalive = 60
+member_count = 3
+connack_packet = mosq_test.gen_connack(rc=0)
+
+shared_subscribe_packet = mosq_test.gen_subscribe(mid, "$share/grp/shared/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+subscribe_packet = mosq_test.gen_subscribe(mid, "shared/#", 0)
+unsubscribe_packet = mosq_test.gen_unsubscribe(mid, "$share/grp/shared/#")
+unsuback_packet = mosq_test.gen_unsuback(mid)
+
+retain_packet = mosq_test.gen_publish("shared/retained", qos=0, retain=True, payload="retained")
+publish_packets = []
+for i in range(8):
+    publish_packets.append(mosq_test.gen_publish("shared/test", qos=0, payload="message "+str(i)))
+plen = len(publish_packets[0])
+
+broker = subprocess.Popen(['../../src/mosquitto', '-p', '1888'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    connect_packet = mosq_test.gen_connect("subpub-shared-pub", keepalive=keepalive)
+    pub = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+    pub.send(retain_packet)
+
+    members = []
+    for i in range(member_count):
+        connect_packet = mosq_test.gen_connect("subpub-shared-test"+str(i), keepalive=keepalive)
+        members.append(mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20))
+    connect_packet = mosq_test.gen_connect("subpub-shared-plain", keepalive=keepalive)
+    plain = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+
+    ok = True
+    for sock in members:
+        sock.send(shared_subscribe_packet)
+        ok = ok and mosq_test.expect_packet(sock, "suback", suback_packet)
+    plain.send(subscribe_packet)
+    ok = ok and mosq_test.expect_packet(plain, "suback", suback_packet)
+    ok = ok and mosq_test.expect_packet(plain, "retained", retain_packet)
+
+    if ok:
+        for i in range(6):
+            pub.send(publish_packets[i])
+        for i in range(6):
+            ok = ok and mosq_test.expect_packet(plain, "publish", publish_packets[i])
+
+        # Two each, with every message delivered exactly once.
+        received = []
+        for sock in members:
+            data = recv_all(sock, 2*plen)
+            received.append(data[0:plen])
+            received.append(data[plen:])
+        if sorted(received) != sorted(publish_packets[0:6]):
+            print("FAIL: Shared messages not delivered once each.")
+            ok = False
+        for sock in members:
+            ok = ok and expect_nothing(sock)
+
+    if ok:
+        members[0].settimeout(20)
+        members[0].send(unsubscribe_packet)
+        ok = ok and mosq_test.expect_packet(members[0], "unsuback", unsuback_packet)
+
+        pub.send(publish_packets[6])
+        pub.send(publish_packets[7])
+        ok = ok and mosq_test.expect_packet(plain, "publish", publish_packets[6])
+        ok = ok and mosq_test.expect_packet(plain, "publish", publish_packets[7])
+
+        received = []
+        for sock in members[1:]:
+            sock.settimeout(20)
+            received.append(recv_all(sock, plen))
+        if sorted(received) != sorted(publish_packets[6:8]):
+            print("FAIL: Shared messages not delivered once each after unsubscribe.")
+            ok = False
+        for sock in members:
+            ok = ok and expect_nothing(sock)
+
+    if ok:
+        rc = 0
+
+    for sock in members:
+        sock.close()
+    plain.close()
+    pub.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,66 @@
+#!/usr/bin/env python
+
+# Test whether ACL decisions stay correct once a client has seen more topics
+# than its ACL decision cache holds. The client may publish to
+# acl/<client id>/# but not to another client's topics. Two rounds over 1500
+# topics of each kind fill the cache and then make it evict entries.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+mid = 42
+keepalive = 60
+topic_count = 1500
+connect_packet = mosq_test.gen_connect("acl-cache-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "acl/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish_end_packet = mosq_test.gen_publish("acl/acl-cache-test/end", qos=0, payload="end")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '03-publish-acl-cache.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        ok = True
+        for r in range(2):
+            for i in range(topic_count):
+                publish_other_packet = mosq_test.gen_publish("acl/other/%d" % (i), qos=0, payload="other")
+                publish_own_packet = mosq_test.gen_publish("acl/acl-cache-test/%d" % (i), qos=0, payload="own")
+                sock.send(publish_other_packet + publish_own_packet)
+                if not mosq_test.expect_packet(sock, "publish %d" % (i), publish_own_packet):
+                    ok = False
+                    break
+            if not ok:
+                break
+
+        if ok:
+            sock.send(publish_end_packet)
+            if mosq_test.expect_packet(sock, "publish end", publish_end_packet):
+                rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,60 @@
+#!/usr/bin/env python
+
+# Test whether pattern ACLs are applied per client, and keep giving the same
+# answer when a topic is checked more than once. The client may publish to
+# acl/<client id>/# but not to another client's topics.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+mid = 41
+keepalive = 60
+connect_packet = mosq_test.gen_connect("acl-pattern-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "acl/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish_own_packet = mosq_test.gen_publish("acl/acl-pattern-test/data", qos=0, payload="own")
+publish_other_packet = mosq_test.gen_publish("acl/other/data", qos=0, payload="other")
+publish_end_packet = mosq_test.gen_publish("acl/acl-pattern-test/end", qos=0, payload="end")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '03-publish-acl-pattern.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(publish_other_packet)
+        sock.send(publish_own_packet)
+        sock.send(publish_other_packet)
+        sock.send(publish_own_packet)
+        sock.send(publish_end_packet)
+
+        if mosq_test.expect_packet(sock, "publish1", publish_own_packet):
+            if mosq_test.expect_packet(sock, "publish2", publish_own_packet):
+                if mosq_test.expect_packet(sock, "publish end", publish_end_packet):
+                    rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,98 @@
+#!/usr/bin/env python
+
+# Test the conflate and drop_oldest queue policies for offline clients, and
+# their $SYS counters.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+conflate_connect_packet = mosq_test.gen_connect("conflate-test", keepalive=keepalive, clean_session=False)
+oldest_connect_packet = mosq_test.gen_connect("oldest-test", keepalive=keepalive, clean_session=False)
+pub_connect_packet = mosq_test.gen_connect("queue-policy-pub", keepalive=keepalive)
+sys_connect_packet = mosq_test.gen_connect("queue-policy-sys", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+subscribe_packet = mosq_test.gen_subscribe(1, "queue/#", 1)
+suback_packet = mosq_test.gen_suback(1, 1)
+
+# conflate-test gets the latest value for each topic, in the order the topics
+# were first queued. oldest-test keeps the two newest messages.
+conflate_a_packet = mosq_test.gen_publish("queue/a", qos=1, mid=1, payload="a3")
+conflate_b_packet = mosq_test.gen_publish("queue/b", qos=1, mid=2, payload="b1")
+oldest_a2_packet = mosq_test.gen_publish("queue/a", qos=1, mid=3, payload="a2")
+oldest_a3_packet = mosq_test.gen_publish("queue/a", qos=1, mid=4, payload="a3")
+
+sys_subscribe_packet = mosq_test.gen_subscribe(2, "$SYS/broker/publish/messages/conflated", 0)
+sys_suback_packet = mosq_test.gen_suback(2, 0)
+sys_conflated_packet = mosq_test.gen_publish("$SYS/broker/publish/messages/conflated", qos=0, payload="2", retain=True)
+sys2_subscribe_packet = mosq_test.gen_subscribe(3, "$SYS/broker/publish/messages/dropped/oldest", 0)
+sys2_suback_packet = mosq_test.gen_suback(3, 0)
+sys_oldest_packet = mosq_test.gen_publish("$SYS/broker/publish/messages/dropped/oldest", qos=0, payload="2", retain=True)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '03-publish-queue-policy.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    for connect_packet in [conflate_connect_packet, oldest_connect_packet]:
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+        sock.send(subscribe_packet)
+        if not mosq_test.expect_packet(sock, "suback", suback_packet):
+            raise ValueError
+        sock.send(disconnect_packet)
+        sock.close()
+
+    pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet)
+    mid = 10
+    for (topic, payload) in [("queue/a", "a1"), ("queue/b", "b1"), ("queue/a", "a2"), ("queue/a", "a3")]:
+        pub.send(mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload))
+        if not mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(mid)):
+            raise ValueError
+        mid = mid + 1
+    pub.close()
+
+    sock = mosq_test.do_client_connect(conflate_connect_packet, connack_packet)
+    if mosq_test.expect_packet(sock, "publish a", conflate_a_packet):
+        sock.send(mosq_test.gen_puback(1))
+        if mosq_test.expect_packet(sock, "publish b", conflate_b_packet):
+            sock.send(mosq_test.gen_puback(2))
+            sock.close()
+
+            sock = mosq_test.do_client_connect(oldest_connect_packet, connack_packet)
+            if mosq_test.expect_packet(sock, "publish a2", oldest_a2_packet):
+                sock.send(mosq_test.gen_puback(3))
+                if mosq_test.expect_packet(sock, "publish a3", oldest_a3_packet):
+                    sock.send(mosq_test.gen_puback(4))
+                    sock.close()
+
+                    time.sleep(2)
+                    sock = mosq_test.do_client_connect(sys_connect_packet, connack_packet)
+                    sock.send(sys_subscribe_packet)
+                    if mosq_test.expect_packet(sock, "suback", sys_suback_packet):
+                        if mosq_test.expect_packet(sock, "conflated", sys_conflated_packet):
+                            sock.send(sys2_subscribe_packet)
+                            if mosq_test.expect_packet(sock, "suback", sys2_suback_packet):
+                                if mosq_test.expect_packet(sock, "dropped oldest", sys_oldest_packet):
+                                    rc = 0
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
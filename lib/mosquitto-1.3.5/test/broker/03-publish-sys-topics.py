@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+
+# Test the per topic prefix counters and the latency figures in $SYS.
+
+import subprocess
+import socket
+import struct
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def expect_number(sock, topic):
+    # The latency figures vary between runs, so only check that a retained
+    # number arrives on the right topic.
+    header = sock.recv(2)
+    (command, rl) = struct.unpack("!BB", header)
+    packet = sock.recv(rl)
+    (tlen,) = struct.unpack("!H", packet[:2])
+    if command != 0x31 or packet[2:2+tlen] != topic or not packet[2+tlen:].isdigit():
+        print("FAIL: Received incorrect "+topic+".")
+        print("Received: "+mosq_test.to_string(header+packet))
+        return 0
+    return 1
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("sys-topics-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(1, "node/#", 0)
+suback_packet = mosq_test.gen_suback(1, 0)
+
+# The pmu topics of every node are counted together under the name "pmu",
+# other plugins under the second prefix, and other topics not at all.
+publish_a_packet = mosq_test.gen_publish("node/a/plugin/pmu/x", qos=0, payload="12345")
+publish_b_packet = mosq_test.gen_publish("node/b/plugin/pmu/y/z", qos=0, payload="123")
+publish_ipmi_packet = mosq_test.gen_publish("node/a/plugin/ipmi/x", qos=0, payload="1234")
+publish_other_packet = mosq_test.gen_publish("other/a/x", qos=0, payload="12345")
+
+sys_subscribe_packet = mosq_test.gen_subscribe(2, "$SYS/broker/topics/pmu/messages/received", 0)
+sys_suback_packet = mosq_test.gen_suback(2, 0)
+sys_received_packet = mosq_test.gen_publish("$SYS/broker/topics/pmu/messages/received", qos=0, payload="3", retain=True)
+sys2_subscribe_packet = mosq_test.gen_subscribe(3, "$SYS/broker/topics/pmu/bytes/received", 0)
+sys2_suback_packet = mosq_test.gen_suback(3, 0)
+sys_bytes_packet = mosq_test.gen_publish("$SYS/broker/topics/pmu/bytes/received", qos=0, payload="13", retain=True)
+sys4_subscribe_packet = mosq_test.gen_subscribe(5, "$SYS/broker/topics/node/_/plugin/_/messages/received", 0)
+sys4_suback_packet = mosq_test.gen_suback(5, 0)
+sys4_received_packet = mosq_test.gen_publish("$SYS/broker/topics/node/_/plugin/_/messages/received", qos=0, payload="1", retain=True)
+sys3_subscribe_packet = mosq_test.gen_subscribe(4, "$SYS/broker/latency/enqueue-write/max", 0)
+sys3_suback_packet = mosq_test.gen_suback(4, 0)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '03-publish-sys-topics.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(publish_a_packet)
+        sock.send(publish_other_packet)
+        sock.send(publish_b_packet)
+        sock.send(publish_ipmi_packet)
+        sock.send(publish_a_packet)
+        if mosq_test.expect_packet(sock, "publish", publish_a_packet):
+            time.sleep(2.5)
+            sock.close()
+
+            sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+            sock.send(sys_subscribe_packet)
+            if mosq_test.expect_packet(sock, "suback", sys_suback_packet):
+                if mosq_test.expect_packet(sock, "messages received", sys_received_packet):
+                    sock.send(sys2_subscribe_packet)
+                    if mosq_test.expect_packet(sock, "suback", sys2_suback_packet):
+                        if mosq_test.expect_packet(sock, "bytes received", sys_bytes_packet):
+                            sock.send(sys3_subscribe_packet)
+                            if mosq_test.expect_packet(sock, "suback", sys3_suback_packet):
+                                if expect_number(sock, "$SYS/broker/latency/enqueue-write/max"):
+                                    sock.send(sys4_subscribe_packet)
+                                    if mosq_test.expect_packet(sock, "suback", sys4_suback_packet):
+                                        if mosq_test.expect_packet(sock, "other plugins", sys4_received_packet):
+                                            rc = 0
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,86 @@
+#!/usr/bin/env python
+
+# Test whether retained messages are delivered to subscriptions with + and #
+# wildcards, that foo/# matches a message retained on foo, that wildcards in
+# the first level don't match $SYS topics and that nothing is delivered once
+# a retained message has been cleared.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("retain-wildcard-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+publish_packet = mosq_test.gen_publish("retain/wildcard/one/leaf", qos=0, payload="retained message", retain=True)
+retain_clear_packet = mosq_test.gen_publish("retain/wildcard/one/leaf", qos=0, payload=None, retain=True)
+clear_packet = mosq_test.gen_publish("retain/wildcard/one/leaf", qos=0, payload=None)
+
+mid = 10
+subscribe_plus_packet = mosq_test.gen_subscribe(mid, "retain/+/one/+", 0)
+suback_plus_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 11
+subscribe_hash_packet = mosq_test.gen_subscribe(mid, "retain/wildcard/one/leaf/#", 0)
+suback_hash_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 12
+subscribe_sys_packet = mosq_test.gen_subscribe(mid, "+/broker/version", 0)
+suback_sys_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 13
+subscribe_clear_packet = mosq_test.gen_subscribe(mid, "retain/+/+/leaf", 0)
+suback_clear_packet = mosq_test.gen_suback(mid, 0)
+
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+broker = subprocess.Popen(['../../src/mosquitto', '-p', '1888'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=4)
+    sock.send(publish_packet)
+
+    sock.send(subscribe_plus_packet)
+    if mosq_test.expect_packet(sock, "suback plus", suback_plus_packet):
+        if mosq_test.expect_packet(sock, "publish plus", publish_packet):
+            sock.send(subscribe_hash_packet)
+            if mosq_test.expect_packet(sock, "suback hash", suback_hash_packet):
+                if mosq_test.expect_packet(sock, "publish hash", publish_packet):
+                    # $SYS/broker/version is retained, but mustn't match.
+                    sock.send(subscribe_sys_packet)
+                    if mosq_test.expect_packet(sock, "suback sys", suback_sys_packet):
+                        sock.send(pingreq_packet)
+                        if mosq_test.expect_packet(sock, "pingresp", pingresp_packet):
+                            # Clearing the message is delivered to the
+                            # existing subscriptions, but a new subscription
+                            # gets nothing.
+                            sock.send(retain_clear_packet)
+                            if mosq_test.expect_packet(sock, "clear", clear_packet):
+                                sock.send(subscribe_clear_packet)
+                                if mosq_test.expect_packet(sock, "suback clear", suback_clear_packet):
+                                    sock.send(pingreq_packet)
+                                    if mosq_test.expect_packet(sock, "pingresp", pingresp_packet):
+                                        rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
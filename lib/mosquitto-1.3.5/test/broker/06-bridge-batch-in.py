@@ -0,0 +1,68 @@
+#!/usr/bin/env python
+
+# Does the broker unpack a compressed batch of messages from a remote bridge
+# and deliver each message in it to subscribers on its own?
+
+import subprocess
+import socket
+import struct
+import time
+import zlib
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+mid = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("batch-sub", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "batch/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+bridge_connect_packet = mosq_test.gen_connect("batch-bridge", keepalive=keepalive)
+
+body = struct.pack("!BBB16sBB4s", 0, 0, 16, "batch/node1/temp", 0, 4, "21;1")
+body = body + struct.pack("!BBB3sBB4s", 0, 12, 3, "pow", 0, 4, "90;1")
+body = body + struct.pack("!BBB4s", 1, 0, 4, "22;2")
+compressed = zlib.compress(body)
+frame = struct.pack("!BBII", 1, 1, len(body), 3) + compressed
+batch_packet = mosq_test.gen_publish("$bridge/batch", qos=0, payload=frame)
+
+publish1_packet = mosq_test.gen_publish("batch/node1/temp", qos=0, payload="21;1")
+publish2_packet = mosq_test.gen_publish("batch/node1/pow", qos=0, payload="90;1")
+publish3_packet = mosq_test.gen_publish("batch/node1/temp", qos=0, payload="22;2")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-p', '1888'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        bridge = mosq_test.do_client_connect(bridge_connect_packet, connack_packet, timeout=20, connack_error="bridge connack")
+        bridge.send(batch_packet)
+
+        if mosq_test.expect_packet(sock, "publish 1", publish1_packet):
+            if mosq_test.expect_packet(sock, "publish 2", publish2_packet):
+                if mosq_test.expect_packet(sock, "publish 3", publish3_packet):
+                    rc = 0
+        bridge.close()
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+
+# Does a bridge with bridge_batch_interval set send QoS 0 messages to the
+# remote broker as a single batch, with each topic spelt out only once and
+# sharing its prefix with the topic before it?
+
+import os
+import subprocess
+import socket
+import struct
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+client_id = socket.gethostname()+".bridge_sample"
+connect_packet = mosq_test.gen_connect(client_id, keepalive=keepalive, clean_session=False, proto_ver=128+3)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+unsubscribe_packet = mosq_test.gen_unsubscribe(mid, "bridge/#")
+unsuback_packet = mosq_test.gen_unsuback(mid)
+
+helper_connect_packet = mosq_test.gen_connect("batch-helper", keepalive=keepalive)
+publish1_packet = mosq_test.gen_publish("bridge/batch/node1/a", qos=0, payload="1")
+publish2_packet = mosq_test.gen_publish("bridge/batch/node1/b", qos=0, payload="2")
+publish3_packet = mosq_test.gen_publish("bridge/batch/node1/a", qos=0, payload="3")
+
+# New topic: ref 0, shared prefix, suffix length, suffix. Repeated topic: ref.
+# Then flags and payload length, payload.
+body = struct.pack("!BBB20sBB1s", 0, 0, 20, "bridge/batch/node1/a", 0, 1, "1")
+body = body + struct.pack("!BBB1sBB1s", 0, 19, 1, "b", 0, 1, "2")
+body = body + struct.pack("!BBB1s", 1, 0, 1, "3")
+frame = struct.pack("!BBII", 1, 0, len(body), 3) + body
+batch_packet = mosq_test.gen_publish("$bridge/batch", qos=0, payload=frame)
+
+ssock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+ssock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+ssock.settimeout(40)
+ssock.bind(('', 1888))
+ssock.listen(5)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '06-bridge-batch-out.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    (bridge, address) = ssock.accept()
+    bridge.settimeout(20)
+
+    if mosq_test.expect_packet(bridge, "connect", connect_packet):
+        bridge.send(connack_packet)
+
+        if mosq_test.expect_packet(bridge, "unsubscribe", unsubscribe_packet):
+            bridge.send(unsuback_packet)
+
+            sock = mosq_test.do_client_connect(helper_connect_packet, connack_packet, port=1889, connack_error="helper connack")
+            sock.send(publish1_packet + publish2_packet + publish3_packet)
+
+            if mosq_test.expect_packet(bridge, "batch", batch_packet):
+                rc = 0
+
+            sock.close()
+    bridge.close()
+finally:
+    try:
+        bridge.close()
+    except NameError:
+        pass
+
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+    ssock.close()
+
+exit(rc)
@@ -0,0 +1,80 @@
+#!/usr/bin/env python
+
+# Are the messages in a batch from a remote bridge counted in the per topic
+# prefix rates and the receive latency figures in $SYS, as messages published
+# on their own are?
+
+import subprocess
+import socket
+import struct
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def recv_publish(sock):
+    header = sock.recv(2)
+    (command, rl) = struct.unpack("!BB", header)
+    packet = sock.recv(rl)
+    (tlen,) = struct.unpack("!H", packet[:2])
+    if command & 0xF0 != 0x30:
+        return (None, None)
+    return (packet[2:2+tlen], packet[2+tlen:])
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("batch-sys", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+received_topic = "$SYS/broker/topics/batch/messages/received"
+latency_topic = "$SYS/broker/latency/receive-enqueue/count"
+subscribe_packet = mosq_test.gen_subscribe(1, received_topic, 0)
+suback_packet = mosq_test.gen_suback(1, 0)
+subscribe2_packet = mosq_test.gen_subscribe(2, latency_topic, 0)
+suback2_packet = mosq_test.gen_suback(2, 0)
+
+bridge_connect_packet = mosq_test.gen_connect("batch-bridge", keepalive=keepalive)
+
+body = struct.pack("!BBB11sBB4s", 0, 0, 11, "batch/node1", 0, 4, "21;1")
+body = body + struct.pack("!BBB4s", 1, 0, 4, "22;2")
+body = body + struct.pack("!BBB1sBB4s", 0, 10, 1, "2", 0, 4, "90;1")
+frame = struct.pack("!BBII", 1, 0, len(body), 3) + body
+batch_packet = mosq_test.gen_publish("$bridge/batch", qos=0, payload=frame)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '06-bridge-batch-sys.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+    sock.send(subscribe_packet)
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(subscribe2_packet)
+        if mosq_test.expect_packet(sock, "suback", suback2_packet):
+            bridge = mosq_test.do_client_connect(bridge_connect_packet, connack_packet, timeout=20, connack_error="bridge connack")
+            bridge.send(batch_packet)
+
+            received = {}
+            for i in range(2):
+                (topic, payload) = recv_publish(sock)
+                received[topic] = payload
+            if received == {received_topic: "3", latency_topic: "3"}:
+                rc = 0
+            else:
+                print("FAIL: Received "+str(received))
+            bridge.close()
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,101 @@
+#!/usr/bin/env python
+
+# Test whether the built in aggregation plugin publishes the sum, mean,
+# minimum and maximum of each group of numeric messages at the end of a
+# window, ignores messages that aren't numbers and publishes nothing for a
+# window without messages.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def recv_all(sock, length):
+    data = ""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            break
+        data = data + chunk
+    return data
+
+def recv_packet(sock):
+    # All of the packets in this test have a one byte remaining length.
+    header = recv_all(sock, 2)
+    if len(header) < 2:
+        return header
+    return header + recv_all(sock, ord(header[1]))
+
+rc = 1
+mid = 53
+keepalive = 60
+window = 2
+connect_packet = mosq_test.gen_connect("plugin-aggregate-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "agg/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+values = [
+    ("test/c1/node/n1/pow", "10;1400000000.000"),
+    ("test/c1/node/n2/pow", "30;1400000000.000"),
+    ("test/c1/node/n3/pow", "20"),
+    ("test/c1/node/n3/pow", "not a number"),
+    ("test/c2/node/n1/pow", "5.5;1400000000.000"),
+    ("test/c2/other/n1/pow", "100;1400000000.000"),
+]
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-plugin-aggregate.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        # Publish everything near the start of a window.
+        while not (0.1 < time.time() % window < 0.5):
+            time.sleep(0.05)
+        window_end = int(time.time()) // window * window + window
+        for (topic, payload) in values:
+            sock.send(mosq_test.gen_publish(topic, qos=0, payload=payload))
+
+        expected = []
+        for (group, stats) in [("c1", ["60", "20", "10", "30"]), ("c2", ["5.5", "5.5", "5.5", "5.5"])]:
+            for (stat, value) in zip(["sum", "mean", "min", "max"], stats):
+                expected.append(mosq_test.gen_publish("agg/"+group+"/pow/"+stat, qos=0, payload=value+";"+str(window_end)))
+
+        sock.settimeout(window+2)
+        received = []
+        for i in range(len(expected)):
+            received.append(recv_packet(sock))
+
+        if sorted(received) != sorted(expected):
+            print("FAIL: Received incorrect aggregates.")
+            for packet in received:
+                print(mosq_test.to_string(packet))
+        else:
+            sock.settimeout(window+1)
+            try:
+                sock.recv(1)
+                print("FAIL: Received aggregates for an empty window.")
+            except socket.timeout:
+                rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,58 @@
+#!/usr/bin/env python
+
+# Test whether a publish plugin is shown messages published by clients and
+# can publish messages of its own, and that its own messages are not shown
+# back to it.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+mid = 53
+keepalive = 60
+connect_packet = mosq_test.gen_connect("plugin-publish-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "echo/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish_packet = mosq_test.gen_publish("plugin/test", qos=0, payload="message")
+echo_packet = mosq_test.gen_publish("echo/plugin/test", qos=0, payload="message")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-plugin-publish.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(publish_packet)
+
+        if mosq_test.expect_packet(sock, "echo", echo_packet):
+            sock.settimeout(1)
+            try:
+                sock.recv(1)
+                print("FAIL: Plugin message was echoed again.")
+            except socket.timeout:
+                rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
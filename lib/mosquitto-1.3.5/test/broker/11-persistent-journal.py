@@ -0,0 +1,85 @@
+#!/usr/bin/env python
+
+# Test whether changes written to the persistence journal survive the broker
+# being killed before it can save its database. A persistent client has a
+# QoS 1 message queued for it and a retained message is set, then the broker
+# is killed and restarted.
+
+import glob
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def remove_db():
+    for f in glob.glob("11-persistent-journal.db*"):
+        os.remove(f)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistent-journal-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 3
+subscribe_packet = mosq_test.gen_subscribe(mid, "journal/qos1", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+pub_connect_packet = mosq_test.gen_connect("persistent-journal-pub", keepalive=keepalive)
+mid = 7
+publish_packet = mosq_test.gen_publish("journal/qos1", qos=1, mid=mid, payload="queued message")
+puback_packet = mosq_test.gen_puback(mid)
+retain_packet = mosq_test.gen_publish("journal/retain", qos=0, retain=True, payload="retained message")
+
+mid = 1
+publish_packet2 = mosq_test.gen_publish("journal/qos1", qos=1, mid=mid, payload="queued message")
+
+mid = 4
+subscribe2_packet = mosq_test.gen_subscribe(mid, "journal/retain", 0)
+suback2_packet = mosq_test.gen_suback(mid, 0)
+
+remove_db()
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '11-persistent-journal.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.close()
+
+        pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet)
+        pub.send(retain_packet)
+        pub.send(publish_packet)
+        if mosq_test.expect_packet(pub, "puback", puback_packet):
+            pub.close()
+            time.sleep(0.5)
+
+            broker.kill()
+            broker.wait()
+            broker = subprocess.Popen(['../../src/mosquitto', '-c', '11-persistent-journal.conf'], stderr=subprocess.PIPE)
+            time.sleep(0.5)
+
+            sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+            if mosq_test.expect_packet(sock, "publish2", publish_packet2):
+                sock.send(subscribe2_packet)
+                if mosq_test.expect_packet(sock, "suback2", suback2_packet):
+                    if mosq_test.expect_packet(sock, "retained", retain_packet):
+                        rc = 0
+            sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    remove_db()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
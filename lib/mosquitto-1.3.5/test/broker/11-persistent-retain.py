@@ -0,0 +1,71 @@
+#!/usr/bin/env python
+
+# Test whether retained messages are restored from the persistent database
+# when the broker is restarted, and that both an exact and a wildcard
+# subscription receive them.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def remove_db():
+    if os.path.exists("11-persistent-retain.db"):
+        os.remove("11-persistent-retain.db")
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistent-retain-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+retain_packet = mosq_test.gen_publish("retain/persist/test", qos=0, retain=True, payload="retained message")
+
+mid = 5
+subscribe_packet = mosq_test.gen_subscribe(mid, "retain/persist/test", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 6
+subscribe2_packet = mosq_test.gen_subscribe(mid, "retain/#", 0)
+suback2_packet = mosq_test.gen_suback(mid, 0)
+
+remove_db()
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '11-persistent-retain.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(retain_packet)
+    time.sleep(0.5)
+    sock.close()
+
+    broker.terminate()
+    broker.wait()
+    broker = subprocess.Popen(['../../src/mosquitto', '-c', '11-persistent-retain.conf'], stderr=subprocess.PIPE)
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        if mosq_test.expect_packet(sock, "retained", retain_packet):
+            sock.send(subscribe2_packet)
+            if mosq_test.expect_packet(sock, "suback2", suback2_packet):
+                if mosq_test.expect_packet(sock, "retained2", retain_packet):
+                    rc = 0
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    remove_db()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
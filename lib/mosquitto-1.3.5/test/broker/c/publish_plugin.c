@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <string.h>
+#include <mosquitto.h>
+#include <mosquitto_publish_plugin.h>
+
+static mosquitto_publish_plugin_publish_t publish_fn = NULL;
+static char prefix[100] = "";
+
+int mosquitto_publish_plugin_version(void)
+{
+	return MOSQ_PUBLISH_PLUGIN_VERSION;
+}
+
+int mosquitto_publish_plugin_init(void **user_data, struct mosquitto_publish_opt *opts, int opt_count, mosquitto_publish_plugin_publish_t publish)
+{
+	int i;
+
+	for(i=0; i<opt_count; i++){
+		if(!strcmp(opts[i].key, "prefix")){
+			snprintf(prefix, sizeof(prefix), "%s", opts[i].value);
+		}
+	}
+	if(!prefix[0]) return MOSQ_ERR_INVAL;
+	publish_fn = publish;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_publish_plugin_cleanup(void *user_data, struct mosquitto_publish_opt *opts, int opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_publish_plugin_message(void *user_data, const char *clientid, const char *topic, int qos, int payloadlen, const void *payload, bool retain)
+{
+	char echo[200];
+
+	snprintf(echo, sizeof(echo), "%s%s", prefix, topic);
+	return publish_fn(echo, qos, payloadlen, payload, false);
+}
+
+void mosquitto_publish_plugin_tick(void *user_data, time_t now)
+{
+}
@@ -0,0 +1,77 @@
+#!/usr/bin/env python
+
+# Test whether a client sends a batch of messages published with
+# mosquitto_publish_batch() correctly and in order, and that a batch with an
+# invalid entry is rejected without anything being sent. The last three
+# messages are QoS 0, so are written in a single packet, and the client checks
+# that on_publish is called for each of them.
+
+import inspect
+import os
+import subprocess
+import socket
+import sys
+import time
+
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("publish-batch-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+publish0_packet = mosq_test.gen_publish("pub/batch/0", qos=0, payload="message 0")
+publish1_packet = mosq_test.gen_publish("pub/batch/1", qos=1, mid=2, payload="message 1")
+publish2_packet = mosq_test.gen_publish("pub/batch/2", qos=0, payload="")
+publish3_packet = mosq_test.gen_publish("pub/batch/3", qos=0, payload="message 3", retain=True)
+publish4_packet = mosq_test.gen_publish("pub/batch/4", qos=0, payload="message 4")
+puback_packet = mosq_test.gen_puback(2)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+sock.settimeout(10)
+sock.bind(('', 1888))
+sock.listen(5)
+
+client_args = sys.argv[1:]
+env = dict(os.environ)
+env['LD_LIBRARY_PATH'] = '../../lib:../../lib/cpp'
+try:
+    pp = env['PYTHONPATH']
+except KeyError:
+    pp = ''
+env['PYTHONPATH'] = '../../lib/python:'+pp
+
+client = subprocess.Popen(client_args, env=env)
+
+try:
+    (conn, address) = sock.accept()
+    conn.settimeout(10)
+
+    if mosq_test.expect_packet(conn, "connect", connect_packet):
+        conn.send(connack_packet)
+
+        if mosq_test.expect_packet(conn, "publish 0", publish0_packet):
+            if mosq_test.expect_packet(conn, "publish 1", publish1_packet):
+                if mosq_test.expect_packet(conn, "publish 2", publish2_packet):
+                    if mosq_test.expect_packet(conn, "publish 3", publish3_packet):
+                        if mosq_test.expect_packet(conn, "publish 4", publish4_packet):
+                            conn.send(puback_packet)
+
+                            if mosq_test.expect_packet(conn, "disconnect", disconnect_packet):
+                                rc = 0
+
+    conn.close()
+finally:
+    client.terminate()
+    client.wait()
+    sock.close()
+
+exit(rc)
@@ -0,0 +1,75 @@
+#!/usr/bin/env python
+
+# Test whether a client driven by a reactor that reconnects from its
+# disconnect callback carries on once reconnected. The new socket usually has
+# the same fd number as the one just closed.
+
+# The client should connect to port 1888 with keepalive=60, clean session set,
+# and client id reactor-reconnect-test. The test closes the first connection
+# without replying. The client should then connect again, and on receiving
+# the CONNACK send a PUBLISH message to topic "reactor/reconnect" with payload
+# "message" and QoS=0, followed by a DISCONNECT message.
+
+import inspect
+import os
+import subprocess
+import socket
+import sys
+import time
+
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("reactor-reconnect-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+publish_packet = mosq_test.gen_publish("reactor/reconnect", qos=0, payload="message")
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+sock.settimeout(10)
+sock.bind(('', 1888))
+sock.listen(5)
+
+client_args = sys.argv[1:]
+env = dict(os.environ)
+env['LD_LIBRARY_PATH'] = '../../lib:../../lib/cpp'
+try:
+    pp = env['PYTHONPATH']
+except KeyError:
+    pp = ''
+env['PYTHONPATH'] = '../../lib/python:'+pp
+client = subprocess.Popen(client_args, env=env)
+
+try:
+    (conn, address) = sock.accept()
+    conn.settimeout(10)
+
+    if mosq_test.expect_packet(conn, "connect", connect_packet):
+        conn.close()
+
+        (conn, address) = sock.accept()
+        conn.settimeout(10)
+
+        if mosq_test.expect_packet(conn, "connect", connect_packet):
+            conn.send(connack_packet)
+
+            if mosq_test.expect_packet(conn, "publish", publish_packet):
+                if mosq_test.expect_packet(conn, "disconnect", disconnect_packet):
+                    rc = 0
+
+    conn.close()
+finally:
+    client.terminate()
+    client.wait()
+    sock.close()
+
+exit(rc)
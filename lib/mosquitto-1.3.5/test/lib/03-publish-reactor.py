@@ -0,0 +1,92 @@
+#!/usr/bin/env python
+
+# Test whether two clients driven by one reactor each connect, publish and
+# disconnect correctly.
+
+# Both clients should connect to port 1888 with keepalive=60, clean session
+# set, and client ids reactor-test-0 and reactor-test-1. The test will send a
+# CONNACK message to each client with rc=0. Upon receiving the CONNACK each
+# client should send a PUBLISH message to topic "reactor/0" or "reactor/1"
+# respectively, with payload "message" and QoS=0, followed by a DISCONNECT
+# message.
+
+import inspect
+import os
+import subprocess
+import socket
+import sys
+import time
+
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packets = [
+    mosq_test.gen_connect("reactor-test-0", keepalive=keepalive),
+    mosq_test.gen_connect("reactor-test-1", keepalive=keepalive)]
+connack_packet = mosq_test.gen_connack(rc=0)
+
+publish_packets = [
+    mosq_test.gen_publish("reactor/0", qos=0, payload="message"),
+    mosq_test.gen_publish("reactor/1", qos=0, payload="message")]
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+sock.settimeout(10)
+sock.bind(('', 1888))
+sock.listen(5)
+
+client_args = sys.argv[1:]
+env = dict(os.environ)
+env['LD_LIBRARY_PATH'] = '../../lib:../../lib/cpp'
+try:
+    pp = env['PYTHONPATH']
+except KeyError:
+    pp = ''
+env['PYTHONPATH'] = '../../lib/python:'+pp
+client = subprocess.Popen(client_args, env=env)
+
+conns = []
+try:
+    # The clients may connect in either order.
+    index = []
+    for i in range(2):
+        (conn, address) = sock.accept()
+        conn.settimeout(10)
+        conns.append(conn)
+        connect_recvd = conn.recv(len(connect_packets[0]))
+        if connect_recvd not in connect_packets:
+            print("FAIL: Received invalid connect.")
+            mosq_test.packet_matches("connect", connect_recvd, connect_packets[i])
+            raise ValueError
+        index.append(connect_packets.index(connect_recvd))
+
+    if sorted(index) == [0, 1]:
+        for conn in conns:
+            conn.send(connack_packet)
+
+        ok = True
+        for (conn, i) in zip(conns, index):
+            if not mosq_test.expect_packet(conn, "publish", publish_packets[i]):
+                ok = False
+            elif not mosq_test.expect_packet(conn, "disconnect", disconnect_packet):
+                ok = False
+        if ok:
+            rc = 0
+except ValueError:
+    pass
+finally:
+    for conn in conns:
+        conn.close()
+    client.terminate()
+    client.wait()
+    sock.close()
+
+exit(rc)
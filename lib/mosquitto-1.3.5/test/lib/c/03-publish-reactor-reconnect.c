@@ -0,0 +1,58 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mosquitto.h>
+
+static struct mosquitto_reactor *reactor;
+static int disconnected = 0;
+
+void on_connect(struct mosquitto *mosq, void *obj, int rc)
+{
+	if(rc){
+		exit(1);
+	}else{
+		mosquitto_publish(mosq, NULL, "reactor/reconnect", strlen("message"), "message", 0, false);
+	}
+}
+
+void on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+	mosquitto_disconnect(mosq);
+}
+
+void on_disconnect(struct mosquitto *mosq, void *obj, int rc)
+{
+	disconnected++;
+	if(disconnected == 1){
+		/* The new socket is likely to get the fd number just closed. */
+		if(mosquitto_reconnect(mosq)) exit(1);
+	}else{
+		mosquitto_reactor_loop_stop(reactor, false);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct mosquitto *mosq;
+
+	mosquitto_lib_init();
+
+	reactor = mosquitto_reactor_new();
+	if(!reactor) return 1;
+
+	mosq = mosquitto_new("reactor-reconnect-test", true, NULL);
+	mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_publish_callback_set(mosq, on_publish);
+	mosquitto_disconnect_callback_set(mosq, on_disconnect);
+
+	mosquitto_connect_async(mosq, "localhost", 1888, 60);
+	if(mosquitto_reactor_add(reactor, mosq)) return 1;
+
+	mosquitto_reactor_loop_forever(reactor, -1, 1);
+
+	mosquitto_destroy(mosq);
+	mosquitto_reactor_destroy(reactor);
+	mosquitto_lib_cleanup();
+	return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mosquitto.h>
+
+static struct mosquitto_reactor *reactor;
+static int disconnected = 0;
+
+void on_connect(struct mosquitto *mosq, void *obj, int rc)
+{
+	char topic[20];
+
+	if(rc){
+		exit(1);
+	}else{
+		snprintf(topic, sizeof(topic), "reactor/%d", *(int *)obj);
+		mosquitto_publish(mosq, NULL, topic, strlen("message"), "message", 0, false);
+	}
+}
+
+void on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+	mosquitto_disconnect(mosq);
+}
+
+void on_disconnect(struct mosquitto *mosq, void *obj, int rc)
+{
+	disconnected++;
+	if(disconnected == 2){
+		mosquitto_reactor_loop_stop(reactor, false);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct mosquitto *mosq[2];
+	int index[2] = {0, 1};
+	char id[20];
+	int i;
+
+	mosquitto_lib_init();
+
+	reactor = mosquitto_reactor_new();
+	if(!reactor) return 1;
+
+	for(i=0; i<2; i++){
+		snprintf(id, sizeof(id), "reactor-test-%d", i);
+		mosq[i] = mosquitto_new(id, true, &index[i]);
+		mosquitto_connect_callback_set(mosq[i], on_connect);
+		mosquitto_publish_callback_set(mosq[i], on_publish);
+		mosquitto_disconnect_callback_set(mosq[i], on_disconnect);
+
+		mosquitto_connect_async(mosq[i], "localhost", 1888, 60);
+		if(mosquitto_reactor_add(reactor, mosq[i])) return 1;
+	}
+
+	mosquitto_reactor_loop_forever(reactor, -1, 1);
+
+	for(i=0; i<2; i++){
+		mosquitto_destroy(mosq[i]);
+	}
+	mosquitto_reactor_destroy(reactor);
+	mosquitto_lib_cleanup();
+	return 0;
+}
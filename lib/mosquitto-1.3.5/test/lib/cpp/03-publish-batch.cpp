@@ -0,0 +1,107 @@
+#include <cstdlib>
+#include <cstring>
+
+#include <mosquittopp.h>
+
+static int run = -1;
+static int sent_mid = -1;
+static int qos0_mids[4];
+static int qos0_published = 0;
+static bool puback_received = false;
+
+class mosquittopp_test : public mosqpp::mosquittopp
+{
+	public:
+		mosquittopp_test(const char *id);
+
+		void on_connect(int rc);
+		void on_disconnect(int rc);
+		void on_publish(int mid);
+};
+
+mosquittopp_test::mosquittopp_test(const char *id) : mosqpp::mosquittopp(id)
+{
+}
+
+void mosquittopp_test::on_connect(int rc)
+{
+	struct mosquitto_publish_entry messages[5];
+
+	if(rc){
+		exit(1);
+	}else{
+		memset(messages, 0, sizeof(messages));
+		messages[0].topic = "pub/batch/0";
+		messages[0].payload = "message 0";
+		messages[0].payloadlen = strlen("message 0");
+		messages[1].topic = "pub/batch/+";
+		messages[1].qos = 1;
+		if(publish_batch(messages, 2) != MOSQ_ERR_INVAL){
+			exit(1);
+		}
+
+		messages[1].topic = "pub/batch/1";
+		messages[1].payload = "message 1";
+		messages[1].payloadlen = strlen("message 1");
+		messages[2].topic = "pub/batch/2";
+		/* A run of QoS 0 messages, which go in one packet. */
+		messages[3].topic = "pub/batch/3";
+		messages[3].payload = "message 3";
+		messages[3].payloadlen = strlen("message 3");
+		messages[3].retain = true;
+		messages[4].topic = "pub/batch/4";
+		messages[4].payload = "message 4";
+		messages[4].payloadlen = strlen("message 4");
+		if(publish_batch(messages, 5) != MOSQ_ERR_SUCCESS){
+			exit(1);
+		}
+		sent_mid = messages[1].mid;
+		qos0_mids[0] = messages[0].mid;
+		qos0_mids[1] = messages[2].mid;
+		qos0_mids[2] = messages[3].mid;
+		qos0_mids[3] = messages[4].mid;
+	}
+}
+
+void mosquittopp_test::on_disconnect(int rc)
+{
+	run = 0;
+}
+
+void mosquittopp_test::on_publish(int mid)
+{
+	int i;
+
+	if(mid == sent_mid){
+		puback_received = true;
+	}else{
+		for(i=0; i<4; i++){
+			if(mid == qos0_mids[i]){
+				qos0_published++;
+				qos0_mids[i] = -1;
+			}
+		}
+	}
+	if(puback_received && qos0_published == 4){
+		disconnect();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct mosquittopp_test *mosq;
+
+	mosqpp::lib_init();
+
+	mosq = new mosquittopp_test("publish-batch-test");
+
+	mosq->connect("localhost", 1888, 60);
+
+	while(run == -1){
+		mosq->loop();
+	}
+
+	mosqpp::lib_cleanup();
+
+	return run;
+}
@@ -0,0 +1,68 @@
+#include <cstdlib>
+#include <cstring>
+
+#include <mosquittopp.h>
+
+static struct mosquitto_reactor *reactor;
+static int disconnected = 0;
+
+class mosquittopp_test : public mosqpp::mosquittopp
+{
+	public:
+		mosquittopp_test(const char *id);
+
+		void on_connect(int rc);
+		void on_publish(int mid);
+		void on_disconnect(int rc);
+};
+
+mosquittopp_test::mosquittopp_test(const char *id) : mosqpp::mosquittopp(id)
+{
+}
+
+void mosquittopp_test::on_connect(int rc)
+{
+	if(rc){
+		exit(1);
+	}else{
+		publish(NULL, "reactor/reconnect", strlen("message"), "message", 0, false);
+	}
+}
+
+void mosquittopp_test::on_publish(int mid)
+{
+	disconnect();
+}
+
+void mosquittopp_test::on_disconnect(int rc)
+{
+	disconnected++;
+	if(disconnected == 1){
+		/* The new socket is likely to get the fd number just closed. */
+		if(reconnect()) exit(1);
+	}else{
+		mosquitto_reactor_loop_stop(reactor, false);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct mosquittopp_test *mosq;
+
+	mosqpp::lib_init();
+
+	reactor = mosquitto_reactor_new();
+	if(!reactor) return 1;
+
+	mosq = new mosquittopp_test("reactor-reconnect-test");
+	mosq->connect_async("localhost", 1888, 60);
+	if(mosq->reactor_add(reactor)) return 1;
+
+	mosquitto_reactor_loop_forever(reactor, -1, 1);
+
+	delete mosq;
+	mosquitto_reactor_destroy(reactor);
+	mosqpp::lib_cleanup();
+
+	return 0;
+}
@@ -0,0 +1,77 @@
+#include <cstdio>
+#include <cstring>
+
+#include <mosquittopp.h>
+
+static struct mosquitto_reactor *reactor;
+static int disconnected = 0;
+
+class mosquittopp_test : public mosqpp::mosquittopp
+{
+	public:
+		mosquittopp_test(const char *id, int index);
+
+		int index;
+
+		void on_connect(int rc);
+		void on_publish(int mid);
+		void on_disconnect(int rc);
+};
+
+mosquittopp_test::mosquittopp_test(const char *id, int index) : mosqpp::mosquittopp(id), index(index)
+{
+}
+
+void mosquittopp_test::on_connect(int rc)
+{
+	char topic[20];
+
+	if(rc){
+		exit(1);
+	}else{
+		snprintf(topic, sizeof(topic), "reactor/%d", index);
+		publish(NULL, topic, strlen("message"), "message", 0, false);
+	}
+}
+
+void mosquittopp_test::on_publish(int mid)
+{
+	disconnect();
+}
+
+void mosquittopp_test::on_disconnect(int rc)
+{
+	disconnected++;
+	if(disconnected == 2){
+		mosquitto_reactor_loop_stop(reactor, false);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct mosquittopp_test *mosq[2];
+	char id[20];
+	int i;
+
+	mosqpp::lib_init();
+
+	reactor = mosquitto_reactor_new();
+	if(!reactor) return 1;
+
+	for(i=0; i<2; i++){
+		snprintf(id, sizeof(id), "reactor-test-%d", i);
+		mosq[i] = new mosquittopp_test(id, i);
+		mosq[i]->connect_async("localhost", 1888, 60);
+		if(mosq[i]->reactor_add(reactor)) return 1;
+	}
+
+	mosquitto_reactor_loop_forever(reactor, -1, 1);
+
+	for(i=0; i<2; i++){
+		delete mosq[i];
+	}
+	mosquitto_reactor_destroy(reactor);
+	mosqpp::lib_cleanup();
+
+	return 0;
+}
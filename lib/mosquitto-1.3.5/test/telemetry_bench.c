@@ -0,0 +1,692 @@
+/* Benchmark a broker with traffic shaped like a cluster of pmu_pub nodes.
+ *
+ * Each simulated node is a client publishing the pmu_pub metric set once per
+ * tick, on the same topics and with the same "<value>;<timestamp>" payloads
+ * as the PUB_METRIC macro, and the subscribers use the filters typical of
+ * the collectors and dashboards reading them. Nodes are spread evenly across
+ * the tick as real, unsynchronised nodes would be.
+ *
+ * The payload timestamp is written with microsecond rather than millisecond
+ * precision so the subscribers can measure publish to deliver latency, which
+ * means the benchmark has to run on the same host as the broker (or hosts
+ * with closely synchronised clocks).
+ *
+ * Results are printed to stdout as a single JSON object. Give the pid of the
+ * broker with -P to include its CPU time and memory use, read from /proc.
+ * cpu_us_per_message is the broker CPU time divided by the number of
+ * messages it handled, that is those published plus those delivered.
+ *
+ * Example, 500 nodes and 4 subscribers for 20 ticks of 1 second:
+ *   ./telemetry_bench -n 500 -s 4 -t 20 -i 1000 -P $(pidof mosquitto)
+ *
+ * With -b each node publishes its metrics for a tick in one call to
+ * mosquitto_publish_batch(), as pmu_pub does, rather than one
+ * mosquitto_publish() per metric.
+ *
+ * Every node and subscriber is a connection, so raise the open file limit
+ * (ulimit -n) before simulating thousands of nodes.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <mosquitto.h>
+
+#define MAX_FILTERS 16
+#define MAX_EVENTS 8
+/* Latencies are kept in a histogram with 16 buckets for each power of two
+ * microseconds, so percentiles are accurate to within about 6%. */
+#define HIST_SUB 16
+#define HIST_BUCKETS (64*HIST_SUB)
+/* Give up waiting for outstanding deliveries after this long without any. */
+#define DRAIN_TIMEOUT_US 5000000ULL
+
+struct metric{
+	char suffix[64];
+	const char *format;
+	uint64_t value;
+	uint64_t step;
+};
+
+struct node{
+	struct mosquitto *mosq;
+	char topic[256];
+	int base_len;
+	uint64_t next_us;
+	int tick;
+	bool connected;
+};
+
+struct subscriber{
+	struct mosquitto *mosq;
+	const char *filter;
+	bool subscribed;
+};
+
+static const char *cpu_metrics[] = {"tsc", "temp_pkg", "erg_dram", "erg_cores", "erg_pkg", "erg_units", "freq_ref", NULL};
+static const char *cpu_extra_metrics[] = {"C2", "C3", "C6", NULL};
+static const char *core_metrics[] = {"tsc", "temp", "instr", "clk_curr", "clk_ref", NULL};
+static const char *core_extra_metrics[] = {"C3", "C6", "aperf", "mperf", NULL};
+/* The core events from the example pmu_pub.conf. */
+static const char *event_names[MAX_EVENTS] = {
+	"UOPS_RETIRED.RETIRE_SLOTS", "ICACHE.MISSES", "LONGEST_LAT_CACHE.MISS",
+	"MEM_LOAD_UOPS_L3_HIT_RETIRED.XSNP_NONE", "BR_MISP_RETIRED.ALL_BRANCHES",
+	"UOPS_ISSUED.ANY", "IDQ_UOPS_NOT_DELIVERED.CORE", "INT_MISC.RECOVERY_CYCLES"
+};
+
+static bool run = true;
+static int connected_count = 0;
+static int subscribed_count = 0;
+static unsigned long long published = 0;
+static unsigned long long delivered = 0;
+static unsigned long long bad_payloads = 0;
+static uint64_t first_publish_us = 0;
+static uint64_t last_deliver_us = 0;
+static unsigned long long histogram[HIST_BUCKETS];
+static uint64_t latency_max = 0;
+
+static uint64_t now_us(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec*1000000 + tp.tv_nsec/1000;
+}
+
+static double wall_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static int hist_bucket(uint64_t usec)
+{
+	int msb = 0;
+	uint64_t v = usec;
+	int i;
+
+	if(usec < HIST_SUB) return (int)usec;
+
+	while(v >>= 1) msb++;
+	i = (msb-3)*HIST_SUB + (int)((usec >> (msb-4)) & (HIST_SUB-1));
+	return i < HIST_BUCKETS ? i : HIST_BUCKETS-1;
+}
+
+static uint64_t hist_bucket_max(int i)
+{
+	int shift;
+
+	if(i < HIST_SUB) return i;
+
+	shift = i/HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + i%HIST_SUB) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static uint64_t hist_percentile(double percent)
+{
+	unsigned long long target, sum = 0;
+	uint64_t value;
+	int i;
+
+	if(delivered == bad_payloads) return 0;
+
+	target = (unsigned long long)((delivered - bad_payloads)*percent/100.0 + 0.5);
+	if(target < 1) target = 1;
+	for(i=0; i<HIST_BUCKETS-1; i++){
+		sum += histogram[i];
+		if(sum >= target) break;
+	}
+	value = hist_bucket_max(i);
+	return value < latency_max ? value : latency_max;
+}
+
+/* CPU time in seconds and resident memory in kB of another process. */
+static int proc_usage(int pid, double *cpu, long *rss, long *rss_peak)
+{
+	char path[64];
+	char line[256];
+	FILE *fptr;
+	unsigned long utime, stime;
+	char *s;
+
+	snprintf(path, 64, "/proc/%d/stat", pid);
+	fptr = fopen(path, "r");
+	if(!fptr) return 1;
+	if(!fgets(line, 256, fptr)){
+		fclose(fptr);
+		return 1;
+	}
+	fclose(fptr);
+	/* Skip the command name, which may contain spaces. */
+	s = strrchr(line, ')');
+	if(!s || sscanf(s+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2){
+		return 1;
+	}
+	*cpu = (double)(utime + stime)/sysconf(_SC_CLK_TCK);
+
+	snprintf(path, 64, "/proc/%d/status", pid);
+	fptr = fopen(path, "r");
+	if(!fptr) return 1;
+	while(fgets(line, 256, fptr)){
+		sscanf(line, "VmRSS: %ld", rss);
+		sscanf(line, "VmHWM: %ld", rss_peak);
+	}
+	fclose(fptr);
+	return 0;
+}
+
+static double self_cpu(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1000000.0
+		+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1000000.0;
+}
+
+void handle_signal(int sig)
+{
+	run = false;
+}
+
+void node_connect_callback(struct mosquitto *mosq, void *obj, int rc)
+{
+	struct node *node = obj;
+
+	if(rc){
+		fprintf(stderr, "Error: Node connection refused (%d).\n", rc);
+		run = false;
+		return;
+	}
+	if(!node->connected){
+		node->connected = true;
+		connected_count++;
+	}
+}
+
+void sub_connect_callback(struct mosquitto *mosq, void *obj, int rc)
+{
+	struct subscriber *sub = obj;
+
+	if(rc){
+		fprintf(stderr, "Error: Subscriber connection refused (%d).\n", rc);
+		run = false;
+		return;
+	}
+	connected_count++;
+	mosquitto_subscribe(mosq, NULL, sub->filter, 0);
+}
+
+void sub_subscribe_callback(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+	struct subscriber *sub = obj;
+
+	if(!sub->subscribed){
+		sub->subscribed = true;
+		subscribed_count++;
+	}
+}
+
+void sub_message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+	char buf[64];
+	char *s;
+	double sent, latency;
+	uint64_t usec;
+	int len;
+
+	delivered++;
+	last_deliver_us = now_us();
+
+	len = msg->payloadlen < 63 ? msg->payloadlen : 63;
+	memcpy(buf, msg->payload, len);
+	buf[len] = '\0';
+	s = strchr(buf, ';');
+	if(!s){
+		bad_payloads++;
+		return;
+	}
+	sent = strtod(s+1, NULL);
+	latency = (wall_time() - sent)*1000000.0;
+	usec = latency > 0 ? (uint64_t)latency : 0;
+	histogram[hist_bucket(usec)]++;
+	if(usec > latency_max){
+		latency_max = usec;
+	}
+}
+
+static int metrics_build(struct metric **metrics, int cpus, int cores, bool extra, int events)
+{
+	struct metric *m;
+	int count, i, j, id;
+
+	count = cpus*(7 + (extra?3:0)) + cores*(5 + (extra?4+events:0));
+	m = calloc(count, sizeof(struct metric));
+	if(!m) return -1;
+
+	i = 0;
+	for(id=0; id<cpus; id++){
+		for(j=0; cpu_metrics[j]; j++, i++){
+			snprintf(m[i].suffix, 64, "cpu/%d/%s", id, cpu_metrics[j]);
+			m[i].format = strcmp(cpu_metrics[j], "freq_ref")?"%lu;%.6f":"%f;%.6f";
+		}
+		for(j=0; extra && cpu_extra_metrics[j]; j++, i++){
+			snprintf(m[i].suffix, 64, "cpu/%d/%s", id, cpu_extra_metrics[j]);
+			m[i].format = "%lu;%.6f";
+		}
+	}
+	for(id=0; id<cores; id++){
+		for(j=0; core_metrics[j]; j++, i++){
+			snprintf(m[i].suffix, 64, "core/%d/%s", id, core_metrics[j]);
+			m[i].format = "%lu;%.6f";
+		}
+		for(j=0; extra && core_extra_metrics[j]; j++, i++){
+			snprintf(m[i].suffix, 64, "core/%d/%s", id, core_extra_metrics[j]);
+			m[i].format = "%lu;%.6f";
+		}
+		for(j=0; extra && j<events; j++, i++){
+			snprintf(m[i].suffix, 64, "core/%d/%s", id, event_names[j]);
+			m[i].format = "%lu;%.6f";
+		}
+	}
+	/* Counters grow at different rates, so payload lengths vary the way
+	 * they do in real traffic. */
+	for(i=0; i<count; i++){
+		m[i].value = rand();
+		m[i].step = 1 + rand()%3000000000UL;
+	}
+	*metrics = m;
+	return count;
+}
+
+static void node_publish(struct node *node, struct metric *metrics, int metric_count, int qos)
+{
+	char payload[64];
+	double timestamp;
+	int i, len;
+
+	timestamp = wall_time();
+	for(i=0; i<metric_count; i++){
+		strcpy(&node->topic[node->base_len], metrics[i].suffix);
+		metrics[i].value += metrics[i].step;
+		if(metrics[i].format[1] == 'f'){
+			len = snprintf(payload, 64, metrics[i].format, 2400000000.0, timestamp);
+		}else{
+			len = snprintf(payload, 64, metrics[i].format, (unsigned long)metrics[i].value, timestamp);
+		}
+		if(mosquitto_publish(node->mosq, NULL, node->topic, len, payload, qos, false) == MOSQ_ERR_SUCCESS){
+			published++;
+		}
+	}
+}
+
+/* As node_publish(), with one mosquitto_publish_batch() call. The topics and
+ * payloads are built in buffers with room for metric_count of each. */
+static void node_publish_batch(struct node *node, struct metric *metrics, int metric_count, int qos,
+		struct mosquitto_publish_entry *batch, char *topics, char *payloads)
+{
+	double timestamp;
+	int i;
+
+	timestamp = wall_time();
+	for(i=0; i<metric_count; i++){
+		memcpy(&topics[i*256], node->topic, node->base_len);
+		strcpy(&topics[i*256+node->base_len], metrics[i].suffix);
+		metrics[i].value += metrics[i].step;
+		if(metrics[i].format[1] == 'f'){
+			batch[i].payloadlen = snprintf(&payloads[i*64], 64, metrics[i].format, 2400000000.0, timestamp);
+		}else{
+			batch[i].payloadlen = snprintf(&payloads[i*64], 64, metrics[i].format, (unsigned long)metrics[i].value, timestamp);
+		}
+		batch[i].topic = &topics[i*256];
+		batch[i].payload = &payloads[i*64];
+		batch[i].qos = qos;
+		batch[i].retain = false;
+	}
+	if(mosquitto_publish_batch(node->mosq, batch, metric_count) == MOSQ_ERR_SUCCESS){
+		published += metric_count;
+	}
+}
+
+/* The number of deliveries one tick of every node should produce. */
+static unsigned long long expected_per_tick(struct node *nodes, int node_count, struct metric *metrics, int metric_count, struct subscriber *subs, int sub_count)
+{
+	unsigned long long count = 0;
+	bool match;
+	int i, j, k;
+
+	for(i=0; i<node_count; i++){
+		for(j=0; j<metric_count; j++){
+			strcpy(&nodes[i].topic[nodes[i].base_len], metrics[j].suffix);
+			for(k=0; k<sub_count; k++){
+				if(!mosquitto_topic_matches_sub(subs[k].filter, nodes[i].topic, &match) && match){
+					count++;
+				}
+			}
+		}
+	}
+	return count;
+}
+
+static void usage(void)
+{
+	printf("telemetry_bench: benchmark a broker with pmu_pub shaped traffic.\n\n");
+	printf("Usage: telemetry_bench [-h host] [-p port] [-n nodes] [-s subscribers] [-t ticks]\n");
+	printf("                       [-i interval_ms] [-q qos] [-c cpus] [-k cores] [-e events]\n");
+	printf("                       [-x] [-b] [-f filter]... [-T topic] [-P broker_pid]\n\n");
+	printf(" -h : broker host. Defaults to localhost.\n");
+	printf(" -p : broker port. Defaults to 1883.\n");
+	printf(" -n : number of nodes publishing. Defaults to 100.\n");
+	printf(" -s : number of subscribers. Defaults to 4.\n");
+	printf(" -t : number of ticks each node publishes. Defaults to 10.\n");
+	printf(" -i : tick interval in milliseconds. Defaults to 1000.\n");
+	printf(" -q : QoS of the published messages. Defaults to 0.\n");
+	printf(" -c : CPU packages per node. Defaults to 2.\n");
+	printf(" -k : cores per node. Defaults to 16.\n");
+	printf(" -e : PMU events published per core. Defaults to 4, at most %d.\n", MAX_EVENTS);
+	printf(" -x : don't publish the extra counters (pmu_pub -c 0).\n");
+	printf(" -b : publish each node's metrics for a tick as one batch.\n");
+	printf(" -f : subscription filter, may be repeated, with %%s replaced by the\n");
+	printf("      topic prefix. Subscribers use the filters in turn.\n");
+	printf(" -T : topic prefix. Defaults to org/antarex/cluster/testcluster.\n");
+	printf(" -P : pid of the broker, to report its CPU time and memory use.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *default_filters[] = {
+		"%s/node/+/plugin/pmu_pub/chnl/data/#",
+		"%s/node/+/plugin/pmu_pub/chnl/data/cpu/+/erg_pkg",
+		"%s/node/+/plugin/pmu_pub/chnl/data/core/+/instr",
+		"%s/node/node00000/#",
+	};
+	const char *filters[MAX_FILTERS];
+	int filter_count = 0;
+	char filter_bufs[MAX_FILTERS][256];
+	const char *host = "localhost";
+	const char *prefix = "org/antarex/cluster/testcluster";
+	int port = 1883;
+	int node_count = 100;
+	int sub_count = 4;
+	int ticks = 10;
+	int interval_ms = 1000;
+	int qos = 0;
+	int cpus = 2;
+	int cores = 16;
+	int events = 4;
+	bool extra = true;
+	bool use_batch = false;
+	int broker_pid = 0;
+
+	struct node *nodes;
+	struct subscriber *subs;
+	struct metric *metrics;
+	int metric_count;
+	struct mosquitto_publish_entry *batch = NULL;
+	char *batch_topics = NULL, *batch_payloads = NULL;
+	struct pollfd *pollfds;
+	struct mosquitto **clients;
+	int client_count;
+	char id[64];
+	int i, rc, opt;
+	int nodes_done;
+	unsigned long long expected;
+	uint64_t now, start_us, interval_us, next_misc, wait_us;
+	double broker_cpu_start = 0, broker_cpu = 0, client_cpu_start;
+	long rss = 0, rss_peak = 0;
+	bool broker_stats = false;
+	double duration;
+	struct sigaction sa;
+
+	while((opt = getopt(argc, argv, "h:p:n:s:t:i:q:c:k:e:xbf:T:P:")) != -1){
+		switch(opt){
+			case 'h': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'n': node_count = atoi(optarg); break;
+			case 's': sub_count = atoi(optarg); break;
+			case 't': ticks = atoi(optarg); break;
+			case 'i': interval_ms = atoi(optarg); break;
+			case 'q': qos = atoi(optarg); break;
+			case 'c': cpus = atoi(optarg); break;
+			case 'k': cores = atoi(optarg); break;
+			case 'e': events = atoi(optarg); break;
+			case 'x': extra = false; break;
+			case 'b': use_batch = true; break;
+			case 'f':
+				if(filter_count == MAX_FILTERS){
+					fprintf(stderr, "Error: Too many filters.\n");
+					return 1;
+				}
+				filters[filter_count++] = optarg;
+				break;
+			case 'T': prefix = optarg; break;
+			case 'P': broker_pid = atoi(optarg); break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if(node_count < 1 || sub_count < 0 || ticks < 1 || interval_ms < 1
+			|| qos < 0 || qos > 2 || cpus < 0 || cores < 0
+			|| events < 0 || events > MAX_EVENTS){
+		usage();
+		return 1;
+	}
+	if(filter_count == 0){
+		for(i=0; i<4; i++){
+			filters[i] = default_filters[i];
+		}
+		filter_count = 4;
+	}
+	for(i=0; i<filter_count; i++){
+		snprintf(filter_bufs[i], 256, filters[i], prefix);
+		filters[i] = filter_bufs[i];
+	}
+
+	srand(1);
+	metric_count = metrics_build(&metrics, cpus, cores, extra, events);
+	if(metric_count < 1){
+		fprintf(stderr, "Error: No metrics to publish.\n");
+		return 1;
+	}
+	if(use_batch){
+		batch = calloc(metric_count, sizeof(struct mosquitto_publish_entry));
+		batch_topics = malloc(metric_count*256);
+		batch_payloads = malloc(metric_count*64);
+		if(!batch || !batch_topics || !batch_payloads){
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+	}
+
+	nodes = calloc(node_count, sizeof(struct node));
+	subs = calloc(sub_count ? sub_count : 1, sizeof(struct subscriber));
+	client_count = node_count + sub_count;
+	clients = calloc(client_count, sizeof(struct mosquitto *));
+	pollfds = calloc(client_count, sizeof(struct pollfd));
+	if(!nodes || !subs || !clients || !pollfds){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	mosquitto_lib_init();
+
+	for(i=0; i<sub_count; i++){
+		snprintf(id, 64, "bench_sub_%d_%d", getpid(), i);
+		subs[i].filter = filters[i%filter_count];
+		subs[i].mosq = mosquitto_new(id, true, &subs[i]);
+		if(!subs[i].mosq){
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+		mosquitto_connect_callback_set(subs[i].mosq, sub_connect_callback);
+		mosquitto_subscribe_callback_set(subs[i].mosq, sub_subscribe_callback);
+		mosquitto_message_callback_set(subs[i].mosq, sub_message_callback);
+		if(mosquitto_connect(subs[i].mosq, host, port, 60)){
+			fprintf(stderr, "Error: Unable to connect to %s:%d.\n", host, port);
+			return 1;
+		}
+		clients[i] = subs[i].mosq;
+	}
+	for(i=0; i<node_count; i++){
+		snprintf(id, 64, "bench_node_%d_%d", getpid(), i);
+		nodes[i].mosq = mosquitto_new(id, true, &nodes[i]);
+		if(!nodes[i].mosq){
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+		/* The same topic layout as pmu_pub. */
+		nodes[i].base_len = snprintf(nodes[i].topic, 256, "%s/node/node%05d/plugin/pmu_pub/chnl/data/", prefix, i);
+		mosquitto_connect_callback_set(nodes[i].mosq, node_connect_callback);
+		mosquitto_max_inflight_messages_set(nodes[i].mosq, 0);
+		if(mosquitto_connect(nodes[i].mosq, host, port, 60)){
+			fprintf(stderr, "Error: Unable to connect to %s:%d.\n", host, port);
+			return 1;
+		}
+		clients[sub_count + i] = nodes[i].mosq;
+	}
+
+	expected = ticks*expected_per_tick(nodes, node_count, metrics, metric_count, subs, sub_count);
+	interval_us = (uint64_t)interval_ms*1000;
+	start_us = 0;
+	next_misc = now_us() + 1000000;
+	nodes_done = 0;
+	client_cpu_start = self_cpu();
+
+	while(run){
+		now = now_us();
+		wait_us = 100000;
+
+		if(!start_us && connected_count == client_count && subscribed_count == sub_count){
+			/* Everyone is ready, so start the clock. */
+			start_us = now;
+			broker_stats = broker_pid && !proc_usage(broker_pid, &broker_cpu_start, &rss, &rss_peak);
+			client_cpu_start = self_cpu();
+			for(i=0; i<node_count; i++){
+				nodes[i].next_us = start_us + interval_us*i/node_count;
+			}
+		}
+		if(start_us){
+			for(i=0; i<node_count; i++){
+				if(nodes[i].tick < ticks && nodes[i].next_us <= now){
+					if(!first_publish_us) first_publish_us = now;
+					if(use_batch){
+						node_publish_batch(&nodes[i], metrics, metric_count, qos, batch, batch_topics, batch_payloads);
+					}else{
+						node_publish(&nodes[i], metrics, metric_count, qos);
+					}
+					nodes[i].tick++;
+					nodes[i].next_us += interval_us;
+					if(nodes[i].tick == ticks) nodes_done++;
+				}
+				if(nodes[i].tick < ticks && nodes[i].next_us < now + wait_us){
+					wait_us = nodes[i].next_us > now ? nodes[i].next_us - now : 0;
+				}
+			}
+			if(nodes_done == node_count){
+				/* Wait for the last deliveries to arrive. With QoS 0 some may
+				 * have been dropped, so don't wait for ever. */
+				if(delivered >= expected
+						|| now - (last_deliver_us > first_publish_us ? last_deliver_us : first_publish_us) > DRAIN_TIMEOUT_US){
+					break;
+				}
+			}
+		}
+
+		for(i=0; i<client_count; i++){
+			pollfds[i].fd = mosquitto_socket(clients[i]);
+			pollfds[i].events = POLLIN;
+			if(mosquitto_want_write(clients[i])){
+				pollfds[i].events |= POLLOUT;
+			}
+			pollfds[i].revents = 0;
+		}
+		rc = poll(pollfds, client_count, (int)(wait_us/1000));
+		if(rc < 0 && errno != EINTR){
+			fprintf(stderr, "Error: poll: %s.\n", strerror(errno));
+			break;
+		}
+		for(i=0; i<client_count && rc > 0; i++){
+			if(pollfds[i].revents & (POLLIN | POLLHUP | POLLERR)){
+				if(mosquitto_loop_read(clients[i], 1)){
+					fprintf(stderr, "Error: Lost connection to the broker.\n");
+					run = false;
+				}
+			}
+			if(pollfds[i].revents & POLLOUT){
+				if(mosquitto_loop_write(clients[i], 1)){
+					fprintf(stderr, "Error: Lost connection to the broker.\n");
+					run = false;
+				}
+			}
+		}
+		if(now_us() >= next_misc){
+			for(i=0; i<client_count; i++){
+				mosquitto_loop_misc(clients[i]);
+			}
+			next_misc = now_us() + 1000000;
+		}
+	}
+
+	if(!start_us){
+		fprintf(stderr, "Error: Interrupted before all clients were connected.\n");
+		return 1;
+	}
+	if(broker_stats){
+		broker_stats = !proc_usage(broker_pid, &broker_cpu, &rss, &rss_peak);
+		broker_cpu -= broker_cpu_start;
+	}
+	if(last_deliver_us > first_publish_us){
+		duration = (last_deliver_us - first_publish_us)/1000000.0;
+	}else{
+		duration = (now_us() - first_publish_us)/1000000.0;
+	}
+
+	printf("{\"nodes\":%d,\"subscribers\":%d,\"ticks\":%d,\"interval_ms\":%d,\"qos\":%d,\"batch\":%s,", node_count, sub_count, ticks, interval_ms, qos, use_batch ? "true" : "false");
+	printf("\"messages_per_tick\":%d,\"published\":%llu,\"expected\":%llu,\"delivered\":%llu,", metric_count, published, expected, delivered);
+	printf("\"duration_s\":%.3f,\"publish_rate\":%.1f,\"deliver_rate\":%.1f,", duration, published/duration, delivered/duration);
+	printf("\"latency_us\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},",
+			(unsigned long long)hist_percentile(50.0), (unsigned long long)hist_percentile(99.0),
+			(unsigned long long)hist_percentile(99.9), (unsigned long long)latency_max);
+	printf("\"client_cpu_s\":%.3f", self_cpu() - client_cpu_start);
+	if(broker_stats){
+		printf(",\"broker\":{\"cpu_s\":%.3f,\"cpu_us_per_message\":%.3f,\"rss_kb\":%ld,\"rss_peak_kb\":%ld}",
+				broker_cpu, published+delivered ? broker_cpu*1000000.0/(published+delivered) : 0.0,
+				rss, rss_peak);
+	}
+	printf("}\n");
+
+	for(i=0; i<client_count; i++){
+		mosquitto_disconnect(clients[i]);
+		mosquitto_loop_write(clients[i], 1);
+		mosquitto_destroy(clients[i]);
+	}
+	mosquitto_lib_cleanup();
+	free(pollfds);
+	free(clients);
+	free(subs);
+	free(nodes);
+	free(metrics);
+	free(batch);
+	free(batch_topics);
+	free(batch_payloads);
+
+	return bad_payloads ? 1 : 0;
+}
@@ -42,6 +42,14 @@
 
 
 struct mosquitto* mosq;
+struct pub_batch batch;
+struct pub_batch backlog;
+int backlog_max;
+int backlog_dropped;
+volatile int mqtt_connected;
+volatile int broker_switch;
+char broker_switch_host[256];
+int broker_switch_port;
 timer_t timer1;
 int keepRunning;
 char * sync_ck = "CK";
@@ -49,6 +57,12 @@ char const *version = "v0.2.3";
 
 
 inline void pub_to_broker(struct sys_data * sysd, struct mosquitto * mosq);
+struct pub_msg *pub_batch_next(struct pub_batch *b);
+int pub_batch_publish(struct pub_batch *b, struct mosquitto * mosq, int qos);
+void pub_batch_send(struct pub_batch *b, struct mosquitto * mosq, int qos, FILE *fp);
+void pub_backlog_add(struct pub_batch *b, FILE *fp);
+void pub_batch_free(struct pub_batch *b);
+void mqtt_switch_broker(struct sys_data * sysd);
 void sig_handler(int sig);
 int start_timer(struct sys_data * sysd);
 inline void get_timestamp(char * buf);
@@ -114,19 +128,27 @@ void on_connect_callback(struct mosquitto *mosq, void *obj, int result) {
     fprintf(stderr, "[MQTT]: Subscribing to command topic...\n");
     if (!result) {
         mosquitto_subscribe(mosq, NULL, sysd->cmd_topic, 0); // QoS!
+        mqtt_connected = 1;
         fprintf(stderr, "[MQTT]: Ready!\n");
     } else {
         fprintf(stderr, "%s\n", mosquitto_connack_string(result));
     }
 }
 
+/* on_disconnect_callback */
+void on_disconnect_callback(struct mosquitto *mosq, void *obj, int rc) {
+
+    mqtt_connected = 0;
+    if (rc) {
+        fprintf(stderr, "[MQTT]: Connection lost, reconnecting...\n");
+    }
+}
+
 /* on message callback */
 void on_message_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message) {
 
     char * data = NULL;
     struct sys_data *sysd;
-    char brokerHost[256];
-    int brokerPort;
     int i;
     char buffer[BUFSIZ];
     float dt;
@@ -152,19 +174,12 @@ void on_message_callback(struct mosquitto *mosq, void *obj, const struct mosquit
         }
 
         if (!strncmp(data, "-b", 2)) {
-            sscanf(data, "%*s%s%d", brokerHost, &brokerPort);
-            fprintf(stderr, "New brokerHost: %s\n", brokerHost);
-            fprintf(stderr, "New brokerPort: %d\n", brokerPort);
-
-            if (mosquitto_disconnect(mosq) != MOSQ_ERR_SUCCESS) {
-                fprintf(stderr, "\n [MQTT]: Error while disconnecting!\n");
-            }
-            sleep(1);
-            if (mosquitto_connect(mosq, brokerHost, brokerPort, 1000) != MOSQ_ERR_SUCCESS) {
-                fprintf(stderr, "\n [MQTT]: Could not connect to broker\n");
-                mosquitto_connect(mosq, sysd->brokerHost, sysd->brokerPort, 1000);
-            }
-            mosquitto_loop_start(mosq);
+            sscanf(data, "%*s%255s%d", broker_switch_host, &broker_switch_port);
+            fprintf(stderr, "New brokerHost: %s\n", broker_switch_host);
+            fprintf(stderr, "New brokerPort: %d\n", broker_switch_port);
+            /* This callback runs in the network thread, which has to be
+             * stopped to move to the new broker: leave it to the main loop. */
+            broker_switch = 1;
         }
 
         if (!strncmp(data, "-t", 2)) {
@@ -209,12 +224,135 @@ void on_message_callback(struct mosquitto *mosq, void *obj, const struct mosquit
     }
 }
 
+/* Return the next free message of the batch, growing it if needed. */
+struct pub_msg *pub_batch_next(struct pub_batch *b) {
+
+    struct pub_msg *msgs;
+    struct mosquitto_publish_entry *entries;
+    int size;
+
+    if (b->count == b->size) {
+        size = b->size ? 2 * b->size : 256;
+        msgs = realloc(b->msgs, size * sizeof(struct pub_msg));
+        if (!msgs)
+            return NULL;
+        b->msgs = msgs;
+        entries = realloc(b->entries, size * sizeof(struct mosquitto_publish_entry));
+        if (!entries)
+            return NULL;
+        b->entries = entries;
+        b->size = size;
+    }
+    return &b->msgs[b->count++];
+}
+
+/* Publish every message in the batch at once. */
+int pub_batch_publish(struct pub_batch *b, struct mosquitto * mosq, int qos) {
+
+    int i;
+
+    for (i = 0; i < b->count; i++) {
+        b->entries[i].topic = b->msgs[i].topic;
+        b->entries[i].payload = b->msgs[i].data;
+        b->entries[i].payloadlen = strlen(b->msgs[i].data);
+        b->entries[i].qos = qos;
+        b->entries[i].retain = false;
+    }
+    return mosquitto_publish_batch(mosq, b->entries, b->count);
+}
+
+/* Publish the batch and empty it. While the broker is unreachable the
+ * messages are moved to the backlog instead, and the backlog is sent ahead
+ * of the first batch after reconnecting. Every payload carries the time it
+ * was sampled at. A QoS 1/2 batch that runs into a lost connection has been
+ * queued for resending by the library, so only QoS 0 ones are kept here. */
+void pub_batch_send(struct pub_batch *b, struct mosquitto * mosq, int qos, FILE *fp) {
+
+    int rc;
+
+    if (mqtt_connected && backlog.count) {
+        rc = pub_batch_publish(&backlog, mosq, qos);
+        if (rc != MOSQ_ERR_NO_CONN || qos > 0) {
+            if (rc != MOSQ_ERR_SUCCESS) {
+                fprintf(fp, "[MQTT]: Warning: cannot send %d messages.\n", backlog.count);
+            } else {
+                fprintf(fp, "[MQTT]: Sent %d buffered messages, %d dropped.\n", backlog.count, backlog_dropped);
+            }
+            backlog.count = 0;
+            backlog_dropped = 0;
+        }
+    }
+    if (mqtt_connected && !backlog.count) {
+        rc = b->count ? pub_batch_publish(b, mosq, qos) : MOSQ_ERR_SUCCESS;
+        if (rc != MOSQ_ERR_NO_CONN || qos > 0) {
+            if (rc != MOSQ_ERR_SUCCESS) {
+                fprintf(fp, "[MQTT]: Warning: cannot send %d messages.\n", b->count);
+            }
+            b->count = 0;
+            return;
+        }
+    }
+    pub_backlog_add(b, fp);
+}
+
+/* Move the messages of the batch to the backlog, dropping those beyond
+ * backlog_max. */
+void pub_backlog_add(struct pub_batch *b, FILE *fp) {
+
+    struct pub_msg *msg_;
+    int i;
+
+    if (!backlog.count && !backlog_dropped && b->count) {
+        fprintf(fp, "[MQTT]: Not connected, buffering messages.\n");
+    }
+    for (i = 0; i < b->count; i++) {
+        if (backlog.count >= backlog_max || (msg_ = pub_batch_next(&backlog)) == NULL) {
+            backlog_dropped += b->count - i;
+            break;
+        }
+        memcpy(msg_, &b->msgs[i], sizeof(struct pub_msg));
+    }
+    b->count = 0;
+}
+
+void pub_batch_free(struct pub_batch *b) {
+
+    free(b->msgs);
+    free(b->entries);
+    memset(b, 0, sizeof(struct pub_batch));
+}
+
+/* Move to the broker requested with the -b command. The new address is
+ * only abandoned for the old one if it cannot be used at all, e.g. it does
+ * not resolve; otherwise the network thread keeps retrying it. */
+void mqtt_switch_broker(struct sys_data * sysd) {
+
+    broker_switch = 0;
+    mqtt_connected = 0;
+    fprintf(stderr, "[MQTT]: Switching to broker %s on port %d\n", broker_switch_host, broker_switch_port);
+
+    if (mosquitto_disconnect(mosq) == MOSQ_ERR_SUCCESS) {
+        mosquitto_loop_stop(mosq, false);
+    } else {
+        /* Not connected: the network thread may be waiting to reconnect. */
+        mosquitto_loop_stop(mosq, true);
+    }
+
+    if (mosquitto_connect_async(mosq, broker_switch_host, broker_switch_port, 1000) == MOSQ_ERR_SUCCESS) {
+        free(sysd->brokerHost);
+        sysd->brokerHost = strdup(broker_switch_host);
+        sysd->brokerPort = broker_switch_port;
+    } else {
+        fprintf(stderr, "\n [MQTT]: Could not connect to broker\n");
+        mosquitto_connect_async(mosq, sysd->brokerHost, sysd->brokerPort, 1000);
+    }
+    mosquitto_loop_start(mosq);
+}
+
 void pub_to_broker(struct sys_data * sysd, struct mosquitto * mosq) {
 
     FILE* fp;
-    char data[255];
-    char tmp_[255];
-    char tmp_s[255];
+    struct pub_msg *msg_;
     int cpuid;
     int coreid;
     int i;
@@ -279,6 +417,8 @@ void pub_to_broker(struct sys_data * sysd, struct mosquitto * mosq) {
         }
     }
 
+    pub_batch_send(&batch, mosq, sysd->qos, fp);
+
     fclose(fp);
 }
 
@@ -473,6 +613,7 @@ int enabled_host(char * host, char * host_whitelist_file, struct sys_data * sysd
         if (!strncmp(result, "[BROKER:]", 9)) {
             sscanf(result, "%*s%s%d", brokerHost, &brokerPort);
             printf("Update brokerhost settings to: %s:%d\n", brokerHost, brokerPort);
+            free(sysd->brokerHost);
             sysd->brokerHost = strdup(brokerHost);
             sysd->brokerPort = brokerPort;
         }
@@ -685,6 +826,8 @@ void main(int argc, char* argv[]) {
     char conf_events[1024];
     char delimit[] = " \t\r\n\v\f,"; //POSIX whitespace characters
     char * token;
+    unsigned int seed;
+    int rc;
     struct sys_data sysd_;
 #ifdef DEBUG
     uint64_t before, after;
@@ -709,11 +852,15 @@ void main(int argc, char* argv[]) {
     fprintf(fp, "\nConf file parameters:\n\n");
     iniparser_dump(ini, stderr);
 
+    /* Copied, as it is replaced and freed when moving to another broker. */
     sysd_.brokerHost = iniparser_getstring(ini, "MQTT:brokerHost", NULL);
+    if (sysd_.brokerHost)
+        sysd_.brokerHost = strdup(sysd_.brokerHost);
     sysd_.brokerPort = iniparser_getint(ini, "MQTT:brokerPort", 1883);
     sysd_.topic = iniparser_getstring(ini, "MQTT:topic", NULL);
     sysd_.cmd_topic = iniparser_getstring(ini, "MQTT:cmd_topic", NULL);
     sysd_.qos = iniparser_getint(ini, "MQTT:qos", 0);
+    backlog_max = iniparser_getint(ini, "MQTT:backlog", PUB_BACKLOG_SIZE);
     sysd_.dT = iniparser_getdouble(ini, "Daemon:dT", 1);
     daemon = iniparser_getboolean(ini, "Daemon:daemonize", 0);
     strcpy(pidfiledir, iniparser_getstring(ini, "Daemon:pidfilename", "./"));
@@ -740,6 +887,7 @@ void main(int argc, char* argv[]) {
                 fprintf(fp, "New cmd topic name: %s\n", sysd_.cmd_topic);
             } else if (strcmp(argv[i], "-b") == 0) // broker ip address
             {
+                free(sysd_.brokerHost);
                 sysd_.brokerHost = strdup(argv[i + 1]);
                 fprintf(fp, "New brokerhost: %s\n", sysd_.brokerHost);
             } else if (strcmp(argv[i], "-q") == 0) // QOS
@@ -918,6 +1066,12 @@ void main(int argc, char* argv[]) {
     fprintf(fp, "[MQTT]: Initializing Mosquitto Library Version %d.%d.%d\n", mosqMajor, mosqMinor, mosqRevision);
     mosquitto_lib_init();
 
+    /* Seed the reconnect jitter differently on every node. */
+    seed = getpid();
+    for (i = 0; hostname[i]; i++)
+        seed = seed * 31 + hostname[i];
+    srand(seed ^ time(NULL));
+
     //mosq = mosquitto_new(hostname, false, NULL);
     mosq = mosquitto_new(NULL, true, &sysd_);
     if (!mosq) {
@@ -926,15 +1080,18 @@ void main(int argc, char* argv[]) {
     }
 
     mosquitto_connect_callback_set(mosq, on_connect_callback);
+    mosquitto_disconnect_callback_set(mosq, on_disconnect_callback);
     mosquitto_message_callback_set(mosq, on_message_callback);
+    mosquitto_reconnect_delay_set(mosq, RECONNECT_DELAY, RECONNECT_DELAY_MAX, true);
+    mosquitto_reconnect_jitter_set(mosq, RECONNECT_JITTER);
 
 
+    /* Sampling starts straight away, the network thread keeps trying to
+     * connect and the data is buffered until it does. */
     fprintf(fp, "[MQTT]: Connecting to broker %s on port %d\n", sysd_.brokerHost, sysd_.brokerPort);
-    while (mosquitto_connect(mosq, sysd_.brokerHost, sysd_.brokerPort, 1000) != MOSQ_ERR_SUCCESS) {
+    if (mosquitto_connect_async(mosq, sysd_.brokerHost, sysd_.brokerPort, 1000) != MOSQ_ERR_SUCCESS) {
         fprintf(fp, "\n [MQTT]: Could not connect to broker\n");
-        fprintf(fp, "\n [MQTT]: Retry in 60 seconds...\n");
-        sleep(60);
-        //exit(EXIT_FAILURE);
+        fprintf(fp, "\n [MQTT]: Retrying in the background...\n");
     }
     if (fp != stderr)
         fclose(fp);
@@ -954,6 +1111,9 @@ void main(int argc, char* argv[]) {
 
         pause();
 
+        if (broker_switch)
+            mqtt_switch_broker(&sysd_);
+
     }
 #else 
     while (keepRunning) {
@@ -962,6 +1122,9 @@ void main(int argc, char* argv[]) {
 
         samp_handler(&sysd_);
 
+        if (broker_switch)
+            mqtt_switch_broker(&sysd_);
+
     }
 #endif
     
@@ -969,13 +1132,20 @@ void main(int argc, char* argv[]) {
     fp = fopen(sysd_.logfile, "a");
     fprintf(fp, "\n [MQTT]: exiting loop... \n");
     fprintf(fp, "\n [MQTT]: Disconnecting from broker... \n");
-    if (mosquitto_disconnect(mosq) != MOSQ_ERR_SUCCESS) {
+    if (backlog.count) {
+        fprintf(fp, "\n [MQTT]: Discarding %d buffered messages\n", backlog.count);
+    }
+    rc = mosquitto_disconnect(mosq);
+    if (rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_NO_CONN) {
         fprintf(fp, "\n [MQTT]: Error while disconnecting!\n");
         exit(EXIT_FAILURE);
     }
     fclose(fp);
     mosquitto_destroy(mosq);
+    pub_batch_free(&batch);
+    pub_batch_free(&backlog);
     iniparser_freedict(ini);
+    free(sysd_.brokerHost);
     cleanup_pmu_pub(&sysd_);
 
     perf_disable_per_core(sysd_.fdd, &sysd_);
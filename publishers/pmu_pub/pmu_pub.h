@@ -38,10 +38,38 @@
 #endif
  
     
+/* The metrics of one sample are collected in a pub_batch and sent with a
+ * single mosquitto_publish_batch() call, see pub_batch_send(). */
+#define PUB_MSG_LEN 255
+
+struct pub_msg {
+    char topic[PUB_MSG_LEN];
+    char data[PUB_MSG_LEN];
+};
+
+struct pub_batch {
+    struct pub_msg *msgs;
+    struct mosquitto_publish_entry *entries;
+    int count;
+    int size;
+};
+
+/* Default number of messages kept while the broker is unreachable, see
+ * pub_batch_send(). Set with MQTT:backlog in the conf file. */
+#define PUB_BACKLOG_SIZE 16384
+
+/* Reconnect delays in seconds: 0, 1, 4, 9, ... up to RECONNECT_DELAY_MAX,
+ * each plus a random jitter of up to RECONNECT_JITTER so that the nodes
+ * that lose a broker together do not all come back at the same moment. */
+#define RECONNECT_DELAY 1
+#define RECONNECT_DELAY_MAX 60
+#define RECONNECT_JITTER 10
+
 #define PUB_METRIC(type, name, function, id, format) \
-    sprintf(tmp_, "%s/%s/%d/%s", sysd->topic, type, id, name); \
-    sprintf(data, format, function, sysd->tmpstr); \
-    if(mosquitto_publish(mosq, NULL, tmp_, strlen(data), data, sysd->qos, false) != MOSQ_ERR_SUCCESS) { \
+    if ((msg_ = pub_batch_next(&batch)) != NULL) { \
+        sprintf(msg_->topic, "%s/%s/%d/%s", sysd->topic, type, id, name); \
+        sprintf(msg_->data, format, function, sysd->tmpstr); \
+    } else { \
         fprintf(fp, "[MQTT]: Warning: cannot send message.\n");  \
     } \
     